@@ -1,4 +1,4 @@
-import json, socket
+import errno, json, socket
 import struct
 
 #############
@@ -12,6 +12,13 @@ DEL_REQ = 2
 GET_RESP = 3
 RESP = 4
 INFO = 11
+HOTKEYS = 12
+RESIZE = 13
+
+# Cache admission policies for PUTs
+ADMIT_ALWAYS = 1
+ADMIT_RESIDENT = 2
+ADMIT_AROUND = 3
 
 # Default timeout (in seconds)
 TIMEOUT = 3
@@ -36,6 +43,16 @@ ERRORS = {
 # CLASSES #
 ###########
 
+class ConnectionLost(Exception):
+    """
+    Raised when a connection turns out to be closed or reset by the server
+    before any of the response to a request arrived, as happens when the
+    server closed it for being idle. The request may be sent again over a
+    new connection.
+    """
+    pass
+
+
 class KVClient:
     """
     This is a client configured to interface with our key-value store server.
@@ -52,52 +69,121 @@ class KVClient:
 
         self.host_server = server
         self.host_port = port
+        self._sock = None
 
     def _connect(self):
         """
-        Creates a socket connection between this client and a server.
+        Creates a socket connection between this client and a server. A
+        server given as an absolute path is reached through the Unix domain
+        socket at that path, and the port is ignored.
         """
         try:
-            self._sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-            self._sock.connect((self.host_server, self.host_port))
+            if self.host_server.startswith("/"):
+                self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+                self._sock.connect(self.host_server)
+            else:
+                self._sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+                self._sock.connect((self.host_server, self.host_port))
         except Exception:
             raise Exception(ERRORS["could_not_connect"])
 
+    def _send(self, message):
+        """
+        Sends MESSAGE over this client's socket. Raises ConnectionLost if
+        the server closed or reset the connection.
+        """
+        try:
+            message.send(self._sock)
+        except socket.timeout:
+            raise
+        except socket.error as e:
+            if e.errno in (errno.ECONNRESET, errno.EPIPE):
+                raise ConnectionLost(ERRORS["no_data"])
+            raise
+
     def _listen(self, timeout=None):
         """
         Waits for incoming data from this client's socket for a maximum of
         TIMEOUT seconds, and returns a KVMessage built from it. If no timeout
-        is specified, the socket will listen indefinitely.
+        is specified, the socket will listen indefinitely. Raises
+        ConnectionLost if the server closed or reset the connection before
+        any of the data arrived.
         """
         self._sock.settimeout(timeout)
 
         try:
-            unpacker = struct.Struct('I')
-            size = socket.ntohl(unpacker.unpack(self._sock.recv(4))[0])
-            data = self._sock.recv(size)
-        except Exception as e:
-            raise e
-        if not data:
-            raise Exception(ERRORS["no_data"])
+            first = self._sock.recv(4)
+        except socket.timeout:
+            raise
+        except socket.error as e:
+            if e.errno in (errno.ECONNRESET, errno.EPIPE):
+                raise ConnectionLost(ERRORS["no_data"])
+            raise
+        if not first:
+            raise ConnectionLost(ERRORS["no_data"])
+
+        unpacker = struct.Struct('I')
+        header = first + self._recv_exactly(4 - len(first))
+        size = socket.ntohl(unpacker.unpack(header)[0])
+        data = self._recv_exactly(size)
 
         return KVMessage(json_data=data)
 
+    def _recv_exactly(self, size):
+        """
+        Receives exactly SIZE bytes from this client's socket, over as many
+        reads as it takes.
+        """
+        chunks = []
+        while size > 0:
+            chunk = self._sock.recv(size)
+            if not chunk:
+                raise Exception(ERRORS["no_data"])
+            chunks.append(chunk)
+            size -= len(chunk)
+        return b"".join(chunks)
+
     def _disconnect(self):
         """
         Closes this client's existing connection to a server.
         """
-        self._sock.close()
+        if self._sock is not None:
+            self._sock.close()
+            self._sock = None
+
+    def close(self):
+        """
+        Closes the connection this client keeps open to the server, if any.
+        The next request opens a new one.
+        """
+        self._disconnect()
 
     def info(self):
         return self._send_request(INFO, "", "")
 
-    def put(self, key, value):
+    def hotkeys(self):
+        """
+        Returns the keys which the server has received the most requests for.
         """
-        PUTs a KEY and a VALUE to the KV server.
+        return self._send_request(HOTKEYS, "", "")
+
+    def resize(self, num_sets):
+        """
+        Grows the server's cache to NUM_SETS sets, rounded up to a multiple
+        of its current number of sets. Entries move to the new sets as
+        requests come in.
+        """
+        return self._send_request(RESIZE, "", str(num_sets))
+
+    def put(self, key, value, admit=None):
+        """
+        PUTs a KEY and a VALUE to the KV server. ADMIT, if given, is the
+        cache admission policy the server applies to the PUT (one of the
+        ADMIT_* constants); otherwise the server uses its own.
         """
         self._check_key(key)
         self._check_value(value)
-        return self._send_request(PUT_REQ, key, value)
+        return self._send_request(PUT_REQ, key, value, admit)
 
     def get(self, key):
         """
@@ -113,19 +199,36 @@ class KVClient:
         self._check_key(key)
         return self._send_request(DEL_REQ, key)
 
-    def _send_request(self, req_type, key, value=None):
+    def _send_request(self, req_type, key, value=None, admit=None):
         """
         Helper function for sending the three different types of request.
         """
-        message = KVMessage(msg_type=req_type, key=key, value=value)
-        self._connect()
-        message.send(self._sock)
-        response = self._listen()
-        self._disconnect()
+        message = KVMessage(msg_type=req_type, key=key, value=value,
+                            admit=admit)
+        # The connection is kept open for later requests. The server closes
+        # connections which stay idle, so a request whose reused connection
+        # turns out to be closed before any response arrives is sent once
+        # more over a new one. Any other failure, a timeout in particular,
+        # may come after the server acted on the request, and is raised.
+        while True:
+            reused = self._sock is not None
+            if not reused:
+                self._connect()
+            try:
+                self._send(message)
+                response = self._listen()
+                break
+            except ConnectionLost:
+                self._disconnect()
+                if not reused:
+                    raise
+            except Exception:
+                self._disconnect()
+                raise
 
         if response.type == GET_RESP:
             return response.value
-        elif req_type == INFO:
+        elif req_type in (INFO, HOTKEYS):
             return response.message
         elif response.type != RESP:
             raise Exception(ERRORS["generic"])
@@ -161,12 +264,13 @@ class KVMessage:
     """
 
     def __init__(self, msg_type=None, key=None, value=None, \
-                 msg=None, json_data=None):
+                 msg=None, admit=None, json_data=None):
         """
         This constructor must be called in one of two mutually exclusive ways:
             1) with a msg_type (mandatory) and optional key, value, msg
             2) with a JSON string (json_data -- incoming data from a connection)
         """
+        self.admit = None
         if json_data:
             self._from_json(json_data)
         else:
@@ -174,6 +278,7 @@ class KVMessage:
             self.key = key
             self.value = value
             self.message = msg
+            self.admit = admit
 
     def __str__(self):
         return self._to_json()
@@ -208,6 +313,8 @@ class KVMessage:
             d["value"] = self.value
         if self.message:
             d["message"] = self.message
+        if self.admit:
+            d["admit"] = self.admit
 
         return json.dumps(d)
 
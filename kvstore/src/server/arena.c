@@ -0,0 +1,189 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+/* Whether arena_map tries to obtain huge pages. */
+static bool hugepages = true;
+
+/* The memory mapped so far by kind of page. Updated atomically. */
+static arena_stats_t mapped;
+
+/* Rounds SIZE up to a multiple of ALIGN, a power of two. */
+static inline size_t round_up(size_t size, size_t align) {
+  return (size + align - 1) & ~(align - 1);
+}
+
+/* Sets whether arena_map tries to obtain huge pages (the default) or only
+ * maps regular pages. Affects memory mapped afterwards only. */
+void arena_set_hugepages(bool enabled) {
+  hugepages = enabled;
+}
+
+/* Maps SIZE bytes, rounded up to a multiple of ARENA_HUGEPAGE, of zeroed
+ * memory aligned to ARENA_HUGEPAGE, backed by huge pages if possible. The
+ * memory stays mapped unless it is given to arena_unmap. Returns NULL if
+ * memory could not be mapped. */
+void *arena_map(size_t size) {
+  char *p, *aligned;
+  size_t slack;
+  size = round_up(size, ARENA_HUGEPAGE);
+#ifdef MAP_HUGETLB
+  if (hugepages) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+      __atomic_add_fetch(&mapped.explicit_bytes, size, __ATOMIC_RELAXED);
+      return p;
+    }
+  }
+#endif
+  /* Map an extra huge page so that an aligned range can be cut out of it,
+     since only aligned 2 MB ranges can be backed by a huge page. */
+  p = mmap(NULL, size + ARENA_HUGEPAGE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  aligned = (char *) round_up((uintptr_t) p, ARENA_HUGEPAGE);
+  if (aligned > p)
+    munmap(p, aligned - p);
+  slack = (p + size + ARENA_HUGEPAGE) - (aligned + size);
+  if (slack > 0)
+    munmap(aligned + size, slack);
+#ifdef MADV_HUGEPAGE
+  if (hugepages && madvise(aligned, size, MADV_HUGEPAGE) == 0) {
+    __atomic_add_fetch(&mapped.transparent_bytes, size, __ATOMIC_RELAXED);
+    return aligned;
+  }
+#endif
+  __atomic_add_fetch(&mapped.regular_bytes, size, __ATOMIC_RELAXED);
+  return aligned;
+}
+
+/* Unmaps the SIZE bytes at P, which were mapped by arena_map(SIZE). Only
+ * used to undo a mapping when what it was for cannot be set up, so the
+ * amounts reported by arena_stats still include it. */
+void arena_unmap(void *p, size_t size) {
+  if (p != NULL)
+    munmap(p, round_up(size, ARENA_HUGEPAGE));
+}
+
+/* Fills STATS with the amount of memory mapped by arena_map so far. */
+void arena_stats(arena_stats_t *stats) {
+  stats->explicit_bytes = __atomic_load_n(&mapped.explicit_bytes,
+      __ATOMIC_RELAXED);
+  stats->transparent_bytes = __atomic_load_n(&mapped.transparent_bytes,
+      __ATOMIC_RELAXED);
+  stats->regular_bytes = __atomic_load_n(&mapped.regular_bytes,
+      __ATOMIC_RELAXED);
+}
+
+/* Returns the number of kB of this process's memory which the kernel backs
+ * with transparent huge pages, or -1 if it cannot be found out. */
+static long anon_hugepages_kb(void) {
+  char line[128];
+  long kb = -1;
+  FILE *file = fopen("/proc/self/smaps_rollup", "r");
+  if (file == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1)
+      break;
+  }
+  fclose(file);
+  return kb;
+}
+
+/* Returns a malloc()d, one line description of the memory mapped by
+ * arena_map so far and the pages backing it, or NULL if memory could not be
+ * allocated. */
+char *arena_report(void) {
+  arena_stats_t stats;
+  long kb = anon_hugepages_kb();
+  char *report = malloc(256);
+  if (report == NULL)
+    return NULL;
+  arena_stats(&stats);
+  snprintf(report, 256, "Cache memory: %zu MB in explicit huge pages, "
+      "%zu MB in transparent huge pages, %zu MB in regular pages",
+      stats.explicit_bytes >> 20, stats.transparent_bytes >> 20,
+      stats.regular_bytes >> 20);
+  if (kb >= 0)
+    snprintf(report + strlen(report), 256 - strlen(report),
+        " (%ld MB of the process backed by transparent huge pages)",
+        kb >> 10);
+  return report;
+}
+
+/* Initializes ARENA to hand out blocks of BLOCK_SIZE bytes, rounded up to a
+ * multiple of 64 so that blocks are aligned to cache lines. No memory is
+ * mapped until the first block is allocated. Returns 0 if successful, else a
+ * negative error code. */
+int arena_init(arena_t *arena, size_t block_size) {
+  if (block_size == 0)
+    return -1;
+  arena->block_size = round_up(block_size, 64);
+  arena->chunk_size = round_up(arena->block_size, ARENA_HUGEPAGE);
+  arena->free_list = NULL;
+  arena->next = arena->end = NULL;
+  arena->chunks = NULL;
+  arena->num_chunks = 0;
+  return pthread_mutex_init(&arena->lock, NULL);
+}
+
+/* Returns a block of ARENA's block size, whose contents are undefined, or
+ * NULL if memory could not be allocated. */
+void *arena_alloc(arena_t *arena) {
+  void *block, **chunks;
+  pthread_mutex_lock(&arena->lock);
+  if ((block = arena->free_list) != NULL) {
+    arena->free_list = *(void **) block;
+  } else {
+    if (arena->next == arena->end) {
+      chunks = realloc(arena->chunks,
+          (arena->num_chunks + 1) * sizeof(void *));
+      if (chunks != NULL)
+        arena->chunks = chunks;
+      if (chunks == NULL
+          || (arena->next = arena_map(arena->chunk_size)) == NULL) {
+        arena->next = arena->end = NULL;
+        pthread_mutex_unlock(&arena->lock);
+        return NULL;
+      }
+      arena->chunks[arena->num_chunks++] = arena->next;
+      /* The chunk holds a whole number of blocks, so NEXT reaches END. */
+      arena->end = arena->next
+          + arena->chunk_size / arena->block_size * arena->block_size;
+    }
+    block = arena->next;
+    arena->next += arena->block_size;
+  }
+  pthread_mutex_unlock(&arena->lock);
+  return block;
+}
+
+/* Unmaps every chunk of ARENA, invalidating all of its blocks, and releases
+ * its resources. ARENA may be initialized again afterwards. */
+void arena_destroy(arena_t *arena) {
+  size_t i;
+  for (i = 0; i < arena->num_chunks; i++)
+    arena_unmap(arena->chunks[i], arena->chunk_size);
+  free(arena->chunks);
+  arena->chunks = NULL;
+  arena->num_chunks = 0;
+  arena->free_list = NULL;
+  arena->next = arena->end = NULL;
+  pthread_mutex_destroy(&arena->lock);
+}
+
+/* Returns BLOCK, which was allocated from ARENA, to ARENA. */
+void arena_free(arena_t *arena, void *block) {
+  if (block == NULL)
+    return;
+  pthread_mutex_lock(&arena->lock);
+  *(void **) block = arena->free_list;
+  arena->free_list = block;
+  pthread_mutex_unlock(&arena->lock);
+}
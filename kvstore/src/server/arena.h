@@ -0,0 +1,67 @@
+#ifndef __KV_ARENA__
+#define __KV_ARENA__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Arena provides memory for the large, long-lived structures of a KVCache
+ * (its arrays of sets and the indexes of those sets) backed by 2 MB huge
+ * pages where possible. A cache of tens of GB otherwise spans millions of
+ * 4 KB pages, and every lookup which touches a set and its index risks a TLB
+ * miss on each.
+ *
+ * Memory is obtained from the kernel by arena_map, in multiples of
+ * ARENA_HUGEPAGE aligned to ARENA_HUGEPAGE, trying in turn:
+ *   1. explicit huge pages (mmap with MAP_HUGETLB), which only succeeds if
+ *      the administrator reserved some through vm.nr_hugepages;
+ *   2. transparent huge pages, by advising the kernel with MADV_HUGEPAGE,
+ *      which it honors unless THP is disabled;
+ *   3. regular pages.
+ * Each step falls back to the next silently. arena_set_hugepages(false)
+ * skips the first two, e.g. to compare. How much memory each step provided
+ * is tracked, and arena_report describes it along with the number of bytes
+ * the kernel actually backs with transparent huge pages, so servers print it
+ * on startup.
+ *
+ * An arena_t carves blocks of a single size out of mapped chunks, and keeps
+ * freed blocks on a free list to hand out again. Chunks are only unmapped
+ * when the whole arena is destroyed.
+ * Cache entries themselves are small and of varying size, and are still
+ * allocated with malloc().
+ */
+
+/* The size and alignment of a huge page. */
+#define ARENA_HUGEPAGE (2 * 1024 * 1024)
+
+/* An allocator of fixed-size blocks. */
+typedef struct arena {
+  pthread_mutex_t lock;         /* Protects all of the fields below. */
+  size_t block_size;            /* The size of each block, a multiple of 64. */
+  size_t chunk_size;            /* The size of each chunk mapped. */
+  void *free_list;              /* Freed blocks, linked through their first word. */
+  char *next;                   /* The next unused block of the current chunk. */
+  char *end;                    /* The end of the current chunk. */
+  void **chunks;                /* The chunks mapped, to unmap on arena_destroy. */
+  size_t num_chunks;            /* The number of CHUNKS. */
+} arena_t;
+
+/* The memory mapped by arena_map, in bytes, by kind of page. */
+typedef struct {
+  size_t explicit_bytes;        /* Backed by explicit (hugetlbfs) huge pages. */
+  size_t transparent_bytes;     /* Advised to use transparent huge pages. */
+  size_t regular_bytes;         /* Backed by regular pages. */
+} arena_stats_t;
+
+void arena_set_hugepages(bool enabled);
+void *arena_map(size_t size);
+void arena_unmap(void *p, size_t size);
+void arena_stats(arena_stats_t *);
+char *arena_report(void);
+
+int arena_init(arena_t *, size_t block_size);
+void *arena_alloc(arena_t *);
+void arena_free(arena_t *, void *block);
+void arena_destroy(arena_t *);
+
+#endif
@@ -0,0 +1,155 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include "epoch.h"
+
+/* Retired objects are collected per epoch, and the global epoch is advanced
+ * after this many retirements. */
+#define EPOCH_RETIRE_BATCH 64
+#define EPOCH_LIMBO_LISTS 3
+#define CACHE_LINE_SIZE 64
+
+/* A reader slot. STATE is 0 while the owning thread is outside a critical
+ * section, and the announced epoch shifted left by one with the low bit set
+ * while it is inside one. */
+struct epoch_slot {
+  unsigned long state;
+  bool in_use;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* An object waiting to be freed. */
+struct epoch_retired {
+  void *ptr;
+  void (*free_fn)(void *);
+  struct epoch_retired *next;
+};
+
+static struct epoch_slot slots[EPOCH_MAX_THREADS];
+static unsigned long global_epoch __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct epoch_retired *limbo[EPOCH_LIMBO_LISTS];
+static unsigned int retired_since_advance;
+
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key;
+static __thread struct epoch_slot *my_slot;
+
+static struct epoch_retired *try_advance(void);
+static void free_retired(struct epoch_retired *);
+
+/* Gives a thread's slot back when the thread exits. */
+static void release_slot(void *slot) {
+  __atomic_store_n(&((struct epoch_slot *) slot)->in_use, false,
+      __ATOMIC_RELEASE);
+}
+
+static void make_slot_key(void) {
+  pthread_key_create(&slot_key, release_slot);
+}
+
+/* Returns the calling thread's slot, claiming a free one if it has none yet.
+ * Returns NULL if every slot is in use. */
+static struct epoch_slot *get_slot(void) {
+  int i;
+  if (my_slot != NULL)
+    return my_slot;
+  pthread_once(&slot_key_once, make_slot_key);
+  for (i = 0; i < EPOCH_MAX_THREADS; i++) {
+    bool expected = false;
+    if (__atomic_compare_exchange_n(&slots[i].in_use, &expected, true, false,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      my_slot = &slots[i];
+      pthread_setspecific(slot_key, my_slot);
+      return my_slot;
+    }
+  }
+  return NULL;
+}
+
+/* Enters a critical section, within which objects passed to epoch_retire by
+ * other threads are not freed. Returns false if the calling thread could not
+ * be given a slot, in which case it is not protected and must not call
+ * epoch_exit. Critical sections may not be nested. */
+bool epoch_enter(void) {
+  struct epoch_slot *slot = get_slot();
+  unsigned long epoch;
+  if (slot == NULL)
+    return false;
+  /* Announce the epoch, then make sure it did not advance before the
+     announcement became visible; otherwise a concurrent advance may have
+     missed this thread and already freed what it is about to read. */
+  do {
+    epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->state, (epoch << 1) | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  } while (__atomic_load_n(&global_epoch, __ATOMIC_RELAXED) != epoch);
+  return true;
+}
+
+/* Leaves the critical section entered by the last call to epoch_enter. */
+void epoch_exit(void) {
+  __atomic_store_n(&my_slot->state, 0, __ATOMIC_RELEASE);
+}
+
+/* Arranges for FREE_FN to be called on PTR once no reader can still be
+ * accessing it. PTR must already be unreachable for new readers. Must not be
+ * called from within a critical section. */
+void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+  struct epoch_retired *r = malloc(sizeof(struct epoch_retired)), *done = NULL;
+  unsigned long start;
+  if (r == NULL) {
+    /* Wait for two epochs to pass instead of deferring the free. */
+    start = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE) - start < 2) {
+      pthread_mutex_lock(&limbo_lock);
+      done = try_advance();
+      pthread_mutex_unlock(&limbo_lock);
+      free_retired(done);
+      sched_yield();
+    }
+    free_fn(ptr);
+    return;
+  }
+  r->ptr = ptr;
+  r->free_fn = free_fn;
+  pthread_mutex_lock(&limbo_lock);
+  r->next = limbo[global_epoch % EPOCH_LIMBO_LISTS];
+  limbo[global_epoch % EPOCH_LIMBO_LISTS] = r;
+  if (++retired_since_advance >= EPOCH_RETIRE_BATCH)
+    done = try_advance();
+  pthread_mutex_unlock(&limbo_lock);
+  free_retired(done);
+}
+
+/* Advances the global epoch if every active reader has announced the current
+ * one. Returns the list of objects which became safe to free as a result,
+ * which the caller should pass to free_retired after dropping LIMBO_LOCK.
+ * Must be called with LIMBO_LOCK held. */
+static struct epoch_retired *try_advance(void) {
+  unsigned long epoch = global_epoch, state;
+  struct epoch_retired *done;
+  int i;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (i = 0; i < EPOCH_MAX_THREADS; i++) {
+    state = __atomic_load_n(&slots[i].state, __ATOMIC_ACQUIRE);
+    if ((state & 1) && (state >> 1) != epoch)
+      return NULL;
+  }
+  __atomic_store_n(&global_epoch, epoch + 1, __ATOMIC_RELEASE);
+  retired_since_advance = 0;
+  /* The list for epoch + 1 holds what was retired during epoch - 2. */
+  done = limbo[(epoch + 1) % EPOCH_LIMBO_LISTS];
+  limbo[(epoch + 1) % EPOCH_LIMBO_LISTS] = NULL;
+  return done;
+}
+
+/* Frees every object on the list R. */
+static void free_retired(struct epoch_retired *r) {
+  struct epoch_retired *next;
+  for (; r != NULL; r = next) {
+    next = r->next;
+    r->free_fn(r->ptr);
+    free(r);
+  }
+}
@@ -0,0 +1,33 @@
+#ifndef __KV_EPOCH__
+#define __KV_EPOCH__
+
+#include <stdbool.h>
+
+/* Epoch defines an epoch-based reclamation scheme for memory which readers
+ * access without holding a lock.
+ *
+ * A reader brackets its accesses with epoch_enter and epoch_exit. A writer
+ * which unlinks an object that such readers may still be looking at passes it
+ * to epoch_retire instead of freeing it. The object is then freed only once
+ * every reader which was inside a critical section at the time has left it.
+ *
+ * Internally there is a global epoch counter, and each thread announces the
+ * epoch it observed in its own cache-line-sized slot when entering. The
+ * global epoch only advances once every active reader has announced the
+ * current one, so anything retired two epochs ago can no longer be reached.
+ * Readers never write to memory shared with other threads besides their own
+ * slot.
+ *
+ * There is a fixed number of reader slots, which threads claim on their first
+ * epoch_enter and give back when they exit. If no slot is free, epoch_enter
+ * returns false and the caller must fall back to a locked read path.
+ */
+
+/* The maximum number of threads which can be inside a critical section. */
+#define EPOCH_MAX_THREADS 256
+
+bool epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+
+#endif
@@ -0,0 +1,129 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kvhash.h"
+#include "hotkeys.h"
+
+/* Counts the requests seen by the calling thread, to pick those recorded. */
+static __thread unsigned int ticks;
+
+/* Initializes HOTKEYS to record one in every SAMPLE requests. Returns 0 if
+ * successful, else a negative error code. */
+int hotkeys_init(hotkeys_t *hotkeys, unsigned int sample) {
+  hotkeys->sample = (sample == 0) ? 1 : sample;
+  hotkeys->used = 0;
+  hotkeys->recorded = 0;
+  return pthread_mutex_init(&hotkeys->lock, NULL);
+}
+
+/* Halves the count and error of every counter of HOTKEYS, dropping those
+ * which reach 0. The lock must be held. */
+static void decay(hotkeys_t *hotkeys) {
+  unsigned int i, kept = 0;
+  for (i = 0; i < hotkeys->used; i++) {
+    hotkey_t *c = &hotkeys->counters[i];
+    c->count /= 2;
+    c->error /= 2;
+    if (c->count == 0)
+      continue;
+    if (kept != i)
+      hotkeys->counters[kept] = *c;
+    kept++;
+  }
+  hotkeys->used = kept;
+  hotkeys->recorded = 0;
+}
+
+/* Records a request for KEY in HOTKEYS, unless it is not sampled or HOTKEYS
+ * is busy. Never blocks. */
+void hotkeys_record(hotkeys_t *hotkeys, char *key) {
+  unsigned long h;
+  unsigned int i;
+  hotkey_t *c, *min = NULL;
+  if (key == NULL || ++ticks % hotkeys->sample != 0
+      || strlen(key) > MAX_KEYLEN)
+    return;
+  h = kvhash(key);
+  if (pthread_mutex_trylock(&hotkeys->lock) != 0)
+    return;
+  for (i = 0; i < hotkeys->used; i++) {
+    c = &hotkeys->counters[i];
+    if (c->hash == h && strcmp(c->key, key) == 0) {
+      c->count++;
+      goto recorded;
+    }
+    if (min == NULL || c->count < min->count)
+      min = c;
+  }
+  if (hotkeys->used < HOTKEYS_CAPACITY) {
+    c = &hotkeys->counters[hotkeys->used++];
+    c->count = 1;
+    c->error = 0;
+  } else {
+    c = min;
+    c->error = c->count;
+    c->count++;
+  }
+  c->hash = h;
+  strcpy(c->key, key);
+
+  recorded:
+    if (++hotkeys->recorded >= HOTKEYS_DECAY)
+      decay(hotkeys);
+    pthread_mutex_unlock(&hotkeys->lock);
+}
+
+/* Orders hotkey_t structs by decreasing count. */
+static int by_count(const void *a, const void *b) {
+  const hotkey_t *x = a, *y = b;
+  return (x->count < y->count) - (x->count > y->count);
+}
+
+/* Copies the (at most) N keys of HOTKEYS with the highest counts into TOP,
+ * most requested first, with their counts and errors scaled to estimate all
+ * requests rather than recorded ones. Returns the number of keys copied. */
+unsigned int hotkeys_top(hotkeys_t *hotkeys, hotkey_t *top, unsigned int n) {
+  hotkey_t *all;
+  unsigned int i, used;
+  if ((all = malloc(HOTKEYS_CAPACITY * sizeof(hotkey_t))) == NULL)
+    return 0;
+  pthread_mutex_lock(&hotkeys->lock);
+  used = hotkeys->used;
+  memcpy(all, hotkeys->counters, used * sizeof(hotkey_t));
+  pthread_mutex_unlock(&hotkeys->lock);
+  qsort(all, used, sizeof(hotkey_t), by_count);
+  if (n > used)
+    n = used;
+  for (i = 0; i < n; i++) {
+    top[i] = all[i];
+    top[i].count *= hotkeys->sample;
+    top[i].error *= hotkeys->sample;
+  }
+  free(all);
+  return n;
+}
+
+/* Returns a malloc()d report of the HOTKEYS_REPORTED most requested keys of
+ * HOTKEYS, one "{key, count, error}" line each, or NULL if memory could not
+ * be allocated. */
+char *hotkeys_report(hotkeys_t *hotkeys) {
+  hotkey_t *top;
+  unsigned int i, n;
+  size_t len;
+  char *report;
+  if ((top = malloc(HOTKEYS_REPORTED * sizeof(hotkey_t))) == NULL)
+    return NULL;
+  n = hotkeys_top(hotkeys, top, HOTKEYS_REPORTED);
+  len = sizeof("Hot keys:");
+  for (i = 0; i < n; i++)
+    len += strlen(top[i].key) + 2 * 20 + sizeof("\n{, , }");
+  if ((report = malloc(len)) != NULL) {
+    strcpy(report, "Hot keys:");
+    for (i = 0; i < n; i++)
+      sprintf(report + strlen(report), "\n{%s, %lu, %lu}", top[i].key,
+          top[i].count, top[i].error);
+  }
+  free(top);
+  return report;
+}
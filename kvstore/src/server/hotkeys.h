@@ -0,0 +1,59 @@
+#ifndef __KV_HOTKEYS__
+#define __KV_HOTKEYS__
+
+#include <pthread.h>
+#include "kvconstants.h"
+
+/* HotKeys tracks the keys which receive the most requests, so that keys
+ * overloading a single server or replica set can be found while it runs.
+ *
+ * It implements the Space-Saving algorithm: HOTKEYS_CAPACITY counters are
+ * kept, each for one key. A request for a key which has a counter increments
+ * it. Otherwise, if every counter is in use, the key takes over the counter
+ * with the lowest count, and starts from that count plus one. The count of a
+ * key is thus never underestimated, and overestimated by at most the count it
+ * took over, which is kept as its error. Any key requested more often than
+ * 1/HOTKEYS_CAPACITY of the time is guaranteed to have a counter.
+ *
+ * To keep the request path cheap, only one in every SAMPLE requests of a
+ * thread is recorded, and a request is simply not recorded if another thread
+ * is updating the counters at the time. Reported counts are scaled back up by
+ * SAMPLE. After every HOTKEYS_DECAY recorded requests all counts are halved,
+ * so that the report follows changes in the load.
+ */
+
+/* The number of keys tracked. */
+#define HOTKEYS_CAPACITY 32
+
+/* The number of recorded requests after which all counts are halved. */
+#define HOTKEYS_DECAY (1 << 20)
+
+/* The default ratio of requests to recorded requests. */
+#define HOTKEYS_SAMPLE 8
+
+/* The number of keys listed by hotkeys_report. */
+#define HOTKEYS_REPORTED 10
+
+/* A key and its estimated number of requests. */
+typedef struct {
+  unsigned long count;          /* The number of requests counted for the key. */
+  unsigned long error;          /* The most by which COUNT may be overestimated. */
+  unsigned long hash;           /* The hash of the key. */
+  char key[MAX_KEYLEN + 1];     /* The key. */
+} hotkey_t;
+
+/* A HotKeys tracker. */
+typedef struct {
+  pthread_mutex_t lock;         /* Protects all of the fields below. */
+  unsigned int sample;          /* The ratio of requests to recorded requests. */
+  unsigned int used;            /* The number of counters in use. */
+  unsigned long recorded;       /* Requests recorded since counts were last halved. */
+  hotkey_t counters[HOTKEYS_CAPACITY];
+} hotkeys_t;
+
+int hotkeys_init(hotkeys_t *, unsigned int sample);
+void hotkeys_record(hotkeys_t *, char *key);
+unsigned int hotkeys_top(hotkeys_t *, hotkey_t *top, unsigned int n);
+char *hotkeys_report(hotkeys_t *);
+
+#endif
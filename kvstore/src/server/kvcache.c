@@ -4,44 +4,156 @@
 #include <string.h>
 #include "kvconstants.h"
 #include "kvcache.h"
-#include "kvstore.h"
+#include "kvhash.h"
+
+/* A resize of a KVCache from OLD_NUM_SETS to NUM_SETS sets. The fields other
+ * than NEXT and MIGRATED do not change once the resize has been published. */
+struct kvcacheresize {
+  unsigned int old_num_sets;    /* The number of sets before the resize. */
+  kvcacheset_t *old_sets;       /* The sets before the resize. */
+  unsigned int num_sets;        /* The number of sets after the resize. */
+  kvcacheset_t *sets;           /* The sets after the resize. */
+  unsigned int elem_per_set;    /* The max number of elements in each new set. */
+  unsigned int next;            /* The next old set to move. */
+  struct kvcacheresize *prev;   /* The previous finished resize. */
+  bool migrated[];              /* Whether each old set has been moved. Accessed atomically. */
+};
+
+static kvcacheset_t *alloc_sets(unsigned int num_sets,
+    unsigned int elem_per_set, cache_policy_t policy);
+static kvcacheset_t *pick_new_set(void *resize, char *key);
+static void finish_resize(kvcache_t *cache, struct kvcacheresize *resize);
+static int for_each_set(kvcache_t *cache, bool write,
+    int (*fn)(kvcacheset_t *set, void *arg), void *arg);
 
 /* Initializes KVCache CACHE. The cache will contains NUM_SETS KVCacheSets,
  * each containing up to ELEM_PER_SET entries. Returns 0 if successful, else a
  * negative error code. */
 int kvcache_init(kvcache_t *cache, unsigned int num_sets,
     unsigned int elem_per_set) {
-  int i;
+  return kvcache_init_policy(cache, num_sets, elem_per_set,
+      CACHE_SECOND_CHANCE);
+}
+
+/* Initializes KVCache CACHE like kvcache_init, but each of its sets will evict
+ * entries using POLICY. Returns 0 if successful, else a negative error code. */
+int kvcache_init_policy(kvcache_t *cache, unsigned int num_sets,
+    unsigned int elem_per_set, cache_policy_t policy) {
   if (num_sets == 0 || elem_per_set == 0)
     return -1;
-  cache->sets = malloc(num_sets * sizeof(kvcacheset_t));
-  if (cache->sets == NULL)
+  if ((cache->sets = alloc_sets(num_sets, elem_per_set, policy)) == NULL)
     return ENOMEM;
   cache->num_sets = num_sets;
   cache->elem_per_set = elem_per_set;
+  cache->policy = policy;
+  cache->negative_ttl = CACHE_NEGATIVE_TTL_MS;
+  cache->resize = cache->retired = NULL;
+  cache->layout_seq = 0;
+  pthread_mutex_init(&cache->resize_lock, NULL);
+  return 0;
+}
+
+/* Allocates and initializes NUM_SETS sets holding up to ELEM_PER_SET entries
+ * each with POLICY. The array of sets, and an arena shared by the sets for
+ * their indexes, are mapped with arena_map once they take up a huge page or
+ * more; smaller caches are allocated with malloc(). Returns NULL if memory
+ * could not be allocated, having released whatever was allocated. */
+static kvcacheset_t *alloc_sets(unsigned int num_sets,
+    unsigned int elem_per_set, cache_policy_t policy) {
+  kvcacheset_t *sets;
+  arena_t *arena = NULL;
+  size_t size = num_sets * sizeof(kvcacheset_t);
+  unsigned int i = 0;
+  if (size >= ARENA_HUGEPAGE) {
+    if ((sets = arena_map(size)) == NULL)
+      return NULL;
+  } else if (posix_memalign((void **) &sets, 64, size) != 0) {
+    /* Sets keep their statistics on a separate cache line. */
+    return NULL;
+  }
+  if ((size_t) num_sets * kvcacheset_index_size(elem_per_set)
+      >= ARENA_HUGEPAGE) {
+    if ((arena = malloc(sizeof(arena_t))) == NULL)
+      goto fail;
+    if (arena_init(arena, kvcacheset_index_size(elem_per_set)) != 0) {
+      free(arena);
+      arena = NULL;
+      goto fail;
+    }
+  }
   for (i = 0; i < num_sets; ++i) {
-    if (kvcacheset_init(&cache->sets[i], elem_per_set) != 0)
-      return -1;
+    if (kvcacheset_init_arena(&sets[i], elem_per_set, policy, arena) != 0)
+      goto fail;
   }
-  return 0;
+  return sets;
+
+fail:
+  while (i-- > 0)
+    kvcacheset_destroy(&sets[i]);
+  if (arena != NULL) {
+    arena_destroy(arena);
+    free(arena);
+  }
+  if (size >= ARENA_HUGEPAGE)
+    arena_unmap(sets, size);
+  else
+    free(sets);
+  return NULL;
 }
 
 /* Retrieves the cache set associated with a given KEY. The correct set can be
- * determined based on the hash of the KEY using the hash() function defined
- * within kvstore.h. */
+ * determined based on the hash of the KEY using the kvhash() function defined
+ * within kvhash.h. During a resize, this is the key's old set until that set
+ * has been moved. */
 kvcacheset_t *get_cache_set(kvcache_t *cache, char *key) {
   // OUR CODE HERE
-  unsigned long index = hash(key) % cache->num_sets;
-  return &cache->sets[index];
+  unsigned long h = kvhash(key);
+  struct kvcacheresize *resize = __atomic_load_n(&cache->resize,
+      __ATOMIC_ACQUIRE);
+  unsigned int num_sets;
+  if (resize != NULL) {
+    if (__atomic_load_n(&resize->migrated[h % resize->old_num_sets],
+        __ATOMIC_ACQUIRE))
+      return &resize->sets[h % resize->num_sets];
+    return &resize->old_sets[h % resize->old_num_sets];
+  }
+  /* NUM_SETS is published after SETS, so the index is always in bounds. */
+  num_sets = __atomic_load_n(&cache->num_sets, __ATOMIC_ACQUIRE);
+  return &__atomic_load_n(&cache->sets, __ATOMIC_RELAXED)[h % num_sets];
 }
 
 /* Attempts to retrieve KEY from CACHE. If successful, returns 0 and stores the
  * associated value inside VALUE using malloc()d memory which should be free()d
  * later. Otherwise, returns a negative error code. */
 int kvcache_get(kvcache_t *cache, char *key, char **value) {
+  kvvalue_t *ref;
+  int ret;
+  if ((ret = kvcache_get_ref(cache, key, &ref)) < 0)
+    return ret;
+  *value = malloc(ref->length + 1);
+  if (*value != NULL)
+    strcpy(*value, ref->data);
+  kvvalue_release(ref);
+  return (*value == NULL) ? -1 : 0;
+}
+
+/* Attempts to retrieve KEY from CACHE without copying its value. If
+ * successful, returns 0 and points VALUE at the cached value; the caller holds
+ * a reference to it which must be released with kvvalue_release. Otherwise,
+ * returns a negative error code. */
+int kvcache_get_ref(kvcache_t *cache, char *key, kvvalue_t **value) {
+  unsigned int seq;
+  int ret;
   if (strlen(key) > MAX_KEYLEN)
     return ERRKEYLEN;
-  return kvcacheset_get(get_cache_set(cache, key), key, value);
+  /* A miss may only mean that KEY was moved away from the set searched while
+     a resize was in progress. */
+  do {
+    seq = __atomic_load_n(&cache->layout_seq, __ATOMIC_ACQUIRE);
+    ret = kvcacheset_get_ref(get_cache_set(cache, key), key, value);
+  } while (ret == ERRNOKEY
+      && __atomic_load_n(&cache->layout_seq, __ATOMIC_ACQUIRE) != seq);
+  return ret;
 }
 
 /* Attempts to place the given KEY, VALUE entry into CACHE. Returns 0 if
@@ -54,6 +166,164 @@ int kvcache_put(kvcache_t *cache, char *key, char *value) {
   return kvcacheset_put(get_cache_set(cache, key), key, value);
 }
 
+/* Applies a write of KEY, VALUE to CACHE according to the admission policy
+ * ADMIT: ADMIT_ALWAYS places the entry into CACHE, ADMIT_RESIDENT only
+ * updates an entry CACHE already holds for KEY, and ADMIT_AROUND removes any
+ * entry for KEY so that a stale value is not served. Returns 0 if successful,
+ * else a negative error code. */
+int kvcache_put_admit(kvcache_t *cache, char *key, char *value,
+    admit_t admit) {
+  int ret;
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  if (strlen(value) > MAX_VALLEN)
+    return ERRVALLEN;
+  switch (admit) {
+    case ADMIT_RESIDENT:
+      ret = kvcacheset_update(get_cache_set(cache, key), key, value);
+      break;
+    case ADMIT_AROUND:
+      ret = kvcacheset_del(get_cache_set(cache, key), key);
+      break;
+    default:
+      ret = kvcacheset_put(get_cache_set(cache, key), key, value);
+      break;
+  }
+  return (ret == ERRNOKEY) ? 0 : ret;
+}
+
+/* Attempts to place the given KEY, VALUE entry into CACHE, sharing VALUE
+ * rather than copying it. The caller keeps its own reference to VALUE.
+ * Returns 0 if successful, else a negative error code. */
+int kvcache_put_ref(kvcache_t *cache, char *key, kvvalue_t *value) {
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  if (value->length > MAX_VALLEN)
+    return ERRVALLEN;
+  return kvcacheset_put_ref(get_cache_set(cache, key), key, value);
+}
+
+/* Attempts to place the given KEY, VALUE entry into CACHE as a dirty entry,
+ * which is written to the store by CACHE's flush function later, at the
+ * latest before it is evicted. Returns 0 if successful, else a negative error
+ * code. */
+int kvcache_put_dirty(kvcache_t *cache, char *key, char *value) {
+  kvvalue_t *ref;
+  int ret;
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  if (strlen(value) > MAX_VALLEN)
+    return ERRVALLEN;
+  if ((ref = kvvalue_new(value)) == NULL)
+    return -1;
+  ret = kvcacheset_put_dirty(get_cache_set(cache, key), key, ref);
+  kvvalue_release(ref);
+  return ret;
+}
+
+/* Writes the entry for KEY in CACHE to the store if it is dirty. Returns 0 if
+ * successful, else a negative error code. */
+int kvcache_flush_key(kvcache_t *cache, char *key) {
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  return kvcacheset_flush_key(get_cache_set(cache, key), key);
+}
+
+/* Sets the function every set of CACHE uses to write dirty entries to the
+ * store to FLUSH, which will be passed ARG. Must be called before any dirty
+ * entries are put into CACHE. */
+void kvcache_set_flush(kvcache_t *cache, kvcache_flush_t flush, void *arg) {
+  int i;
+  pthread_mutex_lock(&cache->resize_lock);
+  for (i = 0; i < cache->num_sets; i++) {
+    cache->sets[i].flush = flush;
+    cache->sets[i].flush_arg = arg;
+  }
+  for (i = 0; cache->resize != NULL && i < cache->resize->num_sets; i++) {
+    cache->resize->sets[i].flush = flush;
+    cache->resize->sets[i].flush_arg = arg;
+  }
+  pthread_mutex_unlock(&cache->resize_lock);
+}
+
+/* Calls FN(set, ARG) for every set of CACHE in use, holding the set's lock
+ * for writing if WRITE is set, else for reading. Returns 0 if every call
+ * returned 0, else -1. */
+static int for_each_set(kvcache_t *cache, bool write,
+    int (*fn)(kvcacheset_t *set, void *arg), void *arg) {
+  struct kvcacheresize *resize;
+  kvcacheset_t *set;
+  int i, n, ret = 0;
+  /* Sets are not moved meanwhile. New sets are only in use, and guarded by
+     their own lock, once the old set feeding them has been moved; old sets
+     which have been moved are empty. */
+  pthread_mutex_lock(&cache->resize_lock);
+  resize = cache->resize;
+  n = cache->num_sets + ((resize == NULL) ? 0 : resize->num_sets);
+  for (i = 0; i < n; i++) {
+    if (i < cache->num_sets) {
+      set = &cache->sets[i];
+    } else if (resize->migrated[(i - cache->num_sets)
+        % resize->old_num_sets]) {
+      set = &resize->sets[i - cache->num_sets];
+    } else {
+      continue;
+    }
+    if (write)
+      pthread_rwlock_wrlock(&set->lock);
+    else
+      pthread_rwlock_rdlock(&set->lock);
+    if (fn(set, arg) != 0)
+      ret = -1;
+    pthread_rwlock_unlock(&set->lock);
+  }
+  pthread_mutex_unlock(&cache->resize_lock);
+  return ret;
+}
+
+static int flush_set(kvcacheset_t *set, void *arg) {
+  return kvcacheset_flush(set);
+}
+
+/* Writes every dirty entry in CACHE to the store, taking the lock of each set
+ * in turn. Returns 0 if successful, or -1 if some entry could not be written,
+ * in which case it stays dirty. */
+int kvcache_flush(kvcache_t *cache) {
+  return for_each_set(cache, true, flush_set, NULL);
+}
+
+/* The arguments of kvcache_walk, passed through to walk_set. */
+struct walk {
+  kvcacheset_visit_t visit;
+  void *arg;
+};
+
+static int walk_set(kvcacheset_t *set, void *walk) {
+  kvcacheset_walk(set, ((struct walk *) walk)->visit,
+      ((struct walk *) walk)->arg);
+  return 0;
+}
+
+/* Calls VISIT(ARG, key, referenced) for every entry of CACHE holding a value
+ * (see kvcacheset_walk), taking the read lock of each set in turn. */
+void kvcache_walk(kvcache_t *cache, kvcacheset_visit_t visit, void *arg) {
+  struct walk walk = {visit, arg};
+  for_each_set(cache, false, walk_set, &walk);
+}
+
+/* Records in CACHE that KEY is not present, for CACHE's NEGATIVE_TTL
+ * milliseconds, unless negative caching is disabled (NEGATIVE_TTL is 0).
+ * Should be called after a lookup elsewhere found that KEY does not exist.
+ * Returns 0 if successful, else a negative error code. */
+int kvcache_put_negative(kvcache_t *cache, char *key) {
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  if (cache->negative_ttl == 0)
+    return 0;
+  return kvcacheset_put_negative(get_cache_set(cache, key), key,
+      cache->negative_ttl);
+}
+
 /* Attempts to delete the given KEY from CACHE. Returns 0 if successful, else a
  * negative error code. */
 int kvcache_del(kvcache_t *cache, char *key) {
@@ -70,8 +340,146 @@ pthread_rwlock_t *kvcache_getlock(kvcache_t *cache, char *key) {
   return &get_cache_set(cache, key)->lock;
 }
 
+/* Acquires the write lock associated with KEY within CACHE, and returns it
+ * for the caller to release. Unlike locking the result of kvcache_getlock,
+ * this makes sure that KEY did not move to another set while waiting for the
+ * lock. Returns NULL if KEY is too long. */
+pthread_rwlock_t *kvcache_wrlock(kvcache_t *cache, char *key) {
+  pthread_rwlock_t *lock;
+  while ((lock = kvcache_getlock(cache, key)) != NULL) {
+    pthread_rwlock_wrlock(lock);
+    if (kvcache_getlock(cache, key) == lock)
+      break;
+    pthread_rwlock_unlock(lock);
+  }
+  return lock;
+}
+
+/* Starts resizing CACHE to NUM_SETS sets holding up to ELEM_PER_SET entries
+ * each. NUM_SETS must be a multiple of the current number of sets. Entries
+ * are only moved to the new sets by later calls to kvcache_resize_step; a
+ * resize which is already in progress is finished first. Returns 0 if
+ * successful, else a negative error code. */
+int kvcache_resize(kvcache_t *cache, unsigned int num_sets,
+    unsigned int elem_per_set) {
+  struct kvcacheresize *resize;
+  kvcacheset_t *sets;
+  int i;
+  while (kvcache_resize_step(cache, cache->num_sets) > 0)
+    ;
+  pthread_mutex_lock(&cache->resize_lock);
+  if (num_sets == 0 || elem_per_set == 0 || num_sets % cache->num_sets != 0
+      || cache->resize != NULL) {
+    pthread_mutex_unlock(&cache->resize_lock);
+    return -1;
+  }
+  resize = calloc(1, sizeof(struct kvcacheresize)
+      + cache->num_sets * sizeof(bool));
+  if (resize == NULL
+      || (sets = alloc_sets(num_sets, elem_per_set, cache->policy)) == NULL) {
+    pthread_mutex_unlock(&cache->resize_lock);
+    free(resize);
+    return ENOMEM;
+  }
+  for (i = 0; i < num_sets; i++) {
+    sets[i].flush = cache->sets[0].flush;
+    sets[i].flush_arg = cache->sets[0].flush_arg;
+  }
+  resize->old_num_sets = cache->num_sets;
+  resize->old_sets = cache->sets;
+  resize->num_sets = num_sets;
+  resize->sets = sets;
+  resize->elem_per_set = elem_per_set;
+  __atomic_store_n(&cache->resize, resize, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&cache->resize_lock);
+  return 0;
+}
+
+/* Moves the entries of up to STEPS old sets of CACHE to their new sets, if a
+ * resize is in progress, taking each old set's lock in turn. Does nothing if
+ * another thread is already doing so. The caller must not hold any of
+ * CACHE's locks. Returns the number of old sets still to be moved. */
+unsigned int kvcache_resize_step(kvcache_t *cache, unsigned int steps) {
+  struct kvcacheresize *resize;
+  kvcacheset_t *old;
+  unsigned int left;
+  if (__atomic_load_n(&cache->resize, __ATOMIC_ACQUIRE) == NULL)
+    return 0;
+  if (pthread_mutex_trylock(&cache->resize_lock) != 0)
+    return 1;
+  resize = cache->resize;
+  for (; resize != NULL && steps > 0 && resize->next < resize->old_num_sets;
+      steps--) {
+    old = &resize->old_sets[resize->next];
+    pthread_rwlock_wrlock(&old->lock);
+    kvcacheset_migrate(old, pick_new_set, resize);
+    /* Direct lookups to the new sets before clearing the old one, so that a
+       lookup which misses because of the clear sees LAYOUT_SEQ change. */
+    __atomic_store_n(&resize->migrated[resize->next], true, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&cache->layout_seq, 1, __ATOMIC_RELEASE);
+    kvcacheset_clear(old);
+    pthread_rwlock_unlock(&old->lock);
+    resize->next++;
+  }
+  if (resize != NULL && resize->next == resize->old_num_sets)
+    finish_resize(cache, resize);
+  left = (resize == NULL) ? 0 : resize->old_num_sets - resize->next;
+  pthread_mutex_unlock(&cache->resize_lock);
+  return left;
+}
+
+/* Makes the new sets of RESIZE, all of whose old sets have been moved, the
+ * sets of CACHE. Must be called with CACHE's RESIZE_LOCK held. */
+static void finish_resize(kvcache_t *cache, struct kvcacheresize *resize) {
+  /* Publish SETS before NUM_SETS, so that a lookup which sees the new number
+     of sets indexes into the new array. */
+  __atomic_store_n(&cache->sets, resize->sets, __ATOMIC_RELEASE);
+  __atomic_store_n(&cache->num_sets, resize->num_sets, __ATOMIC_RELEASE);
+  cache->elem_per_set = resize->elem_per_set;
+  resize->prev = cache->retired;
+  cache->retired = resize;
+  __atomic_store_n(&cache->resize, NULL, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&cache->layout_seq, 1, __ATOMIC_RELEASE);
+}
+
+/* Returns the new set KEY belongs to in the struct kvcacheresize RESIZE. */
+static kvcacheset_t *pick_new_set(void *resize, char *key) {
+  struct kvcacheresize *r = resize;
+  return &r->sets[kvhash(key) % r->num_sets];
+}
+
+/* Adds the lookup statistics of the NUM_SETS sets SETS to STATS. */
+static void add_stats(kvcachestats_t *stats, kvcacheset_t *sets,
+    unsigned int num_sets) {
+  kvcachestats_t *set;
+  for (int i = 0; i < num_sets; i++) {
+    set = &sets[i].stats;
+    stats->hits += __atomic_load_n(&set->hits, __ATOMIC_RELAXED);
+    stats->negative_hits += __atomic_load_n(&set->negative_hits,
+        __ATOMIC_RELAXED);
+    stats->misses += __atomic_load_n(&set->misses, __ATOMIC_RELAXED);
+  }
+}
+
+/* Fills STATS with the lookup statistics of CACHE, summed over its sets,
+ * including the sets it had before being resized. */
+void kvcache_stats(kvcache_t *cache, kvcachestats_t *stats) {
+  struct kvcacheresize *resize;
+  memset(stats, 0, sizeof(kvcachestats_t));
+  pthread_mutex_lock(&cache->resize_lock);
+  add_stats(stats, cache->sets, cache->num_sets);
+  if (cache->resize != NULL)
+    add_stats(stats, cache->resize->sets, cache->resize->num_sets);
+  for (resize = cache->retired; resize != NULL; resize = resize->prev)
+    add_stats(stats, resize->old_sets, resize->old_num_sets);
+  pthread_mutex_unlock(&cache->resize_lock);
+}
+
 /* Completely clears this cache. For testing purposes. */
 void kvcache_clear(kvcache_t *cache) {
-  for (int i = 0; i < cache->num_sets; i++)
+  int i;
+  for (i = 0; i < cache->num_sets; i++)
     kvcacheset_clear(&cache->sets[i]);
+  for (i = 0; cache->resize != NULL && i < cache->resize->num_sets; i++)
+    kvcacheset_clear(&cache->resize->sets[i]);
 }
@@ -2,6 +2,7 @@
 #define __KV_CACHE__
 
 #include <pthread.h>
+#include "kvconstants.h"
 #include "kvcacheset.h"
 
 /* KVCache defines the in-memory cache which is used by KVServers to quickly
@@ -13,7 +14,9 @@
  * However, entries in the same cache set must be modified sequentially. This
  * is achieved using a read-write lock maintained by each cache set. The lock 
  * should be acquired/released from whoever will be calling the cache methods 
- * (i.e. KVServer and, later, TPCMaster).
+ * (i.e. KVServer and, later, TPCMaster). Only PUTs and DELs need it: GETs are
+ * optimistic and lock-free, validated against a per-set sequence count (see
+ * kvcacheset.h), so that readers never write to the lock's cache line.
  *
  * The cache uses a second-chance replacement policy implemented within each
  * cache set.  You can think of this as a FIFO queue, where the entry that has
@@ -25,22 +28,115 @@
  * the front of the queue. Once an entry with a reference bit of false is
  * reached, evict that entry.  If an entry with a reference bit of true is
  * seen, set its reference bit to false, and move it to the back of the queue.
+ *
+ * Alternatively, a cache can be initialized with kvcache_init_policy to use
+ * ARC (Adaptive Replacement Cache, Megiddo & Modha) within each set. ARC
+ * splits resident entries between T1, holding entries seen once recently, and
+ * T2, holding entries seen at least twice. It also remembers the keys of
+ * entries recently evicted from T1 and T2 on the ghost lists B1 and B2. A PUT
+ * of a key found on B1 means T1 was too small and grows its target length; a
+ * key found on B2 shrinks it. This lets ARC shift between recency-friendly
+ * and frequency-friendly behavior as the workload changes, while a one-time
+ * scan only ever passes through T1. Because GETs do not take the lock, a hit
+ * only sets the entry's reference bit; as in CAR (Bansal & Modha), an entry
+ * with its reference bit set is moved to T2 when it would have been evicted.
+ *
+ * Values are stored as reference-counted KVValues (see kvvalue.h). kvcache_get
+ * returns a private copy of a value, while kvcache_get_ref returns the cached
+ * buffer itself along with a reference to it; this is what servers use on
+ * their read path, so that a cache hit involves no allocation or copying.
+ *
+ * A cache can also remember that a key does not exist: after a lookup which
+ * missed both the cache and the backing store (or slaves), a server calls
+ * kvcache_put_negative, and GETs of that key will then return ERRNEGKEY for
+ * NEGATIVE_TTL milliseconds rather than missing again. A PUT of the key
+ * replaces the negative entry immediately. Hits, negative hits and misses are
+ * counted per set and can be read with kvcache_stats.
+ *
+ * By default, servers use the cache in write-through mode, writing every PUT
+ * to their store as well. In write-back mode, a server instead puts entries
+ * with kvcache_put_dirty and writes them to the store later through the flush
+ * function set with kvcache_set_flush, either in batches (kvcacheset_flush)
+ * or when a dirty entry is about to be evicted. A dirty entry which cannot
+ * be flushed is never evicted: a PUT which needs its place fails instead,
+ * and the server writes that PUT to the store itself.
+ *
+ * Write-through servers apply PUTs to the cache with kvcache_put_admit,
+ * according to an admission policy (see admit_t in kvconstants.h). Bulk
+ * loads of data which is written once and rarely read can thus update only
+ * keys already cached, or bypass the cache entirely, instead of evicting the
+ * entries which are actually being read.
+ *
+ * A cache can be grown while in use with kvcache_resize, which allocates the
+ * new sets but leaves the entries where they are. They are then moved over a
+ * set at a time by kvcache_resize_step, which servers call on every write and
+ * cache miss, so that no single request pays for more than one set. Since the
+ * new number of sets must be a multiple of the old one, the entries of an old
+ * set all go to new sets which no other old set feeds, and holding the old
+ * set's lock is enough to move them. A key is looked up in its old set until
+ * that set has been moved, and in its new set afterwards. Because the set
+ * (and so the lock) a key maps to can change while a writer waits for the
+ * lock, writers should lock with kvcache_wrlock, which checks that the lock
+ * it acquired is still the right one. Old sets are kept, empty, after a
+ * resize, so that readers and writers which raced with it never touch freed
+ * memory.
+ *
+ * Once a cache is large enough for it to matter, its array of sets and the
+ * index tables of those sets are allocated from memory backed by huge pages
+ * when the system provides them (see arena.h), so that lookups take fewer
+ * TLB misses.
  */
 
+/* The default lifetime of negative entries, in milliseconds. */
+#define CACHE_NEGATIVE_TTL_MS 1000
+
+/* The number of sets moved per call to kvcache_resize_step by servers. */
+#define CACHE_RESIZE_STEP 1
+
+/* A resize of a KVCache, in progress or finished. */
+struct kvcacheresize;
+
 /* A KVCache. */
 typedef struct {
   unsigned int num_sets;        /* The number of sets within this cache. */
   unsigned int elem_per_set;    /* The max number of elements that can be stored within each set. */
   kvcacheset_t *sets;           /* An array of all of the sets used in this cache. */
+  cache_policy_t policy;        /* The replacement policy used by every set. */
+  unsigned int negative_ttl;    /* The lifetime of negative entries in ms, or 0 to not create them. */
+
+  /* Resizing state. While a resize is in progress, NUM_SETS and SETS still
+     describe the old sets. NUM_SETS, SETS and RESIZE are accessed atomically. */
+  struct kvcacheresize *resize; /* The resize in progress, or NULL. */
+  struct kvcacheresize *retired; /* Finished resizes, which keep the old sets. */
+  unsigned int layout_seq;      /* Incremented whenever entries move to other sets. Accessed atomically. */
+  pthread_mutex_t resize_lock;  /* Serializes resizes, steps and kvcache_flush. */
 } kvcache_t;
 
 int kvcache_init(kvcache_t *, unsigned int num_sets, unsigned int elem_per_set);
+int kvcache_init_policy(kvcache_t *, unsigned int num_sets,
+    unsigned int elem_per_set, cache_policy_t policy);
 
 int kvcache_get(kvcache_t *, char *key, char **value);
+int kvcache_get_ref(kvcache_t *, char *key, kvvalue_t **value);
 int kvcache_put(kvcache_t *, char *key, char *value);
+int kvcache_put_ref(kvcache_t *, char *key, kvvalue_t *value);
+int kvcache_put_admit(kvcache_t *, char *key, char *value, admit_t admit);
+int kvcache_put_negative(kvcache_t *, char *key);
+int kvcache_put_dirty(kvcache_t *, char *key, char *value);
+int kvcache_flush_key(kvcache_t *, char *key);
+void kvcache_set_flush(kvcache_t *, kvcache_flush_t flush, void *arg);
+int kvcache_flush(kvcache_t *);
+void kvcache_walk(kvcache_t *, kvcacheset_visit_t visit, void *arg);
 int kvcache_del(kvcache_t *, char *key);
 
 pthread_rwlock_t *kvcache_getlock(kvcache_t *, char *key);
+pthread_rwlock_t *kvcache_wrlock(kvcache_t *, char *key);
+
+int kvcache_resize(kvcache_t *, unsigned int num_sets,
+    unsigned int elem_per_set);
+unsigned int kvcache_resize_step(kvcache_t *, unsigned int steps);
+
+void kvcache_stats(kvcache_t *, kvcachestats_t *stats);
 
 void kvcache_clear(kvcache_t *);
 
@@ -8,13 +8,83 @@
 // OUR CODE HERE
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-static void kvcacheentry_free(struct kvcacheentry *);
+#include "epoch.h"
+#include "kvhash.h"
+
+/* Marks an index slot whose entry has been removed. */
+#define INDEX_TOMBSTONE ((struct kvcacheentry *) 1)
+
+struct kvcacheindex {
+  arena_t *arena;               /* The arena the index was allocated from, or NULL. */
+  unsigned int mask;            /* The number of slots, minus one. */
+  unsigned int used;            /* The number of slots which are not empty. */
+  struct kvcacheslot {
+    unsigned long hash;         /* The hash of the entry's key. */
+    struct kvcacheentry *entry; /* NULL if the slot is empty. */
+  } slots[0];
+};
+
+static struct kvcacheentry *kvcacheentry_new(char *key, kvvalue_t *value,
+    unsigned long expires, bool dirty);
+static void kvcacheentry_free(void *);
+static void release_value(void *);
+static void set_value(struct kvcacheentry *e, kvvalue_t *value,
+    unsigned long expires, bool dirty);
+static int put_entry(kvcacheset_t *cacheset, char *key, kvvalue_t *value,
+    unsigned long expires, bool dirty);
+static bool flush_entry(kvcacheset_t *cacheset, struct kvcacheentry *e);
+static bool flush_victim(kvcacheset_t *cacheset, struct kvcacheentry *e);
+static unsigned long now_ms(void);
+static inline void stat_inc(unsigned long *counter);
+static int second_chance_evict(kvcacheset_t *cacheset);
+static int arc_put(kvcacheset_t *cacheset, char *key, kvvalue_t *value,
+    unsigned long expires, bool dirty);
+static struct kvcacheentry **arc_list(kvcacheset_t *cacheset, arc_list_t list);
+static unsigned int index_slots(unsigned int elem_per_set);
+static struct kvcacheindex *index_new(unsigned int elem_per_set,
+    arena_t *arena);
+static void index_free(void *);
+static struct kvcacheentry *index_find(struct kvcacheindex *, char *key,
+    unsigned long h);
+static void index_insert(kvcacheset_t *cacheset, struct kvcacheentry *e);
+static void index_remove(kvcacheset_t *cacheset, struct kvcacheentry *e);
+static void index_rebuild(kvcacheset_t *cacheset, bool keep_entries);
+
+/* Marks the start of a modification of CACHESET, during which lock-free
+ * readers will retry. */
+static inline void write_begin(kvcacheset_t *cacheset) {
+  __atomic_store_n(&cacheset->seq, cacheset->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* Marks the end of a modification of CACHESET. */
+static inline void write_end(kvcacheset_t *cacheset) {
+  __atomic_store_n(&cacheset->seq, cacheset->seq + 1, __ATOMIC_RELEASE);
+}
 
 /* Initializes CACHESET to hold a maximum of ELEM_PER_SET elements.
  * ELEM_PER_SET must be at least 2.
  * Returns 0 if successful, else a negative error code. */
 int kvcacheset_init(kvcacheset_t *cacheset, unsigned int elem_per_set) {
+  return kvcacheset_init_policy(cacheset, elem_per_set, CACHE_SECOND_CHANCE);
+}
+
+/* Initializes CACHESET to hold a maximum of ELEM_PER_SET elements, evicting
+ * entries according to POLICY. ELEM_PER_SET must be at least 2.
+ * Returns 0 if successful, else a negative error code. */
+int kvcacheset_init_policy(kvcacheset_t *cacheset, unsigned int elem_per_set,
+    cache_policy_t policy) {
+  return kvcacheset_init_arena(cacheset, elem_per_set, policy, NULL);
+}
+
+/* Initializes CACHESET like kvcacheset_init_policy, but allocates its index
+ * tables from ARENA, whose blocks must be of at least
+ * kvcacheset_index_size(ELEM_PER_SET) bytes, unless ARENA is NULL.
+ * Returns 0 if successful, else a negative error code. */
+int kvcacheset_init_arena(kvcacheset_t *cacheset, unsigned int elem_per_set,
+    cache_policy_t policy, arena_t *arena) {
   if (elem_per_set < 2)
     return -1;
   int ret;
@@ -22,31 +92,111 @@ int kvcacheset_init(kvcacheset_t *cacheset, unsigned int elem_per_set) {
     return ret;
   cacheset->elem_per_set = elem_per_set;
   cacheset->num_entries = 0;
+  cacheset->policy = policy;
   // OUR CODE HERE
-  cacheset->entries = NULL;
+  cacheset->arena = arena;
+  if ((cacheset->index = index_new(elem_per_set, arena)) == NULL) {
+    pthread_rwlock_destroy(&cacheset->lock);
+    return ENOMEM;
+  }
+  cacheset->seq = 0;
+  cacheset->flush = NULL;
+  cacheset->flush_arg = NULL;
+  memset(&cacheset->stats, 0, sizeof(cacheset->stats));
   cacheset->head = NULL;
+  cacheset->t2 = NULL;
+  cacheset->b1 = NULL;
+  cacheset->b2 = NULL;
+  cacheset->ghosts = NULL;
+  memset(cacheset->len, 0, sizeof(cacheset->len));
+  cacheset->target = 0;
   return 0;
 }
 
+/* Releases the index and lock of CACHESET, which must hold no entries, such
+ * as a set which was just initialized and is not used after all. */
+void kvcacheset_destroy(kvcacheset_t *cacheset) {
+  index_free(cacheset->index);
+  cacheset->index = NULL;
+  pthread_rwlock_destroy(&cacheset->lock);
+}
+
 
 /* Get the entry corresponding to KEY from CACHESET. Returns 0 if successful,
  * else returns a negative error code. If successful, populates VALUE with a
  * malloced string which should later be freed. */
 int kvcacheset_get(kvcacheset_t *cacheset, char *key, char **value) {
   // OUR CODE HERE
+  kvvalue_t *ref;
+  int ret;
+  if ((ret = kvcacheset_get_ref(cacheset, key, &ref)) < 0)
+    return ret;
+  *value = (char *) malloc((ref->length + 1) * sizeof(char));
+  if (*value != NULL)
+    strcpy(*value, ref->data);
+  kvvalue_release(ref);
+  return (*value == NULL) ? -1 : 0;
+}
+
+/* Get the entry corresponding to KEY from CACHESET without copying its value.
+ * Returns 0 if successful, else returns a negative error code: ERRNEGKEY if
+ * KEY is cached as not present, or ERRNOKEY if it is not cached at all. If
+ * successful, VALUE will point to the cached value, of which the caller holds
+ * a reference that must later be released with kvvalue_release. Does not
+ * require CACHESET's lock to be held. */
+int kvcacheset_get_ref(kvcacheset_t *cacheset, char *key, kvvalue_t **value) {
   struct kvcacheentry *e;
-  // pthread_rwlock_rdlock(&cacheset->lock);
-  HASH_FIND_STR(cacheset->entries, key, e);
-  // pthread_rwlock_unlock(&cacheset->lock);
-  if (e == NULL) {
-    return ERRNOKEY;
+  kvvalue_t *v = NULL;
+  unsigned long h = kvhash(key), expires = 0;
+  unsigned int seq;
+  bool live;
+
+  if (!epoch_enter()) {
+    /* No reader slot is available, so keep writers out with the lock. */
+    pthread_rwlock_rdlock(&cacheset->lock);
+    e = index_find(cacheset->index, key, h);
+    if (e != NULL) {
+      expires = e->expires;
+      v = (e->value == NULL) ? NULL : kvvalue_ref(e->value);
+    }
+    if ((live = (e != NULL && (expires == 0 || now_ms() < expires))))
+      __atomic_store_n(&e->refbit, true, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&cacheset->lock);
+  } else {
+    while (true) {
+      while ((seq = __atomic_load_n(&cacheset->seq, __ATOMIC_ACQUIRE)) & 1)
+        ;
+      e = index_find(__atomic_load_n(&cacheset->index, __ATOMIC_ACQUIRE),
+          key, h);
+      if (e != NULL) {
+        expires = __atomic_load_n(&e->expires, __ATOMIC_RELAXED);
+        v = __atomic_load_n(&e->value, __ATOMIC_ACQUIRE);
+      }
+      /* A value retired after being loaded here is not freed before
+         epoch_exit, so it is still safe to take a reference to. */
+      if (v != NULL)
+        kvvalue_ref(v);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&cacheset->seq, __ATOMIC_RELAXED) == seq
+          && (e == NULL || v != NULL || expires != 0))
+        break;
+      kvvalue_release(v);
+      v = NULL;
+    }
+    live = (e != NULL && (expires == 0 || now_ms() < expires));
+    if (live && !__atomic_load_n(&e->refbit, __ATOMIC_RELAXED))
+      __atomic_store_n(&e->refbit, true, __ATOMIC_RELAXED);
+    epoch_exit();
   }
-  *value = (char *) malloc((strlen(e->value) + 1) * sizeof(char));
-  if (*value == NULL) {
-    return -1;
+  if (!live) {
+    stat_inc(&cacheset->stats.misses);
+    return ERRNOKEY;
+  } else if (expires != 0) {
+    stat_inc(&cacheset->stats.negative_hits);
+    return ERRNEGKEY;
   }
-  e->refbit = true;
-  strcpy(*value, e->value);
+  stat_inc(&cacheset->stats.hits);
+  *value = v;
   return 0;
 }
 
@@ -54,88 +204,607 @@ int kvcacheset_get(kvcacheset_t *cacheset, char *key, char **value) {
  * returns a negative error code. Should evict elements if necessary to not
  * exceed CACHESET->elem_per_set total entries. */
 int kvcacheset_put(kvcacheset_t *cacheset, char *key, char *value) {
+  int ret;
+  kvvalue_t *ref = kvvalue_new(value);
+  if (ref == NULL)
+    return -1;
+  ret = kvcacheset_put_ref(cacheset, key, ref);
+  kvvalue_release(ref);
+  return ret;
+}
+
+/* Replaces the value of KEY in CACHESET with VALUE if CACHESET holds an entry
+ * for KEY (a negative entry included), without inserting one otherwise.
+ * Returns 0 if successful, ERRNOKEY if KEY is not cached, else a negative
+ * error code. */
+int kvcacheset_update(kvcacheset_t *cacheset, char *key, char *value) {
+  if (index_find(cacheset->index, key, kvhash(key)) == NULL)
+    return ERRNOKEY;
+  return kvcacheset_put(cacheset, key, value);
+}
+
+/* Add the given KEY, VALUE pair to CACHESET without copying VALUE; CACHESET
+ * takes its own reference to it, and the caller keeps its reference. Returns
+ * 0 if successful, else returns a negative error code. */
+int kvcacheset_put_ref(kvcacheset_t *cacheset, char *key, kvvalue_t *value) {
   // OUR CODE HERE
+  return put_entry(cacheset, key, value, 0, false);
+}
+
+/* Like kvcacheset_put_ref, but marks the entry as dirty: its value has not
+ * been written to the store yet. CACHESET's flush function must have been set,
+ * and will be called to write the value before the entry is evicted. Returns
+ * 0 if successful, else returns a negative error code. */
+int kvcacheset_put_dirty(kvcacheset_t *cacheset, char *key, kvvalue_t *value) {
+  return put_entry(cacheset, key, value, 0, true);
+}
+
+/* Writes every dirty entry of CACHESET to the store using its flush function.
+ * Readers are not blocked meanwhile, but the lock must be held as for a PUT.
+ * Returns 0 if successful, or -1 if some entry could not be written, in which
+ * case it stays dirty. */
+int kvcacheset_flush(kvcacheset_t *cacheset) {
   struct kvcacheentry *e;
+  int ret = 0;
+  DL_FOREACH(cacheset->head, e) {
+    if (!flush_entry(cacheset, e))
+      ret = -1;
+  }
+  DL_FOREACH(cacheset->t2, e) {
+    if (!flush_entry(cacheset, e))
+      ret = -1;
+  }
+  return ret;
+}
+
+/* Writes the entry for KEY in CACHESET to the store if it is dirty. The lock
+ * must be held as for a PUT. Returns 0 if the store is now up to date with
+ * the cache for KEY, else -1. */
+int kvcacheset_flush_key(kvcacheset_t *cacheset, char *key) {
+  struct kvcacheentry *e = index_find(cacheset->index, key, kvhash(key));
+  return (e == NULL || flush_entry(cacheset, e)) ? 0 : -1;
+}
 
-  HASH_FIND_STR(cacheset->entries, key, e);
-  if (e == NULL) { // cacheset does NOT contain this key already
+/* Records in CACHESET that KEY is not present, for the next TTL_MS
+ * milliseconds. Until then, or until KEY is PUT, GETs of KEY return ERRNEGKEY
+ * instead of missing. Does nothing if a value is cached for KEY, since that
+ * must be newer. Returns 0 if successful, else returns a negative error
+ * code. */
+int kvcacheset_put_negative(kvcacheset_t *cacheset, char *key,
+    unsigned int ttl_ms) {
+  struct kvcacheentry *e = index_find(cacheset->index, key, kvhash(key));
+  if (e != NULL && e->expires == 0)
+    return 0;
+  return put_entry(cacheset, key, NULL, now_ms() + ttl_ms, false);
+}
+
+/* Inserts or updates the entry for KEY in CACHESET, holding VALUE if EXPIRES
+ * is 0, or a negative entry expiring at EXPIRES otherwise. The entry is
+ * marked as dirty if DIRTY is set. Fails, leaving CACHESET as it was, if a
+ * new entry cannot be made room for because dirty entries cannot be
+ * flushed. */
+static int put_entry(kvcacheset_t *cacheset, char *key, kvvalue_t *value,
+    unsigned long expires, bool dirty) {
+  struct kvcacheentry *e;
+  int ret = 0;
+
+  write_begin(cacheset);
+  if (cacheset->policy == CACHE_ARC) {
+    ret = arc_put(cacheset, key, value, expires, dirty);
+  } else if ((e = index_find(cacheset->index, key, kvhash(key))) != NULL) {
+    set_value(e, value, expires, dirty);
+    __atomic_store_n(&e->refbit, true, __ATOMIC_RELAXED);
+  } else if ((e = kvcacheentry_new(key, value, expires, dirty)) == NULL) {
+    /* cacheset does NOT contain this key already */
+    ret = -1;
+  } else {
     if (cacheset->num_entries < cacheset->elem_per_set) {
       cacheset->num_entries++;
-    } else { // evicting an element: use 2nd change algorithm here
-      while (true) {
-        struct kvcacheentry *candidate = cacheset->head;
-        DL_DELETE(cacheset->head, candidate);
-        if (candidate->refbit) {
-          candidate->refbit = false;
-          DL_APPEND(cacheset->head, candidate);
-        } else {
-          HASH_DEL(cacheset->entries, candidate);
-          kvcacheentry_free(candidate);
-          break; 
-        }
-      }
-    }
-    e = (struct kvcacheentry *) malloc(sizeof(struct kvcacheentry));
-    if (e == NULL) {
-      return -1;
-    }
-    e->key = (char *) malloc((strlen(key) + 1) * sizeof(char));
-    if (e->key == NULL) {
+    } else if (second_chance_evict(cacheset) < 0) {
       kvcacheentry_free(e);
+      write_end(cacheset);
       return -1;
     }
-    strcpy(e->key, key);
-    HASH_ADD_STR(cacheset->entries, key, e);
+    index_insert(cacheset, e);
     DL_APPEND(cacheset->head, e);
-    e->refbit = false;
-  } else {
-    free(e->value); // the value is about to be overwritten, so free old value
-    e->refbit = true;
   }
-
-  e->value = (char *) malloc((strlen(value) + 1) * sizeof(char));
-  if (e->value == NULL) {
-    kvcacheentry_free(e);
-    return -1;
-  }
-  strcpy(e->value, value);
-
-  return 0;
+  write_end(cacheset);
+  return ret;
 }
 
 /* Deletes the entry corresponding to KEY from CACHESET. Returns 0 if
  * successful, else returns a negative error code. */
 int kvcacheset_del(kvcacheset_t *cacheset, char *key) {
   // OUR CODE HERE
-  struct kvcacheentry *e;
-  HASH_FIND_STR(cacheset->entries, key, e);
+  struct kvcacheentry *e = index_find(cacheset->index, key, kvhash(key));
   if (e == NULL) {
     return ERRNOKEY;
   }
-  HASH_DEL(cacheset->entries, e);
-  DL_DELETE(cacheset->head, e);
-  kvcacheentry_free(e);
+  write_begin(cacheset);
+  index_remove(cacheset, e);
+  if (cacheset->policy == CACHE_ARC) {
+    struct kvcacheentry **list = arc_list(cacheset, e->list);
+    DL_DELETE(*list, e);
+    cacheset->len[e->list]--;
+  } else {
+    DL_DELETE(cacheset->head, e);
+  }
   cacheset->num_entries--;
+  write_end(cacheset);
+  epoch_retire(e, kvcacheentry_free);
   return 0;
 }
 
 /* Completely clears this cache set. For testing purposes. */
 void kvcacheset_clear(kvcacheset_t *cacheset) {
   // OUR CODE HERE
-  HASH_CLEAR(hh, cacheset->entries);
+  struct kvcacheentry **lists[] = {&cacheset->head, &cacheset->t2,
+    &cacheset->b1, &cacheset->b2};
   struct kvcacheentry *elt, *tmp;
-  DL_FOREACH_SAFE(cacheset->head, elt, tmp) {
-    DL_DELETE(cacheset->head, elt);
-    kvcacheentry_free(elt);
+  int i;
+  write_begin(cacheset);
+  index_rebuild(cacheset, false);
+  HASH_CLEAR(hh, cacheset->ghosts);
+  for (i = 0; i < 4; i++) {
+    DL_FOREACH_SAFE(*lists[i], elt, tmp) {
+      DL_DELETE(*lists[i], elt);
+      epoch_retire(elt, kvcacheentry_free);
+    }
+  }
+  cacheset->num_entries = 0;
+  memset(cacheset->len, 0, sizeof(cacheset->len));
+  cacheset->target = 0;
+  write_end(cacheset);
+}
+
+/* Copies every resident entry of CACHESET, in order from least to most
+ * recently inserted, into the set returned by PICK(ARG, key), keeping its
+ * value, expiry and dirty flag. Expired negative entries are dropped. Used to
+ * move a set's entries when its cache is resized; CACHESET should be cleared
+ * afterwards, once lookups of its keys go to the new sets. The locks of
+ * CACHESET and of every set PICK may return must be held as for a PUT.
+ * Returns 0 if successful, or -1 if some entry could not be copied; dirty
+ * entries are then written to the store first, so that only the cached copy
+ * is lost. */
+int kvcacheset_migrate(kvcacheset_t *cacheset, kvcacheset_pick_t pick,
+    void *arg) {
+  struct kvcacheentry *lists[] = {cacheset->head, cacheset->t2}, *e;
+  unsigned long now = now_ms(), expires;
+  int i, ret = 0;
+  for (i = 0; i < 2; i++) {
+    DL_FOREACH(lists[i], e) {
+      expires = __atomic_load_n(&e->expires, __ATOMIC_RELAXED);
+      if (expires != 0 && expires <= now)
+        continue;
+      if (put_entry(pick(arg, e->key), e->key, e->value, expires, e->dirty)
+          < 0) {
+        flush_entry(cacheset, e);
+        ret = -1;
+      }
+    }
+  }
+  return ret;
+}
+
+/* Calls VISIT(ARG, key, referenced) for every entry of CACHESET holding a
+ * value, in order from least to most recently inserted. Under ARC, entries on
+ * T2 count as referenced. The lock must be held, at least for reading. */
+void kvcacheset_walk(kvcacheset_t *cacheset, kvcacheset_visit_t visit,
+    void *arg) {
+  struct kvcacheentry *lists[] = {cacheset->head, cacheset->t2}, *e;
+  int i;
+  for (i = 0; i < 2; i++) {
+    DL_FOREACH(lists[i], e) {
+      if (e->value != NULL)
+        visit(arg, e->key, e->list == ARC_T2
+            || __atomic_load_n(&e->refbit, __ATOMIC_RELAXED));
+    }
   }
 }
 
 // OUR CODE HERE
-/* Frees the kvcacheentry element and all of it's malloc()-ed fields. */
-static void kvcacheentry_free(struct kvcacheentry *e) {
+/* Evicts one entry from the full, second-chance CACHESET. Entries are taken
+ * from the front of the queue; those with their reference bit set have it
+ * cleared and are moved to the back of the queue instead. Dirty entries are
+ * written to the store first, and also moved to the back if that fails. Since
+ * readers may keep setting reference bits, the front entry is evicted
+ * regardless once every entry has been given its second chance, unless it is
+ * dirty and cannot be flushed: a write which has been acknowledged is never
+ * dropped. Returns 0 if an entry was evicted, else -1. */
+static int second_chance_evict(kvcacheset_t *cacheset) {
+  int passes = 2 * cacheset->num_entries;
+  while (true) {
+    struct kvcacheentry *candidate = cacheset->head;
+    DL_DELETE(cacheset->head, candidate);
+    if (__atomic_load_n(&candidate->refbit, __ATOMIC_RELAXED) && passes-- > 0) {
+      __atomic_store_n(&candidate->refbit, false, __ATOMIC_RELAXED);
+      DL_APPEND(cacheset->head, candidate);
+    } else if (!flush_victim(cacheset, candidate)) {
+      DL_APPEND(cacheset->head, candidate);
+      if (passes-- <= 0)
+        return -1;
+    } else {
+      index_remove(cacheset, candidate);
+      epoch_retire(candidate, kvcacheentry_free);
+      return 0;
+    }
+  }
+}
+
+/* Returns the head of the ARC list LIST within CACHESET. */
+static struct kvcacheentry **arc_list(kvcacheset_t *cacheset, arc_list_t list) {
+  switch (list) {
+    case ARC_T1: return &cacheset->head;
+    case ARC_T2: return &cacheset->t2;
+    case ARC_B1: return &cacheset->b1;
+    default:     return &cacheset->b2;
+  }
+}
+
+/* Moves E from whichever ARC list it is on to the MRU end of LIST. */
+static void arc_move(kvcacheset_t *cacheset, struct kvcacheentry *e,
+    arc_list_t list) {
+  DL_DELETE(*arc_list(cacheset, e->list), e);
+  cacheset->len[e->list]--;
+  e->list = list;
+  DL_APPEND(*arc_list(cacheset, list), e);
+  cacheset->len[list]++;
+}
+
+/* Removes the LRU entry of the ghost list LIST from CACHESET entirely. */
+static void arc_drop_ghost(kvcacheset_t *cacheset, arc_list_t list) {
+  struct kvcacheentry *ghost = *arc_list(cacheset, list);
+  DL_DELETE(*arc_list(cacheset, list), ghost);
+  cacheset->len[list]--;
+  HASH_DEL(cacheset->ghosts, ghost);
+  epoch_retire(ghost, kvcacheentry_free);
+}
+
+/* ARC's REPLACE: evicts the LRU entry of either T1 or T2, leaving its key
+ * behind on the corresponding ghost list. T1 is chosen if it is longer than
+ * its target, or as long as its target and the key being inserted was a hit
+ * in B2. IN_B2 indicates the latter.
+ *
+ * Hits do not reorder the lists, since readers do not hold the lock; they
+ * only set the entry's reference bit. As in CAR, an entry about to be evicted
+ * whose reference bit is set instead has it cleared and moves to the MRU end
+ * of T2, having been seen at least twice. A dirty entry is written to the
+ * store before it is evicted, or moved to the MRU end of its list if that
+ * fails; nothing is evicted if no dirty entry can be flushed in the end.
+ * Returns 0 if an entry was evicted, else -1. */
+static int arc_replace(kvcacheset_t *cacheset, bool in_b2) {
+  struct kvcacheentry *victim;
+  unsigned int t1_len;
+  int passes = 2 * cacheset->num_entries;
+  while (true) {
+    t1_len = cacheset->len[ARC_T1];
+    if (t1_len > 0 && (t1_len > cacheset->target || cacheset->t2 == NULL
+        || (in_b2 && t1_len == cacheset->target))) {
+      victim = cacheset->head;
+    } else {
+      victim = cacheset->t2;
+    }
+    if (__atomic_load_n(&victim->refbit, __ATOMIC_RELAXED) && passes-- > 0) {
+      __atomic_store_n(&victim->refbit, false, __ATOMIC_RELAXED);
+      arc_move(cacheset, victim, ARC_T2);
+    } else if (flush_victim(cacheset, victim)) {
+      break;
+    } else {
+      arc_move(cacheset, victim, victim->list);
+      if (passes-- <= 0)
+        return -1;
+    }
+  }
+  arc_move(cacheset, victim, (victim->list == ARC_T1) ? ARC_B1 : ARC_B2);
+  index_remove(cacheset, victim);
+  HASH_ADD_STR(cacheset->ghosts, key, victim);
+  if (victim->value != NULL)
+    epoch_retire(victim->value, release_value);
+  __atomic_store_n(&victim->value, NULL, __ATOMIC_RELEASE);
+  cacheset->num_entries--;
+  return 0;
+}
+
+/* ARC version of kvcacheset_put. A key found on a ghost list was evicted too
+ * early, so the target length of T1 is adapted towards the list which would
+ * have kept it (B1 grows T1, B2 shrinks it) and the key re-enters on T2. */
+static int arc_put(kvcacheset_t *cacheset, char *key, kvvalue_t *value,
+    unsigned long expires, bool dirty) {
+  struct kvcacheentry *e;
+  unsigned int c = cacheset->elem_per_set, *len = cacheset->len, delta;
+
+  if ((e = index_find(cacheset->index, key, kvhash(key))) != NULL) {
+    set_value(e, value, expires, dirty);
+    __atomic_store_n(&e->refbit, true, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  HASH_FIND_STR(cacheset->ghosts, key, e);
+  if (e != NULL) {
+    if (e->list == ARC_B1) {
+      delta = (len[ARC_B2] > len[ARC_B1]) ? len[ARC_B2] / len[ARC_B1] : 1;
+      cacheset->target = (cacheset->target + delta > c) ? c : cacheset->target + delta;
+    } else {
+      delta = (len[ARC_B1] > len[ARC_B2]) ? len[ARC_B1] / len[ARC_B2] : 1;
+      cacheset->target = (cacheset->target > delta) ? cacheset->target - delta : 0;
+    }
+    if (cacheset->num_entries >= c
+        && arc_replace(cacheset, e->list == ARC_B2) < 0)
+      return -1;
+    HASH_DEL(cacheset->ghosts, e);
+    set_value(e, value, expires, dirty);
+    arc_move(cacheset, e, ARC_T2);
+    index_insert(cacheset, e);
+    cacheset->num_entries++;
+    return 0;
+  }
+
+  /* A complete miss: make room, then trim the ghost lists so that T1 + B1
+     and the whole directory stay within c and 2c entries respectively. */
+  if ((e = kvcacheentry_new(key, value, expires, dirty)) == NULL)
+    return -1;
+  if (cacheset->num_entries >= c && arc_replace(cacheset, false) < 0) {
+    kvcacheentry_free(e);
+    return -1;
+  }
+  if (len[ARC_T1] + len[ARC_B1] >= c) {
+    if (len[ARC_B1] > 0)
+      arc_drop_ghost(cacheset, ARC_B1);
+  } else if (len[ARC_T1] + len[ARC_T2] + len[ARC_B1] + len[ARC_B2] >= 2 * c) {
+    arc_drop_ghost(cacheset, ARC_B2);
+  }
+  e->list = ARC_T1;
+  DL_APPEND(cacheset->head, e);
+  len[ARC_T1]++;
+  index_insert(cacheset, e);
+  cacheset->num_entries++;
+  return 0;
+}
+
+/* Returns the number of slots of the index of a set of ELEM_PER_SET entries:
+ * the smallest power of two which is at least twice ELEM_PER_SET. */
+static unsigned int index_slots(unsigned int elem_per_set) {
+  unsigned int size = 4;
+  while (size < 2 * elem_per_set)
+    size <<= 1;
+  return size;
+}
+
+/* Returns the size in bytes of the index of a set of ELEM_PER_SET entries. */
+size_t kvcacheset_index_size(unsigned int elem_per_set) {
+  return sizeof(struct kvcacheindex)
+      + index_slots(elem_per_set) * sizeof(struct kvcacheslot);
+}
+
+/* Allocates an empty index with room for at least twice ELEM_PER_SET entries,
+ * from ARENA unless it is NULL. Returns NULL if memory could not be
+ * allocated. */
+static struct kvcacheindex *index_new(unsigned int elem_per_set,
+    arena_t *arena) {
+  struct kvcacheindex *index;
+  size_t size = kvcacheset_index_size(elem_per_set);
+  if (arena == NULL) {
+    index = calloc(1, size);
+  } else if ((index = arena_alloc(arena)) != NULL) {
+    memset(index, 0, size);
+  }
+  if (index != NULL) {
+    index->arena = arena;
+    index->mask = index_slots(elem_per_set) - 1;
+  }
+  return index;
+}
+
+/* Frees the struct kvcacheindex INDEX. Used with epoch_retire. */
+static void index_free(void *index) {
+  struct kvcacheindex *i = index;
+  if (i->arena != NULL)
+    arena_free(i->arena, i);
+  else
+    free(i);
+}
+
+/* Returns the slot at which probing for hash H starts in INDEX. Keys in the
+ * same set share kvhash(key) % num_sets, so the hash is mixed first. */
+static unsigned int index_start(struct kvcacheindex *index, unsigned long h) {
+  return (unsigned int) ((h * 0x9E3779B97F4A7C15UL) >> 32) & index->mask;
+}
+
+/* Returns the entry for KEY, whose hash is H, within INDEX, or NULL if there
+ * is none. Safe to call without the lock, in which case the result is only
+ * meaningful if the set was not modified meanwhile. */
+static struct kvcacheentry *index_find(struct kvcacheindex *index, char *key,
+    unsigned long h) {
+  unsigned int i, pos = index_start(index, h);
+  struct kvcacheslot *slot;
+  struct kvcacheentry *e;
+  for (i = 0; i <= index->mask; i++) {
+    slot = &index->slots[(pos + i) & index->mask];
+    e = __atomic_load_n(&slot->entry, __ATOMIC_ACQUIRE);
+    if (e == NULL)
+      return NULL;
+    if (e != INDEX_TOMBSTONE && __atomic_load_n(&slot->hash, __ATOMIC_RELAXED) == h
+        && strcmp(e->key, key) == 0)
+      return e;
+  }
+  return NULL;
+}
+
+/* Adds E to INDEX, which must not already contain it. */
+static void index_add(struct kvcacheindex *index, struct kvcacheentry *e) {
+  unsigned long h = kvhash(e->key);
+  unsigned int pos = index_start(index, h);
+  struct kvcacheslot *slot;
+  while (true) {
+    slot = &index->slots[pos];
+    if (slot->entry == NULL || slot->entry == INDEX_TOMBSTONE)
+      break;
+    pos = (pos + 1) & index->mask;
+  }
+  if (slot->entry == NULL)
+    index->used++;
+  __atomic_store_n(&slot->hash, h, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->entry, e, __ATOMIC_RELEASE);
+}
+
+/* Adds E to the index of CACHESET, which must not already contain it. */
+static void index_insert(kvcacheset_t *cacheset, struct kvcacheentry *e) {
+  struct kvcacheindex *index = cacheset->index;
+  index_add(index, e);
+  /* Keep a quarter of the slots empty so that misses terminate quickly. */
+  if (index->used > 3 * (index->mask + 1) / 4)
+    index_rebuild(cacheset, true);
+}
+
+/* Removes E from the index of CACHESET, leaving a tombstone behind so that
+ * probes for other keys continue past its slot. */
+static void index_remove(kvcacheset_t *cacheset, struct kvcacheentry *e) {
+  struct kvcacheindex *index = cacheset->index;
+  unsigned int pos = index_start(index, kvhash(e->key));
+  while (index->slots[pos].entry != e)
+    pos = (pos + 1) & index->mask;
+  __atomic_store_n(&index->slots[pos].entry, INDEX_TOMBSTONE, __ATOMIC_RELEASE);
+}
+
+/* Replaces the index of CACHESET with a new one without tombstones, holding
+ * the same entries if KEEP_ENTRIES is set and none otherwise. The old index
+ * is freed once no reader can be probing it. If memory could not be
+ * allocated, the old index is kept when possible or cleared in place. */
+static void index_rebuild(kvcacheset_t *cacheset, bool keep_entries) {
+  struct kvcacheindex *old = cacheset->index, *index;
+  struct kvcacheentry *e;
+  unsigned int i;
+  if ((index = index_new(cacheset->elem_per_set, cacheset->arena)) == NULL) {
+    if (!keep_entries) {
+      for (i = 0; i <= old->mask; i++)
+        __atomic_store_n(&old->slots[i].entry, NULL, __ATOMIC_RELEASE);
+      old->used = 0;
+    }
+    return;
+  }
+  if (keep_entries) {
+    for (i = 0; i <= old->mask; i++) {
+      e = old->slots[i].entry;
+      if (e != NULL && e != INDEX_TOMBSTONE)
+        index_add(index, e);
+    }
+  }
+  __atomic_store_n(&cacheset->index, index, __ATOMIC_RELEASE);
+  epoch_retire(old, index_free);
+}
+
+/* Returns the room taken ahead of an entry by an inline value of LENGTH
+ * bytes, keeping the entry which follows it aligned. */
+static inline size_t inline_size(size_t length) {
+  size_t align = __alignof__(struct kvcacheentry);
+  return (sizeof(kvvalue_t) + length + 1 + align - 1) & ~(align - 1);
+}
+
+/* Allocates a new, unlinked entry holding a copy of KEY and VALUE, or a
+ * negative entry expiring at EXPIRES if EXPIRES is not 0, which is marked as
+ * dirty if DIRTY is set. VALUE is copied inline if it is short enough, else
+ * the entry takes a reference to it. Returns NULL if memory could not be
+ * allocated. */
+static struct kvcacheentry *kvcacheentry_new(char *key, kvvalue_t *value,
+    unsigned long expires, bool dirty) {
+  size_t keysize = strlen(key) + 1, valsize = 0;
+  struct kvcacheentry *e;
+  kvvalue_t *v = NULL;
+  char *block;
+  if (expires == 0 && value->length <= CACHE_INLINE_VALUE)
+    valsize = inline_size(value->length);
+  block = malloc(valsize + sizeof(struct kvcacheentry) + keysize);
+  if (block == NULL)
+    return NULL;
+  e = (struct kvcacheentry *) (block + valsize);
+  memset(e, 0, sizeof(struct kvcacheentry));
+  memcpy(e->key, key, keysize);
+  if (valsize > 0) {
+    /* One reference for E->value, and one keeping E itself allocated. */
+    v = (kvvalue_t *) block;
+    v->refcount = 2;
+    v->length = value->length;
+    memcpy(v->data, value->data, value->length + 1);
+    e->value = v;
+  } else {
+    e->value = (expires == 0) ? kvvalue_ref(value) : NULL;
+  }
+  e->inline_value = v;
+  e->expires = expires;
+  e->dirty = dirty;
+  e->refbit = false;
+  return e;
+}
+
+/* Replaces the value stored within E with a reference to VALUE, or makes E a
+ * negative entry expiring at EXPIRES if EXPIRES is not 0, and sets whether it
+ * is DIRTY. Readers may still be using the old value, so the entry's
+ * reference to it is released through epoch_retire. */
+static void set_value(struct kvcacheentry *e, kvvalue_t *value,
+    unsigned long expires, bool dirty) {
+  kvvalue_t *old = e->value;
+  e->dirty = dirty;
+  __atomic_store_n(&e->expires, expires, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->value, (expires == 0) ? kvvalue_ref(value) : NULL,
+      __ATOMIC_RELEASE);
+  if (old != NULL)
+    epoch_retire(old, release_value);
+}
+
+/* Writes E to the store using the flush function of CACHESET if it is dirty.
+ * Returns true if E is clean afterwards. */
+static bool flush_entry(kvcacheset_t *cacheset, struct kvcacheentry *e) {
+  if (!e->dirty)
+    return true;
+  if (cacheset->flush(cacheset->flush_arg, e->key, e->value) < 0)
+    return false;
+  e->dirty = false;
+  return true;
+}
+
+/* Like flush_entry, for an entry about to be evicted in the middle of a
+ * modification of CACHESET. Writing to the store is slow, and only the dirty
+ * flag, which readers ignore, changes, so readers are let back in meanwhile.
+ * The index must be in a consistent state. */
+static bool flush_victim(kvcacheset_t *cacheset, struct kvcacheentry *e) {
+  bool clean;
+  if (!e->dirty)
+    return true;
+  write_end(cacheset);
+  clean = flush_entry(cacheset, e);
+  write_begin(cacheset);
+  return clean;
+}
+
+/* Returns the current time in milliseconds, from a clock which does not jump
+ * with changes to the system time. */
+static unsigned long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Increments one of a set's statistics COUNTER. Readers on any thread may
+ * increment it, and nothing is ordered by it. */
+static inline void stat_inc(unsigned long *counter) {
+  __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+/* Releases a reference to the KVValue V. Used with epoch_retire. */
+static void release_value(void *v) {
+  kvvalue_release(v);
+}
+
+/* Frees the kvcacheentry element and releases its value. An entry allocated
+ * along with an inline value lives on until the last reference to that value
+ * is released. */
+static void kvcacheentry_free(void *ptr) {
+  struct kvcacheentry *e = ptr;
   if (e != NULL) {
-    free(e->key);
-    free(e->value);
-    free(e);
+    kvvalue_release(e->value);
+    if (e->inline_value != NULL)
+      kvvalue_release(e->inline_value);
+    else
+      free(e);
   }
 }
@@ -6,50 +6,156 @@
 #include "uthash.h"
 // OUR CODE HERE
 #include "utlist.h"
+#include "kvvalue.h"
+#include "arena.h"
 
 /* KVCacheSet represents a single distinct set of elements within a KVCache.
  *
- * Elements within a KVCacheSet may not be accessed/modified concurrently. The
+ * Elements within a KVCacheSet may not be modified concurrently. The
  * read-write lock within the KVCacheSet struct should be used to enforce this.
  * The lock should be acquired/released from whoever will be calling the 
  * cache methods (i.e. KVServer and, later, TPCMaster).
  *
+ * Lookups (kvcacheset_get and kvcacheset_get_ref) do not need the lock, and
+ * may run concurrently with a writer holding it. Each set keeps a sequence
+ * count which writers make odd for the duration of a modification; a reader
+ * searches an open-addressed index of the resident entries and retries if
+ * the count changed meanwhile. Entries, values and index tables which a
+ * reader may still be looking at are freed through epoch.h. A hit only sets
+ * the entry's reference bit, with a relaxed atomic store.
+ *
+ * Besides entries holding a value, a KVCacheSet can hold negative entries,
+ * which record that a key is not present for a short, bounded time. They take
+ * up room in the set like any other entry, and are replaced by a PUT of their
+ * key.
+ *
+ * An entry and its key are a single allocation. A value of at most
+ * CACHE_INLINE_VALUE bytes is copied into that allocation too, right ahead of
+ * the entry, rather than referenced, so that a hit on a short value touches
+ * no other memory. The inline value is still a KVValue: a reader takes a
+ * reference to it like to any other, and the allocation is freed once both
+ * the entry and the last such reference are gone.
+ *
+ * The index tables of a set may be allocated from an arena (see arena.h),
+ * which a KVCache shares between all of its sets of the same size.
+ *
  * A KVCacheSet may not store more than ELEM_PER_SET entries. The eviction
- * policy used is the second-chance algorithm. See kvcache.h for more details
- * on this algorithm.
+ * policy used is either the second-chance algorithm or ARC, chosen when the
+ * set is initialized. See kvcache.h for more details on these algorithms.
  */
 
+/* Values no longer than this are stored inline within their entry. */
+#define CACHE_INLINE_VALUE 32
+
+/* The replacement policies a KVCacheSet can use. */
+typedef enum {
+  CACHE_SECOND_CHANCE,
+  CACHE_ARC
+} cache_policy_t;
+
+/* The lists an entry can be on when a KVCacheSet uses ARC. */
+typedef enum {
+  ARC_T1,                       /* Resident, seen once recently. */
+  ARC_T2,                       /* Resident, seen at least twice recently. */
+  ARC_B1,                       /* Ghost of an entry evicted from T1. */
+  ARC_B2                        /* Ghost of an entry evicted from T2. */
+} arc_list_t;
+
 /* An entry within the KVCacheSet. */
 struct kvcacheentry {
-  char *key;                    /* The entry's key. */
-  char *value;                  /* The entry's value. */
-  bool refbit;                  /* Used to determine if this entry has been used. */
+  kvvalue_t *value;             /* The entry's value, of which the entry holds one reference. Accessed atomically. */
+  kvvalue_t *inline_value;      /* If not NULL, the inline value whose allocation holds this entry.
+                                   The entry holds a reference to it until it is freed. */
+  unsigned long expires;        /* If not 0, this is a negative entry (the key is known not to
+                                   exist), valid until this time in ms. Accessed atomically. */
+  bool refbit;                  /* Used to determine if this entry has been used. Accessed atomically. */
+  bool dirty;                   /* True if the value has not been written to the store yet. */
+  arc_list_t list;              /* The ARC list this entry is on (ARC only). */
 
   // OUR CODE HERE
   UT_hash_handle hh;            /* Handle to allow ut_hash operations for the
-                                   kvcacheentry hashtable in struct kvcacheset_t. */
+                                   ghost hashtable in struct kvcacheset_t. */
 
   /* These pointers are needed to implement a kvcacheset_t's doubly-linked list. */
   struct kvcacheentry *prev;
   struct kvcacheentry *next;
+
+  char key[];                   /* The entry's key, within the entry's allocation. */
 };
 
+/* Counts of the lookups made in a KVCacheSet. */
+typedef struct {
+  unsigned long hits;           /* Lookups which found a value. */
+  unsigned long negative_hits;  /* Lookups which found a negative entry. */
+  unsigned long misses;         /* Lookups which found nothing, or an expired negative entry. */
+} kvcachestats_t;
+
+/* Writes KEY and VALUE to the store behind a KVCacheSet. ARG is the set's
+ * FLUSH_ARG. Returns 0 if successful, else a negative error code. */
+typedef int (*kvcache_flush_t)(void *arg, char *key, kvvalue_t *value);
+
+/* An open-addressed table mapping keys to the resident entries of a set. */
+struct kvcacheindex;
+
 /* A KVCacheSet. */
 typedef struct {
   unsigned int elem_per_set;      /* The max number of elements which can be stored in this set. */
   pthread_rwlock_t lock;          /* The lock which can be used to lock this set. */
   int num_entries;                /* The current number of entries in this set. */
+  cache_policy_t policy;          /* The replacement policy used by this set. */
   
   // OUR CODE HERE
-  struct kvcacheentry *head;	    /* List view of my kvcacheentries. */
-  struct kvcacheentry *entries;   /* Hash table view of my kvcacheentries. */
+  struct kvcacheentry *head;	    /* List view of my kvcacheentries (T1 under ARC). */
+  struct kvcacheindex *index;     /* Lock-free readable index of my resident kvcacheentries. */
+  arena_t *arena;                 /* The arena INDEX is allocated from, or NULL for malloc. */
+  unsigned int seq;               /* Sequence count, odd while the set is being modified. */
+
+  /* ARC state. HEAD is used as T1, and only keys are kept for the entries on
+     the ghost lists B1 and B2. Lists are ordered from LRU to MRU. */
+  struct kvcacheentry *t2;        /* Resident entries seen at least twice. */
+  struct kvcacheentry *b1;        /* Ghosts of entries evicted from T1. */
+  struct kvcacheentry *b2;        /* Ghosts of entries evicted from T2. */
+  struct kvcacheentry *ghosts;    /* Hash table view of the ghost entries. */
+  unsigned int len[4];            /* The length of each list, indexed by arc_list_t. */
+  unsigned int target;            /* The adaptive target length of T1. */
+
+  kvcache_flush_t flush;          /* Writes dirty entries to the store (write-back only). */
+  void *flush_arg;                /* The argument passed to FLUSH. */
+
+  /* Lookup statistics, updated atomically. Kept on their own cache line so
+     that counting does not slow down readers of the fields above. */
+  kvcachestats_t stats __attribute__((aligned(64)));
 } kvcacheset_t;
 
+/* Returns the set to which KEY should be moved. ARG is passed through from
+ * kvcacheset_migrate. */
+typedef kvcacheset_t *(*kvcacheset_pick_t)(void *arg, char *key);
+
+/* Visits the resident entry for KEY. REFERENCED is true if the entry has been
+ * used since it was inserted or last given a second chance. ARG is passed
+ * through from kvcacheset_walk. */
+typedef void (*kvcacheset_visit_t)(void *arg, char *key, bool referenced);
+
 int kvcacheset_init(kvcacheset_t *, unsigned int elem_per_set);
+int kvcacheset_init_policy(kvcacheset_t *, unsigned int elem_per_set,
+    cache_policy_t policy);
+int kvcacheset_init_arena(kvcacheset_t *, unsigned int elem_per_set,
+    cache_policy_t policy, arena_t *arena);
+void kvcacheset_destroy(kvcacheset_t *);
+size_t kvcacheset_index_size(unsigned int elem_per_set);
 
 int kvcacheset_get(kvcacheset_t *, char *key, char **value);
+int kvcacheset_get_ref(kvcacheset_t *, char *key, kvvalue_t **value);
 int kvcacheset_put(kvcacheset_t *, char *key, char *value);
+int kvcacheset_put_ref(kvcacheset_t *, char *key, kvvalue_t *value);
+int kvcacheset_update(kvcacheset_t *, char *key, char *value);
+int kvcacheset_put_negative(kvcacheset_t *, char *key, unsigned int ttl_ms);
+int kvcacheset_put_dirty(kvcacheset_t *, char *key, kvvalue_t *value);
+int kvcacheset_flush(kvcacheset_t *);
+int kvcacheset_flush_key(kvcacheset_t *, char *key);
 int kvcacheset_del(kvcacheset_t *, char *key);
+int kvcacheset_migrate(kvcacheset_t *, kvcacheset_pick_t pick, void *arg);
+void kvcacheset_walk(kvcacheset_t *, kvcacheset_visit_t visit, void *arg);
 
 void kvcacheset_clear(kvcacheset_t *);
 
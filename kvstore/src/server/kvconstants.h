@@ -39,9 +39,19 @@ typedef enum {
   VOTE_COMMIT,
   VOTE_ABORT,
   REGISTER,
-  INFO
+  INFO,
+  HOTKEYS,
+  RESIZE
 } msgtype_t;
 
+/* Cache admission policies for writes. */
+typedef enum {
+  ADMIT_DEFAULT,                /* Use the server's policy (requests only). */
+  ADMIT_ALWAYS,                 /* Insert the written value into the cache. */
+  ADMIT_RESIDENT,               /* Only update an entry which is already cached. */
+  ADMIT_AROUND                  /* Write around the cache, dropping any cached entry. */
+} admit_t;
+
 /* Possible TPC states. */
 typedef enum {
   TPC_INIT,
@@ -66,5 +76,7 @@ typedef enum {
 #define ERRFILCRT -16
 /* Error returned if error was encountered accessing a file. */
 #define ERRFILACCESS -17
+/* Error returned by a cache for a key which it has cached as not present. */
+#define ERRNEGKEY -18
 
 #endif
@@ -0,0 +1,79 @@
+#include <stdint.h>
+#include <string.h>
+#include "kvstore.h"
+#include "kvhash.h"
+
+#ifndef KVHASH_DJB2
+
+/* Mixing constants, odd and with evenly spread bits (those of wyhash). */
+#define P0 0xa0761d6478bd642fULL
+#define P1 0xe7037ed1a0b428dbULL
+#define P2 0x8ebc6af09c88c6e3ULL
+#define P3 0x589965cc75374cc3ULL
+
+/* Multiplies A and B into 128 bits and folds the halves together. */
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+  __uint128_t r = (__uint128_t) a * b;
+  return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+/* Reads 8 (possibly unaligned) bytes at P. */
+static inline uint64_t read64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/* Reads 4 (possibly unaligned) bytes at P. */
+static inline uint64_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/* Returns the hash of the null terminated KEY. */
+unsigned long kvhash(const char *key) {
+  const uint8_t *p = (const uint8_t *) key;
+  size_t len = strlen(key), left = len;
+  uint64_t seed = P0 ^ mix(len ^ P0, P1), a, b;
+
+  if (left > 48) {
+    uint64_t lane1 = seed, lane2 = seed;
+    do {
+      seed = mix(read64(p) ^ P1, read64(p + 8) ^ seed);
+      lane1 = mix(read64(p + 16) ^ P2, read64(p + 24) ^ lane1);
+      lane2 = mix(read64(p + 32) ^ P3, read64(p + 40) ^ lane2);
+      p += 48;
+      left -= 48;
+    } while (left > 48);
+    seed ^= lane1 ^ lane2;
+  }
+  while (left > 16) {
+    seed = mix(read64(p) ^ P1, read64(p + 8) ^ seed);
+    p += 16;
+    left -= 16;
+  }
+  /* The last 1 to 16 bytes, read as two possibly overlapping words. */
+  if (left > 8) {
+    a = read64(p);
+    b = read64(p + left - 8);
+  } else if (left >= 4) {
+    a = read32(p);
+    b = read32(p + left - 4);
+  } else if (left > 0) {
+    a = ((uint64_t) p[0] << 16) | ((uint64_t) p[left >> 1] << 8) | p[left - 1];
+    b = 0;
+  } else {
+    a = b = 0;
+  }
+  return mix(P1 ^ len, mix(a ^ P1, b ^ seed));
+}
+
+#else
+
+/* Returns the djb2 hash of the null terminated KEY. */
+unsigned long kvhash(const char *key) {
+  return hash((char *) key);
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __KV_HASH__
+#define __KV_HASH__
+
+/* KVHash is the string hash used by in-memory structures: choosing a key's
+ * KVCache set, indexing the entries within a set, steering requests to a
+ * worker in sharded mode and tracking hot keys.
+ *
+ * The djb2 hash() of kvstore.h consumes one byte per iteration, and each
+ * iteration depends on the one before. That is a noticeable cost for keys of
+ * a few hundred bytes. KVHash instead reads eight bytes at a time and mixes
+ * them with 64x64->128 bit multiplications, in the style of wyhash; keys
+ * longer than 48 bytes are processed as three independent lanes, so that
+ * multiplications overlap. The length of the key is found first with
+ * strlen(), which the C library vectorizes.
+ *
+ * hash() is still used for file names within a KVStore, whose layout on disk
+ * must not change. Building with -DKVHASH_DJB2 makes kvhash() return hash()
+ * instead, which is useful to compare the two.
+ *
+ * The values returned by kvhash() are only meant to be used within a single
+ * process, and may change between versions.
+ */
+
+unsigned long kvhash(const char *key);
+
+#endif
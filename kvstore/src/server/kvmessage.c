@@ -2,30 +2,153 @@
 #include <unistd.h>
 #include <json-c/json.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <stdio.h>
+#include <stdbool.h>
 #include <string.h>
 #include "kvmessage.h"
 
-/* Receives and returns a message from socket SOCKFD.
- * Returns NULL if there is an error. */
-kvmessage_t *kvmessage_parse(int sockfd) {
+/* Reads exactly SIZE bytes from socket SOCKFD into BUF, over as many reads as
+ * it takes. Returns false if the connection was closed or an error occurred
+ * first. */
+static bool read_all(int sockfd, void *buf, size_t size) {
+  ssize_t got;
+  while (size > 0) {
+    if ((got = read(sockfd, buf, size)) <= 0)
+      return false;
+    buf = (char *) buf + got;
+    size -= got;
+  }
+  return true;
+}
+
+/* Takes a field of LEN bytes of a binary message, from *SRC if SRC is not
+ * NULL (advancing it past the field), else from socket SOCKFD, and stores it,
+ * null terminated, in *FIELD. The field is stored in *DATA, which is then
+ * advanced past it, or in memory allocated for it if DATA is NULL. Returns
+ * false if there is an error. */
+static bool take_field(int sockfd, const char **src, uint32_t len,
+    char **data, char **field) {
+  char *p = (data != NULL) ? *data : malloc(len + 1);
+  if (p == NULL)
+    return false;
+  if (src != NULL) {
+    memcpy(p, *src, len);
+    *src += len;
+  } else if (!read_all(sockfd, p, len)) {
+    if (data == NULL)
+      free(p);
+    return false;
+  }
+  p[len] = '\0';
+  *field = p;
+  if (data != NULL)
+    *data += len + 1;
+  return true;
+}
+
+/* Returns the message which the binary HEADER starts, with its fields yet to
+ * be filled in: in BUFFER, with *DATA set to the room for its fields, if
+ * BUFFER is not NULL and they fit there, else allocated, with *DATA set to
+ * NULL. Returns NULL if HEADER is invalid or memory could not be allocated. */
+static kvmessage_t *binary_message(const kvheader_t *header,
+    kvmessage_buffer_t *buffer, char **data) {
+  kvmessage_t *msg;
+  uint16_t flags = ntohs(header->flags);
+  uint32_t key_len = ntohl(header->key_len);
+  uint32_t value_len = ntohl(header->value_len);
+  uint32_t message_len = ntohl(header->message_len);
+  if (key_len > KVMESSAGE_MAX_BODY || value_len > KVMESSAGE_MAX_BODY
+      || message_len > KVMESSAGE_MAX_BODY
+      || key_len + value_len + message_len > KVMESSAGE_MAX_BODY)
+    return NULL;
+  /* Absent fields are sent with a length of 0. */
+  if ((key_len > 0 && !(flags & KVMESSAGE_HAS_KEY))
+      || (value_len > 0 && !(flags & KVMESSAGE_HAS_VALUE))
+      || (message_len > 0 && !(flags & KVMESSAGE_HAS_MESSAGE)))
+    return NULL;
+  *data = NULL;
+  /* Room for the three fields and their null terminators. */
+  if (buffer != NULL && key_len + value_len + message_len + 3
+      <= KVMESSAGE_INLINE) {
+    msg = &buffer->msg;
+    memset(msg, 0, sizeof(kvmessage_t));
+    msg->borrowed = true;
+    *data = buffer->data;
+  } else if ((msg = calloc(1, sizeof(kvmessage_t))) == NULL) {
+    return NULL;
+  }
+  msg->binary = true;
+  msg->type = header->type;
+  msg->id = ntohl(header->id);
+  if ((flags >> KVMESSAGE_ADMIT_SHIFT) <= ADMIT_AROUND)
+    msg->admit = flags >> KVMESSAGE_ADMIT_SHIFT;
+  return msg;
+}
+
+/* Fills in the fields of MSG, which the binary HEADER starts, from *SRC if
+ * SRC is not NULL, else from socket SOCKFD, into DATA as returned by
+ * binary_message. Frees MSG and returns NULL if there is an error. */
+static kvmessage_t *binary_fields(int sockfd, const char **src,
+    const kvheader_t *header, kvmessage_t *msg, char *data) {
+  uint16_t flags = ntohs(header->flags);
+  bool ok = true;
+  /* Absent fields are read as NULL. */
+  if (ok && (flags & KVMESSAGE_HAS_KEY))
+    ok = take_field(sockfd, src, ntohl(header->key_len),
+        data ? &data : NULL, &msg->key);
+  if (ok && (flags & KVMESSAGE_HAS_VALUE))
+    ok = take_field(sockfd, src, ntohl(header->value_len),
+        data ? &data : NULL, &msg->value);
+  if (ok && (flags & KVMESSAGE_HAS_MESSAGE))
+    ok = take_field(sockfd, src, ntohl(header->message_len),
+        data ? &data : NULL, &msg->message);
+  if (!ok) {
+    kvmessage_free(msg);
+    return NULL;
+  }
+  return msg;
+}
+
+/* Receives the rest of a binary message from socket SOCKFD, whose first four
+ * bytes were already read into START, into BUFFER if it is not NULL and the
+ * message fits. Returns NULL if there is an error. */
+static kvmessage_t *parse_binary(int sockfd, const void *start,
+    kvmessage_buffer_t *buffer) {
+  kvheader_t header;
+  kvmessage_t *msg;
+  char *data;
+
+  memcpy(&header, start, 4);
+  if (!read_all(sockfd, (char *) &header + 4, sizeof(header) - 4))
+    return NULL;
+  if ((msg = binary_message(&header, buffer, &data)) == NULL)
+    return NULL;
+  return binary_fields(sockfd, NULL, &header, msg, data);
+}
+
+/* Returns a message holding the fields of the JSON object in the LEN bytes
+ * at JSON, which need not be null terminated. Fields which are missing, or
+ * all of them if JSON is not valid, are left unset. Returns NULL if memory
+ * could not be allocated. */
+static kvmessage_t *parse_json(const char *json, size_t len) {
+  json_tokener *tok;
   json_object *new_obj;
-  kvmessage_t *msg = (kvmessage_t *) calloc(1, sizeof(kvmessage_t));
-  int size;
+  kvmessage_t *msg;
 
-  /* First read the size of the incoming message */
-  if (read(sockfd, &size, 4) < 4) {
+  msg = (kvmessage_t *) calloc(1, sizeof(kvmessage_t));
+  if (msg == NULL) {
     return NULL;
   }
-  /* Then create the buffer and read in the data */
-  size = ntohl(size);
-  char buffer[size];
-  if (read(sockfd, buffer, size) < size) {
+  if ((tok = json_tokener_new()) == NULL) {
+    free(msg);
     return NULL;
   }
+  new_obj = json_tokener_parse_ex(tok, json, len);
+  json_tokener_free(tok);
 
   struct json_object *value_obj;
-  new_obj = json_tokener_parse(buffer);
   if (json_object_object_get_ex(new_obj, "type", &value_obj)) {
     int type = json_object_get_int(value_obj);
     msg->type = type;
@@ -49,14 +172,186 @@ kvmessage_t *kvmessage_parse(int sockfd) {
     memcpy(message_buf, message, strlen(message) + 1);
     msg->message = message_buf;
   }
+  if (json_object_object_get_ex(new_obj, "admit", &value_obj)) {
+    int admit = json_object_get_int(value_obj);
+    if (admit > ADMIT_DEFAULT && admit <= ADMIT_AROUND)
+      msg->admit = admit;
+  }
+  if (json_object_object_get_ex(new_obj, "id", &value_obj)) {
+    msg->id = (uint32_t) json_object_get_int64(value_obj);
+  }
   json_object_put(new_obj);
   return msg;
 }
 
-/* Sends MESSAGE on socket SOCKFD. Includes whichever fields are
- * non-null in the message. Returns the number of bytes which were sent. */
-int kvmessage_send(kvmessage_t *message, int sockfd) {
-  int sent = 0;
+/* Receives and returns a message from socket SOCKFD. The whole message is
+ * consumed, so that the next message on a persistent connection can be read
+ * afterwards. Returns NULL if there is an error. */
+kvmessage_t *kvmessage_parse(int sockfd) {
+  return kvmessage_parse_buffered(sockfd, NULL);
+}
+
+/* Receives and returns a message from socket SOCKFD, as kvmessage_parse
+ * does, but parses a binary message into BUFFER if it fits there. Returns
+ * NULL if there is an error. */
+kvmessage_t *kvmessage_parse_buffered(int sockfd, kvmessage_buffer_t *buffer) {
+  char stack_buffer[KVMESSAGE_STACK_JSON];
+  char *json_buffer = stack_buffer;
+  kvmessage_t *msg = NULL;
+  int size;
+
+  /* First read the size of the incoming message */
+  if (!read_all(sockfd, &size, 4)) {
+    return NULL;
+  }
+  if (*(unsigned char *) &size == KVMESSAGE_MAGIC) {
+    return parse_binary(sockfd, &size, buffer);
+  }
+  /* Then read in the data, on the stack unless it is large */
+  size = ntohl(size);
+  if (size <= 0 || size > KVMESSAGE_MAX_BODY) {
+    return NULL;
+  }
+  if (size > KVMESSAGE_STACK_JSON && (json_buffer = malloc(size)) == NULL) {
+    return NULL;
+  }
+  if (read_all(sockfd, json_buffer, size)) {
+    msg = parse_json(json_buffer, size);
+  }
+  if (json_buffer != stack_buffer) {
+    free(json_buffer);
+  }
+  return msg;
+}
+
+/* Returns the total number of bytes of the message starting at DATA, header
+ * included, given the first LEN bytes of it. Returns 0 if LEN bytes are not
+ * enough to tell, or -1 if the message is invalid or larger than
+ * KVMESSAGE_MAX_FRAME. */
+long kvmessage_frame_size(const void *data, size_t len) {
+  kvheader_t header;
+  int size;
+  long body;
+  if (len < 4)
+    return 0;
+  if (*(const unsigned char *) data != KVMESSAGE_MAGIC) {
+    memcpy(&size, data, 4);
+    size = ntohl(size);
+    return (size <= 0 || size > KVMESSAGE_MAX_BODY) ? -1 : 4 + (long) size;
+  }
+  if (len < sizeof(header))
+    return 0;
+  memcpy(&header, data, sizeof(header));
+  body = (long) ntohl(header.key_len) + ntohl(header.value_len)
+      + ntohl(header.message_len);
+  return (body > KVMESSAGE_MAX_BODY) ? -1 : (long) sizeof(header) + body;
+}
+
+/* Returns the message in the SIZE bytes at FRAME, which hold exactly one
+ * whole message as sized by kvmessage_frame_size. A binary message is
+ * decoded into BUFFER if it is not NULL and the message fits, as by
+ * kvmessage_parse_buffered. FRAME is not modified, and is not referred to by
+ * the message. Returns NULL if the message is invalid. */
+kvmessage_t *kvmessage_decode(const char *frame, size_t size,
+    kvmessage_buffer_t *buffer) {
+  kvheader_t header;
+  kvmessage_t *msg;
+  char *data;
+  if (kvmessage_frame_size(frame, size) != (long) size)
+    return NULL;
+  if (*(const unsigned char *) frame != KVMESSAGE_MAGIC)
+    return parse_json(frame + 4, size - 4);
+  memcpy(&header, frame, sizeof(header));
+  frame += sizeof(header);
+  if ((msg = binary_message(&header, buffer, &data)) == NULL)
+    return NULL;
+  return binary_fields(-1, &frame, &header, msg, data);
+}
+
+/* Returns the total number of bytes of the next message on socket SOCKFD,
+ * header included, by peeking at its header without consuming it. Returns 0
+ * if not enough of the header has arrived yet, or -1 if it is invalid. */
+long kvmessage_peek_size(int sockfd) {
+  kvheader_t header;
+  ssize_t got;
+  got = recv(sockfd, &header, sizeof(header), MSG_PEEK | MSG_DONTWAIT);
+  return (got < 0) ? 0 : kvmessage_frame_size(&header, got);
+}
+
+/* Returns the ID of the next message on socket SOCKFD, without consuming it.
+ * Only works for a binary message whose header has arrived. Returns -1 if
+ * it could not be peeked at. */
+long kvmessage_peek_id(int sockfd) {
+  kvheader_t header;
+  if (recv(sockfd, &header, sizeof(header), MSG_PEEK | MSG_DONTWAIT)
+      != sizeof(header) || header.magic != KVMESSAGE_MAGIC)
+    return -1;
+  return ntohl(header.id);
+}
+
+/* Copies the key of the next message on socket SOCKFD into KEY, which must
+ * hold MAX_KEYLEN + 1 bytes, without consuming the message. Only works for a
+ * binary message whose header and key have arrived. Returns 1 if the key was
+ * copied, 0 if the message has no key, or -1 if it could not be peeked at. */
+int kvmessage_peek_key(int sockfd, char *key) {
+  char peeked[sizeof(kvheader_t) + MAX_KEYLEN];
+  kvheader_t header;
+  uint32_t key_len;
+  ssize_t got;
+  got = recv(sockfd, peeked, sizeof(peeked), MSG_PEEK | MSG_DONTWAIT);
+  if (got < (ssize_t) sizeof(header))
+    return -1;
+  memcpy(&header, peeked, sizeof(header));
+  if (header.magic != KVMESSAGE_MAGIC)
+    return -1;
+  if (!(ntohs(header.flags) & KVMESSAGE_HAS_KEY))
+    return 0;
+  key_len = ntohl(header.key_len);
+  if (key_len > MAX_KEYLEN || got < (ssize_t) (sizeof(header) + key_len))
+    return -1;
+  memcpy(key, peeked + sizeof(header), key_len);
+  key[key_len] = '\0';
+  return 1;
+}
+
+/* Fills HEADER and IOV with the binary framing of MESSAGE: its header, then
+ * whichever of its fields are non-null, pointed to rather than copied.
+ * Returns the number of entries of IOV used. */
+static int binary_frame(kvmessage_t *message, kvheader_t *header,
+    struct iovec *iov) {
+  uint16_t flags = message->admit << KVMESSAGE_ADMIT_SHIFT;
+  int n = 1;
+  memset(header, 0, sizeof(kvheader_t));
+  header->magic = KVMESSAGE_MAGIC;
+  header->type = message->type;
+  header->id = htonl(message->id);
+  iov[0].iov_base = header;
+  iov[0].iov_len = sizeof(kvheader_t);
+  if (message->key) {
+    flags |= KVMESSAGE_HAS_KEY;
+    header->key_len = htonl(strlen(message->key));
+    iov[n].iov_base = message->key;
+    iov[n++].iov_len = strlen(message->key);
+  }
+  if (message->value) {
+    flags |= KVMESSAGE_HAS_VALUE;
+    header->value_len = htonl(strlen(message->value));
+    iov[n].iov_base = message->value;
+    iov[n++].iov_len = strlen(message->value);
+  }
+  if (message->message) {
+    flags |= KVMESSAGE_HAS_MESSAGE;
+    header->message_len = htonl(strlen(message->message));
+    iov[n].iov_base = message->message;
+    iov[n++].iov_len = strlen(message->message);
+  }
+  header->flags = htons(flags);
+  return n;
+}
+
+/* Returns the JSON object holding whichever fields of MESSAGE are non-null,
+ * which the caller must release with json_object_put. */
+static json_object *json_frame(kvmessage_t *message) {
   json_object *json = json_object_new_object();
   json_object_object_add(json, "type", json_object_new_int(message->type));
   if (message->key) {
@@ -70,20 +365,99 @@ int kvmessage_send(kvmessage_t *message, int sockfd) {
     json_object_object_add(json, "message",
         json_object_new_string(message->message));
   }
-  const char *json_string = json_object_to_json_string(json);
-  int size = htonl(strlen(json_string));
-  sent += write(sockfd, &size, 4);
-  sent += write(sockfd, json_string, strlen(json_string));
-  json_object_put(json);
+  if (message->admit != ADMIT_DEFAULT) {
+    json_object_object_add(json, "admit", json_object_new_int(message->admit));
+  }
+  if (message->id != 0) {
+    json_object_object_add(json, "id", json_object_new_int64(message->id));
+  }
+  return json;
+}
+
+/* Fills IOV with the framing of MESSAGE: binary, using HEADER, if its BINARY
+ * field is set, else its size, stored in SIZE, followed by its JSON, which
+ * is stored in *JSON and must be released with json_object_put once IOV has
+ * been used. Returns the number of entries of IOV used, at most 4. */
+static int message_frame(kvmessage_t *message, kvheader_t *header, int *size,
+    struct iovec *iov, json_object **json) {
+  const char *json_string;
+  *json = NULL;
+  if (message->binary)
+    return binary_frame(message, header, iov);
+  *json = json_frame(message);
+  json_string = json_object_to_json_string(*json);
+  *size = htonl(strlen(json_string));
+  iov[0].iov_base = size;
+  iov[0].iov_len = 4;
+  iov[1].iov_base = (void *) json_string;
+  iov[1].iov_len = strlen(json_string);
+  return 2;
+}
+
+/* Sends MESSAGE on socket SOCKFD, in the binary framing if its BINARY field
+ * is set, else as JSON. Includes whichever fields are non-null in the
+ * message. The whole message goes out with a single system call, and its
+ * fields are not copied. Returns the number of bytes which were sent. */
+int kvmessage_send(kvmessage_t *message, int sockfd) {
+  kvheader_t header;
+  struct iovec iov[4];
+  struct msghdr msg;
+  json_object *json;
+  int size, sent;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = message_frame(message, &header, &size, iov, &json);
+  /* A peer which has closed the connection must not kill the process with
+     SIGPIPE; the write simply fails. */
+  sent = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+  if (json != NULL)
+    json_object_put(json);
   return sent;
 }
 
+/* Writes MESSAGE into the SIZE bytes at BUF, exactly as kvmessage_send would
+ * send it, if it fits there. Returns the number of bytes which MESSAGE takes,
+ * whether or not it was written. */
+size_t kvmessage_encode(kvmessage_t *message, char *buf, size_t size) {
+  kvheader_t header;
+  struct iovec iov[4];
+  json_object *json;
+  size_t total = 0;
+  int json_size, n, i;
+  n = message_frame(message, &header, &json_size, iov, &json);
+  for (i = 0; i < n; i++)
+    total += iov[i].iov_len;
+  if (total <= size) {
+    for (i = 0; i < n; i++) {
+      memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+      buf += iov[i].iov_len;
+    }
+  }
+  if (json != NULL)
+    json_object_put(json);
+  return total;
+}
+
+/* Drops MESSAGE's reference to a shared value, if it holds one. The VALUE
+ * field is cleared along with it, since it pointed into the shared value. */
+void kvmessage_release_value(kvmessage_t *message) {
+  if (message != NULL && message->valref != NULL) {
+    kvvalue_release(message->valref);
+    message->valref = NULL;
+    message->value = NULL;
+  }
+}
+
 /* Frees the memory for MESSAGE. Assumes that the message itself and all
  * fields were allocated using malloc/calloc (which will be the case for a
- * message created using kvmessage_parse). */
+ * message created using kvmessage_parse), unless it is BORROWED from a
+ * kvmessage_buffer_t, in which case there is nothing to free. */
 void kvmessage_free(kvmessage_t *message) {
   // OUR CODE HERE to allow free-ing of null messages
   if (message != NULL) {
+    kvmessage_release_value(message);
+    if (message->borrowed)
+      return;
     if (message->key)
       free(message->key);
     if (message->value)
@@ -1,7 +1,11 @@
 #ifndef __KV_MESSAGE__
 #define __KV_MESSAGE__
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include "kvconstants.h"
+#include "kvvalue.h"
 
 /* KVMessage is used to send messages across sockets.
  *
@@ -12,18 +16,127 @@
  * kvmessage_parse reads the first four bytes of the message, uses this to determine
  * the size of the remainder of the message, then parses the remainder of the message
  * as JSON and populates whichever fields of the message are present in the incoming JSON.
+ *
+ * Any number of messages may be exchanged over the same connection, one after
+ * the other; kvmessage_parse consumes exactly one message.
+ *
+ * A PUTREQ may carry the cache admission policy to apply to it, as the
+ * integer field "admit"; it is omitted when it is ADMIT_DEFAULT.
+ *
+ * Messages may instead use a compact binary framing, which spares encoding
+ * and decoding JSON. A binary message starts with a fixed kvheader_t, whose
+ * first byte is KVMESSAGE_MAGIC, followed by the raw bytes of its key, value
+ * and message, without null terminators. A JSON message starts with its size,
+ * whose first byte is 0 for any message of a sane size, so kvmessage_parse
+ * tells the two apart from the first byte of each message. A message sent
+ * with BINARY set uses the binary framing. Servers answer each request in the
+ * framing it arrived in, so a client picks the framing of its connection by
+ * the requests it sends, and clients which only speak JSON keep working.
+ *
+ * kvmessage_parse_buffered parses a message into a kvmessage_buffer_t owned
+ * by the caller, typically on its stack. A binary message which fits in the
+ * buffer is parsed without any allocation: the message is the buffer's, and
+ * its fields point into the buffer. kvmessage_free then only releases it.
+ * Other messages are allocated as by kvmessage_parse.
+ *
+ * kvmessage_parse reads each message with as many reads as it takes, so a
+ * message which arrives in pieces is parsed whole. A JSON message is read on
+ * the stack if it is no larger than KVMESSAGE_STACK_JSON, else into memory
+ * allocated for it. Messages larger than KVMESSAGE_MAX_FRAME are rejected
+ * before anything is allocated for them.
+ *
+ * A server may instead read whatever has arrived on a connection into a
+ * buffer of its own, and split it into messages without further system
+ * calls: kvmessage_frame_size tells from the first bytes of a message how
+ * many bytes the whole message takes (or that more are needed to tell), and
+ * kvmessage_decode then decodes those bytes, into a kvmessage_buffer_t like
+ * kvmessage_parse_buffered does.
+ *
+ * kvmessage_send sends a whole message, in either framing, with a single
+ * system call. A server may instead gather several messages into a buffer
+ * of its own with kvmessage_encode, and send them all at once.
+ *
+ * A request may carry an ID, the integer field "id" in JSON (omitted when 0),
+ * which is copied into its response. A client may send several requests
+ * without waiting for their responses. Binary requests with distinct nonzero
+ * IDs may be answered in any order, and their responses are matched by ID;
+ * other requests are answered in order (see socket_server.h).
+ *
+ * A response may carry a value which is shared with the cache rather than
+ * owned by the message. In that case VALREF holds a reference to the shared
+ * KVValue and VALUE points at its data; the reference is dropped once the
+ * response has been sent, using kvmessage_release_value.
  */
 
+/* The first byte of a message in the binary framing. */
+#define KVMESSAGE_MAGIC 0xB7
+
+/* Flags of a binary message, telling which of its fields are present. */
+#define KVMESSAGE_HAS_KEY 0x1
+#define KVMESSAGE_HAS_VALUE 0x2
+#define KVMESSAGE_HAS_MESSAGE 0x4
+
+/* The admission policy of a binary message is stored in its flags, above
+ * this many bits. */
+#define KVMESSAGE_ADMIT_SHIFT 8
+
+/* The largest size of a JSON message, and total length of the fields of a
+ * binary message. */
+#define KVMESSAGE_MAX_BODY (1 << 20)
+
+/* The largest size of a JSON message read on the stack. */
+#define KVMESSAGE_STACK_JSON 4096
+
+/* The header of a binary message, with its fields in network byte order. */
+typedef struct {
+  uint8_t magic;          /* KVMESSAGE_MAGIC. */
+  uint8_t type;           /* The type of the message. */
+  uint16_t flags;         /* KVMESSAGE_HAS_* and the admission policy. */
+  uint32_t key_len;       /* The number of bytes of the key which follow. */
+  uint32_t value_len;     /* Then those of the value. */
+  uint32_t message_len;   /* Then those of the message. */
+  uint32_t id;            /* The ID of the message, or 0. */
+} kvheader_t;
+
+/* The largest size of a whole message, header included, in either framing. */
+#define KVMESSAGE_MAX_FRAME (sizeof(kvheader_t) + KVMESSAGE_MAX_BODY)
+
 typedef struct {
   msgtype_t type;    /* The type of this message. */
   char *key;         /* The key this message stores. May be NULL, depending on type. */
   char *value;       /* The value this message stores. May be NULL, depending on type. */
   char *message;     /* The message this message stores. May be NULL, depending on type. */
+  kvvalue_t *valref; /* If not NULL, the shared value which VALUE points into. */
+  admit_t admit;     /* The cache admission policy for a PUTREQ, or ADMIT_DEFAULT. */
+  uint32_t id;       /* The ID of a pipelined request, echoed in its response, or 0. */
+  bool binary;       /* Whether this message is sent (or arrived) in the binary framing. */
+  bool borrowed;     /* Whether this message and its fields live in a kvmessage_buffer_t. */
 } kvmessage_t;
 
+/* The number of bytes of fields a kvmessage_buffer_t holds. */
+#define KVMESSAGE_INLINE (MAX_KEYLEN + MAX_VALLEN + 256)
+
+/* Storage for a message parsed by kvmessage_parse_buffered. */
+typedef struct {
+  kvmessage_t msg;
+  char data[KVMESSAGE_INLINE];
+} kvmessage_buffer_t;
+
 kvmessage_t *kvmessage_parse(int sockfd);
+kvmessage_t *kvmessage_parse_buffered(int sockfd, kvmessage_buffer_t *);
+
+long kvmessage_frame_size(const void *data, size_t len);
+kvmessage_t *kvmessage_decode(const char *frame, size_t size,
+    kvmessage_buffer_t *);
+
+long kvmessage_peek_size(int sockfd);
+long kvmessage_peek_id(int sockfd);
+int kvmessage_peek_key(int sockfd, char *key);
 
 int kvmessage_send(kvmessage_t *, int sockfd);
+size_t kvmessage_encode(kvmessage_t *, char *buf, size_t size);
+
+void kvmessage_release_value(kvmessage_t *);
 
 void kvmessage_free(kvmessage_t *);
 
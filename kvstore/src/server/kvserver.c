@@ -9,15 +9,26 @@
 #include "kvserver.h"
 #include "tpclog.h"
 #include "socket_server.h"
+#include "kvhash.h"
 
 // OUR CODE HERE
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
 
 #define PORT_NUM_LENGTH 16 // Used to help malloc our registration string with this server
 
 static int copy_and_store_kvmessage(kvserver_t *server, kvmessage_t *msg);
 static int rebuild_kvmessage(kvserver_t *server, logentry_t *e, bool put);
+static int load_from_store(void *server, char *key, kvvalue_t **value);
+static void bump_version(kvserver_t *server, char *key, int delta);
+static int flush_to_store(void *server, char *key, kvvalue_t *value);
+static int replay_to_store(void *server, logentry_t *entry);
+static void *flusher_thread(void *server);
+static void *snapshot_thread(void *server);
+static void *warm_thread(void *warmer);
 
 /* Initializes a kvserver. Will return 0 if successful, or a negative error
  * code if not. DIRNAME is the directory which should be used to store entries
@@ -28,11 +39,27 @@ static int rebuild_kvmessage(kvserver_t *server, logentry_t *e, bool put);
 int kvserver_init(kvserver_t *server, char *dirname, unsigned int num_sets,
     unsigned int elem_per_set, unsigned int max_threads, const char *hostname,
     int port, bool use_tpc) {
+  return kvserver_init_policy(server, dirname, num_sets, elem_per_set,
+      max_threads, hostname, port, use_tpc, CACHE_SECOND_CHANCE);
+}
+
+/* Initializes a kvserver like kvserver_init, but the sets of its cache will
+ * evict entries using POLICY (see kvcache.h). */
+int kvserver_init_policy(kvserver_t *server, char *dirname,
+    unsigned int num_sets, unsigned int elem_per_set, unsigned int max_threads,
+    const char *hostname, int port, bool use_tpc, cache_policy_t policy) {
   int ret;
-  ret = kvcache_init(&server->cache, num_sets, elem_per_set);
+  ret = kvcache_init_policy(&server->cache, num_sets, elem_per_set, policy);
   if (ret < 0) return ret;
   ret = kvstore_init(&server->store, dirname);
   if (ret < 0) return ret;
+  ret = singleflight_init(&server->inflight);
+  if (ret != 0) return -1;
+  ret = hotkeys_init(&server->hotkeys, HOTKEYS_SAMPLE);
+  if (ret != 0) return -1;
+  server->versions = calloc(SERVER_VERSION_SLOTS, sizeof(kvversion_t));
+  if (server->versions == NULL) return ENOMEM;
+  server->write_seq = 0;
   if (use_tpc) {
     ret = tpclog_init(&server->log, dirname);
     if (ret < 0) return ret;
@@ -48,9 +75,216 @@ int kvserver_init(kvserver_t *server, char *dirname, unsigned int num_sets,
   // OUR CODE HERE
   server->msg = NULL;
   server->state = TPC_READY;
+  server->write_back = false;
+  server->snapshot_interval = 0;
+  server->admit = ADMIT_ALWAYS;
   return 0;
 }
 
+/* Switches SERVER to write-back mode. PUTs will then only be logged to
+ * SERVER's WAL and applied to its cache before they complete, and the dirty
+ * cache entries will be written to the store every FLUSH_MS milliseconds by
+ * a background thread (or only when kvserver_flush is called, if FLUSH_MS is
+ * 0), as well as before they are evicted. Any writes left in the WAL by a
+ * previous run are applied to the store first. Returns 0 if successful, else
+ * a negative error code. */
+int kvserver_enable_write_back(kvserver_t *server, unsigned int flush_ms) {
+  pthread_t flusher;
+  int ret;
+  if ((ret = wal_init(&server->wal, server->store.dirname)) < 0)
+    return ret;
+  if ((ret = wal_replay(&server->wal, replay_to_store, server)) < 0)
+    return ret;
+  wal_discard(&server->wal, server->wal.gen);
+  kvcache_set_flush(&server->cache, flush_to_store, server);
+  server->flush_interval = flush_ms;
+  server->write_back = true;
+  if (flush_ms > 0) {
+    if (pthread_create(&flusher, NULL, flusher_thread, server) != 0)
+      return -1;
+    pthread_detach(flusher);
+  }
+  return 0;
+}
+
+/* Writes every dirty entry in the cache of write-back SERVER to its store, so
+ * that the writes logged so far can be dropped from the WAL. Writes made
+ * meanwhile are logged to a new generation of the WAL and kept. Returns 0 if
+ * successful, else a negative error code. */
+int kvserver_flush(kvserver_t *server) {
+  unsigned long gen;
+  int ret = 0;
+  if (!server->write_back)
+    return 0;
+  if ((ret = wal_rotate(&server->wal, &gen)) < 0)
+    return ret;
+  if (kvcache_flush(&server->cache) < 0)
+    ret = ERRFILACCESS;
+  /* Writes which failed are still dirty, and their records must be kept. */
+  if (ret == 0)
+    ret = wal_discard(&server->wal, gen);
+  return ret;
+}
+
+/* Flushes the cache of SERVER every FLUSH_INTERVAL milliseconds. */
+static void *flusher_thread(void *server) {
+  kvserver_t *s = server;
+  while (true) {
+    usleep(s->flush_interval * 1000);
+    kvserver_flush(s);
+  }
+  return NULL;
+}
+
+/* Stores the name of SERVER's cache snapshot file in FILENAME, which must
+ * have room for MAX_FILENAME characters. Returns 0 if successful, or
+ * ERRFILLEN if the name is too long. */
+static int snapshot_filename(kvserver_t *server, char *filename) {
+  if (snprintf(filename, MAX_FILENAME, "%s/%s", server->store.dirname,
+      SNAPSHOT_FILENAME) >= MAX_FILENAME)
+    return ERRFILLEN;
+  return 0;
+}
+
+/* Saves the keys held by SERVER's cache to its snapshot file, replacing the
+ * previous snapshot. Returns 0 if successful, else a negative error code. */
+int kvserver_save_snapshot(kvserver_t *server) {
+  char filename[MAX_FILENAME];
+  int ret;
+  if ((ret = snapshot_filename(server, filename)) < 0)
+    return ret;
+  return kvsnapshot_save(&server->cache, filename);
+}
+
+/* Starts a background thread which saves a snapshot of SERVER's cache every
+ * INTERVAL_MS milliseconds. Returns 0 if successful, else a negative error
+ * code. */
+int kvserver_enable_snapshots(kvserver_t *server, unsigned int interval_ms) {
+  pthread_t thread;
+  if (interval_ms == 0)
+    return -1;
+  server->snapshot_interval = interval_ms;
+  if (pthread_create(&thread, NULL, snapshot_thread, server) != 0)
+    return -1;
+  pthread_detach(thread);
+  return 0;
+}
+
+/* Saves a snapshot of SERVER's cache every SNAPSHOT_INTERVAL milliseconds. */
+static void *snapshot_thread(void *server) {
+  kvserver_t *s = server;
+  while (true) {
+    usleep(s->snapshot_interval * 1000);
+    kvserver_save_snapshot(s);
+  }
+  return NULL;
+}
+
+/* The state shared by the threads warming a KVServer's cache. */
+struct warmer {
+  kvserver_t *server;           /* The server whose cache is warmed. */
+  kvsnapshot_entry_t *entries;  /* The keys to load, from the snapshot. */
+  unsigned int count;           /* The number of ENTRIES. */
+  unsigned int next;            /* The index of the next entry to load. Accessed atomically. */
+  unsigned int rate;            /* The max number of keys loaded per second, or 0. */
+  struct timespec start;        /* When warming started, on CLOCK_MONOTONIC. */
+  unsigned int threads;         /* The number of threads still running. Accessed atomically. */
+};
+
+/* Starts warming SERVER's cache from its snapshot file, if there is one: THREADS
+ * background threads read the keys it lists from the store into the cache,
+ * loading at most RATE keys per second between them (or as fast as possible
+ * if RATE is 0). Returns 0 if successful, or if there is no snapshot, else a
+ * negative error code. */
+int kvserver_warm_cache(kvserver_t *server, unsigned int threads,
+    unsigned int rate) {
+  char filename[MAX_FILENAME];
+  struct warmer *warmer;
+  pthread_t thread;
+  unsigned int i;
+  if (threads == 0)
+    return -1;
+  if ((warmer = calloc(1, sizeof(struct warmer))) == NULL)
+    return ENOMEM;
+  if (snapshot_filename(server, filename) < 0
+      || kvsnapshot_load(filename, &warmer->entries, &warmer->count) < 0
+      || warmer->count == 0) {
+    free(warmer);
+    return 0;
+  }
+  warmer->server = server;
+  warmer->rate = rate;
+  clock_gettime(CLOCK_MONOTONIC, &warmer->start);
+  /* Count every thread up front, so that none frees WARMER early. */
+  warmer->threads = threads;
+  for (i = 0; i < threads; i++) {
+    if (pthread_create(&thread, NULL, warm_thread, warmer) != 0) {
+      if (__atomic_sub_fetch(&warmer->threads, threads - i, __ATOMIC_ACQ_REL)
+          == 0) {
+        kvsnapshot_free(warmer->entries, warmer->count);
+        free(warmer);
+      }
+      return (i == 0) ? -1 : 0;
+    }
+    pthread_detach(thread);
+  }
+  return 0;
+}
+
+/* Loads keys from the snapshot of struct warmer WARMER into its server's
+ * cache until none are left. Keys are handed out in order, and key I is not
+ * loaded before I / RATE seconds have passed since warming started. The last
+ * thread to finish frees WARMER. */
+static void *warm_thread(void *warmer) {
+  struct warmer *w = warmer;
+  struct timespec due;
+  unsigned long long offset;
+  kvsnapshot_entry_t *e;
+  kvvalue_t *value;
+  unsigned int i;
+  while ((i = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED)) < w->count) {
+    if (w->rate > 0) {
+      offset = (unsigned long long) i * 1000000000ULL / w->rate;
+      due.tv_sec = w->start.tv_sec + (w->start.tv_nsec + offset) / 1000000000;
+      due.tv_nsec = (w->start.tv_nsec + offset) % 1000000000;
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL)
+          == EINTR)
+        ;
+    }
+    /* A miss loads the key into the cache, unless a request already did. */
+    e = &w->entries[i];
+    if (kvserver_get_ref(w->server, e->key, &value) != 0)
+      continue;
+    kvvalue_release(value);
+    /* Hit it again to restore its reference bit. */
+    if (e->referenced && kvcache_get_ref(&w->server->cache, e->key, &value)
+        == 0)
+      kvvalue_release(value);
+  }
+  if (__atomic_sub_fetch(&w->threads, 1, __ATOMIC_ACQ_REL) == 0) {
+    kvsnapshot_free(w->entries, w->count);
+    free(w);
+  }
+  return NULL;
+}
+
+/* Writes the dirty cache entry KEY, VALUE of kvserver_t SERVER to its store.
+ * Used as the cache's flush function in write-back mode. */
+static int flush_to_store(void *server, char *key, kvvalue_t *value) {
+  return kvstore_put(&((kvserver_t *) server)->store, key, value->data);
+}
+
+/* Applies the WAL record ENTRY to the store of kvserver_t SERVER. */
+static int replay_to_store(void *server, logentry_t *entry) {
+  kvstore_t *store = &((kvserver_t *) server)->store;
+  int ret;
+  if (entry->type == PUTREQ)
+    return kvstore_put(store, entry->data,
+        entry->data + strlen(entry->data) + 1);
+  ret = kvstore_del(store, entry->data);
+  return (ret == ERRNOKEY) ? 0 : ret;
+}
+
 /* Sends a message to register SERVER with a TPCMaster over a socket located at
  * SOCKFD which has previously been connected. Does not close the socket when
  * done. Returns -1 if an error was encountered.
@@ -58,7 +292,7 @@ int kvserver_init(kvserver_t *server, char *dirname, unsigned int num_sets,
  * Checkpoint 2 only. */
 int kvserver_register_master(kvserver_t *server, int sockfd) {
   // OUR CODE HERE
-  kvmessage_t *reqmsg = (kvmessage_t *) malloc(sizeof(kvmessage_t));
+  kvmessage_t *reqmsg = (kvmessage_t *) calloc(1, sizeof(kvmessage_t));
   if (reqmsg == NULL) {
     return -1;
   }
@@ -94,21 +328,104 @@ int kvserver_register_master(kvserver_t *server, int sockfd) {
  * go to the store and update the value in the cache. */
 int kvserver_get(kvserver_t *server, char *key, char **value) {
   // OUR CODE HERE
+  kvvalue_t *ref;
   int ret;
-  pthread_rwlock_t *lock = kvcache_getlock(&server->cache, key);
-  if (lock == NULL) return ERRKEYLEN;
-  pthread_rwlock_rdlock(lock);
-  if (kvcache_get(&server->cache, key, value) == 0) {
-    pthread_rwlock_unlock(lock);
+  if ((ret = kvserver_get_ref(server, key, &ref)) != 0)
+    return ret;
+  *value = malloc(ref->length + 1);
+  if (*value != NULL)
+    strcpy(*value, ref->data);
+  kvvalue_release(ref);
+  return (*value == NULL) ? ENOMEM : 0;
+}
+
+/* Attempts to get KEY from SERVER without copying the cached value. Returns 0
+ * if successful, else a negative error code. If successful, VALUE will point
+ * to a shared value whose reference must later be released with
+ * kvvalue_release. On a cache miss, the value read from the store is inserted
+ * into the cache and shared with the caller, as well as with any other
+ * threads which missed on KEY meanwhile. Cache hits do not take the cache
+ * set's lock. */
+int kvserver_get_ref(kvserver_t *server, char *key, kvvalue_t **value) {
+  int ret;
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  if ((ret = kvcache_get_ref(&server->cache, key, value)) == 0)
     return 0;
-  }
-  pthread_rwlock_unlock(lock);
-  if ((ret = kvstore_get(&server->store, key, value)) < 0)
+  if (ret == ERRNEGKEY)
+    return ERRNOKEY;
+  return singleflight_do(&server->inflight, key, load_from_store, server,
+      value);
+}
+
+/* Loads KEY from the store of kvserver_t SERVER into its cache after a cache
+ * miss, storing a reference to the value in VALUE. Used with singleflight_do.
+ * A key missing from the store is cached as a negative entry. Nothing is
+ * cached if a write of KEY raced with the read (see kvserver_fill). Returns 0
+ * if successful, else a negative error code. */
+static int load_from_store(void *server, char *key, kvvalue_t **value) {
+  kvserver_t *s = server;
+  unsigned long since;
+  int ret;
+  kvcache_resize_step(&s->cache, CACHE_RESIZE_STEP);
+  /* A previous load may have finished between the miss and this call. */
+  if ((ret = kvcache_get_ref(&s->cache, key, value)) == 0)
+    return 0;
+  if (ret == ERRNEGKEY)
+    return ERRNOKEY;
+  since = kvserver_version(s);
+  /* The value is read from its file straight into the KVValue which is
+     cached, and sent without being copied again. */
+  if ((ret = kvstore_get_ref(&s->store, key, value)) < 0) {
+    if (ret == ERRNOKEY)
+      kvserver_fill(s, key, NULL, since);
     return ret;
-  pthread_rwlock_wrlock(lock);
-  ret = kvcache_put(&server->cache, key, *value); // what happens if this is unsuccessful?
+  }
+  kvserver_fill(s, key, *value, since);
+  return 0;
+}
+
+/* Returns the sequence number of the last write of SERVER to start or end.
+ * Read before reading a key from the store, and passed to kvserver_fill. */
+unsigned long kvserver_version(kvserver_t *server) {
+  return __atomic_load_n(&server->write_seq, __ATOMIC_SEQ_CST);
+}
+
+/* Advances the version of the slot of KEY in SERVER to a new sequence
+ * number, and adds DELTA to its count of writes in progress. */
+static void bump_version(kvserver_t *server, char *key, int delta) {
+  kvversion_t *v = &server->versions[kvhash(key) % SERVER_VERSION_SLOTS];
+  unsigned long seq = __atomic_add_fetch(&server->write_seq, 1,
+      __ATOMIC_SEQ_CST), old = __atomic_load_n(&v->seq, __ATOMIC_SEQ_CST);
+  if (delta > 0)
+    __atomic_add_fetch(&v->writing, delta, __ATOMIC_SEQ_CST);
+  while (old < seq && !__atomic_compare_exchange_n(&v->seq, &old, seq, false,
+      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    ;
+  if (delta < 0)
+    __atomic_sub_fetch(&v->writing, -delta, __ATOMIC_SEQ_CST);
+}
+
+/* Caches VALUE for KEY in SERVER, or a negative entry if VALUE is NULL, after
+ * VALUE was read from the store. SINCE is the result of kvserver_version from
+ * before the store was read. Nothing is cached if a PUT or DEL of KEY (or of
+ * a key in the same slot) is in progress or has started or ended since then,
+ * as VALUE may be stale. Returns true if the cache was updated. */
+bool kvserver_fill(kvserver_t *server, char *key, kvvalue_t *value,
+    unsigned long since) {
+  kvversion_t *v = &server->versions[kvhash(key) % SERVER_VERSION_SLOTS];
+  pthread_rwlock_t *lock;
+  bool fresh;
+  if ((lock = kvcache_wrlock(&server->cache, key)) == NULL)
+    return false;
+  fresh = __atomic_load_n(&v->writing, __ATOMIC_SEQ_CST) == 0
+      && __atomic_load_n(&v->seq, __ATOMIC_SEQ_CST) <= since;
+  if (fresh && value != NULL)
+    kvcache_put_ref(&server->cache, key, value); // a failed insert only costs a future miss
+  else if (fresh)
+    kvcache_put_negative(&server->cache, key);
   pthread_rwlock_unlock(lock);
-  return ret;
+  return fresh;
 }
 
 /* Checks if the given KEY, VALUE pair can be inserted into this server's
@@ -122,23 +439,56 @@ int kvserver_put_check(kvserver_t *server, char *key, char *value) {
  * to the cache should be concurrent if the keys are in different cache sets.
  * Returns 0 if successful, else a negative error code. */
 int kvserver_put(kvserver_t *server, char *key, char *value) {
+  return kvserver_put_admit(server, key, value, ADMIT_DEFAULT);
+}
+
+/* Like kvserver_put, but applies the PUT to the cache according to the
+ * admission policy ADMIT, or SERVER's own policy if ADMIT is ADMIT_DEFAULT.
+ * In write-back mode, the value is always cached. Returns 0 if successful,
+ * else a negative error code. */
+int kvserver_put_admit(kvserver_t *server, char *key, char *value,
+    admit_t admit) {
   // OUR CODE HERE
   int success;
-  pthread_rwlock_t *lock = kvcache_getlock(&server->cache, key);
-  if (lock == NULL) return ERRKEYLEN;
-  pthread_rwlock_wrlock(lock);
-  if ((success = kvcache_put(&server->cache, key, value)) < 0) {
+  pthread_rwlock_t *lock;
+  kvcache_resize_step(&server->cache, CACHE_RESIZE_STEP);
+  if ((lock = kvcache_wrlock(&server->cache, key)) == NULL) return ERRKEYLEN;
+  /* Misses which read KEY from the store until the write ends do not cache
+     what they read, since the cache may not hold the new value. */
+  bump_version(server, key, 1);
+  if (server->write_back) {
+    /* Log the write, then leave it to be flushed from the cache later. */
+    if ((success = kvstore_put_check(&server->store, key, value)) == 0
+        && (success = wal_append(&server->wal, PUTREQ, key, value)) == 0
+        && kvcache_put_dirty(&server->cache, key, value) < 0)
+      success = kvstore_put(&server->store, key, value);
+    pthread_rwlock_unlock(lock);
+  } else if ((success = kvcache_put_admit(&server->cache, key, value,
+      (admit != ADMIT_DEFAULT) ? admit : server->admit)) < 0) {
     pthread_rwlock_unlock(lock);
-    return success;
+  } else {
+    pthread_rwlock_unlock(lock);
+    success = kvstore_put(&server->store, key, value);
   }
-  pthread_rwlock_unlock(lock);
-  return kvstore_put(&server->store, key, value);
+  bump_version(server, key, -1);
+  return success;
 }
 
 /* Checks if the given KEY can be deleted from this server's store.
  * Returns 0 if it can, else a negative error code. */
 int kvserver_del_check(kvserver_t *server, char *key) {
   // OUR CODE HERE
+  pthread_rwlock_t *lock;
+  int ret;
+  if (server->write_back) {
+    /* The key may only exist as a dirty cache entry so far. */
+    if ((lock = kvcache_wrlock(&server->cache, key)) == NULL)
+      return ERRKEYLEN;
+    ret = kvcache_flush_key(&server->cache, key);
+    pthread_rwlock_unlock(lock);
+    if (ret < 0)
+      return ret;
+  }
   return kvstore_del_check(&server->store, key);
 }
 
@@ -148,30 +498,89 @@ int kvserver_del_check(kvserver_t *server, char *key) {
 int kvserver_del(kvserver_t *server, char *key) {
   // OUR CODE HERE
   int ret;
-  pthread_rwlock_t *lock = kvcache_getlock(&server->cache, key);
-  if (lock == NULL) return ERRKEYLEN;
-  pthread_rwlock_wrlock(lock);
-  if ((ret = kvstore_del(&server->store, key)) < 0) {
-    pthread_rwlock_unlock(lock);
-    return ret;
+  pthread_rwlock_t *lock;
+  kvcache_resize_step(&server->cache, CACHE_RESIZE_STEP);
+  if ((lock = kvcache_wrlock(&server->cache, key)) == NULL) return ERRKEYLEN;
+  bump_version(server, key, 1);
+  if (server->write_back) {
+    /* Make sure the store has the key, and that replaying the WAL after a
+       crash will not bring it back. */
+    if ((ret = kvcache_flush_key(&server->cache, key)) < 0
+        || (ret = wal_append(&server->wal, DELREQ, key, NULL)) < 0)
+      goto done;
   }
-  pthread_rwlock_unlock(lock);
+  if ((ret = kvstore_del(&server->store, key)) < 0)
+    goto done;
   kvcache_del(&server->cache, key); // if not in server's cache, that's okay
-  return 0;
+  ret = 0;
+done:
+  pthread_rwlock_unlock(lock);
+  bump_version(server, key, -1);
+  return ret;
 }
 
-/* Returns an info string about SERVER including its hostname and port. */
+/* Returns an info string about SERVER including its hostname and port, and
+ * the statistics of its cache. */
 char *kvserver_get_info_message(kvserver_t *server) {
   char info[1024], buf[256];
+  kvcachestats_t stats;
   time_t ltime = time(NULL);
   strcpy(info, asctime(localtime(&ltime)));
   sprintf(buf, "{%s, %d}", server->hostname, server->port);
   strcat(info, buf);
-  char *msg = malloc(strlen(info));
+  kvcache_stats(&server->cache, &stats);
+  sprintf(buf, "\nCache: %lu hits, %lu negative hits, %lu misses", stats.hits,
+      stats.negative_hits, stats.misses);
+  strcat(info, buf);
+  char *msg = malloc(strlen(info) + 1);
   strcpy(msg, info);
   return msg;
 }
 
+/* Grows the cache of SERVER to NUM_SETS sets, rounded up to a multiple of
+ * its current number of sets, keeping the number of entries per set. Entries
+ * move to their new sets gradually, as requests come in (see kvcache.h). As
+ * the number of sets only ever grows by a whole factor, it stays a multiple
+ * of the number of workers in sharded mode, each of which keeps owning the
+ * sets of its keys. Returns 0 if successful, else a negative error code. */
+int kvserver_resize_cache(kvserver_t *server, unsigned int num_sets) {
+  unsigned int current = __atomic_load_n(&server->cache.num_sets,
+      __ATOMIC_ACQUIRE);
+  if (num_sets <= current)
+    return -1;
+  if (num_sets % current != 0)
+    num_sets += current - num_sets % current;
+  return kvcache_resize(&server->cache, num_sets, server->cache.elem_per_set);
+}
+
+/* Populates RESPMSG with the response to the RESIZE request REQMSG, whose
+ * value is the number of cache sets SERVER should grow to. */
+static void kvserver_resize(kvserver_t *server, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg) {
+  char *end;
+  unsigned long num_sets = 0;
+  respmsg->type = RESP;
+  if (reqmsg->value != NULL)
+    num_sets = strtoul(reqmsg->value, &end, 10);
+  if (num_sets == 0 || num_sets > UINT_MAX || *end != '\0')
+    respmsg->message = ERRMSG_INVALID_REQUEST;
+  else if (kvserver_resize_cache(server, num_sets) != 0)
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+  else
+    respmsg->message = MSG_SUCCESS;
+}
+
+/* Populates RESPMSG with the report of the keys SERVER received the most
+ * GETs and PUTs for. */
+static void kvserver_hotkeys(kvserver_t *server, kvmessage_t *respmsg) {
+  if ((respmsg->message = hotkeys_report(&server->hotkeys)) == NULL) {
+    respmsg->type = RESP;
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+  } else {
+    respmsg->type = HOTKEYS;
+  }
+}
+
 /* Handles an incoming kvmessage REQMSG, and populates the appropriate fields
  * of RESPMSG as a response. RESPMSG and REQMSG both must point to valid
  * kvmessage_t structs. Assumes that the request should be handled as a TPC
@@ -200,13 +609,15 @@ void kvserver_handle_tpc(kvserver_t *server, kvmessage_t *reqmsg, kvmessage_t *r
   }
 
   initial_check = false;
+  if (reqmsg->type == GETREQ || reqmsg->type == PUTREQ)
+    hotkeys_record(&server->hotkeys, reqmsg->key);
   switch (reqmsg->type) {
 
     case GETREQ:
-      if ((error = kvserver_get(server, reqmsg->key, &reqmsg->value)) == 0) {
+      if ((error = kvserver_get_ref(server, reqmsg->key, &respmsg->valref)) == 0) {
         respmsg->type = GETRESP;
         respmsg->key = reqmsg->key;
-        respmsg->value = reqmsg->value;
+        respmsg->value = respmsg->valref->data;
       } else {
         goto unsuccessful_request;
       }
@@ -257,8 +668,11 @@ void kvserver_handle_tpc(kvserver_t *server, kvmessage_t *reqmsg, kvmessage_t *r
     case COMMIT:
       server->state = TPC_READY;
       tpclog_log(&server->log, COMMIT, NULL, NULL);
+      /* Applying the request replaces (PUT) or removes (DEL) any negative
+         cache entry for the key, which GETs may have created meanwhile. */
       if (server->msg->type == PUTREQ) {
-        if ((error = kvserver_put(server, server->msg->key, server->msg->value)) < 0) {
+        if ((error = kvserver_put_admit(server, server->msg->key,
+            server->msg->value, server->msg->admit)) < 0) {
           goto unsuccessful_request;
         }
         respmsg->type = ACK;
@@ -276,6 +690,14 @@ void kvserver_handle_tpc(kvserver_t *server, kvmessage_t *reqmsg, kvmessage_t *r
       respmsg->type = ACK;
       break;
 
+    case HOTKEYS:
+      kvserver_hotkeys(server, respmsg);
+      break;
+
+    case RESIZE:
+      kvserver_resize(server, reqmsg, respmsg);
+      break;
+
     default:
       respmsg->type = RESP;
       respmsg->message = ERRMSG_INVALID_REQUEST;
@@ -314,20 +736,23 @@ void kvserver_handle_no_tpc(kvserver_t *server, kvmessage_t *reqmsg, kvmessage_t
 
   initial_check = false;
   int error = -1;
+  if (reqmsg->type == GETREQ || reqmsg->type == PUTREQ)
+    hotkeys_record(&server->hotkeys, reqmsg->key);
   switch (reqmsg->type) {
 
     case GETREQ:
-      if ((error = kvserver_get(server, reqmsg->key, &reqmsg->value)) == 0) {
+      if ((error = kvserver_get_ref(server, reqmsg->key, &respmsg->valref)) == 0) {
         respmsg->type = GETRESP;
         respmsg->key = reqmsg->key;
-        respmsg->value = reqmsg->value;
+        respmsg->value = respmsg->valref->data;
       } else {
         goto unsuccessful_request;
       }
       break;
 
     case PUTREQ:
-      if ((error = kvserver_put(server, reqmsg->key, reqmsg->value)) == 0) {
+      if ((error = kvserver_put_admit(server, reqmsg->key, reqmsg->value,
+          reqmsg->admit)) == 0) {
         respmsg->type = RESP;
         respmsg->message = MSG_SUCCESS;
       } else {
@@ -349,6 +774,14 @@ void kvserver_handle_no_tpc(kvserver_t *server, kvmessage_t *reqmsg, kvmessage_t
       respmsg->message = kvserver_get_info_message(server);
       break;
 
+    case HOTKEYS:
+      kvserver_hotkeys(server, respmsg);
+      break;
+
+    case RESIZE:
+      kvserver_resize(server, reqmsg, respmsg);
+      break;
+
     default:
       respmsg->type = RESP;
       respmsg->message = ERRMSG_NOT_IMPLEMENTED;
@@ -362,25 +795,44 @@ void kvserver_handle_no_tpc(kvserver_t *server, kvmessage_t *reqmsg, kvmessage_t
     respmsg->type = RESP;
     respmsg->message = (initial_check) ? ERRMSG_INVALID_REQUEST : GETMSG(error);
 }
+/* Processes the request REQMSG and fills in the response RESPMSG, which is
+ * answered in the framing REQMSG arrived in, with its ID. Does not send
+ * RESPMSG nor free REQMSG. The value of RESPMSG may be shared with the cache,
+ * and must be released with kvmessage_release_value once it has been sent. */
+void kvserver_process(kvserver_t *server, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg) {
+  if (server->use_tpc) {
+    kvserver_handle_tpc(server, reqmsg, respmsg);
+  } else {
+    kvserver_handle_no_tpc(server, reqmsg, respmsg);
+  }
+  respmsg->binary = reqmsg->binary;
+  respmsg->id = reqmsg->id;
+}
+
 /* Generic entrypoint for this SERVER. Takes in a socket on SOCKFD, which
  * should already be connected to an incoming request. Processes the request
  * and sends back a response message.  This should call out to the appropriate
- * internal handler. */
+ * internal handler. If EXTRA is not NULL, it is the request, already parsed
+ * from SOCKFD, and is freed here. */
 void kvserver_handle(kvserver_t *server, int sockfd, void *extra) {
-  kvmessage_t *reqmsg, *respmsg;
-  respmsg = calloc(1, sizeof(kvmessage_t));
-  reqmsg = kvmessage_parse(sockfd);
-  void (*server_handler)(kvserver_t *server, kvmessage_t *reqmsg,
-      kvmessage_t *respmsg);
-  server_handler = server->use_tpc ?
-    kvserver_handle_tpc : kvserver_handle_no_tpc;
+  kvmessage_t *reqmsg, respmsg;
+  kvmessage_buffer_t buffer;
+  memset(&respmsg, 0, sizeof(kvmessage_t));
+  reqmsg = (extra != NULL) ? extra : kvmessage_parse_buffered(sockfd, &buffer);
   if (reqmsg == NULL) {
-    respmsg->type = RESP;
-    respmsg->message = ERRMSG_INVALID_REQUEST;
+    respmsg.type = RESP;
+    respmsg.message = ERRMSG_INVALID_REQUEST;
   } else {
-    server_handler(server, reqmsg, respmsg);
+    kvserver_process(server, reqmsg, &respmsg);
   }
-  kvmessage_send(respmsg, sockfd);
+  kvmessage_send(&respmsg, sockfd);
+  /* The value of a GET response is shared with the cache; now that it has
+     been written out, our reference to it can be dropped. */
+  kvmessage_release_value(&respmsg);
+  /* Only the messages of these are allocated for the response. */
+  if (respmsg.type == INFO || respmsg.type == HOTKEYS)
+    free(respmsg.message);
   if (reqmsg != NULL)
     kvmessage_free(reqmsg);
 }
@@ -414,7 +866,7 @@ int kvserver_rebuild_state(kvserver_t *server) {
     prev = next;
   }
 
-  server->msg = (kvmessage_t *) malloc(sizeof(kvmessage_t));
+  server->msg = (kvmessage_t *) calloc(1, sizeof(kvmessage_t));
   if (server->msg == NULL)
     return -1;
 
@@ -444,7 +896,7 @@ int kvserver_rebuild_state(kvserver_t *server) {
 }
 
 static int rebuild_kvmessage(kvserver_t *server, logentry_t *e, bool put) {
-  server->msg = (kvmessage_t *) malloc(sizeof(kvmessage_t));
+  server->msg = (kvmessage_t *) calloc(1, sizeof(kvmessage_t));
   if (server->msg == NULL)
     return -1;
   server->msg->type = e->type;
@@ -480,7 +932,7 @@ static int copy_and_store_kvmessage(kvserver_t *server, kvmessage_t *msg) {
   /* We don't need to worry about freeing mallocs, because we
      have kvmessage_free everytime at the beginning of this function. */
   kvmessage_free(server->msg);
-  if ((server->msg = (kvmessage_t *) malloc(sizeof(kvmessage_t))) == NULL) {
+  if ((server->msg = (kvmessage_t *) calloc(1, sizeof(kvmessage_t))) == NULL) {
     return -1;
   }
 
@@ -503,5 +955,6 @@ static int copy_and_store_kvmessage(kvserver_t *server, kvmessage_t *msg) {
   }
 
   m->type = msg->type;
+  m->admit = msg->admit;
   return 0;
 }
@@ -6,6 +6,10 @@
 #include "kvstore.h"
 #include "kvmessage.h"
 #include "tpclog.h"
+#include "singleflight.h"
+#include "wal.h"
+#include "kvsnapshot.h"
+#include "hotkeys.h"
 
 /* KVServer defines a server which will be used to store <key, value> pairs.
  *
@@ -22,7 +26,49 @@
  * to get an entry from cache before accessing its store to eliminate the need
  * to access disk when possible. The cache should write-through; that is, when
  * a new entry is stored, it should be written to both the cache and the store
- * immediately.
+ * immediately. Concurrent cache misses on the same key are coalesced into a
+ * single store read using a SingleFlight. The cache evicts entries by second
+ * chance, or by ARC if the server is initialized with kvserver_init_policy.
+ *
+ * Alternatively, a KVServer can be switched to write-back mode with
+ * kvserver_enable_write_back. A PUT is then appended to a write-ahead log
+ * (see wal.h) and stored in the cache as a dirty entry, and a background
+ * thread periodically writes all dirty entries to the store. Repeated PUTs of
+ * a key between two flushes thus cost a single store write. A dirty entry is
+ * also written to the store before it is evicted from the cache, and before
+ * its key is deleted.
+ *
+ * The cache can be grown without a restart with kvserver_resize_cache, or
+ * by sending the server a RESIZE message whose value is the new number of
+ * sets (e.g. when a node is promoted and given more memory). Every PUT, DEL
+ * and cache miss then moves part of the cache to its new sets (see
+ * kvcache.h), so that the working set stays cached throughout.
+ *
+ * So that a restart does not leave the cache cold, a KVServer can save the
+ * keys held by its cache to a snapshot (see kvsnapshot.h) in its store
+ * directory, periodically and on shutdown. On startup, kvserver_warm_cache
+ * reads them back from the store in the background, at a limited rate and
+ * using several threads, while the server already serves requests; a key
+ * which a request has already brought into the cache is simply hit.
+ *
+ * Each write-through PUT is applied to the cache according to an admission
+ * policy: the one set in the request, or else the server's ADMIT policy
+ * (ADMIT_ALWAYS unless changed). Write-back servers always cache PUTs, since
+ * the cache holds the writes until they are flushed.
+ *
+ * A GET which misses reads the key from the store and then caches the value,
+ * but a PUT or DEL of the key may write the store in between; under a policy
+ * which leaves the key out of the cache, nothing then tells the miss that
+ * its value is stale. Like a TPCMaster (see tpcmaster.h), a KVServer
+ * therefore numbers the start and end of its writes, and keeps for each of
+ * SERVER_VERSION_SLOTS slots (chosen by kvhash(key)) the number of the last
+ * write of a key in that slot to start or end, and the number of such writes
+ * in progress. A miss only caches what it read if the slot of its key has no
+ * write in progress and has not changed since it started reading.
+ *
+ * A KVServer counts the GETs and PUTs it receives for each key in a HotKeys
+ * tracker (see hotkeys.h), and lists the most requested keys in response to
+ * a HOTKEYS message.
  *
  * A KVServer can operate in two modes; TPC or non-TPC. In non-TPC mode, all
  * PUT and DEL requests go immediately to the cache/store. In TPC mode, 2-Phase
@@ -38,6 +84,16 @@
  * state of the server upon crash recovery.
  */
 struct kvserver;
+
+/* The number of slots over which the versions of keys are tracked. */
+#define SERVER_VERSION_SLOTS 4096
+
+/* The version of the keys within one slot. */
+typedef struct {
+  unsigned long seq;        /* The sequence number of the last write to start or end. */
+  unsigned int writing;     /* The number of writes in progress. */
+} kvversion_t;
+
 typedef void (*kvhandle_t)(struct kvserver *, int sockfd, void *extra);
 
 /* A KVServer. Stores the associated KVCache and KVStore, as well as whether or
@@ -53,6 +109,15 @@ typedef struct kvserver {
   int sockfd;               /* The socket fd this server is currently listening on (if any). */
   int port;                 /* The port this server should listen on. */
   char *hostname;           /* The host this server should listen on. */
+  singleflight_t inflight;  /* The store reads in flight after cache misses. */
+  bool write_back;          /* True if PUTs are written to the store by a flusher, else false. */
+  unsigned int flush_interval; /* The number of ms between flushes in write-back mode. */
+  wal_t wal;                /* Logs PUTs not yet written to the store (write-back only). */
+  unsigned int snapshot_interval; /* The number of ms between cache snapshots, or 0. */
+  hotkeys_t hotkeys;        /* The keys receiving the most GETs and PUTs. */
+  admit_t admit;            /* The cache admission policy for PUTs which do not set one. */
+  unsigned long write_seq;  /* The sequence number of the last write started or ended. */
+  kvversion_t *versions;    /* The SERVER_VERSION_SLOTS slot versions. */
   // OUR CODE HERE
   kvmessage_t *msg;         /* The message that I received during phase 1 as a slave. */
   tpc_state_t state;        /* The current state I am in when under TPC operations.
@@ -62,10 +127,23 @@ typedef struct kvserver {
 int kvserver_init(kvserver_t *, char *dirname, unsigned int num_sets,
     unsigned int elem_per_set, unsigned int max_threads, const char *hostname,
     int port, bool use_tpc);
+int kvserver_init_policy(kvserver_t *, char *dirname, unsigned int num_sets,
+    unsigned int elem_per_set, unsigned int max_threads, const char *hostname,
+    int port, bool use_tpc, cache_policy_t policy);
+
+int kvserver_enable_write_back(kvserver_t *, unsigned int flush_ms);
+int kvserver_flush(kvserver_t *);
+
+int kvserver_save_snapshot(kvserver_t *);
+int kvserver_enable_snapshots(kvserver_t *, unsigned int interval_ms);
+int kvserver_warm_cache(kvserver_t *, unsigned int threads, unsigned int rate);
+
+int kvserver_resize_cache(kvserver_t *, unsigned int num_sets);
 
 int kvserver_register_master(kvserver_t *, int sockfd);
 
 void kvserver_handle(kvserver_t *, int sockfd, void *extra);
+void kvserver_process(kvserver_t *, kvmessage_t *reqmsg, kvmessage_t *respmsg);
 
 void kvserver_handle_tpc(kvserver_t *, kvmessage_t *reqmsg,
     kvmessage_t *respmsg);
@@ -73,9 +151,15 @@ void kvserver_handle_no_tpc(kvserver_t *, kvmessage_t *reqmsg,
     kvmessage_t *respmsg);
 
 int kvserver_get(kvserver_t *, char *key, char **value);
+int kvserver_get_ref(kvserver_t *, char *key, kvvalue_t **value);
 int kvserver_put(kvserver_t *, char *key, char *value);
+int kvserver_put_admit(kvserver_t *, char *key, char *value, admit_t admit);
 int kvserver_del(kvserver_t *, char *key);
 
+unsigned long kvserver_version(kvserver_t *);
+bool kvserver_fill(kvserver_t *, char *key, kvvalue_t *value,
+    unsigned long since);
+
 int kvserver_rebuild_state(kvserver_t *);
 
 int kvserver_clean(kvserver_t *);
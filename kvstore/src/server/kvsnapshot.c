@@ -0,0 +1,109 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "kvconstants.h"
+#include "kvsnapshot.h"
+
+/* The state of a snapshot being saved, passed through kvcache_walk. */
+struct save {
+  FILE *file;
+  uint32_t count;
+  bool failed;
+};
+
+/* Appends the record for KEY to the snapshot being saved in SAVE. */
+static void save_key(void *save, char *key, bool referenced) {
+  struct save *s = save;
+  uint8_t flags = referenced ? SNAPSHOT_REFERENCED : 0;
+  uint16_t keylen = strlen(key);
+  if (s->failed)
+    return;
+  if (fwrite(&flags, sizeof(flags), 1, s->file) != 1
+      || fwrite(&keylen, sizeof(keylen), 1, s->file) != 1
+      || fwrite(key, 1, keylen, s->file) != keylen) {
+    s->failed = true;
+    return;
+  }
+  s->count++;
+}
+
+/* Saves the keys currently resident in CACHE to the snapshot file FILENAME,
+ * replacing any previous snapshot. Each set of CACHE is read locked while its
+ * keys are saved. Returns 0 if successful, else a negative error code. */
+int kvsnapshot_save(kvcache_t *cache, char *filename) {
+  char tmpname[MAX_FILENAME];
+  kvsnapshot_header_t header = {SNAPSHOT_MAGIC, 0};
+  struct save save = {NULL, 0, false};
+  if (snprintf(tmpname, MAX_FILENAME, "%s.tmp", filename) >= MAX_FILENAME)
+    return ERRFILLEN;
+  if ((save.file = fopen(tmpname, "w")) == NULL)
+    return ERRFILCRT;
+  if (fwrite(&header, sizeof(header), 1, save.file) != 1)
+    save.failed = true;
+  kvcache_walk(cache, save_key, &save);
+  header.count = save.count;
+  if (fseek(save.file, 0, SEEK_SET) != 0
+      || fwrite(&header, sizeof(header), 1, save.file) != 1
+      || fflush(save.file) != 0 || fsync(fileno(save.file)) != 0)
+    save.failed = true;
+  if (fclose(save.file) != 0 || save.failed
+      || rename(tmpname, filename) != 0) {
+    remove(tmpname);
+    return ERRFILACCESS;
+  }
+  return 0;
+}
+
+/* Reads the snapshot file FILENAME. If successful, returns 0 and stores in
+ * ENTRIES an array of the COUNT keys it holds, in the order they were saved,
+ * to be freed with kvsnapshot_free. A snapshot cut short ends at its last
+ * complete record. Otherwise, returns a negative error code. */
+int kvsnapshot_load(char *filename, kvsnapshot_entry_t **entries,
+    unsigned int *count) {
+  kvsnapshot_header_t header;
+  kvsnapshot_entry_t *e;
+  uint8_t flags;
+  uint16_t keylen;
+  unsigned int i;
+  FILE *file;
+  if ((file = fopen(filename, "r")) == NULL)
+    return ERRFILACCESS;
+  if (fread(&header, sizeof(header), 1, file) != 1
+      || header.magic != SNAPSHOT_MAGIC) {
+    fclose(file);
+    return ERRFILACCESS;
+  }
+  if ((*entries = calloc(header.count, sizeof(kvsnapshot_entry_t))) == NULL
+      && header.count > 0) {
+    fclose(file);
+    return ENOMEM;
+  }
+  for (i = 0; i < header.count; i++) {
+    e = &(*entries)[i];
+    if (fread(&flags, sizeof(flags), 1, file) != 1
+        || fread(&keylen, sizeof(keylen), 1, file) != 1
+        || keylen > MAX_KEYLEN || (e->key = malloc(keylen + 1)) == NULL)
+      break;
+    if (fread(e->key, 1, keylen, file) != keylen) {
+      free(e->key);
+      break;
+    }
+    e->key[keylen] = '\0';
+    e->referenced = flags & SNAPSHOT_REFERENCED;
+  }
+  fclose(file);
+  *count = i;
+  return 0;
+}
+
+/* Frees the COUNT ENTRIES returned by kvsnapshot_load. */
+void kvsnapshot_free(kvsnapshot_entry_t *entries, unsigned int count) {
+  unsigned int i;
+  for (i = 0; i < count; i++)
+    free(entries[i].key);
+  free(entries);
+}
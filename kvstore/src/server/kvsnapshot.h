@@ -0,0 +1,54 @@
+#ifndef __KV_SNAPSHOT__
+#define __KV_SNAPSHOT__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "kvcache.h"
+
+/* KVSnapshot records which keys a KVCache holds, so that a restarted server
+ * can warm its cache instead of sending every GET to disk until the working
+ * set has been read again.
+ *
+ * Only keys are saved, along with whether each entry had been referenced
+ * (its reference bit was set, or it was on ARC's T2); values are read from
+ * the store again when warming, so a snapshot can never bring back stale
+ * data. Negative entries are not saved.
+ *
+ * A snapshot file starts with a kvsnapshot_header_t, followed by COUNT
+ * records, each made of a one byte flags field, the key's length as an
+ * unsigned 16 bit integer and the key itself without a null terminator. All
+ * integers are in host byte order. Records are in the order in which the
+ * cache's sets were walked, each set from least to most recently inserted.
+ *
+ * A snapshot is first written to a temporary file, which then replaces the
+ * previous snapshot with rename(), so that a crash while saving leaves the
+ * previous snapshot intact.
+ */
+
+/* The name of the snapshot file within a KVServer's store directory. */
+#define SNAPSHOT_FILENAME "cache.snapshot"
+
+/* Identifies snapshot files. */
+#define SNAPSHOT_MAGIC 0x4b56534e
+
+/* Flag set in a record if its entry had been referenced. */
+#define SNAPSHOT_REFERENCED 0x1
+
+/* The header of a snapshot file. */
+typedef struct {
+  uint32_t magic;           /* SNAPSHOT_MAGIC. */
+  uint32_t count;           /* The number of records which follow. */
+} kvsnapshot_header_t;
+
+/* A key read from a snapshot. */
+typedef struct {
+  char *key;                /* The key, malloc()d. */
+  bool referenced;          /* True if its entry had been referenced. */
+} kvsnapshot_entry_t;
+
+int kvsnapshot_save(kvcache_t *, char *filename);
+int kvsnapshot_load(char *filename, kvsnapshot_entry_t **entries,
+    unsigned int *count);
+void kvsnapshot_free(kvsnapshot_entry_t *entries, unsigned int count);
+
+#endif
@@ -5,6 +5,7 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include "kvstore.h"
 
 /* The djb2 string hash algorithm
@@ -40,56 +41,63 @@ int kvstore_init(kvstore_t *store, char *dirname) {
  * Returns a negative error code if the entry is not found or an error
  * occurred.
  *
- * If VALUE is not NULL, the value of the entry will be placed into VALUE using
- * malloced memory which should be freed later. */
-int find_entry(kvstore_t *store, char *key, char **value) {
+ * If VALUE is not NULL, the value of the entry will be read straight from its
+ * file into a new KVValue, stored in VALUE, whose reference should be
+ * released later. Each entry file of the chain is read with positioned reads
+ * of just the bytes needed: its length and key to compare them, and then
+ * only for the matching entry its value, so the value is copied once, from
+ * the file into the KVValue which is cached and sent. */
+static int find_entry(kvstore_t *store, char *key, kvvalue_t **value) {
   unsigned long hashval;
   unsigned int counter = 0;
   char currfile[MAX_FILENAME];
   size_t keylen = strlen(key);
   struct stat st;
-  FILE *file;
-  kventry_t *entry, header;
+  char head[sizeof(kventry_t) + MAX_KEYLEN + 1];
+  kventry_t header;
+  ssize_t got;
+  int fd, ret;
   if (keylen > MAX_KEYLEN)
     return ERRKEYLEN;
-  if (stat(store->dirname, &st) == -1)
-    return ERRFILACCESS;
   hashval = hash(key);
   pthread_rwlock_rdlock(&store->lock);
-  sprintf(currfile, "%s/%lu-%u%s", store->dirname, hashval, counter++,
-      KVSTORE_FILETYPE);
-  while (stat(currfile, &st) != -1) {
-    if ((file = fopen(currfile, "r")) == NULL) {
-      pthread_rwlock_unlock(&store->lock);
-      return ERRFILACCESS;
+  while (true) {
+    sprintf(currfile, "%s/%lu-%u%s", store->dirname, hashval, counter++,
+        KVSTORE_FILETYPE);
+    if ((fd = open(currfile, O_RDONLY)) < 0) {
+      /* The end of the chain, unless the store itself is gone. */
+      ret = (errno != ENOENT || stat(store->dirname, &st) == -1)
+          ? ERRFILACCESS : ERRNOKEY;
+      break;
     }
-    fread(&header, sizeof(kventry_t), 1, file);
-    fseek(file, 0L, SEEK_SET);
-    entry = malloc(sizeof(kventry_t) + header.length);
-    if (entry == NULL) {
-      pthread_rwlock_unlock(&store->lock);
-      return ENOMEM;
+    got = pread(fd, head, sizeof(kventry_t) + keylen + 1, 0);
+    memcpy(&header, head, sizeof(kventry_t));
+    if (got != (ssize_t) (sizeof(kventry_t) + keylen + 1)
+        || header.length < (int) keylen + 2
+        || memcmp(head + sizeof(kventry_t), key, keylen + 1) != 0) {
+      close(fd);
+      continue;
     }
-    fread(entry, sizeof(kventry_t) + header.length, 1, file);
-    fclose(file);
-    if (strcmp(key, entry->data) == 0) {
-      if (value != NULL) {
-        *value = malloc(entry->length - strlen(entry->data) - 1);
-        if (*value == NULL) {
-          pthread_rwlock_unlock(&store->lock);
-          return ENOMEM;
-        }
-        strcpy(*value, entry->data + strlen(entry->data) + 1);
-        free(entry);
+    ret = counter - 1;
+    if (value != NULL) {
+      /* The value and its null terminator follow the key's. */
+      size_t vallen = header.length - keylen - 2;
+      if ((*value = kvvalue_alloc(vallen)) == NULL) {
+        ret = -ENOMEM;
+      } else if (pread(fd, (*value)->data, vallen,
+          sizeof(kventry_t) + keylen + 1) != (ssize_t) vallen) {
+        kvvalue_release(*value);
+        *value = NULL;
+        ret = ERRFILACCESS;
+      } else {
+        (*value)->data[vallen] = '\0';
       }
-      pthread_rwlock_unlock(&store->lock);
-      return counter - 1;
     }
-    sprintf(currfile, "%s/%lu-%u%s", store->dirname, hashval, counter++,
-        KVSTORE_FILETYPE);
+    close(fd);
+    break;
   }
   pthread_rwlock_unlock(&store->lock);
-  return ERRNOKEY;
+  return ret;
 }
 
 /* Returns true if STORE contains KEY, else false. */
@@ -101,6 +109,22 @@ bool kvstore_haskey(kvstore_t *store, char *key) {
  * Returns 0 if successful, else a negative error code. The entry's value will
  * be placed into VALUE using malloc()d memory which should be free()d later. */
 int kvstore_get(kvstore_t *store, char *key, char **value) {
+  kvvalue_t *ref;
+  int ret = kvstore_get_ref(store, key, &ref);
+  if (ret < 0)
+    return ret;
+  *value = malloc(ref->length + 1);
+  if (*value != NULL)
+    memcpy(*value, ref->data, ref->length + 1);
+  kvvalue_release(ref);
+  return (*value == NULL) ? ENOMEM : 0;
+}
+
+/* Attempts to retrieve the entry denoted by KEY from STORE, reading its value
+ * straight into a new KVValue. Returns 0 if successful, else a negative error
+ * code. If successful, VALUE holds the only reference to the KVValue, which
+ * must be released with kvvalue_release. */
+int kvstore_get_ref(kvstore_t *store, char *key, kvvalue_t **value) {
   int ret = find_entry(store, key, value);
   if (ret < 0)
     return ret;
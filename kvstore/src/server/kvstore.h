@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <pthread.h>
 #include "kvconstants.h"
+#include "kvvalue.h"
 
 /* KVStore defines the persistent storage used by a server to store <key, value> entries.
  *
@@ -34,6 +35,9 @@
  * All state is stored in persistent file storage, so it is valid to initialize
  * a KVStore using a directory name which was previously used for a KVStore,
  * and the new store will be an exact clone of the old store.
+ *
+ * kvstore_get_ref reads a value from its entry file straight into a KVValue,
+ * so that a server can cache and send it without copying it again.
  */
 
 /* The filetype to append to the filenames of entries within the log. */
@@ -59,6 +63,7 @@ unsigned long hash(char *str);
 int kvstore_init(kvstore_t *, char *dirname);
 
 int kvstore_get(kvstore_t *, char *key, char **value);
+int kvstore_get_ref(kvstore_t *, char *key, kvvalue_t **value);
 
 int kvstore_put(kvstore_t *, char *key, char *value);
 int kvstore_put_check(kvstore_t *, char *key, char *value);
@@ -0,0 +1,41 @@
+#include <stdlib.h>
+#include <string.h>
+#include "kvvalue.h"
+
+/* Allocates a new KVValue of LENGTH bytes, whose data the caller fills in
+ * (and null terminates) before sharing it, so that a value read from a file
+ * can be read straight into it. The caller holds the only reference to it.
+ * Returns NULL if memory could not be allocated. */
+kvvalue_t *kvvalue_alloc(size_t length) {
+  kvvalue_t *v = malloc(sizeof(kvvalue_t) + length + 1);
+  if (v == NULL)
+    return NULL;
+  v->refcount = 1;
+  v->length = length;
+  return v;
+}
+
+/* Allocates a new KVValue holding a copy of VALUE. The caller holds the only
+ * reference to it. Returns NULL if memory could not be allocated. */
+kvvalue_t *kvvalue_new(const char *value) {
+  size_t length = strlen(value);
+  kvvalue_t *v = kvvalue_alloc(length);
+  if (v != NULL)
+    memcpy(v->data, value, length + 1);
+  return v;
+}
+
+/* Takes an additional reference to VALUE, which the caller must already hold
+ * a reference to. Returns VALUE for convenience. */
+kvvalue_t *kvvalue_ref(kvvalue_t *value) {
+  __atomic_add_fetch(&value->refcount, 1, __ATOMIC_RELAXED);
+  return value;
+}
+
+/* Releases a reference to VALUE, freeing it if this was the last one. Does
+ * nothing if VALUE is NULL. */
+void kvvalue_release(kvvalue_t *value) {
+  if (value != NULL && __atomic_sub_fetch(&value->refcount, 1,
+      __ATOMIC_ACQ_REL) == 0)
+    free(value);
+}
@@ -0,0 +1,35 @@
+#ifndef __KV_VALUE__
+#define __KV_VALUE__
+
+#include <stddef.h>
+
+/* KVValue defines an immutable, reference-counted value buffer.
+ *
+ * The KVCache stores its values as KVValues so that a GET can hand out the
+ * cached buffer itself instead of a malloc()d copy. Whoever receives a KVValue
+ * (e.g. through kvcache_get_ref) holds one reference to it and must call
+ * kvvalue_release once it no longer needs the value, such as after the value
+ * has been written out in a response. The buffer is freed when its last
+ * reference is released, so a value which is overwritten or evicted from the
+ * cache stays valid for any readers which still hold a reference to it.
+ *
+ * The contents of a KVValue must never be modified after kvvalue_new, or
+ * once a KVValue from kvvalue_alloc has been filled in and shared.
+ * Reference counts are updated atomically, so references to the same value
+ * may be taken and released from different threads.
+ */
+
+/* A KVValue. */
+typedef struct kvvalue {
+  int refcount;                 /* The number of outstanding references. */
+  size_t length;                /* The length of DATA, excluding the null terminator. */
+  char data[0];                 /* The null terminated value. */
+} kvvalue_t;
+
+kvvalue_t *kvvalue_alloc(size_t length);
+kvvalue_t *kvvalue_new(const char *value);
+
+kvvalue_t *kvvalue_ref(kvvalue_t *);
+void kvvalue_release(kvvalue_t *);
+
+#endif
@@ -0,0 +1,84 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "kvhash.h"
+#include "kvmessage.h"
+#include "kvstore.h"
+#include "tpcmaster.h"
+
+const char *USAGE = "Usage: kvhash_bench [iterations (default=1000000)]";
+
+/* The key lengths to time each hash function on. */
+static const size_t lengths[] = {16, 64, 100, 250, 500, 1000};
+
+#define NUM_KEYS 64
+
+static unsigned long djb2(char *key) {
+  return hash(key);
+}
+
+static unsigned long java64(char *key) {
+  return (unsigned long) hash_64_bit(key);
+}
+
+static unsigned long kvhash_fn(char *key) {
+  return kvhash(key);
+}
+
+/* The hash functions being compared. */
+static struct {
+  const char *name;
+  unsigned long (*fn)(char *key);
+} functions[] = {
+  {"hash", djb2},
+  {"hash_64_bit", java64},
+  {"kvhash", kvhash_fn}
+};
+
+/* Returns the current time in nanoseconds. */
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Times the hash functions on random printable keys of several lengths, and
+ * prints the average number of nanoseconds per call. */
+int main(int argc, char **argv) {
+  unsigned long iterations = 1000000, i, sink = 0;
+  char *keys[NUM_KEYS];
+  size_t l, f, k, j;
+  uint64_t start;
+
+  if (argc > 2 || (argc == 2 && (iterations = strtoul(argv[1], NULL, 10)) == 0)) {
+    printf("%s\n", USAGE);
+    return 1;
+  }
+  srand(1);
+  printf("%8s", "length");
+  for (f = 0; f < sizeof(functions) / sizeof(functions[0]); f++)
+    printf(" %14s", functions[f].name);
+  printf("   (ns per key)\n");
+  for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+    for (k = 0; k < NUM_KEYS; k++) {
+      keys[k] = malloc(lengths[l] + 1);
+      for (j = 0; j < lengths[l]; j++)
+        keys[k][j] = ' ' + 1 + rand() % 94;
+      keys[k][lengths[l]] = '\0';
+    }
+    printf("%8zu", lengths[l]);
+    for (f = 0; f < sizeof(functions) / sizeof(functions[0]); f++) {
+      start = now_ns();
+      for (i = 0; i < iterations; i++)
+        sink += functions[f].fn(keys[i % NUM_KEYS]);
+      printf(" %14.2f", (double) (now_ns() - start) / iterations);
+    }
+    printf("\n");
+    for (k = 0; k < NUM_KEYS; k++)
+      free(keys[k]);
+  }
+  /* Keep the hashes from being optimized away. */
+  return sink == 42;
+}
@@ -1,25 +1,81 @@
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <getopt.h>
 #include "socket_server.h"
 #include "kvserver.h"
 
-const char *USAGE = "Usage: kvmaster [port (default=8888)]";
+const char *USAGE = "Usage: kvmaster "
+    "[-a policy] [--admit always|resident|around, the cache admission "
+    "policy for PUTs (default=always)] "
+    "[-P policy] [--policy second-chance|arc, the cache replacement policy "
+    "(default=second-chance)] "
+    "[port (default=8888)] "
+    "[resp_port, to listen on for Redis (RESP) clients as well (default=none)]";
 
 int main(int argc, char** argv) {
-  int port = 8888;
+  int port = 8888, resp_port = 0;
+  admit_t admit = ADMIT_ALWAYS;
+  cache_policy_t policy = CACHE_SECOND_CHANCE;
   server_t server;
+  char *report;
+  int opt_ind;
+  int c;
+  struct option long_options[] = {{"admit", required_argument, NULL, 'a'},
+      {"policy", required_argument, NULL, 'P'},
+      {0,0,0,0}};
 
-  if (argc > 1) {
-    if (argc > 2) {
-      printf("%s\n", USAGE);
-      return 1;
+  while ((c = getopt_long(argc, argv, "a:P:", long_options, &opt_ind))
+      != -1) {
+    switch (c) {
+      case 'a':
+        if (strcmp(optarg, "always") == 0)
+          admit = ADMIT_ALWAYS;
+        else if (strcmp(optarg, "resident") == 0)
+          admit = ADMIT_RESIDENT;
+        else if (strcmp(optarg, "around") == 0)
+          admit = ADMIT_AROUND;
+        else
+          goto usage;
+        break;
+      case 'P':
+        if (strcmp(optarg, "second-chance") == 0)
+          policy = CACHE_SECOND_CHANCE;
+        else if (strcmp(optarg, "arc") == 0)
+          policy = CACHE_ARC;
+        else
+          goto usage;
+        break;
+      default:
+        goto usage;
     }
-    port = atoi(argv[1]);
+  }
+  if (argc > optind) {
+    if (argc - optind > 2 || (argc - optind == 2
+        && (resp_port = atoi(argv[optind + 1])) <= 0))
+      goto usage;
+    port = atoi(argv[optind]);
   }
   server.master = 1;
   server.max_threads = 3;
-  tpcmaster_init(&server.tpcmaster, 2, 2, 4, 4);
+  server.io_threads = 1;
+  server.reuseport = 0;
+  server.unix_path = NULL;
+  server.resp_port = resp_port;
+  server.sharded = 0;
+  tpcmaster_init_policy(&server.tpcmaster, 2, 2, 4, 4, policy);
+  server.tpcmaster.admit = admit;
+  if ((report = arena_report()) != NULL) {
+    printf("%s\n", report);
+    free(report);
+  }
   printf("TPC Master server started listening on port %d...\n", port);
+  if (resp_port > 0)
+    printf("Also listening for RESP clients on port %d...\n", resp_port);
   server_run("localhost", port, &server, NULL);
+  return 0;
+
+usage:
+  printf("%s\n", USAGE);
+  return 1;
 }
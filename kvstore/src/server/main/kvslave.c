@@ -2,38 +2,151 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <getopt.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
 #include "socket_server.h"
 #include "kvserver.h"
 
 const char *USAGE = "Usage: kvslave "
     "[-t] [--tpc] "
+    "[-c] [--sharded] "
+    "[-o threads] [--io-threads threads running event loops (default=1)] "
+    "[-p] [--reuseport, a listening socket per I/O thread] "
+    "[-u path] [--unix path of a Unix domain socket to listen on as well] "
+    "[-R port] [--resp-port port to listen on for Redis (RESP) clients as "
+    "well] "
+    "[-s sets] [--sets sets (default=4)] "
+    "[-e entries] [--entries entries per set (default=4)] "
+    "[-i ms] [--snapshot-interval ms between cache snapshots, 0 for none "
+    "(default=60000)] "
+    "[-r rate] [--warm-rate keys per second to warm the cache with, 0 for "
+    "no limit (default=1000)] "
+    "[-a policy] [--admit always|resident|around, the cache admission "
+    "policy for PUTs (default=always)] "
+    "[-P policy] [--policy second-chance|arc, the cache replacement policy "
+    "(default=second-chance)] "
+    "[--no-hugepages] "
     "[slave_port (default=9000)] "
     "[master_port (default=8888)]";
 
+/* The number of threads which warm the cache on startup. */
+#define WARM_THREADS 4
+
+/* Waits for SIGINT or SIGTERM, then saves a snapshot of the kvserver_t
+ * SERVER's cache and exits. */
+static void *shutdown_thread(void *server) {
+  sigset_t signals;
+  int sig;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigwait(&signals, &sig);
+  if (kvserver_save_snapshot(server) < 0)
+    printf("Could not save a snapshot of the cache.\n");
+  exit(0);
+}
+
 int main(int argc, char **argv) {
   int tpc_mode = 0,
+      sharded = 0,
+      io_threads = 1,
+      reuseport = 0,
+      resp_port = 0,
       slave_port = 9000,
-      master_port = 8888;
-  char *mode = "";
+      master_port = 8888,
+      num_sets = 4,
+      elem_per_set = 4,
+      snapshot_interval = 60000,
+      warm_rate = 1000,
+      no_hugepages = 0;
+  admit_t admit = ADMIT_ALWAYS;
+  cache_policy_t policy = CACHE_SECOND_CHANCE;
+  char *mode = "", *report, *unix_path = NULL;
   char *slave_hostname = "localhost", *master_hostname = "localhost";
   int index = 0;
   int opt_ind;
   int c;
   struct option long_options[] = {{"tpc", no_argument, &tpc_mode, 1},
+      {"sharded", no_argument, &sharded, 1},
+      {"io-threads", required_argument, NULL, 'o'},
+      {"reuseport", no_argument, &reuseport, 1},
+      {"unix", required_argument, NULL, 'u'},
+      {"resp-port", required_argument, NULL, 'R'},
+      {"sets", required_argument, NULL, 's'},
+      {"entries", required_argument, NULL, 'e'},
+      {"snapshot-interval", required_argument, NULL, 'i'},
+      {"warm-rate", required_argument, NULL, 'r'},
+      {"admit", required_argument, NULL, 'a'},
+      {"policy", required_argument, NULL, 'P'},
+      {"no-hugepages", no_argument, &no_hugepages, 1},
       {0,0,0,0}};
-  if ((c = getopt_long (argc, argv, "t", long_options, &opt_ind)) != -1) {
+  while ((c = getopt_long (argc, argv, "tco:pu:R:s:e:i:r:a:P:", long_options, &opt_ind))
+      != -1) {
     switch (c) {
       case 0:
         break;
       case 't':
         tpc_mode = 1;
-        mode = "(tpc)";
-        index += 1;
+        break;
+      case 'c':
+        sharded = 1;
+        break;
+      case 'o':
+        if ((io_threads = atoi(optarg)) <= 0)
+          goto usage;
+        break;
+      case 'p':
+        reuseport = 1;
+        break;
+      case 'u':
+        unix_path = optarg;
+        break;
+      case 'R':
+        if ((resp_port = atoi(optarg)) <= 0)
+          goto usage;
+        break;
+      case 's':
+        if ((num_sets = atoi(optarg)) <= 0)
+          goto usage;
+        break;
+      case 'e':
+        if ((elem_per_set = atoi(optarg)) <= 0)
+          goto usage;
+        break;
+      case 'i':
+        if ((snapshot_interval = atoi(optarg)) < 0)
+          goto usage;
+        break;
+      case 'r':
+        if ((warm_rate = atoi(optarg)) < 0)
+          goto usage;
+        break;
+      case 'a':
+        if (strcmp(optarg, "always") == 0)
+          admit = ADMIT_ALWAYS;
+        else if (strcmp(optarg, "resident") == 0)
+          admit = ADMIT_RESIDENT;
+        else if (strcmp(optarg, "around") == 0)
+          admit = ADMIT_AROUND;
+        else
+          goto usage;
+        break;
+      case 'P':
+        if (strcmp(optarg, "second-chance") == 0)
+          policy = CACHE_SECOND_CHANCE;
+        else if (strcmp(optarg, "arc") == 0)
+          policy = CACHE_ARC;
+        else
+          goto usage;
         break;
       default:
         goto usage;
     }
   }
+  if (tpc_mode)
+    mode = "(tpc)";
+  index = optind - 1;
   if (index < argc) {
     switch (argc - index - 1) {
       case 1:
@@ -67,17 +180,37 @@ int main(int argc, char **argv) {
   } else {
     printf("Single Node server started on port %d...\n", slave_port);
   }
+  if (unix_path != NULL)
+    printf("Also listening on the Unix domain socket %s...\n", unix_path);
+  if (resp_port > 0)
+    printf("Also listening for RESP clients on port %d...\n", resp_port);
 
   kvserver_t slave;
   server_t server;
   server.master = 0;
   server.max_threads = 3;
+  server.io_threads = io_threads;
+  server.reuseport = reuseport;
+  server.unix_path = unix_path;
+  server.resp_port = resp_port;
+  server.sharded = sharded;
+  /* Each worker owns the sets whose index is its own modulo the number of
+     workers. */
+  if (sharded && num_sets % server.max_threads != 0)
+    num_sets += server.max_threads - num_sets % server.max_threads;
 
   char slave_name[20];
   sprintf(slave_name, "slave-port%d", slave_port);
 
-  kvserver_init(&slave, slave_name, 4, 4, 2, slave_hostname, slave_port,
-      tpc_mode);
+  arena_set_hugepages(!no_hugepages);
+  kvserver_init_policy(&slave, slave_name, num_sets, elem_per_set, 2,
+      slave_hostname, slave_port,
+      tpc_mode, policy);
+  slave.admit = admit;
+  if ((report = arena_report()) != NULL) {
+    printf("%s\n", report);
+    free(report);
+  }
   if (tpc_mode) {
     /* Need to send registration to the master.*/
     int ret, sockfd = connect_to(master_hostname, master_port, 0);
@@ -96,6 +229,22 @@ int main(int argc, char **argv) {
     close(sockfd);
   }
   server.kvserver = slave;
+
+  /* The server runs on its copy of SLAVE, so that is the one whose cache is
+     snapshot and warmed. Signals are blocked in every thread but the one
+     which saves the final snapshot. */
+  if (snapshot_interval > 0) {
+    sigset_t signals;
+    pthread_t thread;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    pthread_create(&thread, NULL, shutdown_thread, &server.kvserver);
+    kvserver_enable_snapshots(&server.kvserver, snapshot_interval);
+  }
+  if (kvserver_warm_cache(&server.kvserver, WARM_THREADS, warm_rate) < 0)
+    printf("Could not warm the cache from its snapshot.\n");
   server_run(slave_hostname, slave_port, &server, NULL);
   return 0;
 
@@ -0,0 +1,339 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include "resp.h"
+
+/* Error replies of commands which are not understood. */
+#define ERRMSG_UNKNOWN_COMMAND "unknown command"
+#define ERRMSG_ARGUMENTS "wrong number of arguments"
+
+/* The commands understood, with the number of arguments each of their
+ * requests takes (0 if they expand into a single request whatever their
+ * arguments), and the largest number of arguments they take (-1 for any). */
+static const struct {
+  const char *name;
+  respcmd_t cmd;
+  long args;
+  long max_args;
+} commands[] = {
+  {"GET", RESP_GET, 1, 1},
+  {"SET", RESP_SET, 2, 2},
+  {"DEL", RESP_DEL, 1, -1},
+  {"MGET", RESP_MGET, 1, -1},
+  {"MSET", RESP_MSET, 2, -1},
+  {"INFO", RESP_INFO, 0, 1},
+  {"PING", RESP_PING, 0, 0}
+};
+
+/* A buffer being written into, like snprintf does: LEN counts all of the
+ * bytes written, including those which did not fit in its SIZE. */
+typedef struct {
+  char *buf;
+  size_t size;
+  size_t len;
+} writer_t;
+
+/* Parses the line of DATA, of LEN bytes, at *AT, which is to be PREFIX
+ * followed by a decimal number, into *N, and moves *AT past it. Returns 1 if
+ * successful, 0 if the line has not all arrived, else -1. */
+static int parse_line(const char *data, size_t len, size_t *at, char prefix,
+    long *n) {
+  size_t i = *at;
+  long value = 0;
+  if (i >= len)
+    return 0;
+  if (data[i++] != prefix)
+    return -1;
+  for (; i < len && data[i] >= '0' && data[i] <= '9'; i++) {
+    value = value * 10 + (data[i] - '0');
+    if (value > RESP_MAX_FRAME)
+      return -1;
+  }
+  if (i == *at + 1 && i < len)
+    return -1;
+  if (i + 1 >= len)
+    return 0;
+  if (data[i] != '\r' || data[i + 1] != '\n')
+    return -1;
+  *n = value;
+  *at = i + 2;
+  return 1;
+}
+
+/* Returns the total number of bytes of the command whose first LEN bytes
+ * are DATA, if they hold all of it. Returns 0 if more bytes are needed to
+ * tell, or -1 if the command is invalid or larger than RESP_MAX_FRAME. */
+long resp_frame_size(const char *data, size_t len) {
+  size_t at = 0;
+  long argc, arg_len;
+  int ret;
+  if ((ret = parse_line(data, len, &at, '*', &argc)) <= 0)
+    return ret;
+  if (argc == 0)
+    return -1;
+  while (argc-- > 0) {
+    if ((ret = parse_line(data, len, &at, '$', &arg_len)) <= 0)
+      return ret;
+    if (at + arg_len + 2 > RESP_MAX_FRAME)
+      return -1;
+    if (at + arg_len + 2 > len)
+      return 0;
+    if (data[at + arg_len] != '\r' || data[at + arg_len + 1] != '\n')
+      return -1;
+    at += arg_len + 2;
+  }
+  return at;
+}
+
+/* Points *ARG at the argument at *AT of the whole, valid command FRAME of
+ * SIZE bytes, moves *AT past it, and returns its length. */
+static size_t next_arg(const char *frame, size_t size, size_t *at,
+    const char **arg) {
+  long len = 0;
+  parse_line(frame, size, at, '$', &len);
+  *arg = frame + *at;
+  *at += len + 2;
+  return len;
+}
+
+/* Copies the argument at *AT of the command FRAME of SIZE bytes to *DATA,
+ * null terminated, and moves both past it. Returns the copy. */
+static char *take_arg(const char *frame, size_t size, size_t *at,
+    char **data) {
+  const char *arg;
+  size_t len = next_arg(frame, size, at, &arg);
+  char *copy = *data;
+  memcpy(copy, arg, len);
+  copy[len] = '\0';
+  *data += len + 1;
+  return copy;
+}
+
+/* Returns NULL if the arguments of the command FRAME of SIZE bytes from *AT
+ * on, ARGC of them, fit in the requests of a command which takes ARGS per
+ * request (its keys, and its values if ARGS is 2), else the error to reply
+ * with. */
+static const char *check_args(const char *frame, size_t size, size_t at,
+    long argc, long args) {
+  const char *arg;
+  size_t len;
+  long i;
+  for (i = 0; args > 0 && i < argc; i++) {
+    len = next_arg(frame, size, &at, &arg);
+    if (memchr(arg, '\0', len) != NULL)
+      return ERRMSG_INVALID_REQUEST;
+    if (i % args == 0 && len > MAX_KEYLEN)
+      return ERRMSG_KEY_LEN;
+    if (i % args == 1 && len > MAX_VALLEN)
+      return ERRMSG_VAL_LEN;
+  }
+  return NULL;
+}
+
+/* Starts expanding the whole, valid command FRAME of SIZE bytes with
+ * CURSOR. If it is not understood, CURSOR is left with a single RESP_ERROR
+ * part, and MSG's message is set to the error to reply with. */
+static void start(resp_cursor_t *cursor, const char *frame, size_t size,
+    kvmessage_t *msg) {
+  const char *name;
+  size_t len, i;
+  long argc = 0;
+  cursor->at = 0;
+  parse_line(frame, size, &cursor->at, '*', &argc);
+  len = next_arg(frame, size, &cursor->at, &name);
+  argc--;
+  cursor->part.cmd = RESP_ERROR;
+  cursor->part.index = 0;
+  cursor->part.parts = 1;
+  msg->message = ERRMSG_UNKNOWN_COMMAND;
+  for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+    if (strlen(commands[i].name) != len
+        || strncasecmp(commands[i].name, name, len) != 0)
+      continue;
+    if ((commands[i].args > 0 && (argc == 0 || argc % commands[i].args != 0))
+        || (commands[i].max_args >= 0 && argc > commands[i].max_args)) {
+      msg->message = ERRMSG_ARGUMENTS;
+    } else if ((msg->message = (char *) check_args(frame, size, cursor->at,
+        argc, commands[i].args)) == NULL) {
+      cursor->part.cmd = commands[i].cmd;
+      if (commands[i].args > 0)
+        cursor->part.parts = argc / commands[i].args;
+    }
+    return;
+  }
+}
+
+/* Decodes the next request of the whole command FRAME, of SIZE bytes, which
+ * resp_frame_size accepted, into BUFFER, and fills in PART with which part
+ * of the command it is. CURSOR, which is to be zeroed before the first call
+ * for a command, keeps track of the command between calls. Returns true if
+ * this was its last request, after which CURSOR is ready for the next
+ * command. */
+bool resp_decode(resp_cursor_t *cursor, const char *frame, size_t size,
+    kvmessage_buffer_t *buffer, resp_part_t *part) {
+  kvmessage_t *msg = &buffer->msg;
+  char *data = buffer->data;
+  memset(msg, 0, sizeof(kvmessage_t));
+  msg->borrowed = true;
+  if (cursor->part.parts == 0)
+    start(cursor, frame, size, msg);
+  *part = cursor->part;
+  switch (part->cmd) {
+    case RESP_GET:
+    case RESP_MGET:
+      msg->type = GETREQ;
+      msg->key = take_arg(frame, size, &cursor->at, &data);
+      break;
+    case RESP_DEL:
+      msg->type = DELREQ;
+      msg->key = take_arg(frame, size, &cursor->at, &data);
+      break;
+    case RESP_SET:
+    case RESP_MSET:
+      msg->type = PUTREQ;
+      msg->key = take_arg(frame, size, &cursor->at, &data);
+      msg->value = take_arg(frame, size, &cursor->at, &data);
+      break;
+    case RESP_INFO:
+      msg->type = INFO;
+      break;
+    case RESP_PING:
+      msg->type = RESP;
+      msg->message = "PONG";
+      break;
+    case RESP_ERROR:
+      msg->type = RESP;
+      break;
+  }
+  if (++cursor->part.index < cursor->part.parts)
+    return false;
+  memset(cursor, 0, sizeof(resp_cursor_t));
+  return true;
+}
+
+/* Returns true if RESPMSG reports a success. */
+static bool succeeded(const kvmessage_t *respmsg) {
+  return respmsg->type == RESP && respmsg->message != NULL
+      && strcmp(respmsg->message, MSG_SUCCESS) == 0;
+}
+
+/* Records the response RESPMSG to the request PART in TALLY, before its
+ * reply is written. */
+void resp_account(resp_tally_t *tally, const resp_part_t *part,
+    const kvmessage_t *respmsg) {
+  if (part->index == 0) {
+    tally->count = 0;
+    tally->error = NULL;
+  }
+  if (succeeded(respmsg)) {
+    tally->count++;
+  } else if (tally->error == NULL) {
+    /* Only constant messages outlive the response. */
+    tally->error = (respmsg->message != NULL
+        && strcmp(respmsg->message, ERRMSG_NO_KEY) == 0) ? ERRMSG_NO_KEY
+        : (respmsg->message != NULL
+        && strcmp(respmsg->message, ERRMSG_KEY_LEN) == 0) ? ERRMSG_KEY_LEN
+        : (respmsg->message != NULL
+        && strcmp(respmsg->message, ERRMSG_VAL_LEN) == 0) ? ERRMSG_VAL_LEN
+        : ERRMSG_GENERIC_ERROR;
+  }
+}
+
+/* Writes the LEN bytes of DATA into W. */
+static void put(writer_t *w, const char *data, size_t len) {
+  if (w->len < w->size)
+    memcpy(w->buf + w->len, data,
+        (len < w->size - w->len) ? len : w->size - w->len);
+  w->len += len;
+}
+
+/* Writes a short line, formatted as by printf from FORMAT, into W. */
+static void put_line(writer_t *w, const char *format, ...) {
+  char line[64];
+  va_list args;
+  int len;
+  va_start(args, format);
+  len = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  put(w, line, len);
+}
+
+/* Writes a bulk string of the LEN bytes of DATA into W. */
+static void put_bulk(writer_t *w, const char *data, size_t len) {
+  put_line(w, "$%zu\r\n", len);
+  put(w, data, len);
+  put(w, "\r\n", 2);
+}
+
+/* Writes an error reply of MESSAGE (or a generic one if it is NULL) into
+ * W. */
+static void put_error(writer_t *w, const char *message) {
+  if (message == NULL)
+    message = ERRMSG_GENERIC_ERROR;
+  /* Redis errors start with their kind instead. */
+  if (strncmp(message, "ERROR: ", 7) == 0)
+    message += 7;
+  put(w, "-ERR ", 5);
+  put(w, message, strlen(message));
+  put(w, "\r\n", 2);
+}
+
+/* Writes the reply to the request PART, whose response is RESPMSG, into
+ * BUF, of SIZE bytes, after resp_account has recorded RESPMSG in TALLY.
+ * Returns the number of bytes of the reply, which does not fit in BUF if
+ * that is more than SIZE. Requests of DEL and MSET write nothing but the
+ * last one. */
+size_t resp_encode(const resp_tally_t *tally, const resp_part_t *part,
+    const kvmessage_t *respmsg, char *buf, size_t size) {
+  writer_t w = {buf, size, 0};
+  bool last = part->index == part->parts - 1;
+  switch (part->cmd) {
+    case RESP_MGET:
+      if (part->index == 0)
+        put_line(&w, "*%ld\r\n", part->parts);
+      /* Fall through: each key is answered as if alone. */
+    case RESP_GET:
+      if (respmsg->type == GETRESP && respmsg->value != NULL)
+        put_bulk(&w, respmsg->value, strlen(respmsg->value));
+      else if (respmsg->message != NULL
+          && strcmp(respmsg->message, ERRMSG_NO_KEY) == 0)
+        put(&w, "$-1\r\n", 5);
+      else
+        put_error(&w, respmsg->message);
+      break;
+    case RESP_SET:
+    case RESP_MSET:
+      if (last && tally->error != NULL)
+        put_error(&w, tally->error);
+      else if (last)
+        put(&w, "+OK\r\n", 5);
+      break;
+    case RESP_DEL:
+      if (last)
+        put_line(&w, ":%ld\r\n", tally->count);
+      break;
+    case RESP_INFO:
+      if ((respmsg->type == INFO || respmsg->type == HOTKEYS)
+          && respmsg->message != NULL)
+        put_bulk(&w, respmsg->message, strlen(respmsg->message));
+      else
+        put_error(&w, respmsg->message);
+      break;
+    case RESP_PING:
+      put_line(&w, "+%s\r\n", respmsg->message);
+      break;
+    case RESP_ERROR:
+      put_error(&w, respmsg->message);
+      break;
+  }
+  return w.len;
+}
+
+/* Writes an error reply of MESSAGE into BUF, of SIZE bytes, for a command
+ * which could not be read. Returns its size, as resp_encode does. */
+size_t resp_encode_error(const char *message, char *buf, size_t size) {
+  writer_t w = {buf, size, 0};
+  put_error(&w, message);
+  return w.len;
+}
@@ -0,0 +1,85 @@
+#ifndef __KV_RESP__
+#define __KV_RESP__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "kvmessage.h"
+
+/* RESP speaks the protocol of Redis, so that Redis client libraries and
+ * tools (redis-cli, redis-benchmark, memtier_benchmark) can be pointed at a
+ * server's RESP listener (see socket_server.h).
+ *
+ * A command is an array of bulk strings: "*<count>\r\n", then for each
+ * argument "$<length>\r\n<bytes>\r\n". Inline commands, a line of words as
+ * typed into telnet, are not supported. The commands understood are:
+ *   GET key               -> the value, or a null reply if there is none
+ *   SET key value         -> +OK
+ *   DEL key [key ...]     -> the number of keys deleted
+ *   MGET key [key ...]    -> an array of values, null for missing keys
+ *   MSET key value [...]  -> +OK
+ *   INFO [section]        -> the server's info message
+ *   PING                  -> +PONG
+ * Anything else is answered with an error, and the connection stays open.
+ *
+ * A server reads commands into a buffer, and resp_frame_size tells from the
+ * bytes which have arrived how many bytes the whole command takes (or that
+ * more are needed to tell), checking its framing as it goes. resp_decode
+ * then expands the command into the kvmessage_t requests it stands for, one
+ * at a time, into a kvmessage_buffer_t: one per key for DEL, MGET and MSET,
+ * else one. Each comes with a resp_part_t, telling which part of which
+ * command it is. PING, and commands which are not understood, expand into a
+ * single part of type RESP which is answered without being served: its
+ * message is the reply.
+ *
+ * Replies are written in the order the commands arrived, by passing each
+ * part and its response, in order, to resp_account and then resp_encode. A
+ * resp_tally_t carries what the parts of a command have in common: DEL
+ * counts the keys deleted, and MSET remembers the first error, and only
+ * their last part writes the reply.
+ */
+
+/* The largest size of a command. */
+#define RESP_MAX_FRAME KVMESSAGE_MAX_FRAME
+
+/* The commands understood. */
+typedef enum {
+  RESP_GET,
+  RESP_SET,
+  RESP_DEL,
+  RESP_MGET,
+  RESP_MSET,
+  RESP_INFO,
+  RESP_PING,
+  RESP_ERROR                    /* A command which is not understood. */
+} respcmd_t;
+
+/* One of the requests a command expands into. */
+typedef struct {
+  respcmd_t cmd;                /* The command. */
+  long index;                   /* Which of its requests this is. */
+  long parts;                   /* The number of requests it expands into. */
+} resp_part_t;
+
+/* The state of a command being expanded by resp_decode. */
+typedef struct {
+  resp_part_t part;             /* The next request, with PARTS 0 before the first. */
+  size_t at;                    /* The offset in the command of its next argument. */
+} resp_cursor_t;
+
+/* What the parts of a command whose replies are being written share. */
+typedef struct {
+  long count;                   /* The number of parts which succeeded. */
+  const char *error;            /* The first error of a part (a constant), or NULL. */
+} resp_tally_t;
+
+long resp_frame_size(const char *data, size_t len);
+bool resp_decode(resp_cursor_t *, const char *frame, size_t size,
+    kvmessage_buffer_t *, resp_part_t *part);
+
+void resp_account(resp_tally_t *, const resp_part_t *part,
+    const kvmessage_t *respmsg);
+size_t resp_encode(const resp_tally_t *, const resp_part_t *part,
+    const kvmessage_t *respmsg, char *buf, size_t size);
+size_t resp_encode_error(const char *message, char *buf, size_t size);
+
+#endif
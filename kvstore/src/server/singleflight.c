@@ -0,0 +1,85 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "uthash.h"
+#include "singleflight.h"
+
+/* A load in flight, which waiters share until the last of them has taken its
+ * result. */
+struct singleflight_call {
+  char *key;                    /* The key being loaded. */
+  bool done;                    /* True once RET and VALUE are set. */
+  int ret;                      /* The result of the load. */
+  kvvalue_t *value;             /* The loaded value, of which the call holds a reference. */
+  int waiters;                  /* The number of threads waiting on this call. */
+  pthread_cond_t cond;          /* Signalled when DONE becomes true. */
+  UT_hash_handle hh;
+};
+
+static void call_free(struct singleflight_call *call) {
+  pthread_cond_destroy(&call->cond);
+  kvvalue_release(call->value);
+  free(call->key);
+  free(call);
+}
+
+/* Initializes SF. Returns 0 if successful, else a negative error code. */
+int singleflight_init(singleflight_t *sf) {
+  sf->calls = NULL;
+  return pthread_mutex_init(&sf->lock, NULL);
+}
+
+/* Loads KEY by calling LOAD(ARG, KEY, VALUE), unless a load of KEY is already
+ * in flight within SF, in which case this waits for that load instead and
+ * shares its result. Either way, returns 0 and stores a reference to the
+ * loaded value in VALUE if the load succeeded, else returns its negative error
+ * code. The caller must release the reference with kvvalue_release. */
+int singleflight_do(singleflight_t *sf, char *key, singleflight_load_t load,
+    void *arg, kvvalue_t **value) {
+  struct singleflight_call *call;
+  int ret;
+
+  pthread_mutex_lock(&sf->lock);
+  HASH_FIND_STR(sf->calls, key, call);
+  if (call != NULL) {
+    call->waiters++;
+    while (!call->done)
+      pthread_cond_wait(&call->cond, &sf->lock);
+    ret = call->ret;
+    if (ret == 0)
+      *value = kvvalue_ref(call->value);
+    if (--call->waiters == 0)
+      call_free(call);
+    pthread_mutex_unlock(&sf->lock);
+    return ret;
+  }
+
+  /* This thread leads the load. If the call cannot be tracked, it simply
+     loads without coalescing. */
+  call = calloc(1, sizeof(struct singleflight_call));
+  if (call == NULL || (call->key = malloc(strlen(key) + 1)) == NULL) {
+    pthread_mutex_unlock(&sf->lock);
+    free(call);
+    return load(arg, key, value);
+  }
+  strcpy(call->key, key);
+  pthread_cond_init(&call->cond, NULL);
+  HASH_ADD_KEYPTR(hh, sf->calls, call->key, strlen(call->key), call);
+  pthread_mutex_unlock(&sf->lock);
+
+  ret = load(arg, key, value);
+
+  pthread_mutex_lock(&sf->lock);
+  HASH_DEL(sf->calls, call);
+  call->done = true;
+  call->ret = ret;
+  if (ret == 0)
+    call->value = kvvalue_ref(*value);
+  if (call->waiters == 0)
+    call_free(call);
+  else
+    pthread_cond_broadcast(&call->cond);
+  pthread_mutex_unlock(&sf->lock);
+  return ret;
+}
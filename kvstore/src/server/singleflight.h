@@ -0,0 +1,39 @@
+#ifndef __KV_SINGLEFLIGHT__
+#define __KV_SINGLEFLIGHT__
+
+#include <pthread.h>
+#include "kvvalue.h"
+
+/* SingleFlight coalesces concurrent loads of the same key.
+ *
+ * When a hot key misses in the cache, every thread serving a GET for it would
+ * otherwise read it from the store (or, on a TPCMaster, ask a slave for it)
+ * independently, and then race to insert the same value into the cache. With
+ * a SingleFlight, only the first thread to miss on a key (the leader) runs the
+ * load. Threads which miss on the same key while that load is in flight wait
+ * for it and share its result: each receives its own reference to the loaded
+ * KVValue, or the same error code.
+ *
+ * The load function is responsible for inserting what it loaded into the
+ * cache. Since a thread may miss just after a previous load for its key
+ * finished, it should check the cache again before going further.
+ */
+
+/* Loads the value of KEY, storing a reference to it in VALUE. ARG is passed
+ * through from singleflight_do. Returns 0 if successful, else a negative error
+ * code. */
+typedef int (*singleflight_load_t)(void *arg, char *key, kvvalue_t **value);
+
+struct singleflight_call;
+
+/* A SingleFlight. */
+typedef struct {
+  pthread_mutex_t lock;                 /* Protects CALLS. */
+  struct singleflight_call *calls;      /* Hash table of the loads in flight, by key. */
+} singleflight_t;
+
+int singleflight_init(singleflight_t *);
+int singleflight_do(singleflight_t *, char *key, singleflight_load_t load,
+    void *arg, kvvalue_t **value);
+
+#endif
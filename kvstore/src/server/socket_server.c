@@ -1,78 +1,303 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 #include "kvserver.h"
 #include "kvconstants.h"
+#include "kvhash.h"
+#include "resp.h"
 #include "socket_server.h"
+#include "utlist.h"
 #include "wq.h"
 
 #define TIMEOUT 100
 
-static void* server_run_helper(void *arg);
+/* The maximum number of events handled per call to epoll_wait. */
+#define REACTOR_EVENTS 64
 
-/* Struct that will be passed in to the server_run_helper thread function,
-   which itself can only take one argument as parameter. */
-struct server_helper {
-  /* All fields are variables found in server_run() that are necessary to pass
-     into server_run_helper() to listen and accept client requests with the
-     server in the helper thread function. */
+/* The number of ms between sweeps for idle connections. */
+#define SWEEP_INTERVAL 1000
+
+/* The size of a connection's read buffer, which only grows to hold a larger
+ * request, up to KVMESSAGE_MAX_FRAME, until that request is decoded. */
+#define READ_BUFFER_SIZE 16384
+
+/* The size of a connection's output buffer, which grows as needed while its
+ * socket is not taking responses as fast as they come, and shrinks back
+ * once they have been sent. */
+#define WRITE_BUFFER_SIZE 16384
+
+/* A request handed to a worker. */
+struct request {
+  struct connection *conn;      /* The connection it arrived on. */
+  kvmessage_t *reqmsg;          /* The parsed request, or NULL for the handler to read it. */
+  kvmessage_buffer_t *storage;  /* Where REQMSG is decoded, unless this is a connection's SERIAL. */
+  bool pipelined;               /* Whether it is served alongside others of its connection. */
+  bool done;                    /* Whether it is a RESP command's, served. */
+  resp_part_t part;             /* Which part of a RESP command it is. */
+  kvmessage_t respmsg;          /* The response to a RESP command's, until its reply is written. */
+  struct request *prev;         /* The pipelined requests in flight on its connection, */
+  struct request *next;         /* or its spare requests. */
+  struct request *returned;     /* The requests handed back by workers. */
+};
+
+/* A client connection, owned by the I/O thread which accepted it. Only that
+ * thread touches its fields, except for WRITE_LOCK and the output buffer it
+ * protects, while workers serve its requests. */
+struct connection {
+  int fd;                       /* Its socket, or -1 once closed. */
+  struct reactor *reactor;      /* The I/O thread owning this connection. */
+  int rcvbuf;                   /* The number of bytes its socket can buffer. */
+  bool hup;                     /* Whether the peer closed its end. */
+  bool broken;                  /* Whether no more requests are to be read from it. */
+  bool serving;                 /* Whether a worker serves its unnumbered request. */
+  unsigned long last_active;    /* When a request last arrived on it, in ms. */
+  struct request serial;        /* Its unnumbered request, for the handler to read. */
+  struct request *inflight;     /* Its pipelined requests being served. */
+  unsigned int pipelined;       /* The number of requests in INFLIGHT. */
+  struct request *held;         /* A parsed request waiting for earlier ones. */
+  struct request *spare;        /* Served requests, kept to be reused. */
+  char *in;                     /* Its read buffer, once it pipelines requests, else NULL. */
+  size_t in_start;              /* The offset in IN of the first byte not yet decoded. */
+  size_t in_len;                /* The number of bytes read into IN. */
+  size_t in_cap;                /* The size of IN. */
+  bool drained;                 /* Whether the last read left nothing on its socket. */
+  bool resp;                    /* Whether it speaks RESP. */
+  bool rejected;                /* Whether a RESP error is to follow its replies. */
+  resp_cursor_t cursor;         /* The RESP command being expanded into requests. */
+  size_t command;               /* The size of that command. */
+  resp_tally_t tally;           /* The RESP command whose replies are being written. */
+  bool want_in;                 /* Whether it is armed for the next bytes to arrive. */
+  bool dirty;                   /* Whether it is in its reactor's DIRTY list. */
+  bool out_blocked;             /* Whether its socket would not take all of OUT. */
+  char *out;                    /* Responses not yet sent, under WRITE_LOCK. */
+  size_t out_start;             /* The offset in OUT of the first byte not yet sent. */
+  size_t out_len;               /* The number of bytes written into OUT. */
+  size_t out_cap;               /* The size of OUT. */
+  bool out_lost;                /* Whether a response did not fit into OUT. */
+  struct connection *next_dirty;
+  pthread_mutex_t write_lock;   /* Protects OUT and the fields about it. */
+  struct connection *prev;      /* The connections of its I/O thread. */
+  struct connection *next;
+};
+
+/* An I/O thread, running an event loop over the connections it accepted. */
+struct reactor {
   server_t *server;
-  int sock_fd;
-  struct sockaddr_in client_address;  
-  size_t client_address_length;
+  int listenfd;                 /* The listening socket it accepts from. */
+  int epfd;                     /* The epoll instance of the event loop. */
+  int wakefd;                   /* An eventfd written to when RETURNED grows. */
+  pthread_mutex_t lock;         /* Protects RETURNED. */
+  struct request *returned;     /* Requests which have been served. */
+  struct connection *conns;     /* All open connections of this thread. */
+  struct connection *closed;    /* Connections closed during this iteration. */
+  struct connection *dirty;     /* Connections with responses to send. */
+  pthread_t thread;
 };
 
-/* Handles requests under the assumption that SERVER is a TPC Master. */
-void handle_master(server_t *server) {
-  int sockfd;
+/* The argument of a worker thread, in sharded mode. */
+struct shard_worker {
+  server_t *server;
+  int index;                    /* The worker's index, which is also its core's. */
+};
+
+static void *reactor_run(void *arg);
+static void *shard_worker(void *arg);
+
+/* Returns the current time in ms. */
+static unsigned long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/* Handles a request under the assumption that SERVER is a TPC Master. */
+void handle_master(server_t *server, int sockfd) {
   tpcmaster_t *tpcmaster = &server->tpcmaster;
-  sockfd = (intptr_t) wq_pop(&server->wq);
   tpcmaster->handle(tpcmaster, sockfd, NULL);
 }
 
-/* Handles requests under the assumption that SERVER is a kvserver slave. */
-void handle_slave(server_t *server) {
-  int sockfd;
+/* Handles a request under the assumption that SERVER is a kvserver slave.
+ * REQMSG is the request if it was parsed already, else NULL. */
+void handle_slave(server_t *server, int sockfd, kvmessage_t *reqmsg) {
   kvserver_t *kvserver = &server->kvserver;
-  sockfd = (intptr_t) wq_pop(&server->wq);
-  kvserver->handle(kvserver, sockfd, NULL);
+  kvserver->handle(kvserver, sockfd, reqmsg);
 }
 
-/* Handles requests for _SERVER. */
-void *handle(void *_server) {
-  server_t *server = (server_t *) _server;
-  if (server->master) {
-    handle_master(server);
+/* Hands the request REQ, which has been served, back to the I/O thread
+ * owning its connection. */
+static void request_return(struct request *req) {
+  struct reactor *r = req->conn->reactor;
+  uint64_t one = 1;
+  pthread_mutex_lock(&r->lock);
+  LL_PREPEND2(r->returned, req, returned);
+  pthread_mutex_unlock(&r->lock);
+  if (write(r->wakefd, &one, sizeof(one)) < 0) {
+    /* The eventfd's counter can only be full if the reactor is gone. */
+  }
+}
+
+/* Makes room for SIZE more bytes in the output buffer of the connection C,
+ * whose WRITE_LOCK is held. Returns false if memory could not be
+ * allocated. */
+static bool connection_reserve(struct connection *c, size_t size) {
+  size_t cap;
+  char *out;
+  if (size <= c->out_cap - c->out_len)
+    return true;
+  cap = (c->out_cap > 0) ? c->out_cap : WRITE_BUFFER_SIZE;
+  while (cap < c->out_len + size)
+    cap *= 2;
+  if ((out = realloc(c->out, cap)) == NULL)
+    return false;
+  c->out = out;
+  c->out_cap = cap;
+  return true;
+}
+
+/* Appends RESPMSG to the output buffer of the connection C, for its I/O
+ * thread to send. May be called by any thread. If the buffer cannot grow to
+ * hold RESPMSG, it is dropped, and C is closed once the responses before it
+ * are sent. */
+static void connection_respond(struct connection *c, kvmessage_t *respmsg) {
+  size_t size;
+  pthread_mutex_lock(&c->write_lock);
+  size = kvmessage_encode(respmsg, c->out + c->out_len,
+      c->out_cap - c->out_len);
+  if (size > c->out_cap - c->out_len) {
+    if (!connection_reserve(c, size)) {
+      c->out_lost = true;
+      pthread_mutex_unlock(&c->write_lock);
+      return;
+    }
+    kvmessage_encode(respmsg, c->out + c->out_len, size);
+  }
+  c->out_len += size;
+  pthread_mutex_unlock(&c->write_lock);
+}
+
+/* Serves the request REQ for SERVER, then hands it back. A pipelined request
+ * is processed here, and its response left in the connection's output
+ * buffer, which the I/O thread sends once per iteration of its event loop
+ * along with the responses other workers left there meanwhile. It is freed
+ * by the I/O thread, which may still be comparing it with others. The
+ * response to a RESP command's request is left in REQ, for the I/O thread
+ * to write its reply in turn. */
+static void serve(server_t *server, struct request *req) {
+  struct connection *c = req->conn;
+  kvmessage_t respmsg;
+  if (c->resp && server->master) {
+    tpcmaster_process(&server->tpcmaster, req->reqmsg, &req->respmsg, NULL);
+  } else if (c->resp) {
+    kvserver_process(&server->kvserver, req->reqmsg, &req->respmsg);
+  } else if (req->pipelined) {
+    memset(&respmsg, 0, sizeof(kvmessage_t));
+    kvserver_process(&server->kvserver, req->reqmsg, &respmsg);
+    connection_respond(c, &respmsg);
+    kvmessage_release_value(&respmsg);
+    if (respmsg.type == INFO || respmsg.type == HOTKEYS)
+      free(respmsg.message);
+  } else if (server->master) {
+    handle_master(server, c->fd);
   } else {
-    handle_slave(server);
+    /* The handler takes ownership of the request. */
+    handle_slave(server, c->fd, req->reqmsg);
+    req->reqmsg = NULL;
   }
+  request_return(req);
+}
+
+/* Handles the requests queued for _SERVER's workers, until it is given a NULL
+ * request. */
+void *handle(void *_server) {
+  server_t *server = (server_t *) _server;
+  struct request *req;
+  while ((req = wq_pop(&server->wq)) != NULL)
+    serve(server, req);
   return NULL;
 }
 
+/* Disables Nagle's algorithm on socket SOCKFD. Every message is sent whole,
+ * with a single system call, so there are no small writes to coalesce, and
+ * holding back the last segment of a message only delays its answer. Unix
+ * domain sockets have no such algorithm, and ignore the call. */
+static void set_nodelay(int sockfd) {
+  int one = 1;
+  setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/* Fills ADDR with the address of the Unix domain socket at PATH. Returns 0
+ * if successful, else -1 if PATH is too long. */
+static int unix_address(struct sockaddr_un *addr, const char *path) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path))
+    return -1;
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+/* Connects to the Unix domain socket at PATH. Returns a socket fd which
+ * should be closed, else -1 if unsuccessful. */
+static int connect_to_unix(const char *path, int timeout) {
+  struct sockaddr_un addr;
+  int sockfd;
+  if (unix_address(&addr, path) < 0)
+    return -1;
+  if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return -1;
+  if (timeout > 0) {
+    struct timeval t;
+    t.tv_sec = timeout;
+    t.tv_usec = 0;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *) &t, sizeof(t));
+  }
+  if (connect(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    close(sockfd);
+    return -1;
+  }
+  return sockfd;
+}
+
 /* Connects to the host given at HOST:PORT using a TIMEOUT second timeout.
- * Returns a socket fd which should be closed, else -1 if unsuccessful. */
+ * If HOST is an absolute path, connects to the Unix domain socket there
+ * instead, and PORT is ignored. Returns a socket fd which should be closed,
+ * else -1 if unsuccessful. */
 int connect_to(const char *host, int port, int timeout) {
   struct sockaddr_in addr;
   struct hostent *ent;
   int sockfd;
 
-  sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (host[0] == '/')
+    return connect_to_unix(host, timeout);
   ent = gethostbyname(host);
   if (ent == NULL) {
     return -1;
   }
+  if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    return -1;
+  }
   bzero((char *) &addr, sizeof(addr));
   addr.sin_family = AF_INET;
   bcopy((char *)ent->h_addr, (char *)&addr.sin_addr.s_addr, ent->h_length);
@@ -84,32 +309,721 @@ int connect_to(const char *host, int port, int timeout) {
     setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *) &t, sizeof(t));
   }
   if (connect(sockfd,(struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    close(sockfd);
     return -1;
   }
+  set_nodelay(sockfd);
   return sockfd;
 }
 
-/* Runs SERVER such that it indefinitely (until server_stop is called) listens
- * for incoming requests at HOSTNAME:PORT. If CALLBACK is not NULL, makes a
- * call to CALLBACK with NULL as its parameter once SERVER is actively
- * listening for requests (this is for testing purposes).
+/* Pins itself to the core of the struct shard_worker ARG_, then handles the
+ * requests queued for its shard until it is given a NULL job. */
+static void *shard_worker(void *arg_) {
+  struct shard_worker *arg = (struct shard_worker *) arg_;
+  struct request *req;
+  cpu_set_t cpus;
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpus > 0) {
+    /* Best effort: an unpinned worker still keeps its sets to itself. */
+    CPU_ZERO(&cpus);
+    CPU_SET(arg->index % ncpus, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+  }
+  while ((req = wq_pop(&arg->server->shards[arg->index])) != NULL)
+    serve(arg->server, req);
+  return NULL;
+}
+
+/* Returns a request of the connection C, with room to decode a message, or
+ * NULL if memory could not be allocated. Spare requests are reused, so a
+ * connection allocates at most one per request it has in flight. */
+static struct request *request_get(struct connection *c) {
+  struct request *req = c->spare;
+  if (req != NULL) {
+    c->spare = req->next;
+  } else {
+    req = malloc(sizeof(struct request) + sizeof(kvmessage_buffer_t));
+    if (req == NULL)
+      return NULL;
+    req->storage = (kvmessage_buffer_t *) (req + 1);
+  }
+  req->conn = c;
+  req->reqmsg = NULL;
+  req->pipelined = false;
+  req->done = false;
+  memset(&req->respmsg, 0, sizeof(kvmessage_t));
+  req->prev = req->next = req->returned = NULL;
+  return req;
+}
+
+/* Frees the request of REQ, which request_get returned for the connection C,
+ * and keeps REQ for reuse. */
+static void request_put(struct connection *c, struct request *req) {
+  kvmessage_free(req->reqmsg);
+  req->reqmsg = NULL;
+  kvmessage_release_value(&req->respmsg);
+  /* Only the messages of these are allocated for the response. */
+  if (req->respmsg.type == INFO || req->respmsg.type == HOTKEYS)
+    free(req->respmsg.message);
+  LL_PREPEND(c->spare, req);
+}
+
+/* Re-arms the connection C of the reactor R, so that R hears of the next
+ * bytes to arrive on it if WANT_IN is set, and of room on its socket if its
+ * output is blocked. Returns false if it could not. */
+static bool connection_arm(struct reactor *r, struct connection *c, int op) {
+  struct epoll_event ev;
+  ev.events = EPOLLONESHOT;
+  if (c->want_in)
+    ev.events |= EPOLLIN | EPOLLRDHUP;
+  if (c->out_blocked)
+    ev.events |= EPOLLOUT;
+  ev.data.ptr = c;
+  return epoll_ctl(r->epfd, op, c->fd, &ev) == 0;
+}
+
+/* Adds the connection C of the reactor R to R's connections with responses
+ * to send, which are sent at the end of the current iteration. */
+static void connection_dirty(struct reactor *r, struct connection *c) {
+  if (!c->dirty) {
+    c->dirty = true;
+    LL_PREPEND2(r->dirty, c, next_dirty);
+  }
+}
+
+/* Closes the connection C of the reactor R, which no worker is serving. C is
+ * only freed at the end of the current iteration of the event loop, since
+ * events for it may still be pending. */
+static void connection_close(struct reactor *r, struct connection *c) {
+  DL_DELETE(r->conns, c);
+  epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  c->fd = -1;
+  if (c->held != NULL)
+    request_put(c, c->held);
+  c->held = NULL;
+  LL_PREPEND(r->closed, c);
+}
+
+/* Frees the connections which the reactor R closed. */
+static void reactor_reap(struct reactor *r) {
+  struct connection *c, *tmp;
+  struct request *req, *rtmp;
+  LL_FOREACH_SAFE(r->closed, c, tmp) {
+    LL_FOREACH_SAFE(c->spare, req, rtmp) {
+      free(req);
+    }
+    pthread_mutex_destroy(&c->write_lock);
+    free(c->in);
+    free(c->out);
+    free(c);
+  }
+  r->closed = NULL;
+}
+
+/* Starts watching the newly accepted socket SOCKFD from the reactor R. If
+ * RESP is set, the peer speaks RESP. */
+static void connection_open(struct reactor *r, int sockfd, bool resp) {
+  struct connection *c = calloc(1, sizeof(struct connection));
+  socklen_t len = sizeof(c->rcvbuf);
+  if (c == NULL) {
+    close(sockfd);
+    return;
+  }
+  /* RESP commands are all read into the read buffer. */
+  if (resp && (c->in = malloc(READ_BUFFER_SIZE)) == NULL) {
+    free(c);
+    close(sockfd);
+    return;
+  }
+  c->resp = resp;
+  c->in_cap = resp ? READ_BUFFER_SIZE : 0;
+  c->fd = sockfd;
+  c->reactor = r;
+  c->serial.conn = c;
+  c->last_active = now_ms();
+  c->want_in = true;
+  pthread_mutex_init(&c->write_lock, NULL);
+  /* The kernel reports twice the space it lets data use. */
+  if (getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &c->rcvbuf, &len) == 0)
+    c->rcvbuf /= 2;
+  set_nodelay(sockfd);
+  DL_APPEND(r->conns, c);
+  if (!connection_arm(r, c, EPOLL_CTL_ADD))
+    connection_close(r, c);
+}
+
+/* Queues the request REQ to the worker which is to serve it: in sharded
+ * mode, the worker owning KEY (the first one if KEY is NULL), else any. */
+static void request_queue(server_t *server, struct request *req,
+    const char *key) {
+  if (server->sharded && !server->master) {
+    wq_push(&server->shards[(key == NULL) ? 0
+        : kvhash(key) % server->max_threads], req);
+  } else {
+    wq_push(&server->wq, req);
+  }
+}
+
+/* Returns true if the requests A and B to SERVER may be served in either
+ * order: both are GETs, or they concern different keys. Other requests
+ * without a key are ordered with every request. A TPCMaster runs one commit
+ * at a time through its shared state, so there only GETs commute. */
+static bool requests_commute(server_t *server, kvmessage_t *a,
+    kvmessage_t *b) {
+  if (a->type == GETREQ && b->type == GETREQ)
+    return true;
+  if (server->master || a->key == NULL || b->key == NULL)
+    return false;
+  return strcmp(a->key, b->key) != 0;
+}
+
+/* Hands the unnumbered request REQ of the connection C to a worker. KEY is
+ * its key, if known. */
+static void connection_serve(server_t *server, struct connection *c,
+    struct request *req, const char *key) {
+  c->serving = true;
+  request_queue(server, req, key);
+}
+
+/* Writes the replies to the RESP commands of the connection C of the
+ * reactor R into its output buffer, in the order the commands arrived, up
+ * to the first request which is still being served, and then the error of
+ * a command which could not be read, once its turn comes. */
+static void connection_emit(struct reactor *r, struct connection *c) {
+  struct request *req;
+  size_t size;
+  pthread_mutex_lock(&c->write_lock);
+  while ((req = c->inflight) != NULL && req->done) {
+    resp_account(&c->tally, &req->part, &req->respmsg);
+    size = resp_encode(&c->tally, &req->part, &req->respmsg,
+        c->out + c->out_len, c->out_cap - c->out_len);
+    if (size > c->out_cap - c->out_len && connection_reserve(c, size))
+      resp_encode(&c->tally, &req->part, &req->respmsg, c->out + c->out_len,
+          size);
+    /* Once a reply is dropped, the following ones would answer the wrong
+       commands. */
+    if (size <= c->out_cap - c->out_len && !c->out_lost)
+      c->out_len += size;
+    else
+      c->out_lost = c->broken = true;
+    DL_DELETE(c->inflight, req);
+    c->pipelined--;
+    request_put(c, req);
+  }
+  if (c->rejected && c->inflight == NULL) {
+    c->rejected = false;
+    size = resp_encode_error(ERRMSG_INVALID_REQUEST, c->out + c->out_len,
+        c->out_cap - c->out_len);
+    if (size > c->out_cap - c->out_len && connection_reserve(c, size))
+      resp_encode_error(ERRMSG_INVALID_REQUEST, c->out + c->out_len, size);
+    if (size <= c->out_cap - c->out_len && !c->out_lost)
+      c->out_len += size;
+  }
+  pthread_mutex_unlock(&c->write_lock);
+  connection_dirty(r, c);
+}
+
+/* Hands the parsed request REQ of the connection C to a worker, if the
+ * requests of C in flight allow it to be served now, and returns true. Else
+ * returns false, and REQ is to be retried once some of them have been
+ * served. */
+static bool connection_start(server_t *server, struct connection *c,
+    struct request *req) {
+  kvmessage_t *reqmsg = req->reqmsg;
+  struct request *other;
+  /* Requests without an ID, and JSON ones, are answered in order, by the
+     handler itself, so only once the responses before them are sent. RESP
+     commands are answered in order too, but by the I/O thread, so they are
+     served alongside each other like numbered ones. */
+  if (!c->resp && (reqmsg->id == 0 || !reqmsg->binary)) {
+    if (c->pipelined > 0 || c->dirty || c->out_blocked)
+      return false;
+    connection_serve(server, c, req, reqmsg->key);
+    return true;
+  }
+  /* Stop serving a peer which does not read its responses. */
+  if (c->pipelined >= PIPELINE_DEPTH || c->out_blocked)
+    return false;
+  /* PING, and RESP commands which are not understood, need no serving. */
+  if (c->resp && reqmsg->type == RESP) {
+    req->respmsg.type = RESP;
+    req->respmsg.message = reqmsg->message;
+    req->done = true;
+  }
+  DL_FOREACH(c->inflight, other) {
+    if (!other->done && !req->done
+        && !requests_commute(server, other->reqmsg, reqmsg))
+      return false;
+  }
+  req->pipelined = true;
+  DL_APPEND(c->inflight, req);
+  c->pipelined++;
+  if (req->done)
+    connection_emit(c->reactor, c);
+  else
+    request_queue(server, req, reqmsg->key);
+  return true;
+}
+
+/* Rejects the request of the connection C which could not be parsed, and
+ * stops reading from C. */
+static void connection_reject(struct connection *c) {
+  kvmessage_t respmsg;
+  if (c->resp) {
+    c->rejected = true;
+    c->broken = true;
+    connection_emit(c->reactor, c);
+    return;
+  }
+  memset(&respmsg, 0, sizeof(kvmessage_t));
+  respmsg.type = RESP;
+  respmsg.message = ERRMSG_INVALID_REQUEST;
+  connection_respond(c, &respmsg);
+  connection_dirty(c->reactor, c);
+  c->broken = true;
+}
+
+/* Reads whatever has arrived on the connection C into its read buffer, with
+ * a single call, after making room for a request of SIZE bytes (or for a
+ * header, if SIZE is 0) at the start of the undecoded bytes. Returns false
+ * if nothing was read: nothing more has arrived, the peer closed its end, or
+ * there was an error. */
+static bool connection_fill(struct connection *c, long size) {
+  size_t need = (size > 0) ? (size_t) size : sizeof(kvheader_t);
+  size_t left = c->in_len - c->in_start;
+  ssize_t got;
+  char *in;
+  /* A short read emptied the socket, so the next read would only block. */
+  if (c->drained && !c->hup) {
+    c->drained = false;
+    return false;
+  }
+  if (c->in_start + need > c->in_cap) {
+    memmove(c->in, c->in + c->in_start, left);
+    c->in_start = 0;
+    c->in_len = left;
+  }
+  if (need > c->in_cap) {
+    if ((in = realloc(c->in, need)) == NULL) {
+      connection_reject(c);
+      return false;
+    }
+    c->in = in;
+    c->in_cap = need;
+  }
+  got = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, MSG_DONTWAIT);
+  if (got > 0) {
+    c->drained = (size_t) got < c->in_cap - c->in_len;
+    c->in_len += got;
+    c->last_active = now_ms();
+    return true;
+  }
+  if (got == 0)
+    c->hup = true;
+  else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    c->broken = true;
+  return false;
+}
+
+/* Returns the size of the request at the start of the undecoded bytes of
+ * the connection C, as kvmessage_frame_size does. The size of a RESP
+ * command is only known once all of it has arrived, so while the read
+ * buffer is full of only part of one, returns a larger size to make room
+ * for more of it. */
+static long connection_frame_size(struct connection *c) {
+  const char *data = c->in + c->in_start;
+  size_t left = c->in_len - c->in_start;
+  long size;
+  if (!c->resp)
+    return kvmessage_frame_size(data, left);
+  size = resp_frame_size(data, left);
+  if (size != 0 || c->in_len < c->in_cap)
+    return size;
+  if (2 * left <= RESP_MAX_FRAME)
+    return 2 * left;
+  return (left < RESP_MAX_FRAME) ? RESP_MAX_FRAME : -1;
+}
+
+/* Decodes the next request in the read buffer of the connection C into
+ * C->held, reading more of it first if it has not all been read. A RESP
+ * command stays in the buffer until it has been decoded into all of its
+ * requests. Returns false if no request could be decoded. */
+static bool connection_decode(struct connection *c) {
+  struct request *req;
+  bool last = true;
+  char *in;
+  long size = c->command;
+  while (c->cursor.part.parts == 0
+      && ((size = connection_frame_size(c)) == 0
+      || (size > 0 && (size_t) size > c->in_len - c->in_start))) {
+    if (!connection_fill(c, size))
+      return false;
+  }
+  if (size < 0) {
+    connection_reject(c);
+    return false;
+  }
+  if ((req = request_get(c)) == NULL) {
+    connection_reject(c);
+    return false;
+  }
+  if (c->resp) {
+    c->command = size;
+    last = resp_decode(&c->cursor, c->in + c->in_start, size, req->storage,
+        &req->part);
+    req->reqmsg = &req->storage->msg;
+  } else {
+    req->reqmsg = kvmessage_decode(c->in + c->in_start, size, req->storage);
+  }
+  if (req->reqmsg == NULL) {
+    request_put(c, req);
+    connection_reject(c);
+    return false;
+  }
+  c->held = req;
+  if (!last)
+    return true;
+  c->in_start += size;
+  if (c->in_start == c->in_len) {
+    c->in_start = c->in_len = 0;
+    /* Give back the room taken by an unusually large request. */
+    if (c->in_cap > READ_BUFFER_SIZE
+        && (in = realloc(c->in, READ_BUFFER_SIZE)) != NULL) {
+      c->in = in;
+      c->in_cap = READ_BUFFER_SIZE;
+    }
+  }
+  return true;
+}
+
+/* Hands the requests which have arrived on the connection C of the reactor R
+ * to workers, as far as their ordering allows, and then waits for more to
+ * arrive or for those in flight to be served. Closes C once its peer has
+ * closed it and all of its requests have been served.
  *
- * As given, this function will synchronously handle only a single request
- * at a time. It is your task to modify it such that it can handle up to
- * SERVER->max_threads jobs at a time asynchronously. */
-int server_run(const char *hostname, int port, server_t *server,
-               callback_t callback) {
+ * A request is only handed over once all of it has arrived. For a KVServer,
+ * a JSON request is parsed here in sharded mode, to find its key. Once a
+ * numbered binary request arrives on C, C's requests are all read into its
+ * read buffer, as many as have arrived at a time, and decoded from there.
+ * Other requests are left for the handler to read, an unnumbered binary one
+ * into its own buffer. */
+static void connection_pump(struct reactor *r, struct connection *c) {
+  server_t *server = r->server;
+  char key[MAX_KEYLEN + 1];
+  int avail, peeked = -1;
+  long size;
+  bool whole;
+  while (!c->serving && !c->broken) {
+    if (c->held != NULL) {
+      if (!connection_start(server, c, c->held))
+        return;
+      c->held = NULL;
+      continue;
+    }
+    if (c->in != NULL) {
+      if (!connection_decode(c))
+        break;
+      continue;
+    }
+    if (ioctl(c->fd, FIONREAD, &avail) < 0)
+      c->broken = true;
+    if (c->broken || avail == 0)
+      break;
+    c->last_active = now_ms();
+    size = kvmessage_peek_size(c->fd);
+    whole = size > 0 && avail >= size;
+    /* Once the peer has closed its end, whatever it sent is all there is. */
+    if (!whole && size >= 0 && size <= c->rcvbuf && !c->hup)
+      break;
+    if (whole && !server->master && kvmessage_peek_id(c->fd) > 0) {
+      if ((c->in = malloc(READ_BUFFER_SIZE)) == NULL)
+        connection_reject(c);
+      else
+        c->in_cap = READ_BUFFER_SIZE;
+    } else if (whole && server->sharded && !server->master
+        && (peeked = kvmessage_peek_key(c->fd, key)) < 0) {
+      /* The key of a JSON request can only be found by parsing it. */
+      if ((c->held = request_get(c)) == NULL
+          || (c->held->reqmsg = kvmessage_parse(c->fd)) == NULL)
+        connection_reject(c);
+    } else {
+      c->serial.reqmsg = NULL;
+      connection_serve(server, c, &c->serial,
+          (whole && peeked > 0) ? key : NULL);
+    }
+  }
+  if (c->serving)
+    return;
+  if (c->hup || c->broken) {
+    /* Once its responses are sent, connection_flush comes back to it. */
+    if (c->pipelined == 0 && !c->dirty && !c->out_blocked)
+      connection_close(r, c);
+    return;
+  }
+  c->want_in = true;
+  if (!connection_arm(r, c, EPOLL_CTL_MOD) && c->pipelined == 0)
+    connection_close(r, c);
+}
+
+/* Sends the responses in the output buffer of the connection C of the
+ * reactor R, as much of them as its socket takes, with a single call. If
+ * some are left, waits for room on the socket. Else carries on with C if it
+ * was waiting for them: to serve its next request, or to be closed. */
+static void connection_flush(struct reactor *r, struct connection *c) {
+  ssize_t sent;
+  size_t left;
+  char *out;
+  c->dirty = false;
+  if (c->fd < 0)
+    return;
+  pthread_mutex_lock(&c->write_lock);
+  /* The peer would wait forever for a response which was dropped. */
+  if (c->out_lost)
+    c->broken = true;
+  left = c->out_len - c->out_start;
+  if (left > 0) {
+    sent = send(c->fd, c->out + c->out_start, left,
+        MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent > 0) {
+      c->out_start += sent;
+      left -= sent;
+    } else if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+        && errno != EINTR) {
+      /* The peer is gone, and so are its responses. */
+      left = 0;
+      c->broken = true;
+    }
+  }
+  if (left == 0) {
+    c->out_start = c->out_len = 0;
+    if (c->out_cap > WRITE_BUFFER_SIZE
+        && (out = realloc(c->out, WRITE_BUFFER_SIZE)) != NULL) {
+      c->out = out;
+      c->out_cap = WRITE_BUFFER_SIZE;
+    }
+  }
+  pthread_mutex_unlock(&c->write_lock);
+  if ((c->out_blocked = (left > 0))) {
+    if (!connection_arm(r, c, EPOLL_CTL_MOD))
+      c->broken = true;
+    return;
+  }
+  if (!c->serving && (c->held != NULL || c->hup || c->broken))
+    connection_pump(r, c);
+}
+
+/* Handles EVENTS on the connection C of the reactor R. */
+static void connection_ready(struct reactor *r, struct connection *c,
+    uint32_t events) {
+  bool want_in = c->want_in;
+  if (c->fd < 0)
+    return;
+  /* Each event disarms C, until connection_arm is called again. */
+  c->want_in = false;
+  if (events & EPOLLOUT)
+    connection_flush(r, c);
+  if (c->fd < 0)
+    return;
+  if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+    c->hup = true;
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+    connection_pump(r, c);
+  } else if (want_in) {
+    c->want_in = true;
+    connection_arm(r, c, EPOLL_CTL_MOD);
+  }
+}
+
+/* Takes back the requests which the workers have served, and carries on
+ * with their connections. */
+static void reactor_collect(struct reactor *r) {
+  struct request *req, *tmp, *returned;
+  struct connection *c;
+  uint64_t count;
+  bool pipelined;
+  if (read(r->wakefd, &count, sizeof(count)) < 0) {
+    /* Nothing to read: another wakeup already collected them. */
+  }
+  pthread_mutex_lock(&r->lock);
+  returned = r->returned;
+  r->returned = NULL;
+  pthread_mutex_unlock(&r->lock);
+  LL_FOREACH_SAFE2(returned, req, tmp, returned) {
+    c = req->conn;
+    pipelined = req->pipelined;
+    if (c->resp) {
+      /* Its reply is written once those before it have been. */
+      req->done = true;
+      connection_emit(r, c);
+    } else if (pipelined) {
+      DL_DELETE(c->inflight, req);
+      c->pipelined--;
+      /* Its response waits in the output buffer. */
+      connection_dirty(r, c);
+      request_put(c, req);
+    } else {
+      c->serving = false;
+      if (req != &c->serial)
+        request_put(c, req);
+    }
+    /* A handler may leave whatever else the peer sent unread. */
+    if (!pipelined && c->hup && c->in == NULL) {
+      connection_close(r, c);
+      continue;
+    }
+    if (c->fd >= 0)
+      connection_pump(r, c);
+  }
+}
+
+/* Sends the responses which workers left for the connections of the reactor
+ * R during this iteration, with one call per connection. */
+static void reactor_flush(struct reactor *r) {
+  struct connection *c;
+  while ((c = r->dirty) != NULL) {
+    r->dirty = c->next_dirty;
+    connection_flush(r, c);
+  }
+}
+
+/* Closes the connections of the reactor R which have been idle for
+ * CONNECTION_IDLE_MS. */
+static void reactor_sweep(struct reactor *r, unsigned long now) {
+  struct connection *c, *tmp;
+  DL_FOREACH_SAFE(r->conns, c, tmp) {
+    if (!c->serving && c->pipelined == 0
+        && now - c->last_active >= CONNECTION_IDLE_MS)
+      connection_close(r, c);
+  }
+}
+
+/* Accepts the pending connections of the listening socket LISTENFD for the
+ * reactor R. If RESP is set, LISTENFD is the RESP listener. */
+static void reactor_accept(struct reactor *r, int listenfd, bool resp) {
+  int sockfd;
+  while ((sockfd = accept(listenfd, NULL, NULL)) >= 0)
+    connection_open(r, sockfd, resp);
+}
+
+/* Runs the event loop of the reactor ARG_ until server_stop is called. */
+static void *reactor_run(void *arg_) {
+  struct reactor *r = (struct reactor *) arg_;
+  struct epoll_event events[REACTOR_EVENTS];
+  unsigned long now, last_sweep = now_ms();
+  int i, n;
+  while (r->server->listening) {
+    /* Wake up every TIMEOUT ms, so that server_stop is noticed. */
+    n = epoll_wait(r->epfd, events, REACTOR_EVENTS, TIMEOUT);
+    for (i = 0; i < n && r->server->listening; i++) {
+      if (events[i].data.ptr == NULL) {
+        reactor_accept(r, r->listenfd, false);
+      } else if (events[i].data.ptr == &r->server->unix_fd) {
+        reactor_accept(r, r->server->unix_fd, false);
+      } else if (events[i].data.ptr == &r->server->resp_fd) {
+        reactor_accept(r, r->server->resp_fd, true);
+      } else if (events[i].data.ptr == r) {
+        reactor_collect(r);
+      } else {
+        connection_ready(r, events[i].data.ptr, events[i].events);
+      }
+    }
+    now = now_ms();
+    if (now - last_sweep >= SWEEP_INTERVAL) {
+      reactor_sweep(r, now);
+      last_sweep = now;
+    }
+    reactor_flush(r);
+    reactor_reap(r);
+  }
+  return NULL;
+}
+
+/* Watches the listening socket LISTENFD from the reactor R, its events
+ * told apart by DATA. If SHARED is set, the other I/O threads watch it
+ * too. */
+static void reactor_listen(struct reactor *r, int listenfd, void *data,
+    bool shared) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+  /* Only wake one of the I/O threads sharing the socket per incoming
+     connection. */
+  if (shared)
+    ev.events |= EPOLLEXCLUSIVE;
+#endif
+  ev.data.ptr = data;
+  epoll_ctl(r->epfd, EPOLL_CTL_ADD, listenfd, &ev);
+}
+
+/* Sets up the reactor R of SERVER, watching the listening socket LISTENFD,
+ * SERVER's Unix domain socket and RESP listener if it has them, and its own
+ * wakeup eventfd. Returns 0 if successful, else -1. */
+static int reactor_init(struct reactor *r, server_t *server, int listenfd) {
+  struct epoll_event ev;
+  r->server = server;
+  r->listenfd = listenfd;
+  r->returned = NULL;
+  r->conns = r->closed = r->dirty = NULL;
+  if ((r->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    return -1;
+  if ((r->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    close(r->epfd);
+    return -1;
+  }
+  pthread_mutex_init(&r->lock, NULL);
+  reactor_listen(r, listenfd, NULL, !server->reuseport);
+  if (server->unix_path != NULL)
+    reactor_listen(r, server->unix_fd, &server->unix_fd, true);
+  if (server->resp_port > 0)
+    reactor_listen(r, server->resp_fd, &server->resp_fd, true);
+  ev.events = EPOLLIN;
+  ev.data.ptr = r;
+  epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &ev);
+  return 0;
+}
+
+/* Closes every connection of the reactor R, once no worker is left, and
+ * releases R. */
+static void reactor_destroy(struct reactor *r) {
+  struct connection *c, *tmp;
+  struct request *req, *rtmp;
+  LL_FOREACH_SAFE2(r->returned, req, rtmp, returned) {
+    if (req->pipelined)
+      DL_DELETE(req->conn->inflight, req);
+    if (req != &req->conn->serial)
+      request_put(req->conn, req);
+  }
+  DL_FOREACH_SAFE(r->conns, c, tmp) {
+    /* Replies to RESP commands which will not be written now. */
+    DL_FOREACH_SAFE(c->inflight, req, rtmp) {
+      DL_DELETE(c->inflight, req);
+      request_put(c, req);
+    }
+    connection_close(r, c);
+  }
+  reactor_reap(r);
+  /* SERVER's own socket is closed by server_stop. */
+  if (r->listenfd != r->server->sockfd)
+    close(r->listenfd);
+  close(r->wakefd);
+  close(r->epfd);
+  pthread_mutex_destroy(&r->lock);
+}
+
+/* Returns the number of I/O threads of SERVER. */
+static int io_thread_count(server_t *server) {
+  return (server->io_threads > 0) ? server->io_threads : 1;
+}
+
+/* Returns a new non-blocking socket listening on PORT, sharing the port with
+ * other sockets of the process if REUSEPORT is set. Exits the process if it
+ * cannot. */
+static int open_listener(int port, int reuseport) {
   int sock_fd, socket_option;
   struct sockaddr_in client_address;
-  size_t client_address_length = sizeof(client_address);
-  wq_init(&server->wq);
-  server->listening = 1;
-  server->port = port;
-  server->hostname = (char *) malloc(strlen(hostname) + 1);
-  strcpy(server->hostname, hostname);
 
   sock_fd = socket(PF_INET, SOCK_STREAM, 0);
-  server->sockfd = sock_fd;
   if (sock_fd == -1) {
     fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno,
         strerror(errno));
@@ -117,7 +1031,9 @@ int server_run(const char *hostname, int port, server_t *server,
   }
   socket_option = 1;
   if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &socket_option,
-      sizeof(socket_option)) == -1) {
+      sizeof(socket_option)) == -1
+      || (reuseport && setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT,
+      &socket_option, sizeof(socket_option)) == -1)) {
     fprintf(stderr, "Failed to set socket options: error %d: %s\n", errno,
         strerror(errno));
     exit(errno);
@@ -138,55 +1054,146 @@ int server_run(const char *hostname, int port, server_t *server,
         strerror(errno));
     exit(errno);
   }
+  /* The I/O threads accept from it without blocking. */
+  fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK);
+  return sock_fd;
+}
+
+/* Returns a new non-blocking socket listening at the path PATH, replacing
+ * any socket left there by an earlier run. Exits the process if it cannot. */
+static int open_unix_listener(const char *path) {
+  struct sockaddr_un addr;
+  int sock_fd;
+
+  if (unix_address(&addr, path) < 0) {
+    fprintf(stderr, "Unix domain socket path too long: %s\n", path);
+    exit(ENAMETOOLONG);
+  }
+  sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock_fd == -1) {
+    fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno,
+        strerror(errno));
+    exit(errno);
+  }
+  unlink(path);
+  if (bind(sock_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    fprintf(stderr, "Failed to bind on socket: error %d: %s\n", errno, strerror(errno));
+    exit(errno);
+  }
+  if (listen(sock_fd, 1024) == -1) {
+    fprintf(stderr, "Failed to listen on socket: error %d: %s\n", errno,
+        strerror(errno));
+    exit(errno);
+  }
+  fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK);
+  return sock_fd;
+}
+
+/* Runs SERVER such that it indefinitely (until server_stop is called) listens
+ * for incoming requests at HOSTNAME:PORT. If CALLBACK is not NULL, makes a
+ * call to CALLBACK with NULL as its parameter once SERVER is actively
+ * listening for requests (this is for testing purposes). If
+ * SERVER->unix_path is not NULL, SERVER also listens on a Unix domain socket
+ * at that path, and if SERVER->resp_port is not 0, for RESP commands on that
+ * port.
+ *
+ * SERVER->io_threads threads (at least one) run event loops accepting and
+ * watching connections, and SERVER->max_threads workers handle the requests
+ * which arrive on them. */
+int server_run(const char *hostname, int port, server_t *server,
+               callback_t callback) {
+  int sock_fd;
+  wq_init(&server->wq);
+  server->listening = 1;
+  server->port = port;
+  server->hostname = (char *) malloc(strlen(hostname) + 1);
+  strcpy(server->hostname, hostname);
+
+  int i, io_threads = io_thread_count(server);
+  sock_fd = open_listener(port, server->reuseport);
+  server->sockfd = sock_fd;
+  /* With REUSEPORT, the other I/O threads get listening sockets of their
+     own, bound to the same port, and the kernel spreads connections across
+     them. */
+  server->listeners = malloc(io_threads * sizeof(int));
+  server->listeners[0] = sock_fd;
+  for (i = 1; i < io_threads; i++)
+    server->listeners[i] = server->reuseport ? open_listener(port, 1) : sock_fd;
+  if (server->unix_path != NULL)
+    server->unix_fd = open_unix_listener(server->unix_path);
+  if (server->resp_port > 0)
+    server->resp_fd = open_listener(server->resp_port, 0);
 
   if (callback != NULL){
     callback(NULL);
   }
 
-  // OUR CODE HERE: initializing argument struct for helper thread function for pool thread.
-  struct server_helper *server_helper_ptr =
-      (struct server_helper *) malloc(sizeof(struct server_helper));
-  server_helper_ptr->server = server;
-  server_helper_ptr->sock_fd = sock_fd;
-  server_helper_ptr->client_address = client_address;
-  server_helper_ptr->client_address_length = client_address_length;
-
-  pthread_t *threads = (pthread_t *) malloc(server->max_threads * sizeof(pthread_t));
-  int i;
-  for (i = 0; i < server->max_threads; i++) {
-    pthread_create(&threads[i], NULL, server_run_helper, server_helper_ptr);
+  // OUR CODE HERE: the I/O threads accept and watch connections, and hand
+  // their requests to a pool of worker threads.
+  pthread_t *workers = malloc(server->max_threads * sizeof(pthread_t));
+  struct shard_worker *args = NULL;
+  struct reactor *reactors = malloc(io_threads * sizeof(struct reactor));
+  if (server->sharded && !server->master) {
+    args = malloc(server->max_threads * sizeof(struct shard_worker));
+    server->shards = malloc(server->max_threads * sizeof(wq_t));
+    for (i = 0; i < server->max_threads; i++) {
+      wq_init(&server->shards[i]);
+      args[i].server = server;
+      args[i].index = i;
+      pthread_create(&workers[i], NULL, shard_worker, &args[i]);
+    }
+  } else {
+    for (i = 0; i < server->max_threads; i++)
+      pthread_create(&workers[i], NULL, handle, server);
+  }
+  for (i = 0; i < io_threads; i++) {
+    if (reactor_init(&reactors[i], server, server->listeners[i]) < 0) {
+      fprintf(stderr, "Failed to start an event loop: error %d: %s\n", errno,
+          strerror(errno));
+      exit(errno);
+    }
+    pthread_create(&reactors[i].thread, NULL, reactor_run, &reactors[i]);
   }
-  // wait for all threads to terminate, then we can free our server_helper_ptr
-  for (i = 0; i < server->max_threads; i++) {
-    pthread_join(threads[i], NULL);
+  for (i = 0; i < io_threads; i++)
+    pthread_join(reactors[i].thread, NULL);
+  /* A NULL connection tells a worker that no more requests will come. */
+  for (i = 0; i < server->max_threads; i++)
+    wq_push(args ? &server->shards[i] : &server->wq, NULL);
+  for (i = 0; i < server->max_threads; i++)
+    pthread_join(workers[i], NULL);
+  for (i = 0; i < io_threads; i++)
+    reactor_destroy(&reactors[i]);
+  if (args != NULL) {
+    free(server->shards);
+    free(args);
   }
-  free(server_helper_ptr);
-  free(threads);
+  free(reactors);
+  free(workers);
+  free(server->listeners);
 
   shutdown(sock_fd, SHUT_RDWR);
   close(sock_fd);
   return 0;
 }
 
-/* Helper function to allow a thread to serve client requests on the server
-   found in server_run. All necessary arguments are found in the server_helper struct. */
-static void* server_run_helper(void *arg_) {
-  // OUR CODE HERE
-  struct server_helper *arg = (struct server_helper *) arg_;
-  while (arg->server->listening) {
-    int client_sock = accept(arg->sock_fd, (struct sockaddr *) &arg->client_address,
-        (socklen_t *) &arg->client_address_length);
-    if (client_sock > 0) {
-      wq_push(&arg->server->wq, (void *) (intptr_t) client_sock);
-      handle(arg->server);
-    }
-  }
-  pthread_exit(0);
-}
-
 /* Stops SERVER from continuing to listen for incoming requests. */
 void server_stop(server_t *server) {
+  int i;
   server->listening = 0;
+  /* Leave the port's group of sockets right away, so that a server started
+     on the port next does not share connections with this one. The I/O
+     threads close their sockets as they exit. */
+  for (i = 1; server->reuseport && i < io_thread_count(server); i++)
+    shutdown(server->listeners[i], SHUT_RDWR);
   shutdown(server->sockfd, SHUT_RDWR);
   close(server->sockfd);
+  if (server->unix_path != NULL) {
+    shutdown(server->unix_fd, SHUT_RDWR);
+    close(server->unix_fd);
+    unlink(server->unix_path);
+  }
+  if (server->resp_port > 0) {
+    shutdown(server->resp_fd, SHUT_RDWR);
+    close(server->resp_fd);
+  }
 }
@@ -15,9 +15,116 @@
  *
  * The server struct stores extra information on top of the stored TPCMaster or
  * KVServer.
+ *
+ * By default, any of a server's threads may handle any request, so the cache
+ * sets (and their locks) of a KVServer move between cores as requests for
+ * their keys land on different threads. A KVServer can instead be run in
+ * sharded mode, by setting SHARDED. The server then runs MAX_THREADS workers,
+ * each pinned to a core and owning the cache sets whose index is equal to its
+ * own modulo MAX_THREADS. Each request is queued to the worker owning its
+ * key (kvhash(key) % MAX_THREADS), so that a cache set is only ever written,
+ * and its lock only ever taken, by the same core, and both stay in that
+ * core's caches. For this to hold, the KVServer's number of cache sets must
+ * be a multiple of MAX_THREADS. Requests without a key go to the first
+ * worker.
+ *
+ * Connections are persistent, and are served by an event loop rather than by
+ * a thread each. SERVER->io_threads I/O threads (one if 0) each run an epoll
+ * loop: they accept connections from the listening socket without blocking,
+ * and watch the connections they accepted. Once a whole request (its size
+ * header and the bytes it announces) is buffered on a connection, the
+ * connection is handed to a worker, which handles that one request and hands
+ * the connection back. On a connection without a read buffer (see below),
+ * the handler reads the request and writes the response itself, with
+ * blocking calls, but the request is already there to be read. On a
+ * buffered connection, the I/O thread has already read and parsed the
+ * request: the handler is passed it parsed, and only writes the response of
+ * an unnumbered request itself. The response to a pipelined request or a
+ * RESP command is left for the I/O thread to send (see below), so the
+ * worker never waits on such a socket. An idle connection thus costs a file
+ * descriptor and a few bytes rather than a thread, so thousands of clients
+ * may keep theirs open. A connection is closed once the peer closes it, or
+ * once it stays idle for CONNECTION_IDLE_MS.
+ *
+ * By default the I/O threads accept from the one listening socket, and
+ * contend on its accept queue. With REUSEPORT set, each I/O thread instead
+ * listens on a socket of its own, all bound to the same port with
+ * SO_REUSEPORT, and the kernel spreads incoming connections across them by
+ * a hash of their addresses. Connections are then accepted on all cores at
+ * once without sharing a queue, which pairs with sharded mode: each core
+ * accepts and reads its share of connections, and hands each request to
+ * the core owning its key.
+ *
+ * Clients on the same host may skip the TCP stack: with UNIX_PATH set, the
+ * server also listens on a Unix domain socket at that path, whose
+ * connections the I/O threads accept and serve like any other. connect_to
+ * connects to such a socket when given its path (anything starting with a
+ * '/') as the host.
+ *
+ * With RESP_PORT set, the server also listens on that port for clients
+ * speaking the protocol of Redis (see resp.h), so that Redis clients and
+ * load generators can be pointed at it. Its connections are read into a
+ * read buffer from the start, and each command is expanded into the
+ * requests it stands for, which are served alongside each other, out of
+ * order, like numbered binary requests (MGET of several keys thus fetches
+ * them in parallel) and by the same handlers: kvserver_process for a
+ * KVServer, tpcmaster_process for a TPC Master. A TPC Master runs one
+ * commit at a time, so it only serves GETs alongside each other, and serves
+ * the writes a command stands for (MSET or DEL of several keys) one after
+ * the other. Since Redis clients expect their replies in order, workers
+ * leave each response with its request, and the I/O thread writes the
+ * replies into the output buffer as the commands they answer come to be
+ * first in line.
+ *
+ * Requests without an ID (see kvmessage.h) are served one at a time per
+ * connection, in order: the next one is only handed over once the previous
+ * one has been answered. A KVServer serves binary requests with an ID out of
+ * order: the I/O thread parses them as they arrive and hands each to a
+ * worker right away, up to PIPELINE_DEPTH per connection, so that a GET
+ * which hits the cache is answered while another one waits for the store. A
+ * request is held back, along with every request after it, while an earlier
+ * request of the same connection which it does not commute with is in
+ * flight: one for the same key, or where either has no key, unless both are
+ * GETs. Writes to a key thus apply in the order they were sent, and a GET
+ * sees the writes sent before it. An unnumbered request waits for all those
+ * before it, and for their responses to be sent. Workers leave the responses
+ * to pipelined requests in an output buffer of their connection rather than
+ * sending them, and the I/O thread sends all those a connection gathered
+ * with a single call per iteration of its event loop. A response which finds
+ * the buffer waiting for the socket to drain simply adds to it, and while it
+ * waits no further requests of the connection are started, so a peer which
+ * does not read its responses cannot make the buffer grow without bound. All
+ * sockets, the server's and those of connect_to, have Nagle's algorithm
+ * disabled, since messages are sent whole. JSON requests, whose ID could
+ * only be found by parsing them, are served in order, as are all requests to
+ * a TPC Master.
+ *
+ * From its first numbered binary request on, a connection to a KVServer gets
+ * a read buffer of its own. Each read takes as many bytes as have arrived
+ * and fit there, and the I/O thread decodes every whole request they hold
+ * before reading again, so a batch of pipelined requests costs a single
+ * system call rather than several per request. A request which arrives in
+ * pieces stays in the buffer until the rest of it is read. The buffer only
+ * grows to hold a single request larger than it (up to KVMESSAGE_MAX_FRAME),
+ * and shrinks back once that request is decoded. Requests are decoded into
+ * storage which is reused once they have been served, so a steady stream of
+ * small requests allocates nothing. Every request of such a connection is
+ * then passed to its handler parsed.
+ *
+ * In sharded mode, the I/O thread finds the worker owning the key of each
+ * request. It peeks at the key of a binary request, which the worker then
+ * parses without allocating, and parses a JSON request itself, passing it to
+ * the handler parsed.
  */
 
-void *handle(void *_kvserver);
+/* The number of ms a persistent connection may stay idle before the server
+ * closes it. */
+#define CONNECTION_IDLE_MS 30000
+
+/* The maximum number of pipelined requests of a connection in flight. */
+#define PIPELINE_DEPTH 64
+
+void *handle(void *_server);
 
 typedef struct server {
   int master;               /* 1 if this server represents a TPC Master, else 0. */
@@ -27,6 +134,15 @@ typedef struct server {
   int port;                 /* The port this server will listen on. */
   char *hostname;           /* The hostname this server will listen on. */
   wq_t wq;                  /* The work queue this server will use to process jobs. */
+  int io_threads;           /* The number of threads running event loops, or 0 for 1. */
+  int reuseport;            /* 1 if each I/O thread has a listening socket of its own, else 0. */
+  int *listeners;           /* The listening socket of each I/O thread. */
+  char *unix_path;          /* The path of a Unix domain socket to listen on as well, or NULL. */
+  int unix_fd;              /* The Unix domain socket listening at UNIX_PATH. */
+  int resp_port;            /* The port to listen on for RESP commands as well, or 0. */
+  int resp_fd;              /* The socket listening on RESP_PORT. */
+  int sharded;              /* 1 if requests are steered to per-core workers by key, else 0. */
+  wq_t *shards;             /* The work queue of each worker, in sharded mode. */
   union {                   /* The kvserver OR tpcmaster this server represents. */
     kvserver_t kvserver;
     tpcmaster_t tpcmaster;
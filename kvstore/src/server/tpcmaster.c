@@ -7,6 +7,7 @@
 #include "socket_server.h"
 #include "time.h"
 #include "tpcmaster.h"
+#include "kvhash.h"
 
 // OUR CODE HERE
 #include <stdlib.h>
@@ -20,12 +21,23 @@ static int port_cmp(tpcslave_t *a, tpcslave_t *b);
 static void sort_slaves_list(tpcmaster_t *master, bool force_sort);
 static void update_check_master_state(tpcmaster_t *master);
 static int copy_and_store_kvmessage(tpcmaster_t *master, kvmessage_t *msg);
+static int error_code(char *msg);
+static int load_from_slaves(void *arg, char *key, kvvalue_t **value);
+
+/* The arguments of load_from_slaves. */
+struct slave_load {
+  tpcmaster_t *master;
+  kvmessage_t *reqmsg;          /* The GET request to forward. */
+};
 
 static void phase1(tpcmaster_t *master, tpcslave_t *slave,
                    kvmessage_t *reqmsg, callback_t callback);
 
 static void phase2(tpcslave_t *slave, kvmessage_t *reqmsg, callback_t callback);
 
+static kvmessage_t *slave_call(tpcslave_t *slave, kvmessage_t *reqmsg,
+    bool *connected);
+
 /* Initializes a tpcmaster. Will return 0 if successful, or a negative error
  * code if not. SLAVE_CAPACITY indicates the maximum number of slaves that
  * the master will support. REDUNDANCY is the number of replicas (slaves) that
@@ -33,9 +45,26 @@ static void phase2(tpcslave_t *slave, kvmessage_t *reqmsg, callback_t callback);
  * each with ELEM_PER_SET elements. */
 int tpcmaster_init(tpcmaster_t *master, unsigned int slave_capacity,
     unsigned int redundancy, unsigned int num_sets, unsigned int elem_per_set) {
+  return tpcmaster_init_policy(master, slave_capacity, redundancy, num_sets,
+      elem_per_set, CACHE_SECOND_CHANCE);
+}
+
+/* Initializes a tpcmaster like tpcmaster_init, but the sets of its cache will
+ * evict entries using POLICY (see kvcache.h). */
+int tpcmaster_init_policy(tpcmaster_t *master, unsigned int slave_capacity,
+    unsigned int redundancy, unsigned int num_sets, unsigned int elem_per_set,
+    cache_policy_t policy) {
   int ret;
-  ret = kvcache_init(&master->cache, num_sets, elem_per_set);
+  ret = kvcache_init_policy(&master->cache, num_sets, elem_per_set, policy);
   if (ret < 0) return ret;
+  ret = singleflight_init(&master->inflight);
+  if (ret != 0) return -1;
+  ret = hotkeys_init(&master->hotkeys, HOTKEYS_SAMPLE);
+  if (ret != 0) return -1;
+  master->versions = calloc(MASTER_VERSION_SLOTS, sizeof(tpcversion_t));
+  if (master->versions == NULL) return -1;
+  master->commit_seq = 0;
+  master->admit = ADMIT_ALWAYS;
   ret = pthread_rwlock_init(&master->slave_lock, NULL);
   if (ret < 0) return ret;
   master->slave_count = 0;
@@ -153,6 +182,8 @@ void tpcmaster_register(tpcmaster_t *master, kvmessage_t *reqmsg, kvmessage_t *r
   if (*ptr) // check for unsuccessful conversion
     goto free_slave_host;
   slave->port = num;
+  pthread_mutex_init(&slave->pool_lock, NULL);
+  slave->pooled = 0;
 
   CDL_PREPEND(master->slaves_head, slave);
   sort_slaves_list(master, true);
@@ -241,76 +272,77 @@ void tpcmaster_handle_get(tpcmaster_t *master, kvmessage_t *reqmsg,
     return;
   }
 
-  char *value;
-  kvmessage_t *received_response;
-  pthread_rwlock_t *lock = kvcache_getlock(&master->cache, reqmsg->key);
-  pthread_rwlock_rdlock(lock);
-  if (kvcache_get(&master->cache, reqmsg->key, &value) == 0) {
-    pthread_rwlock_unlock(lock);
-    if ((respmsg->key = (char *) malloc(sizeof(char) * (strlen(reqmsg->key) + 1))) == NULL) {
-      goto generic_error;
-    }
-    strcpy(respmsg->key, reqmsg->key);
-    if ((respmsg->value = (char *) malloc(sizeof(char) * (strlen(value) + 1))) == NULL) {
-      goto generic_error;
-    }
-    strcpy(respmsg->value, value);
-    free(value); // we malloc()-ed the value, so we have to free it
-    respmsg->type = GETRESP;
-  } else {
-    pthread_rwlock_unlock(lock);
-    tpcslave_t *slave = tpcmaster_get_primary(master, reqmsg->key);
-    bool successful_connection = false;
-    int i, fd;
-    for (i = 0; i < master->redundancy; i++) {
-      if ((fd = connect_to(slave->host, slave->port, TIMEOUT_SECONDS)) == -1) {
-        slave = tpcmaster_get_successor(master, slave);
-      } else {
-        successful_connection = true;
-        break;
-      }
-    }
-    if (!successful_connection)
-      goto generic_error;
-
-    kvmessage_send(reqmsg, fd);
-    received_response = kvmessage_parse(fd);
-    close(fd);
-    if (received_response == NULL) {
-      goto generic_error;
-    }
-
-    if (received_response->type != GETRESP) { // errored out
-      respmsg->type = RESP;
-      respmsg->message = received_response->message;
-    } else {
-      respmsg->key = (char *) malloc(sizeof(char) * (strlen(received_response->key) + 1));
-      respmsg->value = (char *) malloc(sizeof(char) * (strlen(received_response->value) + 1));
-      if (respmsg->key == NULL || respmsg->value == NULL) {
-        goto free_fields;
-      }
-      strcpy(respmsg->key, received_response->key);
-      strcpy(respmsg->value, received_response->value);
-      respmsg->type = received_response->type; // GETRESP
-      respmsg->message = MSG_SUCCESS;
-      pthread_rwlock_wrlock(lock);
-      kvcache_put(&master->cache, respmsg->key, respmsg->value);
-      pthread_rwlock_unlock(lock);
-    }
-    free(received_response);
+  struct slave_load load = {master, reqmsg};
+  hotkeys_record(&master->hotkeys, reqmsg->key);
+  if (kvcache_getlock(&master->cache, reqmsg->key) == NULL) {
+    error = ERRKEYLEN;
+    goto generic_error;
   }
-
+  if ((error = kvcache_get_ref(&master->cache, reqmsg->key,
+      &respmsg->valref)) == ERRNEGKEY) {
+    error = ERRNOKEY;
+    goto generic_error;
+  } else if (error != 0 && (error = singleflight_do(&master->inflight,
+      reqmsg->key, load_from_slaves, &load, &respmsg->valref)) != 0) {
+    goto generic_error;
+  }
+  /* Hand out the cached value itself; the reference is released once the
+     response has been sent. */
+  respmsg->key = reqmsg->key;
+  respmsg->value = respmsg->valref->data;
+  respmsg->type = GETRESP;
   return;
 
-  free_fields:
-    free(received_response);
-    free(respmsg->key);
-    free(respmsg->value);
   generic_error:
     respmsg->type = RESP;
     respmsg->message = GETMSG(error);
 }
 
+/* Fetches KEY from the slaves responsible for it after a miss in the master's
+ * cache, caches it, and stores a reference to the value in VALUE. ARG is the
+ * struct slave_load describing the request. Used with singleflight_do, so
+ * that concurrent misses on the same key share one slave round trip. A key
+ * the slaves do not have is cached as a negative entry. Nothing is cached if
+ * a commit of KEY raced with the read (see tpcmaster_fill). Returns 0 if
+ * successful, else a negative error code. */
+static int load_from_slaves(void *arg, char *key, kvvalue_t **value) {
+  tpcmaster_t *master = ((struct slave_load *) arg)->master;
+  kvmessage_t *reqmsg = ((struct slave_load *) arg)->reqmsg, *received_response;
+  tpcslave_t *slave;
+  unsigned long since;
+  int i, ret;
+
+  kvcache_resize_step(&master->cache, CACHE_RESIZE_STEP);
+  /* A previous load may have finished between the miss and this call. */
+  if ((ret = kvcache_get_ref(&master->cache, key, value)) == 0)
+    return 0;
+  if (ret == ERRNEGKEY)
+    return ERRNOKEY;
+  ret = 0;
+  since = tpcmaster_version(master);
+  slave = tpcmaster_get_primary(master, key);
+  received_response = NULL;
+  for (i = 0; i < master->redundancy && received_response == NULL; i++) {
+    received_response = slave_call(slave, reqmsg, NULL);
+    slave = tpcmaster_get_successor(master, slave);
+  }
+  if (received_response == NULL)
+    return -1;
+
+  if (received_response->type != GETRESP || received_response->value == NULL) { // errored out
+    if ((ret = error_code(received_response->message)) == ERRNOKEY)
+      tpcmaster_fill(master, key, NULL, since);
+  } else if ((*value = kvvalue_new(received_response->value)) == NULL) {
+    ret = -1;
+  } else {
+    /* The value is copied once into a shared buffer, which is both cached
+       and used for the responses. */
+    tpcmaster_fill(master, key, *value, since);
+  }
+  kvmessage_free(received_response);
+  return ret;
+}
+
 /* Handles an incoming TPC request REQMSG, and populates the appropriate fields
  * of RESPMSG as a response. RESPMSG and REQMSG both must point to valid
  * kvmessage_t structs. Implements the TPC algorithm, polling all the slaves
@@ -344,6 +376,7 @@ void tpcmaster_handle_tpc(tpcmaster_t *master, kvmessage_t *reqmsg,
   }
 
   /* Phase 1 of TPC being set up and executed here. */
+  tpcmaster_write_begin(master, reqmsg->key);
   tpcslave_t *primary = tpcmaster_get_primary(master, reqmsg->key);
   tpcslave_t *iter = primary;
   master->state = TPC_COMMIT; // initialized here, will be updated if a server fails
@@ -360,11 +393,12 @@ void tpcmaster_handle_tpc(tpcmaster_t *master, kvmessage_t *reqmsg,
 
   /* Have to mess with master's cache if we commit. */
   if (master->state == TPC_COMMIT) {
-    pthread_rwlock_t *lock = kvcache_getlock(&master->cache, reqmsg->key);
+    kvcache_resize_step(&master->cache, CACHE_RESIZE_STEP);
+    pthread_rwlock_t *lock = kvcache_wrlock(&master->cache, reqmsg->key);
     if (lock != NULL) {
-      pthread_rwlock_wrlock(lock);
       if (reqmsg->type == PUTREQ) {
-        kvcache_put(&master->cache, reqmsg->key, reqmsg->value);
+        kvcache_put_admit(&master->cache, reqmsg->key, reqmsg->value,
+            (reqmsg->admit != ADMIT_DEFAULT) ? reqmsg->admit : master->admit);
       } else { // DELREQ is only other option
         kvcache_del(&master->cache, reqmsg->key);
       }
@@ -383,6 +417,7 @@ void tpcmaster_handle_tpc(tpcmaster_t *master, kvmessage_t *reqmsg,
     phase2(iter, &globalmsg, callback);
     iter = tpcmaster_get_successor(master, iter);
   }
+  tpcmaster_write_end(master, reqmsg->key);
 
   respmsg->type = RESP;
   respmsg->message = (master->state == TPC_COMMIT) ? MSG_SUCCESS : master->err_msg;
@@ -406,6 +441,7 @@ void tpcmaster_info(tpcmaster_t *master, kvmessage_t *reqmsg,
   }
   respmsg->type = INFO;
   char buf[256];
+  int fd;
   char *info = (char *) malloc((master->slave_count * MAX_INFOLINE_LENGTH + 256) * sizeof(char));
   if (info == NULL) {
     respmsg->type = RESP;
@@ -418,7 +454,8 @@ void tpcmaster_info(tpcmaster_t *master, kvmessage_t *reqmsg,
   tpcslave_t *elt;
   pthread_rwlock_rdlock(&master->slave_lock);
   CDL_FOREACH(master->slaves_head, elt) {
-    if (connect_to(elt->host, elt->port, TIMEOUT_SECONDS) != -1) {
+    if ((fd = connect_to(elt->host, elt->port, TIMEOUT_SECONDS)) != -1) {
+      close(fd);
       sprintf(buf, "\n{%s, %d}", elt->host, elt->port);
       strcat(info, buf);
     }
@@ -427,42 +464,120 @@ void tpcmaster_info(tpcmaster_t *master, kvmessage_t *reqmsg,
   respmsg->message = info;
 }
 
-/* Generic entrypoint for this MASTER. Takes in a socket on SOCKFD, which
- * should already be connected to an incoming request. Processes the request
- * and sends back a response message.  This should call out to the appropriate
- * internal handler. */
-void tpcmaster_handle(tpcmaster_t *master, int sockfd, callback_t callback) {
-  kvmessage_t *reqmsg, respmsg;
-  reqmsg = kvmessage_parse(sockfd);
-  memset(&respmsg, 0, sizeof(kvmessage_t));
-  respmsg.type = RESP;
-  if (reqmsg->key != NULL) {
-    respmsg.key = calloc(1, strlen(reqmsg->key));
-    strcpy(respmsg.key, reqmsg->key);
+/* Processes the request REQMSG, which may be NULL if it could not be
+ * parsed, and fills in the response RESPMSG, which is answered in the
+ * framing REQMSG arrived in, with its ID. Does not send RESPMSG nor free
+ * REQMSG. The value of RESPMSG may be shared with the cache, and must be
+ * released with kvmessage_release_value once it has been sent. */
+void tpcmaster_process(tpcmaster_t *master, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg, callback_t callback) {
+  respmsg->type = RESP;
+  if (reqmsg != NULL) {
+    respmsg->key = reqmsg->key;
+    /* Answer in the framing the request arrived in, with its ID. */
+    respmsg->binary = reqmsg->binary;
+    respmsg->id = reqmsg->id;
   }
 
   // OUR CODE HERE
-  if (copy_and_store_kvmessage(master, reqmsg) == -1) {
-    respmsg.message = ERRMSG_GENERIC_ERROR; // type is already set above to RESP
+  if (reqmsg != NULL && copy_and_store_kvmessage(master, reqmsg) == -1) {
+    respmsg->message = ERRMSG_GENERIC_ERROR; // type is already set above to RESP
     return;
   }
 
   // OUR CODE HERE: Staff code had potential to segfault, so changed order of checks
-  if (reqmsg == NULL || reqmsg->key == NULL) {
-    respmsg.message = ERRMSG_INVALID_REQUEST;
+  if (reqmsg == NULL) {
+    respmsg->message = ERRMSG_INVALID_REQUEST;
   } else if (reqmsg->type == INFO) {
-    tpcmaster_info(master, reqmsg, &respmsg);
+    tpcmaster_info(master, reqmsg, respmsg);
+  } else if (reqmsg->type == HOTKEYS) {
+    if ((respmsg->message = hotkeys_report(&master->hotkeys)) == NULL)
+      respmsg->message = ERRMSG_GENERIC_ERROR;
+    else
+      respmsg->type = HOTKEYS;
+  } else if (reqmsg->key == NULL) {
+    respmsg->message = ERRMSG_INVALID_REQUEST;
   } else if (reqmsg->type == REGISTER) {
-    tpcmaster_register(master, reqmsg, &respmsg);
+    tpcmaster_register(master, reqmsg, respmsg);
   } else if (reqmsg->type == GETREQ) {
-    tpcmaster_handle_get(master, reqmsg, &respmsg);
+    tpcmaster_handle_get(master, reqmsg, respmsg);
   } else {
-    tpcmaster_handle_tpc(master, reqmsg, &respmsg, callback);
+    tpcmaster_handle_tpc(master, reqmsg, respmsg, callback);
   }
+}
+
+/* Generic entrypoint for this MASTER. Takes in a socket on SOCKFD, which
+ * should already be connected to an incoming request. Processes the request
+ * and sends back a response message.  This should call out to the appropriate
+ * internal handler. */
+void tpcmaster_handle(tpcmaster_t *master, int sockfd, callback_t callback) {
+  kvmessage_t *reqmsg, respmsg;
+  kvmessage_buffer_t buffer;
+  reqmsg = kvmessage_parse_buffered(sockfd, &buffer);
+  memset(&respmsg, 0, sizeof(kvmessage_t));
+  tpcmaster_process(master, reqmsg, &respmsg, callback);
   kvmessage_send(&respmsg, sockfd);
+  kvmessage_release_value(&respmsg);
+  /* Only the messages of these are allocated for the response. */
+  if (respmsg.type == INFO || respmsg.type == HOTKEYS)
+    free(respmsg.message);
   kvmessage_free(reqmsg);
-  if (respmsg.key != NULL)
-    free(respmsg.key);
+}
+
+/* Returns the sequence number of the last commit of MASTER to start or end.
+ * Read before fetching a key from a slave, and passed to tpcmaster_fill. */
+unsigned long tpcmaster_version(tpcmaster_t *master) {
+  return __atomic_load_n(&master->commit_seq, __ATOMIC_SEQ_CST);
+}
+
+/* Advances the version of the slot of KEY in MASTER to a new sequence
+ * number, and adds DELTA to its count of commits in progress. */
+static void bump_version(tpcmaster_t *master, char *key, int delta) {
+  tpcversion_t *v = &master->versions[kvhash(key) % MASTER_VERSION_SLOTS];
+  unsigned long seq = __atomic_add_fetch(&master->commit_seq, 1,
+      __ATOMIC_SEQ_CST), old = __atomic_load_n(&v->seq, __ATOMIC_SEQ_CST);
+  if (delta > 0)
+    __atomic_add_fetch(&v->writing, delta, __ATOMIC_SEQ_CST);
+  while (old < seq && !__atomic_compare_exchange_n(&v->seq, &old, seq, false,
+      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    ;
+  if (delta < 0)
+    __atomic_sub_fetch(&v->writing, -delta, __ATOMIC_SEQ_CST);
+}
+
+/* Records in MASTER that a PUT or DEL of KEY is about to be committed. Values
+ * of KEY read from slaves from now on are not cached, until the matching
+ * tpcmaster_write_end. */
+void tpcmaster_write_begin(tpcmaster_t *master, char *key) {
+  bump_version(master, key, 1);
+}
+
+/* Records in MASTER that the commit of KEY started with tpcmaster_write_begin
+ * has reached every slave, or was aborted. */
+void tpcmaster_write_end(tpcmaster_t *master, char *key) {
+  bump_version(master, key, -1);
+}
+
+/* Caches VALUE for KEY in MASTER, or a negative entry if VALUE is NULL, after
+ * VALUE was read from a slave. SINCE is the result of tpcmaster_version from
+ * before the slave was asked. Nothing is cached if a commit of KEY (or of a
+ * key in the same slot) is in progress or has started or ended since then, as
+ * VALUE may be stale. Returns true if the cache was updated. */
+bool tpcmaster_fill(tpcmaster_t *master, char *key, kvvalue_t *value,
+    unsigned long since) {
+  tpcversion_t *v = &master->versions[kvhash(key) % MASTER_VERSION_SLOTS];
+  pthread_rwlock_t *lock;
+  bool fresh;
+  if ((lock = kvcache_wrlock(&master->cache, key)) == NULL)
+    return false;
+  fresh = __atomic_load_n(&v->writing, __ATOMIC_SEQ_CST) == 0
+      && __atomic_load_n(&v->seq, __ATOMIC_SEQ_CST) <= since;
+  if (fresh && value != NULL)
+    kvcache_put_ref(&master->cache, key, value);
+  else if (fresh)
+    kvcache_put_negative(&master->cache, key);
+  pthread_rwlock_unlock(lock);
+  return fresh;
 }
 
 /* Completely clears this TPCMaster's cache. For testing purposes. */
@@ -470,23 +585,71 @@ void tpcmaster_clear_cache(tpcmaster_t *tpcmaster) {
   kvcache_clear(&tpcmaster->cache);
 }
 
+/* Returns a connection to SLAVE: an idle one from its pool if there is one,
+ * else a new one. Sets *POOLED to whether it came from the pool. Returns -1
+ * if no connection could be made. */
+static int slave_connect(tpcslave_t *slave, bool *pooled) {
+  int fd = -1;
+  pthread_mutex_lock(&slave->pool_lock);
+  if (slave->pooled > 0)
+    fd = slave->pool[--slave->pooled];
+  pthread_mutex_unlock(&slave->pool_lock);
+  *pooled = (fd != -1);
+  if (fd == -1)
+    fd = connect_to(slave->host, slave->port, TIMEOUT_SECONDS);
+  return fd;
+}
+
+/* Puts the connection FD to SLAVE back into its pool if REUSABLE is set and
+ * the pool is not full, else closes it. */
+static void slave_release(tpcslave_t *slave, int fd, bool reusable) {
+  pthread_mutex_lock(&slave->pool_lock);
+  if (reusable && slave->pooled < SLAVE_POOL_SIZE) {
+    slave->pool[slave->pooled++] = fd;
+    fd = -1;
+  }
+  pthread_mutex_unlock(&slave->pool_lock);
+  if (fd != -1)
+    close(fd);
+}
+
+/* Sends REQMSG to SLAVE and returns its response, or NULL if none was
+ * received. If a reused connection turns out to have been closed by SLAVE,
+ * REQMSG is sent again over a new one. If CONNECTED is not NULL, sets it to
+ * whether a connection to SLAVE could be made at all. */
+static kvmessage_t *slave_call(tpcslave_t *slave, kvmessage_t *reqmsg,
+    bool *connected) {
+  kvmessage_t *response = NULL;
+  bool pooled = true;
+  int fd = 0;
+  while (response == NULL && pooled) {
+    if ((fd = slave_connect(slave, &pooled)) == -1)
+      break;
+    kvmessage_send(reqmsg, fd);
+    response = kvmessage_parse(fd);
+    slave_release(slave, fd, response != NULL);
+  }
+  if (connected != NULL)
+    *connected = (fd != -1);
+  return response;
+}
+
 /* Send and receive message to and from slave in phase 1 of TPC */
 static void phase1(tpcmaster_t *master, tpcslave_t *slave,
                    kvmessage_t *reqmsg, callback_t callback) {
   // OUR CODE HERE
-  int fd = connect_to(slave->host, slave->port, 2);
-  if (fd == -1) {
+  bool connected;
+  kvmessage_t *response = slave_call(slave, reqmsg, &connected);
+  if (!connected) {
     if (callback != NULL) {
       callback(slave);
     }
     return;
   }
-  kvmessage_send(reqmsg, fd);
-  kvmessage_t *response = kvmessage_parse(fd);
-  close(fd);
   if (response == NULL || response->type == VOTE_ABORT) {
     master->state = TPC_ABORT;
-    master->err_msg = response->message; // literal string, free-ing doesn't affect it
+    master->err_msg = (response == NULL) ? ERRMSG_GENERIC_ERROR
+        : response->message; // literal string, free-ing doesn't affect it
   }
   free(response);
 }
@@ -494,23 +657,35 @@ static void phase1(tpcmaster_t *master, tpcslave_t *slave,
 /* Send and receive message to and from slave in phase 2 of TPC */
 static void phase2(tpcslave_t *slave, kvmessage_t *reqmsg, callback_t callback) {
   // OUR CODE HERE
-  int fd = connect_to(slave->host, slave->port, 2);
-  if (fd == -1) {
-    if (callback != NULL) {
-      callback(slave);
-    }
-    return;
-  }
+  bool connected;
+  kvmessage_t *response;
   while (true) {
-    kvmessage_send(reqmsg, fd);
-    kvmessage_t *response = kvmessage_parse(fd);
-    if (response->type == ACK) {
+    response = slave_call(slave, reqmsg, &connected);
+    if (!connected) {
+      if (callback != NULL) {
+        callback(slave);
+      }
+      return;
+    }
+    if (response != NULL && response->type == ACK) {
       free(response);
       break;
     }
     free(response);
   }
-  close(fd);
+}
+
+/* Returns the error code matching the error message MSG, which was received
+ * from a slave, or -1 (a generic error) if MSG is not a GET error. */
+static int error_code(char *msg) {
+  char *known[] = {ERRMSG_NO_KEY, ERRMSG_KEY_LEN, ERRMSG_VAL_LEN};
+  int codes[] = {ERRNOKEY, ERRKEYLEN, ERRVALLEN};
+  int i;
+  for (i = 0; msg != NULL && i < sizeof(known) / sizeof(char *); i++) {
+    if (strcmp(msg, known[i]) == 0)
+      return codes[i];
+  }
+  return -1;
 }
 
 // OUR CODE HERE
@@ -527,7 +702,7 @@ static void update_check_master_state(tpcmaster_t *master) {
 /* Copies and mallocs MSG and stores it in the SERVER->msg field for safety. */
 static int copy_and_store_kvmessage(tpcmaster_t *master, kvmessage_t *msg) {
   kvmessage_free(master->client_req); // we free old kvmessages if they failed
-  if ((master->client_req = (kvmessage_t *) malloc(sizeof(kvmessage_t))) == NULL)
+  if ((master->client_req = (kvmessage_t *) calloc(1, sizeof(kvmessage_t))) == NULL)
     return -1;
 
   kvmessage_t *m = master->client_req;
@@ -549,5 +724,6 @@ static int copy_and_store_kvmessage(tpcmaster_t *master, kvmessage_t *msg) {
   }
   
   m->type = msg->type;
+  m->admit = msg->admit;
   return 0;
 }
@@ -3,6 +3,8 @@
 
 #include <pthread.h>
 #include "kvcache.h"
+#include "singleflight.h"
+#include "hotkeys.h"
 
 /* TPCMaster defines a master server which will communicate with multiple
  * slave servers.
@@ -19,6 +21,32 @@
  *
  * The TPCMaster has an associated KVCache, which should be updated on PUT
  * and DEL requests, and accessed on GET requests before going to the slaves.
+ * Concurrent misses on the same key share a single request to the slaves.
+ * The cache evicts entries by second chance, or by ARC if the master is
+ * initialized with tpcmaster_init_policy.
+ * GETs are counted per key in a HotKeys tracker, and the most requested keys
+ * are listed in response to a HOTKEYS message.
+ *
+ * PUTs are applied to the cache on commit according to the admission policy
+ * set in the request, or else the master's ADMIT policy (ADMIT_ALWAYS
+ * unless changed). The request is forwarded to the slaves as is, so they
+ * apply the same policy.
+ *
+ * The master keeps up to SLAVE_POOL_SIZE idle connections open to each slave,
+ * and reuses them for later requests instead of connecting every time. A
+ * slave may close an idle connection at any time, so a request which gets no
+ * response over a reused connection is sent again over a new one.
+ *
+ * A GET which misses reads the key from a slave and then caches the value it
+ * received. If a PUT or DEL of that key is committed in between, the value is
+ * stale and must not be cached, since the cache would otherwise keep serving
+ * it. The master therefore numbers its commits with a sequence number, and
+ * keeps for each of MASTER_VERSION_SLOTS slots (chosen by kvhash(key)) the
+ * number of the last commit of a key in that slot to start or to end, and the
+ * number of such commits in progress. A GET notes the current sequence number
+ * before asking a slave, and tpcmaster_fill only caches the value if the
+ * slot of its key has no commit in progress and has not changed since. Keys
+ * which share a slot can only cause a value not to be cached.
  *
  * For this project, you can assume that the TPCMaster will never fail. Thus,
  * you don't need to maintain a TPCLog for it.
@@ -28,11 +56,26 @@
 
 typedef void (*callback_t)(void*);
 
+/* The number of slots over which the versions of keys are tracked. */
+#define MASTER_VERSION_SLOTS 4096
+
+/* The version of the keys within one slot. */
+typedef struct {
+  unsigned long seq;            /* The sequence number of the last commit to start or end. */
+  unsigned int writing;         /* The number of commits in progress. */
+} tpcversion_t;
+
+/* The number of idle connections kept open to each slave. */
+#define SLAVE_POOL_SIZE 4
+
 /* A struct used to represent the slaves which this TPC Master is aware of. */
 typedef struct tpcslave {
   int64_t id;                   /* The unique ID for this slave. */
   char *host;                   /* The host where this slave can be reached. */
   unsigned int port;            /* The port where this slave can be reached. */
+  pthread_mutex_t pool_lock;    /* Protects POOL and POOLED. */
+  int pool[SLAVE_POOL_SIZE];    /* Idle connections to this slave, to reuse. */
+  unsigned int pooled;          /* The number of connections in POOL. */
   struct tpcslave *next;        /* The next slave in the list of slaves. */
   struct tpcslave *prev;        /* The previous slave in the list of slaves. */
 } tpcslave_t;
@@ -50,6 +93,11 @@ typedef struct tpcmaster {
   pthread_rwlock_t slave_lock;  /* A lock used to protect the list of slaves. */
   kvcache_t cache;              /* The cache this master will use. */
   tpchandle_t handle;           /* The function this master will use to handle requests. */
+  singleflight_t inflight;      /* The slave requests in flight after cache misses. */
+  hotkeys_t hotkeys;            /* The keys receiving the most GETs. */
+  admit_t admit;                /* The cache admission policy for PUTs which do not set one. */
+  unsigned long commit_seq;     /* The sequence number of the last commit started or ended. */
+  tpcversion_t *versions;       /* The MASTER_VERSION_SLOTS slot versions. */
 
   // OUR CODE HERE
   tpc_state_t state;            /* The current state this master is in. */
@@ -61,14 +109,20 @@ typedef struct tpcmaster {
 
 int tpcmaster_init(tpcmaster_t *master, unsigned int slave_capacity,
     unsigned int redundancy, unsigned int num_sets, unsigned int elem_per_set);
+int tpcmaster_init_policy(tpcmaster_t *master, unsigned int slave_capacity,
+    unsigned int redundancy, unsigned int num_sets, unsigned int elem_per_set,
+    cache_policy_t policy);
 
 void tpcmaster_register(tpcmaster_t *master, kvmessage_t *reqmsg,
     kvmessage_t *respmsg);
+int64_t hash_64_bit(char *s);
 tpcslave_t *tpcmaster_get_primary(tpcmaster_t *master, char *key);
 tpcslave_t *tpcmaster_get_successor(tpcmaster_t *master,
     tpcslave_t *predecessor);
 
 void tpcmaster_handle(tpcmaster_t *master, int sockfd, callback_t callback);
+void tpcmaster_process(tpcmaster_t *master, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg, callback_t callback);
 
 void tpcmaster_handle_get(tpcmaster_t *master, kvmessage_t *reqmsg,
     kvmessage_t *respmsg);
@@ -78,6 +132,12 @@ void tpcmaster_handle_tpc(tpcmaster_t *master, kvmessage_t *reqmsg,
 void tpcmaster_info(tpcmaster_t *master, kvmessage_t *reqmsg,
     kvmessage_t *respmsg);
 
+unsigned long tpcmaster_version(tpcmaster_t *master);
+void tpcmaster_write_begin(tpcmaster_t *master, char *key);
+void tpcmaster_write_end(tpcmaster_t *master, char *key);
+bool tpcmaster_fill(tpcmaster_t *master, char *key, kvvalue_t *value,
+    unsigned long since);
+
 void tpcmaster_clear_cache(tpcmaster_t *tpcmaster);
 
 #endif
@@ -0,0 +1,156 @@
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include "kvconstants.h"
+#include "wal.h"
+
+static int open_generation(wal_t *log);
+
+/* Initializes WAL LOG to store its files within DIRNAME, creating the
+ * directory if necessary. Generations left behind by a previous run are kept
+ * for wal_replay, and new records go to a new generation. Returns 0 if
+ * successful, else a negative error code. */
+int wal_init(wal_t *log, char *dirname) {
+  struct stat st;
+  struct dirent *dent;
+  DIR *dir;
+  unsigned long gen;
+  char suffix[sizeof(WAL_FILETYPE) + 1];
+  bool found = false;
+
+  if (stat(dirname, &st) == -1) {
+    if (mkdir(dirname, 0700) == -1)
+      return ERRFILCRT;
+  }
+  log->dirname = malloc(strlen(dirname) + 1);
+  if (log->dirname == NULL)
+    return -1;
+  strcpy(log->dirname, dirname);
+  pthread_mutex_init(&log->lock, NULL);
+  log->first = log->gen = 0;
+  log->fd = -1;
+
+  if ((dir = opendir(dirname)) == NULL)
+    return ERRFILACCESS;
+  while ((dent = readdir(dir)) != NULL) {
+    if (sscanf(dent->d_name, "%lu%5s", &gen, suffix) != 2
+        || strcmp(suffix, WAL_FILETYPE) != 0)
+      continue;
+    if (!found || gen < log->first)
+      log->first = gen;
+    if (!found || gen >= log->gen)
+      log->gen = gen + 1;
+    found = true;
+  }
+  closedir(dir);
+  return open_generation(log);
+}
+
+/* Appends a record of a PUTREQ or DELREQ of TYPE for KEY (and VALUE, for a
+ * PUTREQ) to LOG. Returns 0 once the record has been written to the log file,
+ * else a negative error code. */
+int wal_append(wal_t *log, msgtype_t type, char *key, char *value) {
+  int keylen, vallen, ret = 0;
+  size_t size;
+  logentry_t *entry;
+  if (type != PUTREQ && type != DELREQ)
+    return ERRINVLDMSG;
+  keylen = strlen(key) + 1;
+  vallen = (type == PUTREQ) ? (strlen(value) + 1) : 0;
+  size = sizeof(logentry_t) + keylen + vallen;
+  if ((entry = malloc(size)) == NULL)
+    return -1;
+  entry->type = type;
+  entry->length = keylen + vallen;
+  strcpy(entry->data, key);
+  if (type == PUTREQ)
+    strcpy(entry->data + keylen, value);
+  pthread_mutex_lock(&log->lock);
+  if (log->fd < 0 || write(log->fd, entry, size) < size)
+    ret = ERRFILACCESS;
+  pthread_mutex_unlock(&log->lock);
+  free(entry);
+  return ret;
+}
+
+/* Calls APPLY(ARG, entry) for every record in the generations of LOG which
+ * precede the current one, from oldest to newest. A record cut short by a
+ * crash ends its generation. Returns 0 if successful, else the first negative
+ * error code returned by APPLY. */
+int wal_replay(wal_t *log, wal_apply_t apply, void *arg) {
+  char filename[MAX_FILENAME];
+  logentry_t header, *entry;
+  unsigned long gen;
+  int fd, ret = 0;
+  bool torn;
+  for (gen = log->first; gen < log->gen && ret == 0; gen++) {
+    sprintf(filename, "%s/%lu%s", log->dirname, gen, WAL_FILETYPE);
+    if ((fd = open(filename, O_RDONLY)) < 0)
+      continue;
+    while (ret == 0 && read(fd, &header, sizeof(logentry_t))
+        == sizeof(logentry_t)) {
+      if ((entry = malloc(sizeof(logentry_t) + header.length)) == NULL) {
+        ret = -1;
+        break;
+      }
+      *entry = header;
+      torn = (read(fd, entry->data, header.length) != header.length);
+      if (!torn)
+        ret = apply(arg, entry);
+      free(entry);
+      if (torn)
+        break;
+    }
+    close(fd);
+  }
+  return ret;
+}
+
+/* Starts a new generation of LOG, to which all further records are appended,
+ * after making sure the current one has reached the disk. Stores the number
+ * of the new generation in GEN. Returns 0 if successful, else a negative error
+ * code. */
+int wal_rotate(wal_t *log, unsigned long *gen) {
+  int ret;
+  pthread_mutex_lock(&log->lock);
+  if (log->fd >= 0) {
+    fdatasync(log->fd);
+    close(log->fd);
+  }
+  log->gen++;
+  ret = open_generation(log);
+  *gen = log->gen;
+  pthread_mutex_unlock(&log->lock);
+  return ret;
+}
+
+/* Removes every generation of LOG older than GEN, whose records must all have
+ * been applied to the store. Returns 0 if successful, else a negative error
+ * code. */
+int wal_discard(wal_t *log, unsigned long gen) {
+  char filename[MAX_FILENAME];
+  int ret = 0;
+  pthread_mutex_lock(&log->lock);
+  for (; log->first < gen; log->first++) {
+    sprintf(filename, "%s/%lu%s", log->dirname, log->first, WAL_FILETYPE);
+    if (remove(filename) < 0 && errno != ENOENT)
+      ret = ERRFILACCESS;
+  }
+  pthread_mutex_unlock(&log->lock);
+  return ret;
+}
+
+/* Opens the file of LOG's current generation for appending. */
+static int open_generation(wal_t *log) {
+  char filename[MAX_FILENAME];
+  sprintf(filename, "%s/%lu%s", log->dirname, log->gen, WAL_FILETYPE);
+  log->fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+  return (log->fd < 0) ? ERRFILCRT : 0;
+}
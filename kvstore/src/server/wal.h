@@ -0,0 +1,54 @@
+#ifndef __KV_WAL__
+#define __KV_WAL__
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "kvconstants.h"
+#include "tpclog.h"
+
+/* WAL defines the write-ahead log which makes a KVServer's write-back cache
+ * crash safe.
+ *
+ * In write-back mode, a PUT is only applied to the cache before responding,
+ * and is written to the KVStore later. So that it is not lost if the server
+ * crashes in between, it is first appended to the WAL. Unlike a TPCLog, which
+ * creates a file per entry, the WAL appends every record to a single file,
+ * so logging a write costs no more than a write() call. Records use the
+ * logentry_t layout described in tpclog.h (PUTREQ and DELREQ only).
+ *
+ * The log is split into generations, each stored within DIRNAME in a file
+ * named after its number, e.g. "3.wal". Records are always appended to the
+ * newest generation. To flush the cache, a server first calls wal_rotate to
+ * start a new generation, then writes every dirty cache entry to the store.
+ * At that point every record of the older generations has reached the store,
+ * so they are removed with wal_discard. Records appended meanwhile are part
+ * of the new generation and are kept.
+ *
+ * After a crash, wal_replay passes the records of every generation on disk to
+ * a callback, oldest first, so that they can be applied to the store.
+ */
+
+/* Filetype to use as an extension for the filenames of WAL generations. */
+#define WAL_FILETYPE ".wal"
+
+/* A WAL. */
+typedef struct {
+  char *dirname;             /* The name of the directory holding the log files. */
+  unsigned long first;       /* The oldest generation which may still exist. */
+  unsigned long gen;         /* The generation being appended to. */
+  int fd;                    /* The file of generation GEN, or -1 if not open. */
+  pthread_mutex_t lock;      /* Serializes appends and rotations. */
+} wal_t;
+
+/* Applies the log entry ENTRY. ARG is passed through from wal_replay. */
+typedef int (*wal_apply_t)(void *arg, logentry_t *entry);
+
+int wal_init(wal_t *, char *dirname);
+
+int wal_append(wal_t *, msgtype_t type, char *key, char *value);
+
+int wal_replay(wal_t *, wal_apply_t apply, void *arg);
+int wal_rotate(wal_t *, unsigned long *old_gen);
+int wal_discard(wal_t *, unsigned long old_gen);
+
+#endif
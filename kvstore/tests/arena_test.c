@@ -0,0 +1,127 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "kvcache.h"
+#include "tester.h"
+
+arena_t testarena;
+
+int arena_test_init(void) {
+  arena_set_hugepages(true);
+  arena_init(&testarena, 100);
+  return 0;
+}
+
+int arena_map_aligned_and_counted(void) {
+  arena_stats_t before, after;
+  char *p;
+  size_t i;
+  arena_stats(&before);
+  p = arena_map(ARENA_HUGEPAGE + 1);
+  ASSERT_PTR_NOT_NULL(p);
+  ASSERT_EQUAL((uintptr_t) p % ARENA_HUGEPAGE, 0);
+  for (i = 0; i < 2 * ARENA_HUGEPAGE; i += 4096)
+    ASSERT_EQUAL(p[i], 0);
+  p[2 * ARENA_HUGEPAGE - 1] = 1;
+  arena_stats(&after);
+  ASSERT_EQUAL(after.explicit_bytes + after.transparent_bytes
+      + after.regular_bytes - before.explicit_bytes - before.transparent_bytes
+      - before.regular_bytes, 2 * ARENA_HUGEPAGE);
+  return 1;
+}
+
+int arena_map_without_hugepages(void) {
+  arena_stats_t before, after;
+  arena_set_hugepages(false);
+  arena_stats(&before);
+  ASSERT_PTR_NOT_NULL(arena_map(1));
+  arena_stats(&after);
+  ASSERT_EQUAL(after.regular_bytes - before.regular_bytes, ARENA_HUGEPAGE);
+  ASSERT_EQUAL(after.explicit_bytes, before.explicit_bytes);
+  ASSERT_EQUAL(after.transparent_bytes, before.transparent_bytes);
+  return 1;
+}
+
+int arena_blocks_reused(void) {
+  char *a, *b, *c;
+  ASSERT_EQUAL(testarena.block_size, 128);
+  a = arena_alloc(&testarena);
+  b = arena_alloc(&testarena);
+  ASSERT_PTR_NOT_NULL(a);
+  ASSERT_PTR_NOT_NULL(b);
+  ASSERT_EQUAL((uintptr_t) a % 64, 0);
+  ASSERT_EQUAL(b - a, 128);
+  memset(a, 'x', 128);
+  arena_free(&testarena, a);
+  c = arena_alloc(&testarena);
+  ASSERT_TRUE(c == a);
+  return 1;
+}
+
+int arena_report_lists_pages(void) {
+  char *report;
+  ASSERT_PTR_NOT_NULL(arena_map(1));
+  report = arena_report();
+  ASSERT_PTR_NOT_NULL(report);
+  ASSERT_PTR_NOT_NULL(strstr(report, "in explicit huge pages"));
+  ASSERT_PTR_NOT_NULL(strstr(report, "in regular pages"));
+  free(report);
+  return 1;
+}
+
+/* A cache whose sets span several huge pages allocates them, and their
+ * indexes, through arena_map. */
+int arena_backs_large_cache(void) {
+  kvcache_t cache;
+  char *value;
+  unsigned int num_sets = 4 * ARENA_HUGEPAGE / sizeof(kvcacheset_t);
+  ASSERT_EQUAL(kvcache_init(&cache, num_sets, 4), 0);
+  ASSERT_EQUAL((uintptr_t) cache.sets % ARENA_HUGEPAGE, 0);
+  ASSERT_PTR_NOT_NULL(cache.sets[0].arena);
+  ASSERT_TRUE(cache.sets[0].arena == cache.sets[num_sets - 1].arena);
+  ASSERT_EQUAL(kvcache_put(&cache, "mykey", "myvalue"), 0);
+  ASSERT_EQUAL(kvcache_get(&cache, "mykey", &value), 0);
+  ASSERT_STRING_EQUAL(value, "myvalue");
+  free(value);
+  return 1;
+}
+
+int arena_destroy_unmaps_chunks(void) {
+  unsigned int blocks = ARENA_HUGEPAGE / testarena.block_size + 1, i;
+  for (i = 0; i < blocks; i++)
+    ASSERT_PTR_NOT_NULL(arena_alloc(&testarena));
+  ASSERT_EQUAL(testarena.num_chunks, 2);
+  arena_destroy(&testarena);
+  ASSERT_EQUAL(testarena.num_chunks, 0);
+  ASSERT_PTR_NULL(testarena.chunks);
+  /* The arena can be set up again. */
+  ASSERT_EQUAL(arena_init(&testarena, 100), 0);
+  ASSERT_PTR_NOT_NULL(arena_alloc(&testarena));
+  ASSERT_EQUAL(testarena.num_chunks, 1);
+  return 1;
+}
+
+/* A small cache is allocated with malloc(). */
+int arena_skipped_for_small_cache(void) {
+  kvcache_t cache;
+  ASSERT_EQUAL(kvcache_init(&cache, 4, 4), 0);
+  ASSERT_PTR_NULL(cache.sets[0].arena);
+  return 1;
+}
+
+test_info_t arena_tests[] = {
+  {"Mapped memory is aligned, zeroed and counted",
+    arena_map_aligned_and_counted},
+  {"Huge pages can be turned off", arena_map_without_hugepages},
+  {"Freed blocks are handed out again", arena_blocks_reused},
+  {"Destroying an arena unmaps its chunks", arena_destroy_unmaps_chunks},
+  {"Report lists the pages obtained", arena_report_lists_pages},
+  {"Large caches are backed by arenas", arena_backs_large_cache},
+  {"Small caches are not backed by arenas", arena_skipped_for_small_cache},
+  NULL_TEST_INFO
+};
+
+suite_info_t arena_suite = {"Arena Tests", arena_test_init, NULL,
+  arena_tests};
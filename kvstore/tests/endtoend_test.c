@@ -1,12 +1,25 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include "tester.h"
 #include "socket_server.h"
 
 #define ENDTOEND_HOSTNAME "localhost"
 #define ENDTOEND_PORT 8162
+#define ENDTOEND_UNIX_PATH "/tmp/kvstore_endtoend_test.sock"
 #define ENDTOEND_SERVER_NAME "endtoend_server"
+#define ENDTOEND_IDLE_CONNECTIONS 64
+#define ENDTOEND_PIPELINED_KEYS 4
+#define ENDTOEND_PIPELINED_PUTS 32
+#define ENDTOEND_TRICKLE 7
+#define ENDTOEND_BACKLOGGED_GETS 2048
+#define ENDTOEND_RESP_PORT 8163
+#define ENDTOEND_RESP_ROUNDS 200
 
 server_t socket_server;
 kvserver_t *kvserver;
@@ -14,6 +27,22 @@ pthread_mutex_t endtoend_lock;
 pthread_cond_t endtoend_cond;
 int synch;
 
+/* The host the clients connect to: ENDTOEND_HOSTNAME, or the path of the
+ * server's Unix domain socket. */
+const char *endtoend_host = ENDTOEND_HOSTNAME;
+
+/* Whether the persistent client uses the binary framing. */
+bool endtoend_binary;
+
+/* Whether the pipelined client sends its requests ENDTOEND_TRICKLE bytes at
+ * a time. */
+bool endtoend_trickle;
+
+void *endtoend_test_client_thread(void *aux);
+
+/* The client run against the server once it is listening. */
+void *(*endtoend_client)(void *) = endtoend_test_client_thread;
+
 int endtoend_test_init(void) {
   pthread_mutex_init(&endtoend_lock, NULL);
   pthread_cond_init(&endtoend_cond, NULL);
@@ -32,7 +61,7 @@ int endtoend_test_clean(void) {
 kvmessage_t *endtoend_send_and_receive(kvmessage_t *reqmsg) {
   kvmessage_t *respmsg;
   int sockfd;
-  sockfd = connect_to(ENDTOEND_HOSTNAME, ENDTOEND_PORT, 3);
+  sockfd = connect_to(endtoend_host, ENDTOEND_PORT, 3);
   kvmessage_send(reqmsg, sockfd);
   respmsg = kvmessage_parse(sockfd);
   shutdown(sockfd, SHUT_RDWR);
@@ -104,9 +133,285 @@ void *endtoend_test_client_thread(void *aux) {
   return 0;
 }
 
+/* Sends PUTs and GETs of several keys over a single connection, and then
+ * reads them back over another one, more than there are server threads. */
+void *endtoend_persistent_client_thread(void *aux) {
+  kvmessage_t reqmsg, *respmsg;
+  char key[16], value[16];
+  int pass = 1, sockfd, i, conn;
+
+  for (conn = 0; conn < 2 * socket_server.max_threads + 1; conn++) {
+    sockfd = connect_to(endtoend_host, ENDTOEND_PORT, 3);
+    for (i = 0; i < 8 && sockfd >= 0; i++) {
+      sprintf(key, "key%d", i);
+      sprintf(value, "value%d", i);
+      memset(&reqmsg, 0, sizeof(kvmessage_t));
+      reqmsg.type = (conn == 0) ? PUTREQ : GETREQ;
+      reqmsg.key = key;
+      reqmsg.value = (conn == 0) ? value : NULL;
+      reqmsg.binary = endtoend_binary;
+      kvmessage_send(&reqmsg, sockfd);
+      respmsg = kvmessage_parse(sockfd);
+      if (respmsg == NULL || respmsg->type != ((conn == 0) ? RESP : GETRESP)
+          || respmsg->binary != endtoend_binary
+          || (conn > 0 && strcmp(respmsg->value, value) != 0))
+        pass = 0;
+      kvmessage_free(respmsg);
+    }
+    if (sockfd < 0)
+      pass = 0;
+    close(sockfd);
+  }
+
+  pthread_mutex_lock(&endtoend_lock);
+  synch = pass;
+  pthread_cond_signal(&endtoend_cond);
+  pthread_mutex_unlock(&endtoend_lock);
+  return 0;
+}
+
+/* Sends REQMSG on SOCKFD, ENDTOEND_TRICKLE bytes per write if
+ * endtoend_trickle is set, so that requests reach the server split at
+ * arbitrary points. */
+void endtoend_pipelined_send(kvmessage_t *reqmsg, int sockfd) {
+  char frame[256];
+  int pair[2], one = 1;
+  ssize_t size, i;
+  if (!endtoend_trickle || socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+    kvmessage_send(reqmsg, sockfd);
+    return;
+  }
+  setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  kvmessage_send(reqmsg, pair[0]);
+  size = recv(pair[1], frame, sizeof(frame), 0);
+  for (i = 0; i < size; i += ENDTOEND_TRICKLE)
+    send(sockfd, frame + i, (size - i < ENDTOEND_TRICKLE) ? size - i
+        : ENDTOEND_TRICKLE, MSG_NOSIGNAL);
+  close(pair[0]);
+  close(pair[1]);
+}
+
+/* Sends numbered PUTs of a few keys, several to each, then numbered GETs of
+ * them and an unnumbered one, all back to back over a single connection.
+ * Checks that every request is answered, that the GETs see the last PUT of
+ * their key, and that the unnumbered GET is answered last. */
+void *endtoend_pipelined_client_thread(void *aux) {
+  kvmessage_t reqmsg, *respmsg;
+  char keys[ENDTOEND_PIPELINED_KEYS][16];
+  char values[ENDTOEND_PIPELINED_PUTS][16];
+  bool answered[ENDTOEND_PIPELINED_PUTS + ENDTOEND_PIPELINED_KEYS + 1];
+  int pass = 1, sockfd, i, n = 0;
+  uint32_t id;
+
+  memset(answered, 0, sizeof(answered));
+  sockfd = connect_to(endtoend_host, ENDTOEND_PORT, 3);
+  for (i = 0; i < ENDTOEND_PIPELINED_KEYS; i++)
+    sprintf(keys[i], "pipelined%d", i);
+  for (i = 0; i < ENDTOEND_PIPELINED_PUTS; i++) {
+    sprintf(values[i], "value%d", i);
+    memset(&reqmsg, 0, sizeof(kvmessage_t));
+    reqmsg.type = PUTREQ;
+    reqmsg.key = keys[i % ENDTOEND_PIPELINED_KEYS];
+    reqmsg.value = values[i];
+    reqmsg.id = i + 1;
+    reqmsg.binary = endtoend_binary;
+    endtoend_pipelined_send(&reqmsg, sockfd);
+  }
+  for (i = 0; i <= ENDTOEND_PIPELINED_KEYS; i++) {
+    memset(&reqmsg, 0, sizeof(kvmessage_t));
+    reqmsg.type = GETREQ;
+    reqmsg.key = keys[i % ENDTOEND_PIPELINED_KEYS];
+    reqmsg.id = (i < ENDTOEND_PIPELINED_KEYS) ? ENDTOEND_PIPELINED_PUTS + i + 1 : 0;
+    reqmsg.binary = endtoend_binary;
+    endtoend_pipelined_send(&reqmsg, sockfd);
+  }
+  while (n <= ENDTOEND_PIPELINED_PUTS + ENDTOEND_PIPELINED_KEYS
+      && (respmsg = kvmessage_parse(sockfd)) != NULL) {
+    id = respmsg->id;
+    if (id == 0) {
+      /* The last PUT of the first key. */
+      if (n != ENDTOEND_PIPELINED_PUTS + ENDTOEND_PIPELINED_KEYS
+          || respmsg->type != GETRESP || strcmp(respmsg->value,
+          values[ENDTOEND_PIPELINED_PUTS - ENDTOEND_PIPELINED_KEYS]) != 0)
+        pass = 0;
+    } else if (id > ENDTOEND_PIPELINED_PUTS + ENDTOEND_PIPELINED_KEYS
+        || answered[id]) {
+      pass = 0;
+    } else if (id > ENDTOEND_PIPELINED_PUTS) {
+      i = ENDTOEND_PIPELINED_PUTS - ENDTOEND_PIPELINED_KEYS
+          + (id - ENDTOEND_PIPELINED_PUTS - 1);
+      if (respmsg->type != GETRESP || strcmp(respmsg->value, values[i]) != 0)
+        pass = 0;
+    } else if (respmsg->type != RESP
+        || strcmp(respmsg->message, MSG_SUCCESS) != 0) {
+      pass = 0;
+    }
+    answered[id] = true;
+    n++;
+    kvmessage_free(respmsg);
+  }
+  if (n != ENDTOEND_PIPELINED_PUTS + ENDTOEND_PIPELINED_KEYS + 1)
+    pass = 0;
+  close(sockfd);
+
+  pthread_mutex_lock(&endtoend_lock);
+  synch = pass;
+  pthread_cond_signal(&endtoend_cond);
+  pthread_mutex_unlock(&endtoend_lock);
+  return 0;
+}
+
+/* Stores a value as large as allowed, then sends numbered GETs of it before
+ * reading any response, so that megabytes of responses pile up in the
+ * server's output buffer and socket. Checks that every GET is answered with
+ * the value. */
+void *endtoend_backlogged_client_thread(void *aux) {
+  kvmessage_t reqmsg, *respmsg;
+  char value[MAX_VALLEN + 1];
+  int pass = 1, sockfd, i, n = 0;
+
+  memset(value, 'b', MAX_VALLEN);
+  value[MAX_VALLEN] = '\0';
+  sockfd = connect_to(endtoend_host, ENDTOEND_PORT, 3);
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "backlogged";
+  reqmsg.value = value;
+  reqmsg.binary = true;
+  kvmessage_send(&reqmsg, sockfd);
+  respmsg = kvmessage_parse(sockfd);
+  if (respmsg == NULL || respmsg->type != RESP)
+    pass = 0;
+  kvmessage_free(respmsg);
+  reqmsg.type = GETREQ;
+  reqmsg.value = NULL;
+  for (i = 0; i < ENDTOEND_BACKLOGGED_GETS; i++) {
+    reqmsg.id = i + 1;
+    kvmessage_send(&reqmsg, sockfd);
+  }
+  while (n < ENDTOEND_BACKLOGGED_GETS
+      && (respmsg = kvmessage_parse(sockfd)) != NULL) {
+    if (respmsg->type != GETRESP || respmsg->id == 0
+        || respmsg->id > ENDTOEND_BACKLOGGED_GETS
+        || strcmp(respmsg->value, value) != 0)
+      pass = 0;
+    n++;
+    kvmessage_free(respmsg);
+  }
+  if (n != ENDTOEND_BACKLOGGED_GETS)
+    pass = 0;
+  close(sockfd);
+
+  pthread_mutex_lock(&endtoend_lock);
+  synch = pass;
+  pthread_cond_signal(&endtoend_cond);
+  pthread_mutex_unlock(&endtoend_lock);
+  return 0;
+}
+
+/* Appends the RESP command made of the ARGC strings which follow to BUF,
+ * and returns its length. */
+size_t endtoend_resp_command(char *buf, int argc, ...) {
+  va_list args;
+  size_t len = sprintf(buf, "*%d\r\n", argc);
+  char *arg;
+  va_start(args, argc);
+  while (argc-- > 0) {
+    arg = va_arg(args, char *);
+    len += sprintf(buf + len, "$%zu\r\n%s\r\n", strlen(arg), arg);
+  }
+  va_end(args);
+  return len;
+}
+
+/* Reads LEN bytes from socket SOCKFD into BUF, and null terminates them.
+ * Returns false if they did not all arrive. */
+bool endtoend_recv_all(int sockfd, char *buf, size_t len) {
+  ssize_t got;
+  size_t read = 0;
+  while (read < len && (got = recv(sockfd, buf + read, len - read, 0)) > 0)
+    read += got;
+  buf[read] = '\0';
+  return read == len;
+}
+
+/* Sends a batch of RESP commands in a single write to the RESP listener,
+ * and checks that their replies come back in order, then writes and reads
+ * back the same key many times over, pipelined, so that any reordering of
+ * commands for the same key would show. */
+void *endtoend_resp_client_thread(void *aux) {
+  static char commands[64 * ENDTOEND_RESP_ROUNDS], expected[64 * ENDTOEND_RESP_ROUNDS],
+      replies[64 * ENDTOEND_RESP_ROUNDS];
+  char value[16];
+  size_t len = 0, expected_len = 0;
+  int pass = 1, sockfd, i;
+
+  sockfd = connect_to(ENDTOEND_HOSTNAME, ENDTOEND_RESP_PORT, 3);
+  len += endtoend_resp_command(commands + len, 3, "SET", "k1", "v1");
+  len += endtoend_resp_command(commands + len, 5, "MSET", "k2", "v2", "k3",
+      "v3");
+  len += endtoend_resp_command(commands + len, 2, "GET", "k1");
+  len += endtoend_resp_command(commands + len, 4, "MGET", "k1", "none", "k3");
+  len += endtoend_resp_command(commands + len, 3, "DEL", "k1", "none");
+  len += endtoend_resp_command(commands + len, 2, "get", "k1");
+  len += endtoend_resp_command(commands + len, 1, "PING");
+  len += endtoend_resp_command(commands + len, 2, "CONFIG", "GET");
+  strcpy(expected, "+OK\r\n+OK\r\n$2\r\nv1\r\n"
+      "*3\r\n$2\r\nv1\r\n$-1\r\n$2\r\nv3\r\n:1\r\n$-1\r\n+PONG\r\n"
+      "-ERR unknown command\r\n");
+  if (sockfd < 0 || send(sockfd, commands, len, MSG_NOSIGNAL) != (ssize_t) len
+      || !endtoend_recv_all(sockfd, replies, strlen(expected))
+      || strcmp(replies, expected) != 0)
+    pass = 0;
+
+  len = 0;
+  for (i = 0; i < ENDTOEND_RESP_ROUNDS; i++) {
+    sprintf(value, "%d", i);
+    len += endtoend_resp_command(commands + len, 3, "SET", "key", value);
+    len += endtoend_resp_command(commands + len, 2, "GET", "key");
+    expected_len += sprintf(expected + expected_len, "+OK\r\n$%zu\r\n%s\r\n",
+        strlen(value), value);
+  }
+  if (pass && (send(sockfd, commands, len, MSG_NOSIGNAL) != (ssize_t) len
+      || !endtoend_recv_all(sockfd, replies, expected_len)
+      || strcmp(replies, expected) != 0))
+    pass = 0;
+
+  len = endtoend_resp_command(commands, 1, "INFO");
+  if (pass && (send(sockfd, commands, len, MSG_NOSIGNAL) != (ssize_t) len
+      || !endtoend_recv_all(sockfd, replies, 1) || replies[0] != '$'))
+    pass = 0;
+  if (sockfd >= 0)
+    close(sockfd);
+
+  pthread_mutex_lock(&endtoend_lock);
+  synch = pass;
+  pthread_cond_signal(&endtoend_cond);
+  pthread_mutex_unlock(&endtoend_lock);
+  return 0;
+}
+
+/* Opens many more connections than there are server threads, leaves them
+ * idle or with half a request sent, and then runs the basic client. */
+void *endtoend_idle_client_thread(void *aux) {
+  int sockfds[ENDTOEND_IDLE_CONNECTIONS], i;
+  char partial[] = {0, 0, 0, 64, '{', '"'};
+
+  for (i = 0; i < ENDTOEND_IDLE_CONNECTIONS; i++) {
+    sockfds[i] = connect_to(endtoend_host, ENDTOEND_PORT, 3);
+    if (sockfds[i] >= 0 && i % 2 == 1)
+      send(sockfds[i], partial, sizeof(partial), MSG_NOSIGNAL);
+  }
+  endtoend_test_client_thread(aux);
+  for (i = 0; i < ENDTOEND_IDLE_CONNECTIONS; i++)
+    if (sockfds[i] >= 0)
+      close(sockfds[i]);
+  return 0;
+}
+
 void endtoend_test_connect() {
   pthread_t thread;
-  pthread_create(&thread, NULL, &endtoend_test_client_thread, NULL);
+  pthread_create(&thread, NULL, endtoend_client, NULL);
 }
 
 void *endtoend_server_runner(void *callback){
@@ -131,8 +436,141 @@ int endtoend_test(void) {
   return 1;
 }
 
+int endtoend_sharded_test(void) {
+  socket_server.sharded = 1;
+  return endtoend_test();
+}
+
+int endtoend_persistent_test(void) {
+  endtoend_client = endtoend_persistent_client_thread;
+  return endtoend_test();
+}
+
+int endtoend_persistent_sharded_test(void) {
+  socket_server.sharded = 1;
+  return endtoend_persistent_test();
+}
+
+int endtoend_binary_test(void) {
+  endtoend_binary = true;
+  return endtoend_persistent_test();
+}
+
+int endtoend_binary_sharded_test(void) {
+  socket_server.sharded = 1;
+  return endtoend_binary_test();
+}
+
+int endtoend_pipelined_test(void) {
+  endtoend_client = endtoend_pipelined_client_thread;
+  return endtoend_test();
+}
+
+int endtoend_pipelined_binary_test(void) {
+  endtoend_binary = true;
+  return endtoend_pipelined_test();
+}
+
+int endtoend_pipelined_sharded_test(void) {
+  socket_server.sharded = 1;
+  return endtoend_pipelined_binary_test();
+}
+
+int endtoend_pipelined_trickled_test(void) {
+  endtoend_trickle = true;
+  return endtoend_pipelined_binary_test();
+}
+
+int endtoend_backlogged_test(void) {
+  endtoend_client = endtoend_backlogged_client_thread;
+  return endtoend_test();
+}
+
+int endtoend_backlogged_sharded_test(void) {
+  socket_server.sharded = 1;
+  return endtoend_backlogged_test();
+}
+
+int endtoend_idle_test(void) {
+  endtoend_client = endtoend_idle_client_thread;
+  return endtoend_test();
+}
+
+int endtoend_idle_sharded_test(void) {
+  socket_server.sharded = 1;
+  return endtoend_idle_test();
+}
+
+int endtoend_reuseport_test(void) {
+  socket_server.io_threads = 4;
+  socket_server.reuseport = 1;
+  return endtoend_idle_test();
+}
+
+int endtoend_reuseport_sharded_test(void) {
+  socket_server.sharded = 1;
+  return endtoend_reuseport_test();
+}
+
+int endtoend_unix_test(void) {
+  socket_server.unix_path = ENDTOEND_UNIX_PATH;
+  endtoend_host = ENDTOEND_UNIX_PATH;
+  return endtoend_test();
+}
+
+int endtoend_unix_pipelined_test(void) {
+  socket_server.unix_path = ENDTOEND_UNIX_PATH;
+  endtoend_host = ENDTOEND_UNIX_PATH;
+  return endtoend_pipelined_sharded_test();
+}
+
+int endtoend_resp_test(void) {
+  socket_server.resp_port = ENDTOEND_RESP_PORT;
+  endtoend_client = endtoend_resp_client_thread;
+  return endtoend_test();
+}
+
+int endtoend_resp_sharded_test(void) {
+  socket_server.sharded = 1;
+  return endtoend_resp_test();
+}
+
 test_info_t endtoend_tests[] = {
   {"End to end test placing keys, deleting them, getting them", endtoend_test},
+  {"End to end test with requests steered to per-core workers",
+    endtoend_sharded_test},
+  {"End to end test with several requests per connection",
+    endtoend_persistent_test},
+  {"End to end test with several requests per connection to per-core workers",
+    endtoend_persistent_sharded_test},
+  {"End to end test with binary framing", endtoend_binary_test},
+  {"End to end test with binary framing to per-core workers",
+    endtoend_binary_sharded_test},
+  {"End to end test with pipelined requests", endtoend_pipelined_test},
+  {"End to end test with pipelined binary requests",
+    endtoend_pipelined_binary_test},
+  {"End to end test with pipelined binary requests to per-core workers",
+    endtoend_pipelined_sharded_test},
+  {"End to end test with pipelined binary requests split across writes",
+    endtoend_pipelined_trickled_test},
+  {"End to end test with pipelined responses backing up",
+    endtoend_backlogged_test},
+  {"End to end test with pipelined responses backing up from per-core workers",
+    endtoend_backlogged_sharded_test},
+  {"End to end test with many idle and partial connections",
+    endtoend_idle_test},
+  {"End to end test with many idle and partial connections to per-core workers",
+    endtoend_idle_sharded_test},
+  {"End to end test with a listening socket per I/O thread",
+    endtoend_reuseport_test},
+  {"End to end test with a listening socket per I/O thread and per-core workers",
+    endtoend_reuseport_sharded_test},
+  {"End to end test over a Unix domain socket", endtoend_unix_test},
+  {"End to end test with pipelined binary requests over a Unix domain socket",
+    endtoend_unix_pipelined_test},
+  {"End to end test with pipelined RESP commands", endtoend_resp_test},
+  {"End to end test with pipelined RESP commands to per-core workers",
+    endtoend_resp_sharded_test},
   NULL_TEST_INFO
 };
 
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hotkeys.h"
+#include "tester.h"
+
+hotkeys_t testhotkeys;
+
+int hotkeys_test_init(void) {
+  hotkeys_init(&testhotkeys, 1);
+  return 0;
+}
+
+/* Records a request for "hot" for every 3 requests, for "warm" for every 6,
+ * and otherwise for a key which is never seen again, many more of which than
+ * there are counters. */
+int hotkeys_finds_heavy_hitters(void) {
+  hotkey_t top[2];
+  char key[32];
+  int i;
+  for (i = 0; i < 6000; i++) {
+    if (i % 3 == 0) {
+      hotkeys_record(&testhotkeys, "hot");
+    } else if (i % 6 == 1) {
+      hotkeys_record(&testhotkeys, "warm");
+    } else {
+      sprintf(key, "cold%d", i);
+      hotkeys_record(&testhotkeys, key);
+    }
+  }
+  ASSERT_EQUAL(hotkeys_top(&testhotkeys, top, 2), 2);
+  ASSERT_STRING_EQUAL(top[0].key, "hot");
+  ASSERT_STRING_EQUAL(top[1].key, "warm");
+  /* Counts are never underestimated, and off by at most their error. */
+  ASSERT(top[0].count >= 2000 && top[0].count - top[0].error <= 2000);
+  ASSERT(top[1].count >= 1000 && top[1].count - top[1].error <= 1000);
+  return 1;
+}
+
+int hotkeys_sampled_counts_scaled(void) {
+  hotkey_t top[HOTKEYS_CAPACITY];
+  int i;
+  hotkeys_init(&testhotkeys, 4);
+  for (i = 0; i < 400; i++)
+    hotkeys_record(&testhotkeys, "key");
+  ASSERT_EQUAL(hotkeys_top(&testhotkeys, top, HOTKEYS_CAPACITY), 1);
+  ASSERT_EQUAL(top[0].count, 400);
+  ASSERT_EQUAL(top[0].error, 0);
+  return 1;
+}
+
+int hotkeys_report_format(void) {
+  char *report;
+  int i;
+  for (i = 0; i < 3; i++)
+    hotkeys_record(&testhotkeys, "first");
+  hotkeys_record(&testhotkeys, "second");
+  report = hotkeys_report(&testhotkeys);
+  ASSERT_PTR_NOT_NULL(report);
+  ASSERT_STRING_EQUAL(report, "Hot keys:\n{first, 3, 0}\n{second, 1, 0}");
+  free(report);
+  return 1;
+}
+
+test_info_t hotkeys_tests[] = {
+  {"Space-Saving finds the most requested keys", hotkeys_finds_heavy_hitters},
+  {"Sampled counts are scaled back up", hotkeys_sampled_counts_scaled},
+  {"Report lists keys by count", hotkeys_report_format},
+  NULL_TEST_INFO
+};
+
+suite_info_t hotkeys_suite = {"HotKeys Tests", hotkeys_test_init, NULL,
+  hotkeys_tests};
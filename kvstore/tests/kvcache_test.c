@@ -1,7 +1,10 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <pthread.h>
+#include <unistd.h>
 #include "kvcache.h"
+#include "kvhash.h"
 #include "kvconstants.h"
 #include "tester.h"
 
@@ -24,26 +27,35 @@ int kvcache_simple_put_get_single(void) {
   return 1;
 }
 
+/* Stores in KEYS the first COUNT keys of the form "mykeyN" which hash to
+ * each set of the two-set test cache, so that they fill it to capacity. */
+static void keys_filling_sets(char keys[][16], int count) {
+  int filled[2] = {0, 0}, n = 0, i = 0;
+  char key[16];
+  while (n < 2 * count) {
+    sprintf(key, "mykey%d", ++i);
+    if (filled[kvhash(key) % 2] < count) {
+      filled[kvhash(key) % 2]++;
+      strcpy(keys[n++], key);
+    }
+  }
+}
+
 int kvcache_simple_put_get_multiple(void) {
-  char *retval;
-  int ret;
-  ret = kvcache_put(&testcache, "mykey1", "myvalue1");
-  ret += kvcache_put(&testcache, "mykey2", "myvalue2");
-  ret += kvcache_put(&testcache, "mykey3", "myvalue3");
-  ret += kvcache_put(&testcache, "mykey4", "myvalue4");
-  ret += kvcache_get(&testcache, "mykey1", &retval);
-  ASSERT_PTR_NOT_NULL(retval);
-  ASSERT_STRING_EQUAL(retval, "myvalue1");
-  free(retval);
-  ret += kvcache_get(&testcache, "mykey2", &retval);
-  ASSERT_STRING_EQUAL(retval, "myvalue2");
-  free(retval);
-  ret += kvcache_get(&testcache, "mykey3", &retval);
-  ASSERT_STRING_EQUAL(retval, "myvalue3");
-  free(retval);
-  ret += kvcache_get(&testcache, "mykey4", &retval);
-  ASSERT_STRING_EQUAL(retval, "myvalue4");
-  free(retval);
+  char *retval, keys[4][16], value[16];
+  int ret = 0, i;
+  keys_filling_sets(keys, 2);
+  for (i = 0; i < 4; i++) {
+    sprintf(value, "myvalue%d", i);
+    ret += kvcache_put(&testcache, keys[i], value);
+  }
+  for (i = 0; i < 4; i++) {
+    ret += kvcache_get(&testcache, keys[i], &retval);
+    ASSERT_PTR_NOT_NULL(retval);
+    sprintf(value, "myvalue%d", i);
+    ASSERT_STRING_EQUAL(retval, value);
+    free(retval);
+  }
   ASSERT_EQUAL(ret, 0);
   return 1;
 }
@@ -76,30 +88,222 @@ int kvcache_del_simple(void) {
 }
 
 int kvcache_set_locks(void) {
-  pthread_rwlock_t *l1, *l2, *l3, *l4, *l5, *l6;
+  char *keys[] = {"mykey1", "mykey2", "mykey3", "mykey4", "mykey5", "mykey6"};
+  pthread_rwlock_t *locks[6];
+  int i, j;
   kvcache_init(&testcache, 3, 3);
-  kvcache_put(&testcache, "mykey1", "myvalue1");
-  kvcache_put(&testcache, "mykey2", "myvalue2");
-  kvcache_put(&testcache, "mykey3", "myvalue3");
-  kvcache_put(&testcache, "mykey4", "myvalue4");
-  kvcache_put(&testcache, "mykey5", "myvalue5");
-  kvcache_put(&testcache, "mykey6", "myvalue6");
-  l1 = kvcache_getlock(&testcache, "mykey1");
-  l2 = kvcache_getlock(&testcache, "mykey2");
-  l3 = kvcache_getlock(&testcache, "mykey3");
-  l4 = kvcache_getlock(&testcache, "mykey4");
-  l5 = kvcache_getlock(&testcache, "mykey5");
-  l6 = kvcache_getlock(&testcache, "mykey6");
-  ASSERT_NOT_EQUAL(l1, l2);
-  ASSERT_NOT_EQUAL(l1, l3);
-  ASSERT_EQUAL(l1, l4);
-  ASSERT_NOT_EQUAL(l3, l5);
-  ASSERT_EQUAL(l3, l6);
-  ASSERT_EQUAL(l5, l2);
-  ASSERT_NOT_EQUAL(l6, l2);
+  for (i = 0; i < 6; i++)
+    kvcache_put(&testcache, keys[i], "myvalue");
+  for (i = 0; i < 6; i++)
+    locks[i] = kvcache_getlock(&testcache, keys[i]);
+  /* Keys share a lock exactly when they hash to the same set. */
+  for (i = 0; i < 6; i++) {
+    for (j = i + 1; j < 6; j++) {
+      if (kvhash(keys[i]) % 3 == kvhash(keys[j]) % 3) {
+        ASSERT_EQUAL(locks[i], locks[j]);
+      } else {
+        ASSERT_NOT_EQUAL(locks[i], locks[j]);
+      }
+    }
+  }
   return 1;
 }
 
+int kvcache_get_ref_shared(void) {
+  kvvalue_t *first, *second;
+  int ret;
+  ret = kvcache_put(&testcache, "mykey", "myvalue");
+  ret += kvcache_get_ref(&testcache, "mykey", &first);
+  ret += kvcache_get_ref(&testcache, "mykey", &second);
+  ASSERT_EQUAL(ret, 0);
+  /* Both readers share the cached buffer instead of receiving copies. */
+  ASSERT_EQUAL(first, second);
+  ASSERT_STRING_EQUAL(first->data, "myvalue");
+  /* Overwriting the entry must not invalidate references still held. */
+  ret = kvcache_put(&testcache, "mykey", "newvalue");
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_STRING_EQUAL(first->data, "myvalue");
+  kvvalue_release(first);
+  kvvalue_release(second);
+  ret = kvcache_get_ref(&testcache, "mykey", &first);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_STRING_EQUAL(first->data, "newvalue");
+  kvvalue_release(first);
+  return 1;
+}
+
+#define CONCURRENT_READERS 4
+#define CONCURRENT_ROUNDS 20000
+
+int concurrent_done;
+
+/* Repeatedly GETs keys being overwritten by kvcache_concurrent_get without
+ * taking any locks. Returns NULL if every hit returned a value which was
+ * stored for its key. */
+void *kvcache_concurrent_reader(void *arg) {
+  char key[16], prefix[16];
+  kvvalue_t *value;
+  int i = 0;
+  while (!__atomic_load_n(&concurrent_done, __ATOMIC_ACQUIRE)) {
+    sprintf(key, "key%d", i % 8);
+    sprintf(prefix, "val%d-", i % 8);
+    if (kvcache_get_ref(&testcache, key, &value) == 0) {
+      if (strncmp(value->data, prefix, strlen(prefix)) != 0)
+        return value;
+      kvvalue_release(value);
+    }
+    i++;
+  }
+  return NULL;
+}
+
+int kvcache_concurrent_get(void) {
+  pthread_t readers[CONCURRENT_READERS];
+  char key[16], value[32];
+  void *failed;
+  int i, failures = 0;
+  pthread_rwlock_t *lock;
+  for (i = 0; i < CONCURRENT_READERS; i++)
+    pthread_create(&readers[i], NULL, kvcache_concurrent_reader, NULL);
+  for (i = 0; i < CONCURRENT_ROUNDS; i++) {
+    sprintf(key, "key%d", i % 8);
+    sprintf(value, "val%d-%d", i % 8, i);
+    lock = kvcache_getlock(&testcache, key);
+    pthread_rwlock_wrlock(lock);
+    if (i % 5 == 4)
+      kvcache_del(&testcache, key);
+    else
+      kvcache_put(&testcache, key, value);
+    pthread_rwlock_unlock(lock);
+  }
+  __atomic_store_n(&concurrent_done, 1, __ATOMIC_RELEASE);
+  for (i = 0; i < CONCURRENT_READERS; i++) {
+    pthread_join(readers[i], &failed);
+    if (failed != NULL)
+      failures++;
+  }
+  ASSERT_EQUAL(failures, 0);
+  return 1;
+}
+
+/* Returns the number of the keys "key0" to "keyN-1" which are not found in
+ * the test cache with the value "valI". */
+int kvcache_count_missing(int n) {
+  char key[16], value[16];
+  kvvalue_t *ref;
+  int i, missing = 0;
+  for (i = 0; i < n; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(value, "val%d", i);
+    if (kvcache_get_ref(&testcache, key, &ref) != 0) {
+      missing++;
+      continue;
+    }
+    if (strcmp(ref->data, value) != 0)
+      missing++;
+    kvvalue_release(ref);
+  }
+  return missing;
+}
+
+int kvcache_resize_keeps_entries(void) {
+  char key[16], value[16];
+  pthread_rwlock_t *lock;
+  int i;
+  kvcache_init(&testcache, 2, 8);
+  for (i = 0; i < 8; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(value, "val%d", i);
+    kvcache_put(&testcache, key, value);
+  }
+  ASSERT_EQUAL(kvcache_resize(&testcache, 3, 4), -1);
+  ASSERT_EQUAL(kvcache_resize(&testcache, 8, 4), 0);
+  ASSERT_EQUAL(kvcache_count_missing(8), 0);
+  /* Half of the old sets have been moved. */
+  ASSERT_EQUAL(kvcache_resize_step(&testcache, 1), 1);
+  ASSERT_EQUAL(kvcache_count_missing(8), 0);
+  for (i = 8; i < 12; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(value, "val%d", i);
+    lock = kvcache_wrlock(&testcache, key);
+    kvcache_put(&testcache, key, value);
+    pthread_rwlock_unlock(lock);
+  }
+  ASSERT_EQUAL(kvcache_count_missing(12), 0);
+  ASSERT_EQUAL(kvcache_resize_step(&testcache, 1), 0);
+  ASSERT_EQUAL(testcache.num_sets, 8);
+  ASSERT_EQUAL(testcache.elem_per_set, 4);
+  ASSERT_EQUAL(kvcache_count_missing(12), 0);
+  return 1;
+}
+
+/* Repeatedly GETs keys which are never evicted or changed while the test
+ * cache is resized. Returns NULL if every GET found its key. */
+void *kvcache_resize_reader(void *arg) {
+  while (!__atomic_load_n(&concurrent_done, __ATOMIC_ACQUIRE)) {
+    if (kvcache_count_missing(16) != 0)
+      return &concurrent_done;
+  }
+  return NULL;
+}
+
+int kvcache_concurrent_resize(void) {
+  pthread_t readers[CONCURRENT_READERS];
+  char key[16], value[16];
+  void *failed;
+  int i, failures = 0;
+  kvcache_init(&testcache, 1, 32);
+  for (i = 0; i < 16; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(value, "val%d", i);
+    kvcache_put(&testcache, key, value);
+  }
+  for (i = 0; i < CONCURRENT_READERS; i++)
+    pthread_create(&readers[i], NULL, kvcache_resize_reader, NULL);
+  for (i = 1; i <= 64; i *= 2) {
+    ASSERT_EQUAL(kvcache_resize(&testcache, 2 * i, 32), 0);
+    while (kvcache_resize_step(&testcache, 1) > 0)
+      usleep(100);
+  }
+  __atomic_store_n(&concurrent_done, 1, __ATOMIC_RELEASE);
+  for (i = 0; i < CONCURRENT_READERS; i++) {
+    pthread_join(readers[i], &failed);
+    if (failed != NULL)
+      failures++;
+  }
+  ASSERT_EQUAL(failures, 0);
+  ASSERT_EQUAL(testcache.num_sets, 128);
+  return 1;
+}
+
+int kvcache_put_admit_policies(void) {
+  char *retval = NULL;
+  int ret;
+  ret = kvcache_put_admit(&testcache, "mykey1", "myvalue1", ADMIT_RESIDENT);
+  ASSERT_EQUAL(ret, 0);
+  ret = kvcache_get(&testcache, "mykey1", &retval);
+  ASSERT_EQUAL(ret, ERRNOKEY);
+  ret = kvcache_put(&testcache, "mykey1", "myvalue1");
+  ret += kvcache_put_admit(&testcache, "mykey1", "myvalue2", ADMIT_RESIDENT);
+  ret += kvcache_get(&testcache, "mykey1", &retval);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_STRING_EQUAL(retval, "myvalue2");
+  free(retval);
+  retval = NULL;
+  ret = kvcache_put_admit(&testcache, "mykey1", "myvalue3", ADMIT_AROUND);
+  ret += kvcache_put_admit(&testcache, "mykey2", "myvalue3", ADMIT_AROUND);
+  ASSERT_EQUAL(ret, 0);
+  ret = kvcache_get(&testcache, "mykey1", &retval);
+  ASSERT_EQUAL(ret, ERRNOKEY);
+  ret = kvcache_get(&testcache, "mykey2", &retval);
+  ASSERT_EQUAL(ret, ERRNOKEY);
+  ret = kvcache_put_admit(&testcache, "mykey2", "myvalue4", ADMIT_ALWAYS);
+  ret += kvcache_get(&testcache, "mykey2", &retval);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_STRING_EQUAL(retval, "myvalue4");
+  free(retval);
+  return 1;
+}
 
 test_info_t kvcache_tests[] = {
   {"Simple PUT and GET of a single value", kvcache_simple_put_get_single},
@@ -109,6 +313,11 @@ test_info_t kvcache_tests[] = {
   {"Simple DEL test", kvcache_del_simple},
   {"Testing that locks are same for keys in same set, diff for keys in "
     "diff sets", kvcache_set_locks},
+  {"GET by reference shares the cached value", kvcache_get_ref_shared},
+  {"Lock-free GETs during concurrent PUTs and DELs", kvcache_concurrent_get},
+  {"Resizing moves entries a set at a time", kvcache_resize_keeps_entries},
+  {"Lock-free GETs during a resize", kvcache_concurrent_resize},
+  {"PUTs follow the cache admission policy", kvcache_put_admit_policies},
   NULL_TEST_INFO
 };
 
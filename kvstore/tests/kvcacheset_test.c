@@ -1,4 +1,6 @@
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
 #include "tester.h"
 #include "kvcacheset.h"
 #include "kvconstants.h"
@@ -142,6 +144,206 @@ int kvcacheset_clear_all(void) {
   return 1;
 }
 
+int kvcacheset_arc_scan_resistant(void) {
+  char *retval = NULL;
+  int ret;
+  kvcacheset_init_policy(&testset, 3, CACHE_ARC);
+  kvcacheset_put(&testset, "key1", "val1");
+  kvcacheset_put(&testset, "key2", "val2");
+  kvcacheset_get(&testset, "key1", &retval);
+  free(retval);
+  kvcacheset_get(&testset, "key2", &retval);
+  free(retval);
+  /* A scan of keys seen only once should not push out key1 and key2. */
+  kvcacheset_put(&testset, "key3", "val3");
+  kvcacheset_put(&testset, "key4", "val4");
+  kvcacheset_put(&testset, "key5", "val5");
+  kvcacheset_put(&testset, "key6", "val6");
+  ret = kvcacheset_get(&testset, "key1", &retval);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_STRING_EQUAL(retval, "val1");
+  free(retval);
+  ret = kvcacheset_get(&testset, "key2", &retval);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_STRING_EQUAL(retval, "val2");
+  free(retval);
+  ret = kvcacheset_get(&testset, "key3", &retval);
+  ASSERT_EQUAL(ret, ERRNOKEY);
+  ASSERT_EQUAL(testset.num_entries, 3);
+  return 1;
+}
+
+int kvcacheset_arc_ghost_hit(void) {
+  char *retval = NULL;
+  int ret;
+  kvcacheset_init_policy(&testset, 3, CACHE_ARC);
+  kvcacheset_put(&testset, "key1", "val1");
+  kvcacheset_put(&testset, "key2", "val2");
+  kvcacheset_get(&testset, "key1", &retval);
+  free(retval);
+  kvcacheset_get(&testset, "key2", &retval);
+  free(retval);
+  kvcacheset_put(&testset, "key3", "val3");
+  kvcacheset_put(&testset, "key4", "val4");
+  ASSERT_EQUAL(testset.len[ARC_B1], 1);
+  ASSERT_EQUAL(testset.target, 0);
+  /* key3 was evicted from T1 too early, so T1 should be allowed to grow. */
+  kvcacheset_put(&testset, "key3", "val3new");
+  ASSERT_EQUAL(testset.target, 1);
+  ASSERT_EQUAL(testset.len[ARC_B1], 0);
+  ret = kvcacheset_get(&testset, "key3", &retval);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_STRING_EQUAL(retval, "val3new");
+  free(retval);
+  ret = kvcacheset_get(&testset, "key1", &retval);
+  ASSERT_EQUAL(ret, ERRNOKEY);
+  ASSERT_EQUAL(testset.len[ARC_B2], 1);
+  ASSERT_EQUAL(testset.num_entries, 3);
+  return 1;
+}
+
+int kvcacheset_negative_entry(void) {
+  kvvalue_t *ref;
+  int ret;
+  kvcacheset_put_negative(&testset, "key1", 1000);
+  ret = kvcacheset_get_ref(&testset, "key1", &ref);
+  ASSERT_EQUAL(ret, ERRNEGKEY);
+  ASSERT_EQUAL(testset.stats.negative_hits, 1);
+  /* A PUT replaces the negative entry. */
+  kvcacheset_put(&testset, "key1", "val1");
+  ret = kvcacheset_get_ref(&testset, "key1", &ref);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_STRING_EQUAL(ref->data, "val1");
+  kvvalue_release(ref);
+  /* ...and a negative entry never replaces a value. */
+  kvcacheset_put_negative(&testset, "key1", 1000);
+  ret = kvcacheset_get_ref(&testset, "key1", &ref);
+  ASSERT_EQUAL(ret, 0);
+  kvvalue_release(ref);
+  ASSERT_EQUAL(testset.stats.hits, 2);
+  return 1;
+}
+
+int kvcacheset_negative_entry_expires(void) {
+  kvvalue_t *ref;
+  int ret;
+  kvcacheset_put_negative(&testset, "key1", 0);
+  ret = kvcacheset_get_ref(&testset, "key1", &ref);
+  ASSERT_EQUAL(ret, ERRNOKEY);
+  ASSERT_EQUAL(testset.stats.misses, 1);
+  ASSERT_EQUAL(testset.stats.negative_hits, 0);
+  return 1;
+}
+
+/* Records the last key written by flush_record, and fails if FLUSH_FAILS. */
+static char flushed[MAX_KEYLEN + 1];
+static bool flush_fails;
+
+static int flush_record(void *arg, char *key, kvvalue_t *value) {
+  if (flush_fails)
+    return -1;
+  strcpy(flushed, key);
+  (*(int *) arg)++;
+  return 0;
+}
+
+int kvcacheset_dirty_entry_flushed_on_eviction(void) {
+  kvvalue_t *ref = kvvalue_new("val");
+  int flushes = 0;
+  testset.flush = flush_record;
+  testset.flush_arg = &flushes;
+  kvcacheset_put_dirty(&testset, "key1", ref);
+  kvcacheset_put(&testset, "key2", "val2");
+  kvcacheset_put(&testset, "key3", "val3");
+  ASSERT_EQUAL(flushes, 0);
+  /* Evicting key1 writes it out first. */
+  kvcacheset_put(&testset, "key4", "val4");
+  ASSERT_EQUAL(flushes, 1);
+  ASSERT_STRING_EQUAL(flushed, "key1");
+  /* Clean entries are never flushed. */
+  kvcacheset_put(&testset, "key5", "val5");
+  ASSERT_EQUAL(flushes, 1);
+  kvvalue_release(ref);
+  return 1;
+}
+
+int kvcacheset_dirty_entry_flush_failure(void) {
+  kvvalue_t *ref = kvvalue_new("val");
+  int flushes = 0;
+  testset.flush = flush_record;
+  testset.flush_arg = &flushes;
+  kvcacheset_put_dirty(&testset, "key1", ref);
+  flush_fails = true;
+  ASSERT_EQUAL(kvcacheset_flush(&testset), -1);
+  flush_fails = false;
+  /* The entry stayed dirty, so a later flush writes it. */
+  ASSERT_EQUAL(kvcacheset_flush(&testset), 0);
+  ASSERT_EQUAL(flushes, 1);
+  ASSERT_EQUAL(kvcacheset_flush(&testset), 0);
+  ASSERT_EQUAL(flushes, 1);
+  kvvalue_release(ref);
+  return 1;
+}
+
+/* Fills TESTSET, initialized with POLICY, with dirty entries, and checks
+ * that none of them is evicted while they cannot be flushed. */
+static int check_eviction_flush_failure(cache_policy_t policy) {
+  kvvalue_t *ref = kvvalue_new("val"), *cached;
+  int flushes = 0;
+  kvcacheset_init_policy(&testset, 3, policy);
+  testset.flush = flush_record;
+  testset.flush_arg = &flushes;
+  kvcacheset_put_dirty(&testset, "key1", ref);
+  kvcacheset_put_dirty(&testset, "key2", ref);
+  kvcacheset_put_dirty(&testset, "key3", ref);
+  flush_fails = true;
+  ASSERT_TRUE(kvcacheset_put(&testset, "key4", "val4") < 0);
+  ASSERT_TRUE(kvcacheset_put_dirty(&testset, "key4", ref) < 0);
+  flush_fails = false;
+  ASSERT_EQUAL(kvcacheset_get_ref(&testset, "key4", &cached), ERRNOKEY);
+  ASSERT_EQUAL(kvcacheset_get_ref(&testset, "key1", &cached), 0);
+  kvvalue_release(cached);
+  /* The writes are all still there to be flushed. */
+  ASSERT_EQUAL(kvcacheset_flush(&testset), 0);
+  ASSERT_EQUAL(flushes, 3);
+  ASSERT_EQUAL(kvcacheset_put(&testset, "key4", "val4"), 0);
+  kvvalue_release(ref);
+  return 1;
+}
+
+int kvcacheset_eviction_flush_failure(void) {
+  return check_eviction_flush_failure(CACHE_SECOND_CHANCE);
+}
+
+int kvcacheset_arc_eviction_flush_failure(void) {
+  return check_eviction_flush_failure(CACHE_ARC);
+}
+
+int kvcacheset_inline_value_outlives_entry(void) {
+  char longval[CACHE_INLINE_VALUE + 2];
+  kvvalue_t *shortref, *longref;
+  int ret;
+  memset(longval, 'x', sizeof(longval) - 1);
+  longval[sizeof(longval) - 1] = '\0';
+  ret = kvcacheset_put(&testset, "short", "tiny");
+  ret += kvcacheset_put(&testset, "long", longval);
+  ret += kvcacheset_get_ref(&testset, "short", &shortref);
+  ret += kvcacheset_get_ref(&testset, "long", &longref);
+  ASSERT_EQUAL(ret, 0);
+  /* References taken before the entries go away must stay valid. */
+  ret = kvcacheset_del(&testset, "short");
+  ret += kvcacheset_put(&testset, "long", "replaced");
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_STRING_EQUAL(shortref->data, "tiny");
+  ASSERT_EQUAL(shortref->length, 4);
+  ASSERT_STRING_EQUAL(longref->data, longval);
+  kvvalue_release(shortref);
+  kvvalue_release(longref);
+  ASSERT_EQUAL(kvcacheset_get_ref(&testset, "long", &longref), 0);
+  ASSERT_STRING_EQUAL(longref->data, "replaced");
+  kvvalue_release(longref);
+  return 1;
+}
 
 test_info_t kvcacheset_tests[] = {
   {"Simple PUT and GET of a single value", kvcacheset_simple_put_get_single},
@@ -154,6 +356,21 @@ test_info_t kvcacheset_tests[] = {
   {"PUT with overfull cache, replacement policy when all ref bits set",
     kvcacheset_replacement_all_ref_bits},
   {"Clearing the cache set", kvcacheset_clear_all},
+  {"ARC keeps frequently used entries during a scan",
+    kvcacheset_arc_scan_resistant},
+  {"ARC adapts its target on a ghost hit", kvcacheset_arc_ghost_hit},
+  {"Negative entries until a PUT", kvcacheset_negative_entry},
+  {"Negative entries expire", kvcacheset_negative_entry_expires},
+  {"Dirty entries are flushed before eviction",
+    kvcacheset_dirty_entry_flushed_on_eviction},
+  {"Dirty entries stay dirty when a flush fails",
+    kvcacheset_dirty_entry_flush_failure},
+  {"Dirty entries are not evicted while a flush fails",
+    kvcacheset_eviction_flush_failure},
+  {"ARC does not evict dirty entries while a flush fails",
+    kvcacheset_arc_eviction_flush_failure},
+  {"Inline values stay valid after their entry is gone",
+    kvcacheset_inline_value_outlives_entry},
   NULL_TEST_INFO
 };
 
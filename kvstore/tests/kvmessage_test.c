@@ -0,0 +1,272 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "kvmessage.h"
+#include "tester.h"
+
+int kvmessage_sockets[2];
+
+int kvmessage_test_init(void) {
+  return socketpair(AF_UNIX, SOCK_STREAM, 0, kvmessage_sockets);
+}
+
+int kvmessage_test_clean(void) {
+  close(kvmessage_sockets[0]);
+  close(kvmessage_sockets[1]);
+  return 0;
+}
+
+int kvmessage_json_round_trip(void) {
+  kvmessage_t msg, *parsed;
+  memset(&msg, 0, sizeof(kvmessage_t));
+  msg.type = PUTREQ;
+  msg.key = "key";
+  msg.value = "value";
+  msg.admit = ADMIT_AROUND;
+  msg.id = 4000000000U;
+  ASSERT_TRUE(kvmessage_send(&msg, kvmessage_sockets[0]) > 0);
+  ASSERT_EQUAL(kvmessage_peek_id(kvmessage_sockets[1]), -1);
+  parsed = kvmessage_parse(kvmessage_sockets[1]);
+  ASSERT_PTR_NOT_NULL(parsed);
+  ASSERT_FALSE(parsed->binary);
+  ASSERT_EQUAL(parsed->type, PUTREQ);
+  ASSERT_STRING_EQUAL(parsed->key, "key");
+  ASSERT_STRING_EQUAL(parsed->value, "value");
+  ASSERT_PTR_NULL(parsed->message);
+  ASSERT_EQUAL(parsed->admit, ADMIT_AROUND);
+  ASSERT_EQUAL(parsed->id, 4000000000U);
+  kvmessage_free(parsed);
+  return 1;
+}
+
+int kvmessage_binary_parsed_into_buffer(void) {
+  kvmessage_t msg, *parsed;
+  kvmessage_buffer_t buffer;
+  memset(&msg, 0, sizeof(kvmessage_t));
+  msg.type = PUTREQ;
+  msg.key = "key";
+  msg.value = "";
+  msg.admit = ADMIT_RESIDENT;
+  msg.id = 42;
+  msg.binary = true;
+  ASSERT_EQUAL(kvmessage_send(&msg, kvmessage_sockets[0]),
+      (int) (sizeof(kvheader_t) + strlen("key")));
+  ASSERT_EQUAL(kvmessage_peek_size(kvmessage_sockets[1]),
+      (long) (sizeof(kvheader_t) + strlen("key")));
+  ASSERT_EQUAL(kvmessage_peek_id(kvmessage_sockets[1]), 42);
+  parsed = kvmessage_parse_buffered(kvmessage_sockets[1], &buffer);
+  /* No allocation: the message and its fields live in the buffer. */
+  ASSERT_TRUE(parsed == &buffer.msg);
+  ASSERT_TRUE(parsed->borrowed);
+  ASSERT_TRUE(parsed->key >= buffer.data
+      && parsed->key < buffer.data + KVMESSAGE_INLINE);
+  ASSERT_TRUE(parsed->binary);
+  ASSERT_EQUAL(parsed->type, PUTREQ);
+  ASSERT_STRING_EQUAL(parsed->key, "key");
+  ASSERT_STRING_EQUAL(parsed->value, "");
+  ASSERT_PTR_NULL(parsed->message);
+  ASSERT_EQUAL(parsed->admit, ADMIT_RESIDENT);
+  ASSERT_EQUAL(parsed->id, 42);
+  kvmessage_free(parsed);
+  return 1;
+}
+
+int kvmessage_binary_too_large_for_buffer(void) {
+  kvmessage_t msg, *parsed;
+  kvmessage_buffer_t buffer;
+  char *message = malloc(2 * KVMESSAGE_INLINE + 1);
+  memset(message, 'm', 2 * KVMESSAGE_INLINE);
+  message[2 * KVMESSAGE_INLINE] = '\0';
+  memset(&msg, 0, sizeof(kvmessage_t));
+  msg.type = RESP;
+  msg.message = message;
+  msg.binary = true;
+  kvmessage_send(&msg, kvmessage_sockets[0]);
+  parsed = kvmessage_parse_buffered(kvmessage_sockets[1], &buffer);
+  ASSERT_PTR_NOT_NULL(parsed);
+  ASSERT_TRUE(parsed != &buffer.msg);
+  ASSERT_FALSE(parsed->borrowed);
+  ASSERT_PTR_NULL(parsed->key);
+  ASSERT_STRING_EQUAL(parsed->message, message);
+  kvmessage_free(parsed);
+  free(message);
+  return 1;
+}
+
+int kvmessage_framings_mixed(void) {
+  kvmessage_t msg, *parsed;
+  char key[MAX_KEYLEN + 1];
+  int i;
+  memset(&msg, 0, sizeof(kvmessage_t));
+  msg.type = GETREQ;
+  msg.key = "mixed";
+  for (i = 0; i < 4; i++) {
+    msg.binary = i % 2;
+    kvmessage_send(&msg, kvmessage_sockets[0]);
+  }
+  for (i = 0; i < 4; i++) {
+    ASSERT_EQUAL(kvmessage_peek_key(kvmessage_sockets[1], key), i % 2 ? 1 : -1);
+    if (i % 2)
+      ASSERT_STRING_EQUAL(key, "mixed");
+    parsed = kvmessage_parse(kvmessage_sockets[1]);
+    ASSERT_PTR_NOT_NULL(parsed);
+    ASSERT_EQUAL(parsed->binary, i % 2);
+    ASSERT_STRING_EQUAL(parsed->key, "mixed");
+    kvmessage_free(parsed);
+  }
+  return 1;
+}
+
+int kvmessage_binary_partial_header(void) {
+  kvheader_t header;
+  kvmessage_t *parsed;
+  memset(&header, 0, sizeof(header));
+  header.magic = KVMESSAGE_MAGIC;
+  header.type = GETREQ;
+  send(kvmessage_sockets[0], &header, 6, 0);
+  ASSERT_EQUAL(kvmessage_peek_size(kvmessage_sockets[1]), 0);
+  send(kvmessage_sockets[0], (char *) &header + 6, sizeof(header) - 6, 0);
+  ASSERT_EQUAL(kvmessage_peek_size(kvmessage_sockets[1]),
+      (long) sizeof(header));
+  parsed = kvmessage_parse(kvmessage_sockets[1]);
+  ASSERT_PTR_NOT_NULL(parsed);
+  ASSERT_EQUAL(parsed->type, GETREQ);
+  ASSERT_PTR_NULL(parsed->key);
+  kvmessage_free(parsed);
+  return 1;
+}
+
+int kvmessage_json_arrives_in_pieces(void) {
+  kvmessage_t msg, *parsed;
+  char frame[256];
+  ssize_t size;
+  memset(&msg, 0, sizeof(kvmessage_t));
+  msg.type = GETREQ;
+  msg.key = "pieces";
+  kvmessage_send(&msg, kvmessage_sockets[0]);
+  size = recv(kvmessage_sockets[1], frame, sizeof(frame), 0);
+  ASSERT_TRUE(size > 8);
+  /* The parser must read the rest of the body rather than give up. */
+  send(kvmessage_sockets[0], frame, 7, 0);
+  if (fork() == 0) {
+    usleep(50000);
+    send(kvmessage_sockets[0], frame + 7, size - 7, 0);
+    _exit(0);
+  }
+  parsed = kvmessage_parse(kvmessage_sockets[1]);
+  ASSERT_PTR_NOT_NULL(parsed);
+  ASSERT_EQUAL(parsed->type, GETREQ);
+  ASSERT_STRING_EQUAL(parsed->key, "pieces");
+  kvmessage_free(parsed);
+  return 1;
+}
+
+int kvmessage_frames_decoded_from_memory(void) {
+  kvmessage_t msg, *decoded;
+  kvmessage_buffer_t buffer;
+  char frames[512];
+  ssize_t size, first;
+  int i;
+  memset(&msg, 0, sizeof(kvmessage_t));
+  msg.type = PUTREQ;
+  msg.key = "decoded";
+  msg.value = "value";
+  for (i = 0; i < 2; i++) {
+    msg.binary = (i == 0);
+    msg.id = i + 1;
+    kvmessage_send(&msg, kvmessage_sockets[0]);
+  }
+  size = recv(kvmessage_sockets[1], frames, sizeof(frames), 0);
+  first = sizeof(kvheader_t) + strlen("decoded") + strlen("value");
+  ASSERT_TRUE(size > first + 4);
+  /* Sizes are only told once enough of a header is there. */
+  ASSERT_EQUAL(kvmessage_frame_size(frames, 3), 0);
+  ASSERT_EQUAL(kvmessage_frame_size(frames, sizeof(kvheader_t) - 1), 0);
+  ASSERT_EQUAL(kvmessage_frame_size(frames, size), first);
+  ASSERT_EQUAL(kvmessage_frame_size(frames + first, 4), size - first);
+  ASSERT_PTR_NULL(kvmessage_decode(frames, first - 1, &buffer));
+
+  decoded = kvmessage_decode(frames, first, &buffer);
+  ASSERT_TRUE(decoded == &buffer.msg);
+  ASSERT_TRUE(decoded->binary);
+  ASSERT_EQUAL(decoded->id, 1);
+  ASSERT_STRING_EQUAL(decoded->key, "decoded");
+  ASSERT_STRING_EQUAL(decoded->value, "value");
+  kvmessage_free(decoded);
+
+  /* JSON is decoded from bytes which are not null terminated. */
+  decoded = kvmessage_decode(frames + first, size - first, &buffer);
+  ASSERT_PTR_NOT_NULL(decoded);
+  ASSERT_FALSE(decoded->binary);
+  ASSERT_EQUAL(decoded->id, 2);
+  ASSERT_STRING_EQUAL(decoded->key, "decoded");
+  ASSERT_STRING_EQUAL(decoded->value, "value");
+  kvmessage_free(decoded);
+  return 1;
+}
+
+int kvmessage_oversized_frames_rejected(void) {
+  kvheader_t header;
+  char frame[sizeof(kvheader_t) + 1];
+  int size = htonl(KVMESSAGE_MAX_BODY + 1);
+  memset(&header, 0, sizeof(header));
+  header.magic = KVMESSAGE_MAGIC;
+  header.flags = htons(KVMESSAGE_HAS_VALUE);
+  header.value_len = htonl(KVMESSAGE_MAX_BODY + 1);
+  ASSERT_EQUAL(kvmessage_frame_size(&header, sizeof(header)), -1);
+  ASSERT_EQUAL(kvmessage_frame_size(&size, 4), -1);
+  /* A length for a field which is absent is invalid too. */
+  header.flags = 0;
+  header.value_len = htonl(1);
+  memcpy(frame, &header, sizeof(header));
+  frame[sizeof(header)] = 'v';
+  ASSERT_EQUAL(kvmessage_frame_size(frame, sizeof(frame)), sizeof(frame));
+  ASSERT_PTR_NULL(kvmessage_decode(frame, sizeof(frame), NULL));
+  send(kvmessage_sockets[0], &size, 4, 0);
+  ASSERT_PTR_NULL(kvmessage_parse(kvmessage_sockets[1]));
+  return 1;
+}
+
+int kvmessage_encoded_as_sent(void) {
+  kvmessage_t msg;
+  char sent[256], encoded[256];
+  ssize_t size;
+  int binary;
+  memset(&msg, 0, sizeof(kvmessage_t));
+  msg.type = GETRESP;
+  msg.key = "encoded";
+  msg.value = "value";
+  msg.id = 7;
+  for (binary = 0; binary < 2; binary++) {
+    msg.binary = binary;
+    ASSERT_TRUE(kvmessage_send(&msg, kvmessage_sockets[0]) > 0);
+    size = recv(kvmessage_sockets[1], sent, sizeof(sent), 0);
+    /* Too small a buffer is left alone, but the size is still told. */
+    ASSERT_EQUAL(kvmessage_encode(&msg, encoded, size - 1), size);
+    ASSERT_EQUAL(kvmessage_encode(&msg, encoded, sizeof(encoded)), size);
+    ASSERT_TRUE(memcmp(sent, encoded, size) == 0);
+  }
+  return 1;
+}
+
+test_info_t kvmessage_tests[] = {
+  {"JSON messages keep their fields", kvmessage_json_round_trip},
+  {"Binary messages are parsed into the caller's buffer",
+    kvmessage_binary_parsed_into_buffer},
+  {"Binary messages too large for the buffer are allocated",
+    kvmessage_binary_too_large_for_buffer},
+  {"Both framings can share a connection", kvmessage_framings_mixed},
+  {"Binary headers are only sized once whole", kvmessage_binary_partial_header},
+  {"JSON messages arriving in pieces are parsed whole",
+    kvmessage_json_arrives_in_pieces},
+  {"Messages are sized and decoded from memory",
+    kvmessage_frames_decoded_from_memory},
+  {"Oversized messages are rejected", kvmessage_oversized_frames_rejected},
+  {"Messages are encoded as they are sent", kvmessage_encoded_as_sent},
+  NULL_TEST_INFO
+};
+
+suite_info_t kvmessage_suite = {"KVMessage Tests", kvmessage_test_init,
+  kvmessage_test_clean, kvmessage_tests};
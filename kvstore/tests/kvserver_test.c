@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <string.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -197,6 +198,14 @@ int kvserver_use_cache(void) {
   return 1;
 }
 
+int kvserver_arc_cache(void) {
+  kvserver_init_policy(&testserver, KVSERVER_DIRNAME, 4, 4, 1,
+      KVSERVER_HOSTNAME, KVSERVER_PORT, false, CACHE_ARC);
+  ASSERT_EQUAL(testserver.cache.policy, CACHE_ARC);
+  ASSERT_EQUAL(testserver.cache.sets[0].policy, CACHE_ARC);
+  return kvserver_use_cache();
+}
+
 int kvserver_get_fills_cache(void) {
   kvserver_init(&testserver, KVSERVER_DIRNAME, 1, 2, 1, KVSERVER_HOSTNAME,
       KVSERVER_PORT, false);
@@ -240,6 +249,137 @@ int kvserver_get_fills_cache(void) {
   return 1;
 }
 
+int kvserver_get_negative_cache(void) {
+  kvcachestats_t stats;
+  reqmsg.type = GETREQ;
+  reqmsg.key = "MYKEY";
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, RESP);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_NO_KEY);
+  /* The second GET is answered by the negative entry left by the first. */
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, RESP);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_NO_KEY);
+  kvcache_stats(&testserver.cache, &stats);
+  ASSERT_EQUAL(stats.negative_hits, 1);
+
+  reqmsg.type = PUTREQ;
+  reqmsg.value = "MYVALUE";
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, RESP);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  reqmsg.type = GETREQ;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, GETRESP);
+  ASSERT_STRING_EQUAL(respmsg.value, "MYVALUE");
+  return 1;
+}
+
+int kvserver_write_back_put(void) {
+  char *value;
+  kvserver_enable_write_back(&testserver, 0);
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "MYKEY";
+  reqmsg.value = "MYVALUE";
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, RESP);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  /* The PUT is only in the cache until the next flush. */
+  ASSERT_EQUAL(kvstore_get(&testserver.store, "MYKEY", &value), ERRNOKEY);
+  reqmsg.type = GETREQ;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, GETRESP);
+  ASSERT_STRING_EQUAL(respmsg.value, "MYVALUE");
+  ASSERT_EQUAL(kvserver_flush(&testserver), 0);
+  ASSERT_EQUAL(kvstore_get(&testserver.store, "MYKEY", &value), 0);
+  ASSERT_STRING_EQUAL(value, "MYVALUE");
+  free(value);
+  return 1;
+}
+
+int kvserver_write_back_del(void) {
+  kvserver_enable_write_back(&testserver, 0);
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "MYKEY";
+  reqmsg.value = "MYVALUE";
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  reqmsg.type = DELREQ;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, RESP);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  reqmsg.type = GETREQ;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, RESP);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_NO_KEY);
+  return 1;
+}
+
+int kvserver_write_back_replay(void) {
+  char *value;
+  kvserver_enable_write_back(&testserver, 0);
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "MYKEY1";
+  reqmsg.value = "MYVALUE1";
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  reqmsg.key = "MYKEY2";
+  reqmsg.value = "MYVALUE2";
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  reqmsg.type = DELREQ;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+
+  /* Simulate a crash: a new server over the same directory loses the cache,
+     but replays the WAL into its store. */
+  kvserver_init(&testserver, KVSERVER_DIRNAME, 4, 4, 1, KVSERVER_HOSTNAME,
+      KVSERVER_PORT, false);
+  ASSERT_EQUAL(kvserver_enable_write_back(&testserver, 0), 0);
+  ASSERT_EQUAL(kvstore_get(&testserver.store, "MYKEY1", &value), 0);
+  ASSERT_STRING_EQUAL(value, "MYVALUE1");
+  free(value);
+  ASSERT_EQUAL(kvstore_get(&testserver.store, "MYKEY2", &value), ERRNOKEY);
+  return 1;
+}
+
+int kvserver_warm_cache_from_snapshot(void) {
+  kvvalue_t *value;
+  int i;
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "MYKEY1";
+  reqmsg.value = "MYVALUE1";
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  reqmsg.key = "MYKEY2";
+  reqmsg.value = "MYVALUE2";
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(kvserver_save_snapshot(&testserver), 0);
+
+  /* Restart with an empty cache, which warms up in the background. */
+  kvserver_init(&testserver, KVSERVER_DIRNAME, 4, 4, 1, KVSERVER_HOSTNAME,
+      KVSERVER_PORT, false);
+  ASSERT_EQUAL(kvcache_get_ref(&testserver.cache, "MYKEY1", &value), ERRNOKEY);
+  ASSERT_EQUAL(kvserver_warm_cache(&testserver, 2, 0), 0);
+  for (i = 0; i < 100; i++) {
+    if (kvcache_get_ref(&testserver.cache, "MYKEY2", &value) == 0)
+      break;
+    usleep(1000 * SLEEP_TIME);
+  }
+  ASSERT(i < 100);
+  ASSERT_STRING_EQUAL(value->data, "MYVALUE2");
+  kvvalue_release(value);
+  for (; i < 100; i++) {
+    if (kvcache_get_ref(&testserver.cache, "MYKEY1", &value) == 0)
+      break;
+    usleep(1000 * SLEEP_TIME);
+  }
+  ASSERT(i < 100);
+  ASSERT_STRING_EQUAL(value->data, "MYVALUE1");
+  kvvalue_release(value);
+  return 1;
+}
+
+int kvserver_warm_cache_without_snapshot(void) {
+  ASSERT_EQUAL(kvserver_warm_cache(&testserver, 2, 100), 0);
+  return 1;
+}
+
 /* Attempts to submit the current request message and then set SYNCH variable
  * to 1 to indicate that the request completed. */
 void *kvserver_concurrent_helper(void *aux) {
@@ -336,13 +476,113 @@ int kvserver_cache_concurrent_get_cache_writes(void) {
 }
 
 
+int kvserver_hotkeys_report(void) {
+  int i;
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "HOTKEY";
+  reqmsg.value = "MYVALUE";
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  reqmsg.type = GETREQ;
+  for (i = 1; i < 64; i++) {
+    kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+    ASSERT_EQUAL(respmsg.type, GETRESP);
+    kvmessage_release_value(&respmsg);
+  }
+  reqmsg.type = HOTKEYS;
+  reqmsg.key = "";
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, HOTKEYS);
+  ASSERT_PTR_NOT_NULL(strstr(respmsg.message, "{HOTKEY, 64, 0}"));
+  free(respmsg.message);
+  return 1;
+}
+
+int kvserver_put_write_around(void) {
+  char *value = NULL;
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "MYKEY";
+  reqmsg.value = "MYVALUE";
+  reqmsg.admit = ADMIT_AROUND;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  reqmsg.admit = ADMIT_DEFAULT;
+  ASSERT_EQUAL(respmsg.type, RESP);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  ASSERT_EQUAL(kvcache_get(&testserver.cache, "MYKEY", &value), ERRNOKEY);
+  reqmsg.type = GETREQ;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, GETRESP);
+  ASSERT_STRING_EQUAL(respmsg.value, "MYVALUE");
+  return 1;
+}
+
+int kvserver_miss_races_write_around(void) {
+  kvvalue_t *old;
+  char *value = NULL;
+  unsigned long since;
+  ASSERT_EQUAL(kvserver_put_admit(&testserver, "MYKEY", "OLD", ADMIT_AROUND), 0);
+  /* A miss reads the old value from the store, and a PUT written around the
+     cache completes before the miss fills the cache. */
+  since = kvserver_version(&testserver);
+  ASSERT_EQUAL(kvstore_get_ref(&testserver.store, "MYKEY", &old), 0);
+  ASSERT_EQUAL(kvserver_put_admit(&testserver, "MYKEY", "NEW", ADMIT_AROUND), 0);
+  ASSERT_FALSE(kvserver_fill(&testserver, "MYKEY", old, since));
+  kvvalue_release(old);
+  ASSERT_EQUAL(kvserver_get(&testserver, "MYKEY", &value), 0);
+  ASSERT_STRING_EQUAL(value, "NEW");
+  free(value);
+  /* Likewise, a miss on a new key does not cache a negative entry. */
+  since = kvserver_version(&testserver);
+  ASSERT_EQUAL(kvstore_get_ref(&testserver.store, "NEWKEY", &old), ERRNOKEY);
+  ASSERT_EQUAL(kvserver_put_admit(&testserver, "NEWKEY", "VAL", ADMIT_RESIDENT), 0);
+  ASSERT_FALSE(kvserver_fill(&testserver, "NEWKEY", NULL, since));
+  ASSERT_EQUAL(kvserver_get(&testserver, "NEWKEY", &value), 0);
+  ASSERT_STRING_EQUAL(value, "VAL");
+  free(value);
+  return 1;
+}
+
+int kvserver_resize_message(void) {
+  char *value = NULL;
+  ASSERT_EQUAL(kvserver_put(&testserver, "MYKEY", "MYVALUE"), 0);
+  reqmsg.type = RESIZE;
+  reqmsg.value = "6";
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, RESP);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  /* The number of sets is rounded up to a multiple of the current one. */
+  while (kvcache_resize_step(&testserver.cache, 4) > 0)
+    ;
+  ASSERT_EQUAL(testserver.cache.num_sets, 8);
+  ASSERT_EQUAL(kvserver_get(&testserver, "MYKEY", &value), 0);
+  ASSERT_STRING_EQUAL(value, "MYVALUE");
+  free(value);
+  /* The cache only grows. */
+  reqmsg.value = "8";
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_GENERIC_ERROR);
+  reqmsg.value = "lots";
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_INVALID_REQUEST);
+  return 1;
+}
+
 test_info_t kvserver_tests[] = {
   {"Simple PUT and GET of a single value", kvserver_single_put_get},
   {"Simple PUT and GET of multiple values", kvserver_multiple_put_get},
   {"GET when there is no valid key", kvserver_get_no_key},
   {"GET on an oversized key", kvserver_get_oversized_key},
   {"GET requests fill the cache", kvserver_get_fills_cache},
+  {"GET of a missing key is cached until a PUT", kvserver_get_negative_cache},
+  {"Server with an ARC cache uses it", kvserver_arc_cache},
   {"PUT on an oversized key or value", kvserver_put_oversized_fields},
+  {"Write-back PUT reaches the store on flush", kvserver_write_back_put},
+  {"Write-back DEL of a dirty key", kvserver_write_back_del},
+  {"Write-back PUTs are replayed from the WAL", kvserver_write_back_replay},
+  {"Cache is warmed from a snapshot after a restart",
+    kvserver_warm_cache_from_snapshot},
+  {"Warming without a snapshot does nothing",
+    kvserver_warm_cache_without_snapshot},
   {"Simple DEL on a value", kvserver_del_simple},
   {"PUT request cannot complete when a lock is held on cacheset",
     kvserver_cache_concurrent_puts},
@@ -350,6 +590,11 @@ test_info_t kvserver_tests[] = {
     kvserver_cache_concurrent_gets_rdlock},
   {"GET request cannot complete when a read lock is held on cacheset and the "
     "cache must be filled", kvserver_cache_concurrent_get_cache_writes},
+  {"HOTKEYS reports the most requested keys", kvserver_hotkeys_report},
+  {"RESIZE grows the cache", kvserver_resize_message},
+  {"PUT written around the cache is still read", kvserver_put_write_around},
+  {"GET miss racing a PUT written around the cache does not cache the old "
+    "value", kvserver_miss_races_write_around},
   NULL_TEST_INFO
 };
 
@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "kvconstants.h"
+#include "kvcache.h"
+#include "kvsnapshot.h"
+#include "tester.h"
+
+#define SNAPSHOT_TEST_FILE "kvsnapshot-test.snapshot"
+
+kvcache_t snapcache;
+
+int kvsnapshot_test_init(void) {
+  kvcache_init(&snapcache, 2, 4);
+  return 0;
+}
+
+int kvsnapshot_test_clean(void) {
+  remove(SNAPSHOT_TEST_FILE);
+  return 0;
+}
+
+/* Returns the entry for KEY within the COUNT ENTRIES, or NULL. */
+kvsnapshot_entry_t *kvsnapshot_find(kvsnapshot_entry_t *entries,
+    unsigned int count, char *key) {
+  unsigned int i;
+  for (i = 0; i < count; i++) {
+    if (strcmp(entries[i].key, key) == 0)
+      return &entries[i];
+  }
+  return NULL;
+}
+
+int kvsnapshot_save_load(void) {
+  kvsnapshot_entry_t *entries, *e;
+  kvvalue_t *ref;
+  unsigned int count;
+  kvcache_put(&snapcache, "key1", "val1");
+  kvcache_put(&snapcache, "key2", "val2");
+  kvcache_put(&snapcache, "key3", "val3");
+  kvcache_put_negative(&snapcache, "missing");
+  kvcache_get_ref(&snapcache, "key2", &ref);
+  kvvalue_release(ref);
+  ASSERT_EQUAL(kvsnapshot_save(&snapcache, SNAPSHOT_TEST_FILE), 0);
+  ASSERT_EQUAL(kvsnapshot_load(SNAPSHOT_TEST_FILE, &entries, &count), 0);
+  /* Negative entries are left out. */
+  ASSERT_EQUAL(count, 3);
+  ASSERT_PTR_NULL(kvsnapshot_find(entries, count, "missing"));
+  e = kvsnapshot_find(entries, count, "key1");
+  ASSERT_PTR_NOT_NULL(e);
+  ASSERT(!e->referenced);
+  e = kvsnapshot_find(entries, count, "key2");
+  ASSERT_PTR_NOT_NULL(e);
+  ASSERT(e->referenced);
+  kvsnapshot_free(entries, count);
+  return 1;
+}
+
+int kvsnapshot_load_truncated(void) {
+  kvsnapshot_entry_t *entries;
+  unsigned int count, saved;
+  struct stat st;
+  char key[16];
+  int i;
+  for (i = 0; i < 8; i++) {
+    sprintf(key, "key%d", i);
+    kvcache_put(&snapcache, key, "value");
+  }
+  ASSERT_EQUAL(kvsnapshot_save(&snapcache, SNAPSHOT_TEST_FILE), 0);
+  ASSERT_EQUAL(kvsnapshot_load(SNAPSHOT_TEST_FILE, &entries, &saved), 0);
+  kvsnapshot_free(entries, saved);
+  /* Cut the last record short; the ones before it are still read. */
+  stat(SNAPSHOT_TEST_FILE, &st);
+  truncate(SNAPSHOT_TEST_FILE, st.st_size - 2);
+  ASSERT_EQUAL(kvsnapshot_load(SNAPSHOT_TEST_FILE, &entries, &count), 0);
+  ASSERT_EQUAL(count, saved - 1);
+  kvsnapshot_free(entries, count);
+  return 1;
+}
+
+int kvsnapshot_load_invalid(void) {
+  kvsnapshot_entry_t *entries;
+  unsigned int count;
+  FILE *file;
+  ASSERT(kvsnapshot_load(SNAPSHOT_TEST_FILE, &entries, &count) < 0);
+  file = fopen(SNAPSHOT_TEST_FILE, "w");
+  fputs("not a snapshot", file);
+  fclose(file);
+  ASSERT(kvsnapshot_load(SNAPSHOT_TEST_FILE, &entries, &count) < 0);
+  return 1;
+}
+
+test_info_t kvsnapshot_tests[] = {
+  {"Saving and loading the keys of a cache", kvsnapshot_save_load},
+  {"Loading a snapshot cut short", kvsnapshot_load_truncated},
+  {"Loading a missing or invalid snapshot", kvsnapshot_load_invalid},
+  NULL_TEST_INFO
+};
+
+suite_info_t kvsnapshot_suite = {"KVSnapshot Tests", kvsnapshot_test_init,
+  kvsnapshot_test_clean, kvsnapshot_tests};
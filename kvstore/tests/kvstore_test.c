@@ -221,6 +221,27 @@ int kvstore_multiple_put_get(void) {
   return 1;
 }
 
+int kvstore_get_ref_reads_value(void) {
+  char value[MAX_VALLEN + 1];
+  kvvalue_t *ref;
+  int ret;
+  memset(value, 'v', MAX_VALLEN);
+  value[MAX_VALLEN] = '\0';
+  ret = kvstore_put(&teststore, "long value", value);
+  ret += kvstore_put(&teststore, "long", "short");
+  ret += kvstore_get_ref(&teststore, "long value", &ref);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_EQUAL(ref->refcount, 1);
+  ASSERT_EQUAL(ref->length, MAX_VALLEN);
+  ASSERT_STRING_EQUAL(ref->data, value);
+  kvvalue_release(ref);
+  ASSERT_EQUAL(kvstore_get_ref(&teststore, "long", &ref), 0);
+  ASSERT_STRING_EQUAL(ref->data, "short");
+  kvvalue_release(ref);
+  ASSERT_EQUAL(kvstore_get_ref(&teststore, "lon", &ref), ERRNOKEY);
+  return 1;
+}
+
 test_info_t kvstore_tests[] = {
   {"Simple PUT and GET of a single value", kvstore_single_put_get},
   {"Simple PUT and GET of multiple values", kvstore_multiple_put_get},
@@ -237,6 +258,8 @@ test_info_t kvstore_tests[] = {
   {"Simple DEL on a value", kvstore_del_simple},
   {"DEL on a key that does not exist", kvstore_del_no_key},
   {"DEL on keys which have hash conflicts", kvstore_del_hash_conflicts},
+  {"GET into a shared value read straight from the store",
+    kvstore_get_ref_reads_value},
   NULL_TEST_INFO
 };
 
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <string.h>
+#include "resp.h"
+#include "tester.h"
+
+/* Decodes the requests of the whole command FRAME into BUFFERS and PARTS,
+ * and returns their number. */
+static int decode_all(const char *frame, kvmessage_buffer_t *buffers,
+    resp_part_t *parts) {
+  resp_cursor_t cursor;
+  int n = 0;
+  memset(&cursor, 0, sizeof(resp_cursor_t));
+  while (!resp_decode(&cursor, frame, strlen(frame), &buffers[n], &parts[n]))
+    n++;
+  return n + 1;
+}
+
+int resp_frame_sizes(void) {
+  const char *set = "*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$5\r\nvalue\r\n";
+  size_t i;
+  for (i = 0; i < strlen(set); i++)
+    ASSERT_EQUAL(resp_frame_size(set, i), 0);
+  ASSERT_EQUAL(resp_frame_size(set, strlen(set)), (long) strlen(set));
+  /* Only the first command counts. */
+  ASSERT_EQUAL(resp_frame_size("*1\r\n$4\r\nPING\r\n*1\r\n", 18), 14);
+  ASSERT_EQUAL(resp_frame_size("PING\r\n", 6), -1);
+  ASSERT_EQUAL(resp_frame_size("*0\r\n", 4), -1);
+  ASSERT_EQUAL(resp_frame_size("*1\r\n$-1\r\n", 9), -1);
+  ASSERT_EQUAL(resp_frame_size("*1\r\n$4\r\nPINGxx", 14), -1);
+  ASSERT_EQUAL(resp_frame_size("*1\r\n$99999999\r\n", 16), -1);
+  return 1;
+}
+
+int resp_commands_expand(void) {
+  kvmessage_buffer_t buffers[3];
+  resp_part_t parts[3];
+  ASSERT_EQUAL(decode_all("*2\r\n$3\r\nget\r\n$3\r\nkey\r\n", buffers, parts),
+      1);
+  ASSERT_EQUAL(parts[0].cmd, RESP_GET);
+  ASSERT_EQUAL(buffers[0].msg.type, GETREQ);
+  ASSERT_STRING_EQUAL(buffers[0].msg.key, "key");
+
+  ASSERT_EQUAL(decode_all("*5\r\n$4\r\nMSET\r\n$2\r\nk1\r\n$2\r\nv1\r\n"
+      "$2\r\nk2\r\n$2\r\nv2\r\n", buffers, parts), 2);
+  ASSERT_EQUAL(parts[1].cmd, RESP_MSET);
+  ASSERT_EQUAL(parts[1].index, 1);
+  ASSERT_EQUAL(parts[1].parts, 2);
+  ASSERT_EQUAL(buffers[1].msg.type, PUTREQ);
+  ASSERT_STRING_EQUAL(buffers[0].msg.key, "k1");
+  ASSERT_STRING_EQUAL(buffers[1].msg.value, "v2");
+
+  ASSERT_EQUAL(decode_all("*3\r\n$3\r\nDEL\r\n$1\r\na\r\n$1\r\nb\r\n", buffers,
+      parts), 2);
+  ASSERT_EQUAL(buffers[1].msg.type, DELREQ);
+  ASSERT_STRING_EQUAL(buffers[1].msg.key, "b");
+
+  ASSERT_EQUAL(decode_all("*1\r\n$4\r\nPING\r\n", buffers, parts), 1);
+  ASSERT_EQUAL(parts[0].cmd, RESP_PING);
+  ASSERT_EQUAL(buffers[0].msg.type, RESP);
+  return 1;
+}
+
+int resp_bad_commands_answered(void) {
+  kvmessage_buffer_t buffers[1];
+  resp_part_t parts[1];
+  char command[MAX_KEYLEN + 64];
+  size_t len;
+  ASSERT_EQUAL(decode_all("*1\r\n$6\r\nCONFIG\r\n", buffers, parts), 1);
+  ASSERT_EQUAL(parts[0].cmd, RESP_ERROR);
+  ASSERT_PTR_NOT_NULL(buffers[0].msg.message);
+  /* MSET with a key but no value. */
+  ASSERT_EQUAL(decode_all("*4\r\n$4\r\nMSET\r\n$1\r\na\r\n$1\r\nb\r\n"
+      "$1\r\nc\r\n", buffers, parts), 1);
+  ASSERT_EQUAL(parts[0].cmd, RESP_ERROR);
+  len = sprintf(command, "*2\r\n$3\r\nGET\r\n$%d\r\n", MAX_KEYLEN + 1);
+  memset(command + len, 'k', MAX_KEYLEN + 1);
+  strcpy(command + len + MAX_KEYLEN + 1, "\r\n");
+  ASSERT_EQUAL(decode_all(command, buffers, parts), 1);
+  ASSERT_EQUAL(parts[0].cmd, RESP_ERROR);
+  ASSERT_STRING_EQUAL(buffers[0].msg.message, ERRMSG_KEY_LEN);
+  return 1;
+}
+
+/* Accounts for and encodes the response RESPMSG to PART into BUF, after
+ * what is there already. */
+static void reply(resp_tally_t *tally, resp_part_t part, kvmessage_t *respmsg,
+    char *buf) {
+  size_t len = strlen(buf), size;
+  resp_account(tally, &part, respmsg);
+  size = resp_encode(tally, &part, respmsg, buf + len, 256 - len);
+  buf[len + size] = '\0';
+}
+
+int resp_replies_encoded(void) {
+  kvmessage_t hit, miss, ok, error;
+  resp_tally_t tally;
+  char buf[256] = "";
+  resp_part_t mget0 = {RESP_MGET, 0, 2}, mget1 = {RESP_MGET, 1, 2};
+  resp_part_t del0 = {RESP_DEL, 0, 2}, del1 = {RESP_DEL, 1, 2};
+  resp_part_t mset0 = {RESP_MSET, 0, 2}, mset1 = {RESP_MSET, 1, 2};
+  resp_part_t set = {RESP_SET, 0, 1};
+  memset(&hit, 0, sizeof(kvmessage_t));
+  hit.type = GETRESP;
+  hit.value = "value";
+  memset(&miss, 0, sizeof(kvmessage_t));
+  miss.type = RESP;
+  miss.message = ERRMSG_NO_KEY;
+  memset(&ok, 0, sizeof(kvmessage_t));
+  ok.type = RESP;
+  ok.message = MSG_SUCCESS;
+  memset(&error, 0, sizeof(kvmessage_t));
+  error.type = RESP;
+  error.message = ERRMSG_VAL_LEN;
+
+  reply(&tally, mget0, &hit, buf);
+  reply(&tally, mget1, &miss, buf);
+  ASSERT_STRING_EQUAL(buf, "*2\r\n$5\r\nvalue\r\n$-1\r\n");
+  buf[0] = '\0';
+  reply(&tally, del0, &ok, buf);
+  reply(&tally, del1, &miss, buf);
+  ASSERT_STRING_EQUAL(buf, ":1\r\n");
+  buf[0] = '\0';
+  reply(&tally, mset0, &error, buf);
+  reply(&tally, mset1, &ok, buf);
+  ASSERT_STRING_EQUAL(buf, "-ERR VALUE TOO LONG\r\n");
+  buf[0] = '\0';
+  reply(&tally, set, &ok, buf);
+  ASSERT_STRING_EQUAL(buf, "+OK\r\n");
+  /* A reply which does not fit is sized. */
+  ASSERT_EQUAL(resp_encode(&tally, &mget0, &hit, buf, 4), 15);
+  return 1;
+}
+
+test_info_t resp_tests[] = {
+  {"Sizes of whole, partial and invalid commands", resp_frame_sizes},
+  {"Commands expand into requests", resp_commands_expand},
+  {"Commands not understood are answered with errors",
+    resp_bad_commands_answered},
+  {"Replies are encoded in the order of their requests",
+    resp_replies_encoded},
+  NULL_TEST_INFO
+};
+
+suite_info_t resp_suite = {"RESP Tests", NULL, NULL, resp_tests};
@@ -0,0 +1,105 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "kvconstants.h"
+#include "singleflight.h"
+#include "tester.h"
+
+#define SINGLEFLIGHT_THREADS 8
+
+singleflight_t testsf;
+int loads, started, load_error;
+kvvalue_t *results[SINGLEFLIGHT_THREADS];
+int rets[SINGLEFLIGHT_THREADS];
+
+int singleflight_test_init(void) {
+  loads = 0;
+  started = 0;
+  load_error = 0;
+  singleflight_init(&testsf);
+  return 0;
+}
+
+/* A slow load, which gives every test thread time to miss on the same key
+ * before it completes. Fails with LOAD_ERROR if it is set. */
+int singleflight_test_load(void *arg, char *key, kvvalue_t **value) {
+  __atomic_add_fetch(&loads, 1, __ATOMIC_RELAXED);
+  while (__atomic_load_n(&started, __ATOMIC_ACQUIRE) < SINGLEFLIGHT_THREADS)
+    usleep(1000);
+  usleep(50000);
+  if (load_error != 0)
+    return load_error;
+  *value = kvvalue_new("loaded");
+  return 0;
+}
+
+void *singleflight_test_thread(void *aux) {
+  int i = (intptr_t) aux;
+  __atomic_add_fetch(&started, 1, __ATOMIC_RELEASE);
+  rets[i] = singleflight_do(&testsf, "hotkey", singleflight_test_load, NULL,
+      &results[i]);
+  return NULL;
+}
+
+/* Runs SINGLEFLIGHT_THREADS concurrent loads of the same key. */
+void singleflight_run_threads(void) {
+  pthread_t threads[SINGLEFLIGHT_THREADS];
+  int i;
+  for (i = 0; i < SINGLEFLIGHT_THREADS; i++)
+    pthread_create(&threads[i], NULL, singleflight_test_thread,
+        (void *) (intptr_t) i);
+  for (i = 0; i < SINGLEFLIGHT_THREADS; i++)
+    pthread_join(threads[i], NULL);
+}
+
+int singleflight_coalesce(void) {
+  int i;
+  singleflight_run_threads();
+  ASSERT_EQUAL(loads, 1);
+  for (i = 0; i < SINGLEFLIGHT_THREADS; i++) {
+    ASSERT_EQUAL(rets[i], 0);
+    ASSERT_EQUAL(results[i], results[0]);
+  }
+  ASSERT_STRING_EQUAL(results[0]->data, "loaded");
+  ASSERT_EQUAL(results[0]->refcount, SINGLEFLIGHT_THREADS);
+  for (i = 0; i < SINGLEFLIGHT_THREADS; i++)
+    kvvalue_release(results[i]);
+  return 1;
+}
+
+int singleflight_shared_error(void) {
+  int i;
+  load_error = ERRNOKEY;
+  singleflight_run_threads();
+  ASSERT_EQUAL(loads, 1);
+  for (i = 0; i < SINGLEFLIGHT_THREADS; i++)
+    ASSERT_EQUAL(rets[i], ERRNOKEY);
+  return 1;
+}
+
+int singleflight_sequential(void) {
+  kvvalue_t *value;
+  int ret;
+  started = SINGLEFLIGHT_THREADS;
+  ret = singleflight_do(&testsf, "key", singleflight_test_load, NULL, &value);
+  ASSERT_EQUAL(ret, 0);
+  kvvalue_release(value);
+  /* A load which has completed is not shared with later calls. */
+  ret = singleflight_do(&testsf, "key", singleflight_test_load, NULL, &value);
+  ASSERT_EQUAL(ret, 0);
+  kvvalue_release(value);
+  ASSERT_EQUAL(loads, 2);
+  return 1;
+}
+
+test_info_t singleflight_tests[] = {
+  {"Concurrent loads of the same key are coalesced", singleflight_coalesce},
+  {"Waiters share the error of a failed load", singleflight_shared_error},
+  {"Loads which do not overlap are not coalesced", singleflight_sequential},
+  NULL_TEST_INFO
+};
+
+suite_info_t singleflight_suite = {"SingleFlight Tests", singleflight_test_init,
+  NULL, singleflight_tests};
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include "socket_server.h"
@@ -36,8 +37,16 @@ void socket_server_request_handler(kvserver_t *server, int sockfd, void *extra)
   pthread_mutex_unlock(&socket_server_test_lock);
 }
 
+/* Sends a request, since a connection is only handed to the handler once a
+ * request has arrived on it. */
 void *socket_server_request_thread(void* aux) {
-  connect_to(SOCKET_SERVER_HOST, SOCKET_SERVER_PORT, 3);
+  kvmessage_t reqmsg;
+  int sockfd = connect_to(SOCKET_SERVER_HOST, SOCKET_SERVER_PORT, 3);
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.type = GETREQ;
+  reqmsg.key = "key";
+  if (sockfd >= 0)
+    kvmessage_send(&reqmsg, sockfd);
   return NULL;
 }
 
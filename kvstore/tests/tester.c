@@ -12,6 +12,12 @@
 #include "kvcache_test.h"
 #include "kvserver_test.h"
 #include "wq_test.h"
+#include "singleflight_test.h"
+#include "kvsnapshot_test.h"
+#include "hotkeys_test.h"
+#include "arena_test.h"
+#include "kvmessage_test.h"
+#include "resp_test.h"
 #include "socket_server_test.h"
 #include "kvserver_tpc_test.h"
 #include "tpclog_test.h"
@@ -119,6 +125,12 @@ int main(int argc, const char *argv[]) {
     {kvcache_suite, "kvcache"},
     {kvserver_suite, "kvserver"},
     {wq_suite, "wq"},
+    {singleflight_suite, "singleflight"},
+    {kvsnapshot_suite, "kvsnapshot"},
+    {hotkeys_suite, "hotkeys"},
+    {arena_suite, "arena"},
+    {kvmessage_suite, "kvmessage"},
+    {resp_suite, "resp"},
     {socket_server_suite, "socket_server"},
     {kvserver_client_suite, "kvserver_client"},
     {kvserver_tpc_suite, "kvserver_tpc"},
@@ -148,6 +160,12 @@ int main(int argc, const char *argv[]) {
     kvcache_suite,
     kvserver_suite,
     wq_suite,
+    singleflight_suite,
+    kvsnapshot_suite,
+    hotkeys_suite,
+    arena_suite,
+    kvmessage_suite,
+    resp_suite,
     socket_server_suite,
     endtoend_suite,
     kvserver_tpc_suite,
@@ -155,6 +155,37 @@ int tpcmaster_get_cached(void) {
   return 1;
 }
 
+int tpcmaster_arc_cache(void) {
+  tpcmaster_init_policy(&testmaster, 4, 2, 4, 4, CACHE_ARC);
+  ASSERT_EQUAL(testmaster.cache.policy, CACHE_ARC);
+  ASSERT_EQUAL(testmaster.cache.sets[0].policy, CACHE_ARC);
+  return tpcmaster_get_cached();
+}
+
+int tpcmaster_fill_skips_stale(void) {
+  kvvalue_t *old = kvvalue_new("OLD"), *cached;
+  unsigned long since = tpcmaster_version(&testmaster);
+  /* A commit in progress, or which ended after the slave was asked, makes
+     the value read from the slave stale. */
+  tpcmaster_write_begin(&testmaster, "KEY");
+  ASSERT_FALSE(tpcmaster_fill(&testmaster, "KEY", old, since));
+  tpcmaster_write_end(&testmaster, "KEY");
+  ASSERT_FALSE(tpcmaster_fill(&testmaster, "KEY", old, since));
+  ASSERT_EQUAL(kvcache_get_ref(&testmaster.cache, "KEY", &cached), ERRNOKEY);
+  /* Other keys are unaffected. */
+  ASSERT_TRUE(tpcmaster_fill(&testmaster, "OTHERKEY", NULL, since));
+  ASSERT_EQUAL(kvcache_get_ref(&testmaster.cache, "OTHERKEY", &cached),
+      ERRNEGKEY);
+  /* A value read after the commit ended is cached. */
+  since = tpcmaster_version(&testmaster);
+  ASSERT_TRUE(tpcmaster_fill(&testmaster, "KEY", old, since));
+  ASSERT_EQUAL(kvcache_get_ref(&testmaster.cache, "KEY", &cached), 0);
+  ASSERT_STRING_EQUAL(cached->data, "OLD");
+  kvvalue_release(cached);
+  kvvalue_release(old);
+  return 1;
+}
+
 void tpcmaster_dummy_handle(tpcmaster_t *master, int sockfd, callback_t callback) {
   kvmessage_t *req, resp;
   req = kvmessage_parse(sockfd);
@@ -354,6 +385,9 @@ test_info_t tpcmaster_tests[] = {
   {"Identify first replica for multiple keys", tpcmaster_get_slave_for_key},
   {"Identify successor for multiple slaves", tpcmaster_get_successor_for_slave},
   {"Master GET value from master cache", tpcmaster_get_cached},
+  {"Master GET value from an ARC cache", tpcmaster_arc_cache},
+  {"Master does not cache values read during a commit",
+    tpcmaster_fill_skips_stale},
   {"Master GET value from main slave", tpcmaster_get_simple},
   {"Master PUT value", tpcmaster_put_simple},
   {"Master DEL value", tpcmaster_del_simple},
@@ -5,7 +5,7 @@
 #include "kvconstants.h"
 #include "kvcacheset.h"
 #include "tester.h"
-#include "kvstore.h"
+#include "kvhash.h"
 #include <stdbool.h>
 #include "utlist.h"
 
@@ -111,7 +111,7 @@ int kvcache_check_initial_refbits() {
 /* Private helper method used for testing */
 static kvcacheset_t *get_cache_set(kvcache_t *cache, char *key) {
   // OUR CODE HERE
-  unsigned long index = hash(key) % cache->num_sets;
+  unsigned long index = kvhash(key) % cache->num_sets;
   return &cache->sets[index];
 }
 